@@ -20,8 +20,10 @@
    Boston, MA 02111 USA.
    */
 
+#import <DBusKit/DKCancellationToken.h>
 #import <DBusKit/DKCommon.h>
 #import <DBusKit/DKNotificationCenter.h>
+#import <DBusKit/DKPackedArray.h>
 #import <DBusKit/DKPort.h>
 #import <DBusKit/DKProxy.h>
 #import <DBusKit/DKStruct.h>
@@ -0,0 +1,58 @@
+/** Interface for the DKCancellationToken class for abandoning D-Bus calls.
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+   */
+
+#import <Foundation/NSObject.h>
+
+@class NSLock, NSMutableArray;
+
+/**
+ * A DKCancellationToken allows abandoning D-Bus method calls that are in
+ * flight. Calls are associated with the token that is installed for the
+ * calling thread with +[DKProxy setDBusCancellationToken:] when they are made.
+ * Cancelling the token (usually from another thread) cancels all of these
+ * calls that have not yet completed: libdbus stops waiting for their replies,
+ * the messages and invocations are released, and everyone waiting for them is
+ * woken up. Synchronous calls and futures raise a
+ * <code>DKDBusCallCancelledException</code>, completion handlers receive the
+ * corresponding NSError. Calls made once the token has been cancelled fail
+ * right away.
+ */
+@interface DKCancellationToken: NSObject
+{
+  @private
+  NSLock *lock;
+  NSMutableArray *calls;
+  BOOL cancelled;
+}
+
+/**
+ * Returns a new, autoreleased token.
+ */
++ (id)token;
+
+/**
+ * Cancels all calls associated with the token.
+ */
+- (void)cancel;
+
+/**
+ * Returns whether the token has been cancelled.
+ */
+- (BOOL)isCancelled;
+@end
@@ -0,0 +1,76 @@
+/** Interface for the DKPackedArray class holding packed numeric D-Bus arrays.
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+   */
+
+#import <Foundation/NSArray.h>
+
+@class NSData;
+
+/**
+ * DKPackedArray is an immutable array of numbers that are stored packed in an
+ * NSData object, all of them having the same Objective-C type. It allows
+ * passing arrays of fixed size numeric D-Bus types (<code>ay</code>,
+ * <code>an</code>, <code>aq</code>, <code>ai</code>, <code>au</code>,
+ * <code>ax</code>, <code>at</code> and <code>ad</code>) in bulk: Packed arrays
+ * whose type matches the element type are marshalled in one go, and arguments
+ * annotated with the <code>org.gnustep.objc.class</code> annotation set to
+ * <code>DKPackedArray</code> are unmarshalled into packed arrays, which might
+ * refer directly to the body of the D-Bus message. The numbers are only boxed
+ * into NSNumber objects when they are accessed as objects.
+ */
+@interface DKPackedArray: NSArray
+{
+  @private
+  NSData *data;
+  const char *objCType;
+  const void *bytes;
+  NSUInteger elementSize;
+  NSUInteger count;
+}
+
+/**
+ * Returns a packed array of the numbers of type <var>type</var> contained in
+ * <var>data</var>.
+ */
++ (id)arrayWithData: (NSData*)data
+           objCType: (const char*)type;
+
+/**
+ * Initializes the array with the numbers of type <var>type</var> contained in
+ * <var>data</var>, which is retained. The type must be one of the integer or
+ * floating point types. Trailing bytes that do not make up a complete number
+ * are ignored.
+ */
+- (id)initWithData: (NSData*)data
+          objCType: (const char*)type;
+
+/**
+ * Returns the data holding the numbers.
+ */
+- (NSData*)data;
+
+/**
+ * Returns a pointer to the packed numbers.
+ */
+- (const void*)bytes;
+
+/**
+ * Returns the Objective-C type encoding of the numbers.
+ */
+- (const char*)objCType;
+@end
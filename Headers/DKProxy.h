@@ -22,9 +22,10 @@
    */
 
 #import <Foundation/NSProxy.h>
+#import <Foundation/NSDate.h>
 #import <DBusKit/DKPort.h>
 
-@class DKEndpoint, DKInterface, NSCondition, NSLock, NSString, NSMapTable, NSMutableArray, NSMutableDictionary;
+@class DKCancellationToken, DKEndpoint, DKInterface, NSArray, NSCondition, NSLock, NSString, NSMapTable, NSMutableArray, NSMutableDictionary, NSThread;
 @protocol NSCoding;
 
 
@@ -33,6 +34,10 @@ typedef NSInteger DKProxyState;
 /**
  * The DKProxy class is used to send messages to D-Bus objects. Usually, you
  * don't create them yourself but by using the DKPort and NSConnection classes.
+ * Once the interfaces of the remote object are known, the proxy implements the
+ * methods that take and return only objects directly (through a generated
+ * subclass), so that calling them bypasses message forwarding. Setting the
+ * <code>DKDirectDispatch</code> user default to NO disables this.
  */
 @interface DKProxy: NSProxy <NSCoding>
 {
@@ -63,6 +68,34 @@ typedef NSInteger DKProxyState;
    */
   DKInterface *activeInterface;
 
+  /**
+   * Whether methods returning objects are called asynchronously.
+   */
+  BOOL usesFutures;
+
+  /**
+   * The timeout for method calls, 0 for the default timeout.
+   */
+  NSTimeInterval callTimeout;
+
+  /**
+   * The cache mapping selectors to the methods they call. It is read without
+   * locking and modified while holding the table lock.
+   */
+  void *selectorCache;
+
+  /**
+   * The number of threads looking up selectors in the selector cache. Tables
+   * replaced by a new one are only freed while there are none.
+   */
+  volatile NSUInteger selectorCacheReaders;
+
+  /**
+   * Set while the proxy has been moved to a generated class for direct
+   * dispatch. Protected by the table lock.
+   */
+  BOOL usesDirectDispatchClass;
+
   @protected
 
   /**
@@ -89,6 +122,46 @@ typedef NSInteger DKProxyState;
                    path: (NSString*)aPath
                     bus: (DKDBusBusType)type;
 
+/**
+ * Invokes a batch of D-Bus method calls. Every element of
+ * <var>invocations</var> is an NSInvocation whose target is a DKProxy. All
+ * calls are sent before waiting for the first reply, so the batch takes about
+ * as long as a single round trip. Return values are stored in the
+ * invocations. Returns an array containing NSNull for every call that
+ * succeeded and an NSError in the <code>DKDBusErrorDomain</code> for every
+ * call that failed. Raises an exception if one of the calls cannot be
+ * marshalled, in which case no call is sent.
+ */
++ (NSArray*)invokeBatch: (NSArray*)invocations;
+
+/**
+ * Sets a deadline for all D-Bus method calls made from the current thread. The
+ * timeout of a call is shortened so that it fails at the deadline, and calls
+ * made after the deadline has passed fail right away with a
+ * <code>DKDBusTimeoutException</code>. This way, the time left to a caller
+ * limits the calls it makes in turn. Pass nil to remove the deadline.
+ */
++ (void)setDBusCallDeadline: (NSDate*)deadline;
+
+/**
+ * Returns the deadline for D-Bus method calls made from the current thread, or
+ * nil if there is none.
+ */
++ (NSDate*)DBusCallDeadline;
+
+/**
+ * Associates all D-Bus method calls made from the current thread with
+ * <var>token</var>, so that they can be abandoned by cancelling it. Pass nil
+ * to stop associating calls with a token.
+ */
++ (void)setDBusCancellationToken: (DKCancellationToken*)token;
+
+/**
+ * Returns the cancellation token for D-Bus method calls made from the current
+ * thread, or nil if there is none.
+ */
++ (DKCancellationToken*)DBusCancellationToken;
+
 - (id) initWithPort: (DKPort*)aPort
                path: (NSString*)aPath;
 
@@ -113,16 +186,95 @@ typedef NSInteger DKProxyState;
  * interface as the primary one by calling -setPrimaryDBusInterface:.
  */
 - (void)setPrimaryDBusInterface: (NSString*)anInterface;
+
+/**
+ * If set, calling a D-Bus method that returns an object will not wait for the
+ * reply. The proxy instead returns a future object immediately, so that a
+ * thread can have many calls in flight. The future forwards all messages to
+ * the real return value, blocking until it has been received. If the call
+ * failed, the exception describing the failure is raised when the future is
+ * used. The default for new proxies is taken from the
+ * <code>DKUseFutures</code> user default.
+ */
+- (void)setUsesFutures: (BOOL)yesno;
+
+/**
+ * Returns whether methods returning objects are called asynchronously.
+ */
+- (BOOL)usesFutures;
+
+/**
+ * Sets the time (in seconds) to wait for the reply to a method call before it
+ * fails. Methods carrying an <code>org.gnustep.dbuskit.method.timeout</code>
+ * annotation use the timeout given there instead. The timeout also applies to
+ * asynchronous calls. Pass 0 to use the default timeout of libdbus. The
+ * default for new proxies is taken from the <code>DKCallTimeout</code> user
+ * default.
+ */
+- (void)setDBusCallTimeout: (NSTimeInterval)interval;
+
+/**
+ * Returns the time to wait for the reply to a method call, or 0 if the default
+ * timeout of libdbus is used.
+ */
+- (NSTimeInterval)DBusCallTimeout;
+
+/**
+ * Calls the D-Bus method corresponding to <var>selector</var> without waiting
+ * for the reply. The arguments are passed as objects (NSNull stands in for
+ * nil). Once the call completes, <var>handler</var> is sent
+ * <var>completionSelector</var> on <var>thread</var> (in one of
+ * <var>modes</var>, or the default mode if nil). The completion selector takes
+ * two arguments, the object returned by the call and an NSError in the
+ * <code>DKDBusErrorDomain</code> if the call failed, as in:
+ * <example>
+ * - (void)call: (id)result didCompleteWithError: (NSError*)error;
+ * </example>
+ * If <var>thread</var> is nil, the handler is called on the worker thread
+ * that received the reply and must not block. The handler is retained until
+ * the call completes. Raises an exception if the method does not exist or the
+ * arguments cannot be marshalled.
+ */
+- (void)callDBusMethod: (SEL)selector
+         withArguments: (NSArray*)arguments
+     completionHandler: (id)handler
+              selector: (SEL)completionSelector
+              onThread: (NSThread*)thread
+                 modes: (NSArray*)modes;
+
+/**
+ * Calls the D-Bus method corresponding to <var>selector</var> without waiting
+ * for the reply and notifies <var>handler</var> on the current thread once it
+ * completes.
+ */
+- (void)callDBusMethod: (SEL)selector
+         withArguments: (NSArray*)arguments
+     completionHandler: (id)handler
+              selector: (SEL)completionSelector;
 @end
 
 extern NSString* DKBusDisconnectedNotification;
 extern NSString* DKBusReconnectedNotification;
 
+/**
+ * The error domain of the NSErrors passed to completion handlers of
+ * asynchronous calls.
+ */
+extern NSString* DKDBusErrorDomain;
+
+/**
+ * The key for the exception that caused an error in the userInfo dictionary of
+ * an NSError in the <code>DKDBusErrorDomain</code>.
+ */
+extern NSString* DKExceptionErrorKey;
+
 /**
  * The DKDBus class exposes the D-Bus objects specifically (i.e. the
  * "org.freedesktop.DBus" service). The instances returned by this class are
  * shared objects: Calling -setPrimaryDBusInterface: on them has no effect.
  *
+ * For the same reason, these objects never return futures.
+ *
  * DKDBus instances also emit notifications about the state of the bus they
  * represent. An application can watch for a
  * <code>DKBusDisconnectedNotification</code> and
@@ -55,6 +55,20 @@ extern NSString *kDKArgumentDirectionOut;
 + (void)registerUnboxingSelector: (SEL)selector
                      forDBusType: (int)type;
 
+/**
+ * Sets the message that the current thread is unmarshalling values from. While
+ * it is set, unmarshalled values may refer to the body of the message instead
+ * of copying it (the message is retained by them as needed). Callers should
+ * restore the previous value, which may be NULL, when they are done.
+ */
++ (void)setMessageBeingUnmarshalled: (DBusMessage*)msg;
+
+/**
+ * Returns the message that the current thread is unmarshalling values from, or
+ * NULL if it is unknown.
+ */
++ (DBusMessage*)messageBeingUnmarshalled;
+
 
 #if HAVE_LIBCLANG
 /**
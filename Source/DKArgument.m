@@ -29,13 +29,12 @@
 #import <Foundation/NSException.h>
 #import <Foundation/NSEnumerator.h>
 #import <Foundation/NSFileHandle.h>
-#import <Foundation/NSHashTable.h>
 #import <Foundation/NSInvocation.h>
 #import <Foundation/NSLock.h>
-#import <Foundation/NSMapTable.h>
 #import <Foundation/NSMethodSignature.h>
 #import <Foundation/NSNull.h>
 #import <Foundation/NSString.h>
+#import <Foundation/NSUserDefaults.h>
 #import <Foundation/NSValue.h>
 #import <Foundation/NSXMLNode.h>
 
@@ -48,7 +47,10 @@
 #import "DKOutgoingProxy.h"
 #import "DKArgument.h"
 #import "DKBoxingUtils.h"
+#import "DKLazyContainers.h"
+#import "DKNumberTemplate.h"
 
+#import "DBusKit/DKPackedArray.h"
 #import "DBusKit/DKStruct.h"
 #import "DBusKit/DKVariant.h"
 
@@ -56,6 +58,9 @@
 #include "config.h"
 #undef INCLUDE_RUNTIME_H
 
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <dbus/dbus.h>
 
@@ -63,6 +68,48 @@ NSString *kDKArgumentDirectionIn = @"in";
 NSString *kDKArgumentDirectionOut = @"out";
 
 
+/*
+ * Whether arrays and dictionaries are unmarshalled lazily (as requested by the
+ * DKLazyContainers user default).
+ */
+static BOOL usesLazyContainers;
+
+/*
+ * Whether booleans and small integers are boxed into shared NSNumber instances.
+ * Enabled unless the DKBoxingCache user default is set to NO.
+ */
+static BOOL usesBoxingCache;
+
+/*
+ * Shared NSNumber instances, one row for every integral D-Bus type.
+ */
+static id boxingCache[8][DK_NUMBER_CACHE_SIZE];
+static Class NSNumberClass;
+
+/*
+ * Returns the cached number for <var>num</var> if possible and boxes it using
+ * <var>expression</var> otherwise. Custom classes set through the
+ * org.gnustep.objc.class annotation always get fresh instances.
+ */
+#define DK_RETURN_BOXED_NUMBER(row, num, expression) \
+  do \
+  { \
+    if (usesBoxingCache \
+      && (NSNumberClass == objCEquivalent) \
+      && DK_NUMBER_IS_CACHEABLE(num)) \
+    { \
+      id *cache = boxingCache[(row)]; \
+      id cached = DKNumberCacheGet(cache, (long long)(num)); \
+      if (nil == cached) \
+      { \
+        cached = DKNumberCacheInsert(cache, (long long)(num), (expression)); \
+      } \
+      return cached; \
+    } \
+    return (expression); \
+  } while (0)
+
+
 /*
  * Macros to call D-Bus function and check whether they returned OOM:
  */
@@ -176,24 +223,20 @@ NSString *kDKArgumentDirectionOut = @"out";
 
 
 /*
- * Tables and paraphernalia for managing unboxing of objects: We want some
- * degree of flexibility on how to unbox objects of arbitrary types. To that
- * end, we define two tables:
- *
- * (1) selectorTypeMap, which maps selectors used to unbox objects to D-Bus
- *     types so that we can construct appropriate DKArguments if we encounter
- *     objects responding to the selector.
+ * Registry for managing unboxing of objects: We want some degree of
+ * flexibility on how to unbox objects of arbitrary types. To that end, we keep
+ * a list of selectors that can be used to obtain an unboxed value of a
+ * specified D-Bus type, so that we can also construct appropriate DKArguments
+ * if we encounter objects responding to the selector.
  *
- * (2) typeSelectorMap, which maps D-Bus types to hash-tables containing all
- *     selectors that can be used to obtain an unboxed value of a specified
- *     type.
+ * The registry is consulted whenever an object is unboxed or the type of a
+ * variant is inferred, but is changed very rarely. It is thus an immutable
+ * snapshot that is replaced as a whole by +registerUnboxingSelector:forDBusType:,
+ * and lookups don't need to take a lock. Every snapshot also caches which of
+ * its selectors the instances of a class respond to.
  *
  * NOTE: Unfortunately, we cannot unbox container types this way.
  */
-static NSMapTable *selectorTypeMap;
-static NSMapTable *typeSelectorMap;
-static NSLock *selectorTypeMapLock;
-
 
 typedef struct
 {
@@ -201,100 +244,270 @@ typedef struct
   int type;
 } DKSelectorTypePair;
 
+/*
+ * Flags recording how instances of a class respond to the selectors in the
+ * registry.
+ */
+enum
+{
+  DK_UNBOXING_RESPONDS = 1,
+  DK_UNBOXING_RETURNS_TYPE = 2
+};
 
-#define DK_INSTALL_TYPE_SELECTOR_PAIR(type,theSel) \
- do \
-  {\
-    SEL selector = theSel;\
-    NSHashTable *selTable = NSCreateHashTable(NSIntHashCallBacks,\
-     1); \
-    NSMapInsert(selectorTypeMap,\
-      (void*)selector,\
-      (void*)(intptr_t)type);\
-    NSMapInsert(typeSelectorMap,\
-      (void*)(intptr_t)type,\
-      (void*)selTable);\
-    NSHashInsert(selTable,selector);\
-  } while (0)
+/*
+ * Immutable information about a class, with one entry in flags for every
+ * selector/type pair in the registry.
+ */
+typedef struct
+{
+  Class theClass;
+  uint8_t flags[];
+} DKUnboxingClassInfo;
 
+#define DK_UNBOXING_CLASS_CACHE_SIZE 128
+#define DK_UNBOXING_CLASS_CACHE_PROBES 8
+
+typedef struct
+{
+  /*
+   * Open addressing with linear probing. Slots are filled once using
+   * compare-and-swap and never replaced, so readers can use the entries
+   * without further synchronisation. Classes that find no free slot among
+   * their probes are not cached.
+   */
+  DKUnboxingClassInfo *classCache[DK_UNBOXING_CLASS_CACHE_SIZE];
+  NSUInteger count;
+  DKSelectorTypePair pairs[];
+} DKUnboxingRegistry;
+
+static DKUnboxingRegistry *unboxingRegistry;
+static NSLock *unboxingRegistryLock;
+static IMP defaultRespondsToSelector;
+
+/*
+ * The message the current thread is unmarshalling from. This is set for every
+ * reply and signal, so it must be cheap: it is neither retained nor boxed.
+ */
+static pthread_key_t messageBeingUnmarshalledKey;
+
+/*
+ * Creates a new snapshot of the registry with the pairs from
+ * <var>registry</var> (which may be NULL) followed by the <var>newCount</var>
+ * pairs in <var>newPairs</var>.
+ */
+static DKUnboxingRegistry*
+DKUnboxingRegistryCreate(DKUnboxingRegistry *registry,
+  const DKSelectorTypePair *newPairs,
+  NSUInteger newCount)
+{
+  NSUInteger count = (NULL == registry) ? 0 : registry->count;
+  DKUnboxingRegistry *newRegistry = calloc(1, sizeof(DKUnboxingRegistry)
+    + ((count + newCount) * sizeof(DKSelectorTypePair)));
+  if (NULL == newRegistry)
+  {
+    return NULL;
+  }
+  if (0 != count)
+  {
+    memcpy(newRegistry->pairs, registry->pairs,
+      count * sizeof(DKSelectorTypePair));
+  }
+  memcpy(&newRegistry->pairs[count], newPairs,
+    newCount * sizeof(DKSelectorTypePair));
+  newRegistry->count = count + newCount;
+  return newRegistry;
+}
+
+/*
+ * Installs a new snapshot. The old one might still be used by other threads,
+ * so it is never freed. This is not a problem because the registry is only
+ * changed a few times over the lifetime of the process. Must be called with
+ * unboxingRegistryLock held.
+ */
+static void
+DKUnboxingRegistryInstallPairs(const DKSelectorTypePair *pairs, NSUInteger count)
+{
+  DKUnboxingRegistry *newRegistry = DKUnboxingRegistryCreate(unboxingRegistry,
+    pairs,
+    count);
+  if (NULL != newRegistry)
+  {
+    __atomic_store_n(&unboxingRegistry, newRegistry, __ATOMIC_RELEASE);
+  }
+}
 
 static inline void
 DKInstallDefaultSelectorTypeMapping()
 {
-  [selectorTypeMapLock lock];
-  DK_INSTALL_TYPE_SELECTOR_PAIR(DBUS_TYPE_STRING, @selector(UTF8String));
-  DK_INSTALL_TYPE_SELECTOR_PAIR(DBUS_TYPE_INT64, @selector(longLongValue));
-  DK_INSTALL_TYPE_SELECTOR_PAIR(DBUS_TYPE_UINT64, @selector(unsignedLongLongValue));
-  DK_INSTALL_TYPE_SELECTOR_PAIR(DBUS_TYPE_INT32, @selector(intValue));
-  DK_INSTALL_TYPE_SELECTOR_PAIR(DBUS_TYPE_UINT32, @selector(unsignedIntValue));
-  DK_INSTALL_TYPE_SELECTOR_PAIR(DBUS_TYPE_INT16, @selector(shortValue));
-  DK_INSTALL_TYPE_SELECTOR_PAIR(DBUS_TYPE_UINT16, @selector(unsignedShortValue));
-  DK_INSTALL_TYPE_SELECTOR_PAIR(DBUS_TYPE_BYTE, @selector(unsignedCharValue));
-  DK_INSTALL_TYPE_SELECTOR_PAIR(DBUS_TYPE_BOOLEAN, @selector(boolValue));
-  DK_INSTALL_TYPE_SELECTOR_PAIR(DBUS_TYPE_DOUBLE, @selector(doubleValue));
-  DK_INSTALL_TYPE_SELECTOR_PAIR(DBUS_TYPE_DOUBLE, @selector(floatValue));
-# ifdef DBUS_TYPE_UNIX_FD
-  DK_INSTALL_TYPE_SELECTOR_PAIR(DBUS_TYPE_UNIX_FD, @selector(fileDescriptor));
-# endif
-  [selectorTypeMapLock unlock];
+  DKSelectorTypePair defaults[] = {
+    {@selector(UTF8String), DBUS_TYPE_STRING},
+    {@selector(longLongValue), DBUS_TYPE_INT64},
+    {@selector(unsignedLongLongValue), DBUS_TYPE_UINT64},
+    {@selector(intValue), DBUS_TYPE_INT32},
+    {@selector(unsignedIntValue), DBUS_TYPE_UINT32},
+    {@selector(shortValue), DBUS_TYPE_INT16},
+    {@selector(unsignedShortValue), DBUS_TYPE_UINT16},
+    {@selector(unsignedCharValue), DBUS_TYPE_BYTE},
+    {@selector(boolValue), DBUS_TYPE_BOOLEAN},
+    {@selector(doubleValue), DBUS_TYPE_DOUBLE},
+    {@selector(floatValue), DBUS_TYPE_DOUBLE},
+#   ifdef DBUS_TYPE_UNIX_FD
+    {@selector(fileDescriptor), DBUS_TYPE_UNIX_FD},
+#   endif
+  };
+  [unboxingRegistryLock lock];
+  DKUnboxingRegistryInstallPairs(defaults,
+    (sizeof(defaults) / sizeof(DKSelectorTypePair)));
+  [unboxingRegistryLock unlock];
 }
 
 static inline void
 DKRegisterSelectorTypePair(DKSelectorTypePair *pair)
 {
-  NSHashTable *selTable = nil;
-  SEL selector = pair->selector;
-  int type = pair->type;
-  void* mapReturn = NULL;
-  if (0 == selector)
+  DKUnboxingRegistry *registry = NULL;
+  BOOL knownType = NO;
+  NSUInteger i = 0;
+  if (0 == pair->selector)
   {
     return;
   }
 
+  [unboxingRegistryLock lock];
+  registry = unboxingRegistry;
+  for (i = 0; i < registry->count; i++)
+  {
+    if (sel_isEqual(pair->selector, registry->pairs[i].selector))
+    {
+      // Every selector can only be used for a single type.
+      [unboxingRegistryLock unlock];
+      return;
+    }
+    if (pair->type == registry->pairs[i].type)
+    {
+      knownType = YES;
+    }
+  }
 
-  [selectorTypeMapLock lock];
-  selTable = NSMapGet(typeSelectorMap, (void*)(intptr_t)type);
+  // We only support the types that have a default unboxing selector.
+  if (knownType)
+  {
+    DKUnboxingRegistryInstallPairs(pair, 1);
+  }
+  [unboxingRegistryLock unlock];
+}
+
+/*
+ * Returns the information about the class of <var>object</var> from the
+ * cache in <var>registry</var>, creating it if there is room for it. Returns
+ * NULL if the information is not cached, either because the class decides
+ * dynamically which selectors it responds to (e.g. proxies) or because all
+ * slots it could use are taken by other classes. Callers then need to ask the
+ * object directly. Nothing is allocated unless a free slot was found.
+ */
+static const uint8_t*
+DKUnboxingFlagsForObject(DKUnboxingRegistry *registry, id object)
+{
+  Class theClass = object_getClass(object);
+  NSUInteger start = ((uintptr_t)theClass >> 4) % DK_UNBOXING_CLASS_CACHE_SIZE;
+  NSUInteger slot = DK_UNBOXING_CLASS_CACHE_SIZE;
+  NSUInteger probe = 0;
+  DKUnboxingClassInfo *info = NULL;
+  NSUInteger i = 0;
 
-  if (!selTable)
+  for (probe = 0; probe < DK_UNBOXING_CLASS_CACHE_PROBES; probe++)
   {
-    [selectorTypeMapLock unlock];
-    return;
+    NSUInteger thisSlot = (start + probe) % DK_UNBOXING_CLASS_CACHE_SIZE;
+    info = __atomic_load_n(&registry->classCache[thisSlot], __ATOMIC_ACQUIRE);
+    if (NULL == info)
+    {
+      // Classes are never removed, so we would have found it by now.
+      slot = thisSlot;
+      break;
+    }
+    if (theClass == info->theClass)
+    {
+      return info->flags;
+    }
+  }
+  if (DK_UNBOXING_CLASS_CACHE_SIZE == slot)
+  {
+    return NULL;
+  }
+  if (defaultRespondsToSelector != class_getMethodImplementation(theClass,
+    @selector(respondsToSelector:)))
+  {
+    return NULL;
   }
 
-  mapReturn = NSMapInsertIfAbsent(selectorTypeMap,
-    (void*)selector,
-    (void*)(intptr_t)type);
+  info = calloc(1, sizeof(DKUnboxingClassInfo)
+    + (registry->count * sizeof(uint8_t)));
+  if (NULL == info)
+  {
+    return NULL;
+  }
+  info->theClass = theClass;
+  for (i = 0; i < registry->count; i++)
+  {
+    SEL aSel = registry->pairs[i].selector;
+    if ([object respondsToSelector: aSel])
+    {
+      // We need to make sure that we get a correctly sized return value by
+      // invoking the corresponding method.
+      NSMethodSignature *sig = [object methodSignatureForSelector: aSel];
+      info->flags[i] = DK_UNBOXING_RESPONDS;
+      if (registry->pairs[i].type == DKDBusTypeForObjCType([sig methodReturnType]))
+      {
+        info->flags[i] |= DK_UNBOXING_RETURNS_TYPE;
+      }
+    }
+  }
 
-  // InsertIfAbsent returns NULL if the key had been absent, which is the only
-  // case where we also want to install the new type-selector mapping.
-  if (NULL == mapReturn)
+  for (; probe < DK_UNBOXING_CLASS_CACHE_PROBES; probe++)
   {
-    NSHashInsertIfAbsent(selTable, (void*)selector);
+    DKUnboxingClassInfo *other = NULL;
+    slot = (start + probe) % DK_UNBOXING_CLASS_CACHE_SIZE;
+    if (__sync_bool_compare_and_swap(&registry->classCache[slot], NULL, info))
+    {
+      return info->flags;
+    }
+    // Another thread filled the slot in the meantime, maybe with our class.
+    other = __atomic_load_n(&registry->classCache[slot], __ATOMIC_ACQUIRE);
+    if (theClass == other->theClass)
+    {
+      free(info);
+      return other->flags;
+    }
   }
-  [selectorTypeMapLock unlock];
+  free(info);
+  return NULL;
 }
 
-
 static SEL
 DKSelectorForUnboxingObjectAsType(id object, int DBusType)
 {
-  SEL theSel = 0;
-  NSHashTable *table = nil;
-  NSHashEnumerator tableEnum;
-  [selectorTypeMapLock lock];
-  table = NSMapGet(typeSelectorMap, (void*)(intptr_t)DBusType);
-  tableEnum = NSEnumerateHashTable(table);
-  while (0 != (theSel = (SEL)NSNextHashEnumeratorItem(&tableEnum)))
+  DKUnboxingRegistry *registry = __atomic_load_n(&unboxingRegistry,
+    __ATOMIC_ACQUIRE);
+  const uint8_t *flags = DKUnboxingFlagsForObject(registry, object);
+  NSUInteger i = 0;
+  for (i = 0; i < registry->count; i++)
   {
-    if ([object respondsToSelector: theSel])
+    SEL theSel = registry->pairs[i].selector;
+    if (DBusType != registry->pairs[i].type)
+    {
+      continue;
+    }
+    if (NULL != flags)
+    {
+      if (0 != (flags[i] & DK_UNBOXING_RESPONDS))
+      {
+        return theSel;
+      }
+    }
+    else if ([object respondsToSelector: theSel])
     {
-      NSEndHashTableEnumeration(&tableEnum);
-      [selectorTypeMapLock unlock];
       return theSel;
     }
   }
-  NSEndHashTableEnumeration(&tableEnum);
-  [selectorTypeMapLock unlock];
   return 0;
 }
 
@@ -319,37 +532,37 @@ DKDBusTypeForUnboxingObject(id object)
     return DBUS_TYPE_STRING;
   }
 
-  // Slow case: We need to find a selector in the table and get the matching
+  // Slow case: We need to find a selector in the registry and get the matching
   // type.
   if (DBUS_TYPE_INVALID == type)
   {
-    SEL aSel = 0;
-    NSMapEnumerator mapEnum;
-    [selectorTypeMapLock lock];
-    mapEnum = NSEnumerateMapTable(selectorTypeMap);
-    while (NSNextMapEnumeratorPair(&mapEnum,
-      (void**)&aSel,
-      (void**)&type))
+    DKUnboxingRegistry *registry = __atomic_load_n(&unboxingRegistry,
+      __ATOMIC_ACQUIRE);
+    const uint8_t *flags = DKUnboxingFlagsForObject(registry, object);
+    NSUInteger i = 0;
+    for (i = 0; i < registry->count; i++)
     {
-      if (aSel != 0)
+      SEL aSel = registry->pairs[i].selector;
+      int thisType = registry->pairs[i].type;
+      if (NULL != flags)
       {
-	if ([object respondsToSelector: aSel])
+        if (0 != (flags[i] & DK_UNBOXING_RETURNS_TYPE))
+        {
+          return thisType;
+        }
+      }
+      else if ([object respondsToSelector: aSel])
+      {
+	// The object responds to the selector. We need to make sure that we
+	// get a correctly sized return value by invoking the corresponding
+	// method.
+	NSMethodSignature *sig = [object methodSignatureForSelector: aSel];
+	if (thisType == DKDBusTypeForObjCType([sig methodReturnType]))
 	{
-	  // The object responds to the selector. We need to make sure that we
-	  // get a correctly sized return value by invoking the corresponding
-	  // method.
-	  NSMethodSignature *sig = [object methodSignatureForSelector: aSel];
-	  if (type == DKDBusTypeForObjCType([sig methodReturnType]))
-	  {
-	    NSEndMapTableEnumeration(&mapEnum);
-	    [selectorTypeMapLock unlock];
-	    return type;
-	  }
+	  return thisType;
 	}
       }
     }
-    NSEndMapTableEnumeration(&mapEnum);
-    [selectorTypeMapLock unlock];
   }
   return type;
 }
@@ -365,16 +578,15 @@ DKDBusTypeForUnboxingObject(id object)
     return;
   }
 
-  selectorTypeMap = NSCreateMapTable(NSIntMapKeyCallBacks,
-    NSIntMapValueCallBacks,
-    17); // We have 17 D-Bus types.
-  typeSelectorMap = NSCreateMapTable(NSIntMapKeyCallBacks,
-    NSObjectMapValueCallBacks,
-    17); // We have 17 D-Bus types.
-
-
-  selectorTypeMapLock = [NSLock new];
+  unboxingRegistryLock = [NSLock new];
+  pthread_key_create(&messageBeingUnmarshalledKey, NULL);
+  defaultRespondsToSelector = class_getMethodImplementation([NSObject class],
+    @selector(respondsToSelector:));
   DKInstallDefaultSelectorTypeMapping();
+  usesLazyContainers = [[NSUserDefaults standardUserDefaults] boolForKey: @"DKLazyContainers"];
+  usesBoxingCache = ((nil == [[NSUserDefaults standardUserDefaults] objectForKey: @"DKBoxingCache"])
+    || [[NSUserDefaults standardUserDefaults] boolForKey: @"DKBoxingCache"]);
+  NSNumberClass = [NSNumber class];
 
   /*
    * Take care that all subclasses are being initialized as well, so that we
@@ -398,6 +610,16 @@ DKDBusTypeForUnboxingObject(id object)
   DKRegisterSelectorTypePair(&pair);
 }
 
++ (void)setMessageBeingUnmarshalled: (DBusMessage*)msg
+{
+  pthread_setspecific(messageBeingUnmarshalledKey, msg);
+}
+
++ (DBusMessage*)messageBeingUnmarshalled
+{
+  return (DBusMessage*)pthread_getspecific(messageBeingUnmarshalledKey);
+}
+
 /**
  * Initializes the argument with the next single argument from
  * <var>iterator</var>. This method will not advance the iterator.
@@ -999,21 +1221,29 @@ DKDBusTypeForUnboxingObject(id object)
   switch (DBusType)
   {
     case DBUS_TYPE_BYTE:
-      return [objCEquivalent numberWithUnsignedChar: *(unsigned char*)buffer];
+      DK_RETURN_BOXED_NUMBER(0, *(unsigned char*)buffer,
+        [objCEquivalent numberWithUnsignedChar: *(unsigned char*)buffer]);
     case DBUS_TYPE_BOOLEAN:
-      return [objCEquivalent numberWithBool: *(BOOL*)buffer];
+      DK_RETURN_BOXED_NUMBER(1, *(BOOL*)buffer,
+        [objCEquivalent numberWithBool: *(BOOL*)buffer]);
     case DBUS_TYPE_INT16:
-      return [objCEquivalent numberWithShort: *(int16_t*)buffer];
+      DK_RETURN_BOXED_NUMBER(2, *(int16_t*)buffer,
+        [objCEquivalent numberWithShort: *(int16_t*)buffer]);
     case DBUS_TYPE_UINT16:
-      return [objCEquivalent numberWithUnsignedShort: *(uint16_t*)buffer];
+      DK_RETURN_BOXED_NUMBER(3, *(uint16_t*)buffer,
+        [objCEquivalent numberWithUnsignedShort: *(uint16_t*)buffer]);
     case DBUS_TYPE_INT32:
-      return [objCEquivalent numberWithInt: *(int32_t*)buffer];
+      DK_RETURN_BOXED_NUMBER(4, *(int32_t*)buffer,
+        [objCEquivalent numberWithInt: *(int32_t*)buffer]);
     case DBUS_TYPE_UINT32:
-      return [objCEquivalent numberWithUnsignedInt: *(uint32_t*)buffer];
+      DK_RETURN_BOXED_NUMBER(5, *(uint32_t*)buffer,
+        [objCEquivalent numberWithUnsignedInt: *(uint32_t*)buffer]);
     case DBUS_TYPE_INT64:
-      return [objCEquivalent numberWithLongLong: *(int64_t*)buffer];
+      DK_RETURN_BOXED_NUMBER(6, *(int64_t*)buffer,
+        [objCEquivalent numberWithLongLong: *(int64_t*)buffer]);
     case DBUS_TYPE_UINT64:
-      return [objCEquivalent numberWithUnsignedLongLong: *(uint64_t*)buffer];
+      DK_RETURN_BOXED_NUMBER(7, *(uint64_t*)buffer,
+        [objCEquivalent numberWithUnsignedLongLong: *(uint64_t*)buffer]);
     case DBUS_TYPE_DOUBLE:
       return [objCEquivalent numberWithDouble: *(double*)buffer];
     case DBUS_TYPE_STRING:
@@ -1545,6 +1775,98 @@ DKDBusTypeForUnboxingObject(id object)
 }
 @end;
 
+/*
+ * Returns whether arrays of <var>type</var> can be transferred in bulk as packed
+ * numbers. Booleans are left out because their D-Bus representation differs
+ * from BOOL.
+ */
+static BOOL
+DKDBusTypeIsPackable(int type)
+{
+  switch (type)
+  {
+    case DBUS_TYPE_BYTE:
+    case DBUS_TYPE_INT16:
+    case DBUS_TYPE_UINT16:
+    case DBUS_TYPE_INT32:
+    case DBUS_TYPE_UINT32:
+    case DBUS_TYPE_INT64:
+    case DBUS_TYPE_UINT64:
+    case DBUS_TYPE_DOUBLE:
+      return YES;
+    default:
+      return NO;
+  }
+}
+
+/*
+ * Returns whether the numbers in <var>array</var> have the representation of
+ * <var>type</var>, so that they can be marshalled without conversion.
+ */
+static BOOL
+DKPackedArrayFitsIntoDBusType(DKPackedArray *array, int type)
+{
+  const char *arrayType = [array objCType];
+  BOOL isFloat = ((_C_FLT == *arrayType) || (_C_DBL == *arrayType));
+  NSUInteger size = 0;
+  if (NO == DKDBusTypeIsPackable(type))
+  {
+    return NO;
+  }
+  NSGetSizeAndAlignment(arrayType, &size, NULL);
+  return ((size == DKUnboxedObjCTypeSizeForDBusType(type))
+    && (isFloat == (DBUS_TYPE_DOUBLE == type)));
+}
+
+/*
+ * NSData subclass pointing into the body of a D-Bus message. The message is
+ * locked once it has been received, so the bytes stay valid while we hold a
+ * reference to it.
+ */
+@interface DKMessageData: NSData
+{
+  DBusMessage *message;
+  const void *bytes;
+  NSUInteger length;
+}
+- (id)initWithMessage: (DBusMessage*)msg
+                bytes: (const void*)someBytes
+               length: (NSUInteger)aLength;
+@end
+
+@implementation DKMessageData
+- (id)initWithMessage: (DBusMessage*)msg
+                bytes: (const void*)someBytes
+               length: (NSUInteger)aLength
+{
+  // NSData leaves initialization to its concrete subclasses, hence no call to
+  // -[super init].
+  message = dbus_message_ref(msg);
+  bytes = someBytes;
+  length = aLength;
+  return self;
+}
+
+- (const void*)bytes
+{
+  return bytes;
+}
+
+- (NSUInteger)length
+{
+  return length;
+}
+
+- (void)dealloc
+{
+  if (NULL != message)
+  {
+    dbus_message_unref(message);
+  }
+  [super dealloc];
+}
+@end
+
 @implementation DKArrayTypeArgument
 - (id)initWithIterator: (DBusSignatureIter*)iterator
                   name: (NSString*)_name
@@ -1623,46 +1945,47 @@ DKDBusTypeForUnboxingObject(id object)
     @"Type mismatch between D-Bus message and introspection data.");
 }
 
+/**
+ * Returns the packed elements of an array of numbers. The elements must be of
+ * a type for which DKDBusTypeIsPackable() returns YES.
+ */
 - (NSData*)dataFromSubIter: (DBusMessageIter*)iter
 {
-  uint8_t bytes[128];
-  NSMutableData *data = [NSMutableData new];
-  NSData *returnData = nil;
-  NSUInteger idx = 0;
-  do
+  const void *bytes = NULL;
+  int count = 0;
+  NSUInteger length = 0;
+  DBusMessage *msg = NULL;
+  int elementType = [[self elementTypeArgument] DBusType];
+  int type = dbus_message_iter_get_arg_type(iter);
+  if (DBUS_TYPE_INVALID == type)
   {
-    if (0 == dbus_message_iter_get_arg_type(iter))
-    {
-      // If we opened an empty iterator, we just break from the loop
-      break;
-    }
-    else if (DBUS_TYPE_BYTE != dbus_message_iter_get_arg_type(iter))
-    {
-      //Very bad, should never happen, but it would trash the stack
-      // if it did, so we protect against it.
-      [data release];
-      [NSException raise: @"DKInternalInconsistencyException"
-                  format: @"Mistyped array iterator"];
-    }
-    NSUInteger offset = idx++ % 128;
-    dbus_message_iter_get_basic(iter, (void*)(&bytes[0] + offset));
-    // We filled the last byte of the on stack buffer, so we
-    if (127 == offset)
-      {
-        [data appendBytes: &bytes[0] length: 128];
-      }
-  } while (dbus_message_iter_next(iter));
-  // We dropped out of the loop after we incremented the running idx
-  // so idx % 128 will now be at offset + 1, which is the length we
-  // used off of our on stack buffer
-  NSUInteger len = idx % 128;
-  if (0 != len)
-    {
-      [data appendBytes: &bytes[0] length: len];
-    }
-  returnData = [NSData dataWithData: data];
-  [data release];
-  return returnData;
+    // If we opened an empty iterator, there is nothing to read.
+    return [NSData data];
+  }
+  else if ((elementType != type) || (NO == DKDBusTypeIsPackable(type)))
+  {
+    // Very bad, should never happen, but we would read garbage if it did, so
+    // we protect against it.
+    [NSException raise: @"DKInternalInconsistencyException"
+                format: @"Mistyped array iterator"];
+  }
+
+  dbus_message_iter_get_fixed_array(iter, (void*)&bytes, &count);
+  length = (NSUInteger)count * DKUnboxedObjCTypeSizeForDBusType(type);
+
+  /*
+   * If we know which message we are reading from, we can return data that
+   * refers to its body instead of copying it.
+   */
+  msg = [DKArgument messageBeingUnmarshalled];
+  if (NULL != msg)
+  {
+    return [[[DKMessageData alloc] initWithMessage: msg
+                                             bytes: bytes
+                                            length: length] autorelease];
+  }
+  return [NSData dataWithBytes: bytes
+                        length: length];
 }
 
 -(id) unmarshalledObjectFromIterator: (DBusMessageIter*)iter
@@ -1670,17 +1993,26 @@ DKDBusTypeForUnboxingObject(id object)
   DKArgument *theChild = [self elementTypeArgument];
   DBusMessageIter subIter;
   NSString *className = [self annotationValueForKey: @"org.gnustep.objc.class"];
+  Class theClass = NSClassFromString(className);
   BOOL returnAsNSData = NO;
+  BOOL returnAsPackedArray = NO;
   // Check whether we are decoding a byte array that has been anotated as being
   // an NSData instance
   if ((DBUS_TYPE_BYTE == [theChild DBusType]) &&
-    ([NSClassFromString(className) isSubclassOfClass: [NSData class]]))
+    ([theClass isSubclassOfClass: [NSData class]]))
    {
      returnAsNSData = YES;
    }
-  NSMutableArray *theArray = (returnAsNSData) ? nil : [NSMutableArray new];
+  // Or an array of numbers that has been annotated as being a packed array:
+  else if (DKDBusTypeIsPackable([theChild DBusType])
+    && [theClass isSubclassOfClass: [DKPackedArray class]])
+  {
+    returnAsPackedArray = YES;
+  }
+  NSMutableArray *theArray = nil;
   NSArray *returnArray = nil;
   NSNull *theNull = [NSNull null];
+  DBusMessage *msg = NULL;
 
   [self assertSaneIterator: iter];
 
@@ -1689,7 +2021,26 @@ DKDBusTypeForUnboxingObject(id object)
     {
       return [self dataFromSubIter: &subIter];
     }
+  else if (returnAsPackedArray)
+  {
+    return [DKPackedArray arrayWithData: [self dataFromSubIter: &subIter]
+                               objCType: [theChild unboxedObjCTypeChar]];
+  }
+  else if (usesLazyContainers
+    && (NULL != (msg = [DKArgument messageBeingUnmarshalled])))
+  {
+    DKLazyArray *lazyArray = [[DKLazyArray alloc] initWithIterator: &subIter
+                                                           message: msg
+                                                   elementArgument: theChild];
+    if (nil != lazyArray)
+    {
+      return [lazyArray autorelease];
+    }
+    // Start over and unmarshall the elements right away.
+    dbus_message_iter_recurse(iter, &subIter);
+  }
 
+  theArray = [NSMutableArray new];
   do
   {
     id obj = nil;
@@ -1741,7 +2092,17 @@ DKDBusTypeForUnboxingObject(id object)
   DK_ITER_OPEN_CONTAINER(iter, DBUS_TYPE_ARRAY, [[theChild DBusTypeSignature] UTF8String], &subIter);
   NS_DURING
     {
-      if ([object respondsToSelector: @selector(objectEnumerator)])
+      if ([object isKindOfClass: [DKPackedArray class]]
+        && DKPackedArrayFitsIntoDBusType(object, [theChild DBusType]))
+      {
+        const void *bytes = [object bytes];
+        if (NO == (BOOL)dbus_message_iter_append_fixed_array(&subIter,
+          [theChild DBusType], (void*)&bytes, (int)[object count]))
+        {
+          DK_MARSHALLING_RAISE_OOM;
+        }
+      }
+      else if ([object respondsToSelector: @selector(objectEnumerator)])
 	{
 	  elementEnum = [object objectEnumerator];
 	  while (nil != (element = [elementEnum nextObject]))
@@ -1753,12 +2114,11 @@ DKDBusTypeForUnboxingObject(id object)
 	}
     else if ([object isKindOfClass: [NSData class]])
       {
-	NSUInteger len = [object length];
 	const void *bytes = [object bytes];
-	NSUInteger pos = 0;
-	for (pos = 0; pos < len; pos++)
+	if (NO == (BOOL)dbus_message_iter_append_fixed_array(&subIter,
+	  DBUS_TYPE_BYTE, (void*)&bytes, (int)[object length]))
 	  {
-	     DK_ITER_APPEND(&subIter, DBUS_TYPE_BYTE, bytes++);
+	    DK_MARSHALLING_RAISE_OOM;
 	  }
       }
     }
@@ -1816,14 +2176,31 @@ DKDBusTypeForUnboxingObject(id object)
 {
   DKDictEntryTypeArgument *theChild = (DKDictEntryTypeArgument*)[self elementTypeArgument];
   DBusMessageIter subIter;
-  NSMutableDictionary *theDictionary = [NSMutableDictionary new];
+  NSMutableDictionary *theDictionary = nil;
   NSDictionary *returnDictionary = nil;
   NSNull *theNull = [NSNull null];
+  DBusMessage *msg = NULL;
 
   [self assertSaneIterator: iter];
 
   // We loop over the dict entries:
   dbus_message_iter_recurse(iter, &subIter);
+  if (usesLazyContainers
+    && (NULL != (msg = [DKArgument messageBeingUnmarshalled])))
+  {
+    DKLazyDictionary *lazyDict = [[DKLazyDictionary alloc] initWithIterator: &subIter
+                                                                    message: msg
+                                                                keyArgument: [theChild keyArgument]
+                                                              valueArgument: [theChild valueArgument]];
+    if (nil != lazyDict)
+    {
+      return [lazyDict autorelease];
+    }
+    // Start over and unmarshall the entries right away.
+    dbus_message_iter_recurse(iter, &subIter);
+  }
+
+  theDictionary = [NSMutableDictionary new];
   do
   {
     id value = nil;
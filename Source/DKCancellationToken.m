@@ -0,0 +1,110 @@
+/** Implementation of the DKCancellationToken class for abandoning D-Bus calls.
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+   */
+
+#import "DBusKit/DKCancellationToken.h"
+#import "DKMethodCall.h"
+
+#import <Foundation/NSArray.h>
+#import <Foundation/NSEnumerator.h>
+#import <Foundation/NSLock.h>
+
+@implementation DKCancellationToken
++ (id)token
+{
+  return [[[self alloc] init] autorelease];
+}
+
+- (id)init
+{
+  if (nil == (self = [super init]))
+  {
+    return nil;
+  }
+  lock = [[NSLock alloc] init];
+  calls = [[NSMutableArray alloc] init];
+  return self;
+}
+
+/**
+ * Called by a method call when it is being sent. Returns NO if the token has
+ * already been cancelled, in which case the call must not be sent.
+ */
+- (BOOL)_addCall: (DKMethodCall*)call
+{
+  BOOL added = NO;
+  [lock lock];
+  if (NO == cancelled)
+  {
+    [calls addObject: call];
+    added = YES;
+  }
+  [lock unlock];
+  return added;
+}
+
+/**
+ * Called by a method call once it has completed.
+ */
+- (void)_removeCall: (DKMethodCall*)call
+{
+  [lock lock];
+  [calls removeObjectIdenticalTo: call];
+  [lock unlock];
+}
+
+- (void)cancel
+{
+  NSArray *pending = nil;
+  NSEnumerator *theEnum = nil;
+  DKMethodCall *call = nil;
+  [lock lock];
+  if (cancelled)
+  {
+    [lock unlock];
+    return;
+  }
+  cancelled = YES;
+  pending = calls;
+  calls = nil;
+  [lock unlock];
+
+  theEnum = [pending objectEnumerator];
+  while (nil != (call = [theEnum nextObject]))
+  {
+    [call cancel];
+  }
+  [pending release];
+}
+
+- (BOOL)isCancelled
+{
+  BOOL isCancelled = NO;
+  [lock lock];
+  isCancelled = cancelled;
+  [lock unlock];
+  return isCancelled;
+}
+
+- (void)dealloc
+{
+  [calls release];
+  [lock release];
+  [super dealloc];
+}
+@end
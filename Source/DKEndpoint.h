@@ -32,7 +32,7 @@
 #  define ATTR_HIDDEN
 #endif
 
-@class DKRunLoopContext, NSRunLoop, NSString, NSDictionary;
+@class DKRunLoopContext, DKWorker, NSRunLoop, NSString, NSDictionary;
 @protocol NSCoding;
 
 /**
@@ -44,6 +44,7 @@
   DBusConnection *connection;
   NSDictionary *info;
   DKRunLoopContext *ctx;
+  DKWorker *worker;
 }
 
 /**
@@ -87,6 +88,22 @@
  */
 - (NSString*)runLoopMode;
 
+/**
+ * Returns the worker whose thread interacts with libdbus on behalf of the
+ * endpoint.
+ */
+- (DKWorker*)worker;
+
+/**
+ * Returns gauges for the dispatching of incoming messages on the connection:
+ * The number of messages and replies dispatched, the number of dispatch turns
+ * that ended with messages left over (exhaustedTurns), the number of
+ * consecutive such turns (backlogTurns), whether the connection is waiting for
+ * its next turn (queued), and the number of bytes waiting to be sent
+ * (outgoingBytes).
+ */
+- (NSDictionary*)dispatchStatistics;
+
 @end
 
 /**
@@ -32,12 +32,14 @@
 #import <Foundation/NSMapTable.h>
 #import <Foundation/NSRunLoop.h>
 #import <Foundation/NSString.h>
-#import <Foundation/NSTimer.h>
+#import <Foundation/NSThread.h>
 #import <Foundation/NSValue.h>
 #import <GNUstepBase/NSDebug+GNUstepBase.h>
 
 #import "DBusKit/DKPort.h"
 #import "DKEndpointManager.h"
+#import "DKEventBackend.h"
+#import "DKTimerWheel.h"
 
 /*
  * Integration functions:
@@ -96,27 +98,44 @@ DKRelease(void *ptr);
 @interface DKRunLoopContext: NSObject
 {
   DBusConnection *connection;
-  NSMapTable *timers;
+  DKTimerWheel *timerWheel;
   NSMapTable *watchers;
   NSString *runLoopMode;
   NSRunLoop *runLoop;
+  DKWorker *worker;
+  /*
+   * Dispatch scheduling state and gauges. Only modified on the worker thread.
+   */
+  BOOL dispatchQueued;
+  NSUInteger dispatchedMessages;
+  NSUInteger dispatchedReplies;
+  NSUInteger exhaustedTurns;
+  NSUInteger backlogTurns;
 }
 
-- (id)_initWithConnection: (DBusConnection*)connection;
+- (id)_initWithConnection: (DBusConnection*)connection
+                   worker: (DKWorker*)aWorker;
 - (NSRunLoop*)runLoop;
 - (NSString*)runLoopMode;
+- (DKWorker*)worker;
+- (DKEventBackend*)eventBackend;
+- (NSDictionary*)dispatchStatistics;
 @end
 
 /**
  * Watcher object to monitor the file descriptors D-Bus signals on.
  */
-@interface DKWatcher: NSObject <RunLoopEvents>
+@interface DKWatcher: NSObject <DKEventHandler>
 {
   DBusWatch *watch;
   BOOL callbackInProgress;
   int fileDesc;
   DKRunLoopContext *ctx;
+  DKEventBackend *backend;
+  NSUInteger monitoredEvents;
 }
+- (DKWorker*)worker;
+- (void)updateMonitoredEvents;
 @end
 
 
@@ -147,7 +166,9 @@ DKRelease(void *ptr);
    */
   dbus_connection_ref(conn);
   connection = conn;
-  ctx = [[DKRunLoopContext alloc] _initWithConnection: connection];
+  worker = [[[DKEndpointManager sharedEndpointManager] workerForNewEndpoint] retain];
+  ctx = [[DKRunLoopContext alloc] _initWithConnection: connection
+                                               worker: worker];
 
   // Install our runLoop hooks:
   if ((initSuccess = (nil != ctx)))
@@ -431,6 +452,16 @@ DKRelease(void *ptr);
   return [ctx runLoopMode];
 }
 
+- (DKWorker*)worker
+{
+  return worker;
+}
+
+- (NSDictionary*)dispatchStatistics
+{
+  return [ctx dispatchStatistics];
+}
+
 - (DBusConnection*)DBusConnection
 {
   return connection;
@@ -461,56 +492,78 @@ DKRelease(void *ptr);
 {
   [self cleanup];
   [info release];
+  [worker release];
   [super dealloc];
 }
 @end
 
 @implementation DKWatcher
 /**
- * Tells the run loop to monitor the events that D-Bus wants to monitor.
+ * Returns the worker responsible for the connection the watch belongs to.
+ */
+- (DKWorker*)worker
+{
+  return [ctx worker];
+}
+
+/**
+ * Tells the event backend of the current thread to monitor the events that
+ * D-Bus wants to monitor.
  */
 - (void)monitorForEvents
 {
-  NSUInteger events = dbus_watch_get_flags(watch);
-  // Dispatch new events to the runLoop:
-  if (events & DBUS_WATCH_READABLE)
-    {
-      [[ctx runLoop] addEvent: (void*)(intptr_t)fileDesc
-                         type: ET_RDESC
-                      watcher: self
-                      forMode: [ctx runLoopMode]];
-    }
-  if (events & DBUS_WATCH_WRITABLE)
-    {
-      [[ctx runLoop] addEvent: (void*)(intptr_t)fileDesc
-                         type: ET_WDESC
-                      watcher: self
-                      forMode: [ctx runLoopMode]];
-    }
+  DKEventBackend *currentBackend = [ctx eventBackend];
+  if (currentBackend == backend)
+  {
+    return;
+  }
+  if (nil != backend)
+  {
+    /*
+     * We are still registered with the backend of another thread (e.g. the
+     * one that created us in synchronized mode and has exited since), which
+     * will never deliver events for us again.
+     */
+    [self unmonitorForEvents];
+  }
+  backend = [currentBackend retain];
+  monitoredEvents = dbus_watch_get_flags(watch);
+  [backend monitorFileDescriptor: fileDesc
+                       forEvents: monitoredEvents
+                         handler: self];
 }
 
 /**
- * Tells the run loop to stop monitoring the events that D-Bus wants to monitor.
+ * Tells the event backend to stop monitoring the events that D-Bus wants to
+ * monitor.
  */
 - (void)unmonitorForEvents
 {
-  NSUInteger events = dbus_watch_get_flags(watch);
-  // Remove events to the runLoop:
-  if (events & DBUS_WATCH_READABLE)
-    {
-      [[ctx runLoop] removeEvent: (void*)(intptr_t)fileDesc
-                            type: ET_RDESC
-                         forMode: [ctx runLoopMode]
-                             all: NO];
-    }
-  if (events & DBUS_WATCH_WRITABLE)
-    {
-      [[ctx runLoop] removeEvent: (void*)(intptr_t)fileDesc
-                            type: ET_WDESC
-                         forMode: [ctx runLoopMode]
-                             all: NO];
-    }
+  [backend unmonitorFileDescriptor: fileDesc
+                         forEvents: monitoredEvents
+                           handler: self];
+  DESTROY(backend);
+}
 
+/**
+ * Makes the event backend follow changes to the enabled state of the watch
+ * without removing the file descriptor from it.
+ */
+- (void)updateMonitoredEvents
+{
+  if (nil == backend)
+  {
+    [self monitorForEvents];
+  }
+  else if (monitoredEvents != dbus_watch_get_flags(watch))
+  {
+    [self unmonitorForEvents];
+    [self monitorForEvents];
+  }
+  [backend setEnabled: (BOOL)dbus_watch_get_enabled(watch)
+            forEvents: monitoredEvents
+       fileDescriptor: fileDesc
+              handler: self];
 }
 
 - (id)initWithWatch: (DBusWatch*)_watch
@@ -522,7 +575,7 @@ DKRelease(void *ptr);
       return nil;
     }
   fileDesc = fd;
-  // The context retains its watchers and timers:
+  // The context retains its watchers:
   ctx = aCtx;
   watch = _watch;
   [self monitorForEvents];
@@ -544,20 +597,27 @@ DKRelease(void *ptr);
       //Not good
       return;
     }
-  callbackInProgress = YES;
   switch (type)
     {
       case ET_RDESC:
-        NSDebugMLog(@"Handling readable on watch");
-        dbus_watch_handle(watch, DBUS_WATCH_READABLE);
+        [self handleWatchEvents: DBUS_WATCH_READABLE];
         break;
       case ET_WDESC:
-        NSDebugMLog(@"Handling writable on watch");
-        dbus_watch_handle(watch, DBUS_WATCH_WRITABLE);
+        [self handleWatchEvents: DBUS_WATCH_WRITABLE];
         break;
       default:
         break;
     }
+}
+
+/**
+ * Delegate method for event delivery by other event backends.
+ */
+- (void)handleWatchEvents: (NSUInteger)flags
+{
+  callbackInProgress = YES;
+  NSDebugMLog(@"Handling events %lu on watch", (unsigned long)flags);
+  dbus_watch_handle(watch, flags);
   callbackInProgress = NO;
 }
 
@@ -565,17 +625,10 @@ DKRelease(void *ptr);
 {
   /*
    * We might be deallocated due to a connection failure. In that case, we
-   * cannot ask libdbus what kind of event we were watching for. Hence, we
-   * remove ourselves from the loop for all event types.
+   * cannot ask libdbus what kind of event we were watching for, so we use the
+   * events recorded when we started monitoring.
    */
-  [[ctx runLoop] removeEvent: (void*)(intptr_t)fileDesc
-                        type: ET_RDESC
-                     forMode: [ctx runLoopMode]
-                         all: NO];
-  [[ctx runLoop] removeEvent: (void*)(intptr_t)fileDesc
-                        type: ET_WDESC
-                     forMode: [ctx runLoopMode]
-                         all: NO];
+  [self unmonitorForEvents];
   [super dealloc];
 }
 @end
@@ -583,10 +636,10 @@ DKRelease(void *ptr);
 static DKEndpointManager *theManager;
 static IMP performOnWorkerThread;
 
-#define performOnWorkerThreadSelector @selector(boolReturnForPerformingSelector:target:data:waitForReturn:)
+#define performOnWorkerThreadSelector @selector(boolReturnForPerformingSelector:target:data:waitForReturn:worker:)
 
 #define doPerformOnWorkerThread(target,selector,data,doWait) \
-  performOnWorkerThread(theManager, performOnWorkerThreadSelector, selector, target, data, doWait)
+  performOnWorkerThread(theManager, performOnWorkerThreadSelector, selector, target, data, doWait, [target worker])
 
 #define ctxPerformOnWorkerThread(selector,data) doPerformOnWorkerThread(ctx,selector,data, NO)
 #define syncCtxPerformOnWorkerThread(selector,data) (BOOL)(uintptr_t)doPerformOnWorkerThread(ctx,selector,data, YES)
@@ -600,17 +653,22 @@ static IMP performOnWorkerThread;
   }
 }
 - (id) _initWithConnection: (DBusConnection*)conn
+                    worker: (DKWorker*)aWorker
 {
   if (nil == (self = [super init]))
   {
     return nil;
   }
   connection = conn;
+  ASSIGN(worker, aWorker);
 
+  timerWheel = [[DKTimerWheel alloc] initWithContext: self];
+  if (nil == timerWheel)
+  {
+    [self release];
+    return nil;
+  }
   // TODO: Profile wether 10 is a reasonable default capacity.
-  timers = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks,
-    NSObjectMapValueCallBacks,
-    10);
   watchers = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks,
     NSObjectMapValueCallBacks,
     10);
@@ -645,13 +703,48 @@ static IMP performOnWorkerThread;
   }
 }
 
+- (DKWorker*)worker
+{
+  return worker;
+}
+
+/**
+ * Returns the event backend to use on the current thread. This is the backend
+ * of the worker if we are running in the worker thread and a plain run loop
+ * backend otherwise (e.g. in synchronized mode).
+ */
+- (DKEventBackend*)eventBackend
+{
+  DKEventBackend *backend = nil;
+  if ([[worker thread] isEqual: [NSThread currentThread]])
+  {
+    backend = [worker eventBackend];
+  }
+  if (nil == backend)
+  {
+    backend = [[[DKRunLoopEventBackend alloc] init] autorelease];
+    [backend attachToRunLoop: [self runLoop]
+                        mode: [self runLoopMode]];
+  }
+  return backend;
+}
 
 - (void)dealloc
 {
   NSDebugMLog(@"Destroying run loop context for libdbus.");
-  NSFreeMapTable(watchers);
-  NSFreeMapTable(timers);
+  if (NULL != watchers)
+  {
+    NSFreeMapTable(watchers);
+  }
+  [theManager unregisterWatcher: timerWheel];
+  [timerWheel release];
   [runLoopMode release];
+  /*
+   * libdbus has released all references to the context, so nobody will submit
+   * requests for this connection to the worker any more.
+   */
+  [theManager retireWorker: worker];
+  [worker release];
   [super dealloc];
 }
 
@@ -660,70 +753,165 @@ static IMP performOnWorkerThread;
  */
 - (BOOL)addTimeout: (DBusTimeout*)timeout
 {
-  NSTimer *timer = nil;
-  int milliSeconds = dbus_timeout_get_interval(timeout);
-  NSTimeInterval interval = (milliSeconds / 1000.0);
   NSAssert(timeout, @"Missing timeout data during D-Bus event handling.");
-  // Just return if we already have a timer for this timeout:
-  if (NSMapGet(timers,timeout))
+  if (NO == [timerWheel isMonitoring])
   {
+    /*
+     * The wheel uses a single timer source for all timeouts, which needs to be
+     * moved to the worker thread like the watchers if we are synchronizing.
+     */
+    [timerWheel monitorForEvents];
+    [theManager registerWatcher: timerWheel];
+  }
+  return [timerWheel addTimeout: timeout];
+}
+
+/**
+ * Lets libdbus remove a timeout it doesn't need anymore. Returns YES because
+ * it is performed synchronously on the worker thread.
+ */
+- (BOOL)removeTimeout: (DBusTimeout*)timeout
+{
+  NSAssert(timeout, @"Missing timeout data during D-Bus event handling.");
+  [timerWheel removeTimeout: timeout];
+  return YES;
+}
+
+/**
+ * Follows changes to the enabled state of a timeout.
+ */
+- (BOOL)toggleTimeout: (DBusTimeout*)timeout
+{
+  NSAssert(timeout, @"Missing timeout data during D-Bus event handling.");
+  if (dbus_timeout_get_enabled(timeout))
+  {
+    // Re-adding resets the interval, which is what libdbus expects.
+    return [self addTimeout: timeout];
+  }
+  [timerWheel removeTimeout: timeout];
+  return YES;
+}
+
+/**
+ * Queues the connection for dispatching by the worker. If we are not running
+ * on the worker thread (i.e. in synchronized mode), we dispatch right away.
+ */
+- (BOOL)scheduleDispatch: (id)ignored
+{
+  if ([[worker thread] isEqual: [NSThread currentThread]])
+  {
+    [worker scheduleDispatchForContext: self];
     return YES;
   }
+  return [self dispatchForConnection: NULL];
+}
 
-  //Create the timer, saving the DBusTimeout pointer for later use.
-  timer = [NSTimer timerWithTimeInterval: MAX(interval, 0.1)
-                                  target: self
-                                selector: @selector(handleTimeout:)
-                                userInfo: [NSValue valueWithPointer: timeout]
-                                 repeats: YES];
-  if (timer == nil)
+- (BOOL)isDispatchQueued
+{
+  return dispatchQueued;
+}
+
+/**
+ * Marks whether the context is waiting in the dispatch queue of the worker.
+ * The connection is kept alive while it is queued.
+ */
+- (void)setDispatchQueued: (BOOL)yesno
+{
+  if (yesno == dispatchQueued)
   {
-    return NO;
+    return;
+  }
+  dispatchQueued = yesno;
+  if (yesno)
+  {
+    dbus_connection_ref(connection);
   }
   else
   {
-    NSMapInsert(timers,timeout,timer);
-    [theManager registerTimer: timer
-                  fromContext: self];
-    [[self runLoop] addTimer: timer
-                     forMode: [self runLoopMode]];
-    return YES;
+    dbus_connection_unref(connection);
   }
 }
 
 /**
- * Lets libdbus remove a timeout it doesn't need anymore.
+ * Returns whether the next message in the incoming queue is a method reply or
+ * an error reply.
  */
-- (void)removeTimeout: (DBusTimeout*)timeout
+- (BOOL)_nextMessageIsReply
 {
-  NSTimer *timer = nil;
-  NSAssert(timeout, @"Missing timeout data during D-Bus event handling.");
-  timer = NSMapGet(timers,timeout);
-  if (nil != timer)
+  DBusMessage *msg = dbus_connection_borrow_message(connection);
+  int type = DBUS_MESSAGE_TYPE_INVALID;
+  if (NULL == msg)
   {
-    [timer invalidate];
-    [theManager unregisterTimer: timer];
-    NSMapRemove(timers,timeout);
+    return NO;
   }
+  type = dbus_message_get_type(msg);
+  dbus_connection_return_message(connection, msg);
+  return ((DBUS_MESSAGE_TYPE_METHOD_RETURN == type)
+    || (DBUS_MESSAGE_TYPE_ERROR == type));
 }
 
 /**
- * Callback method for timers.
+ * Dispatches up to <var>budget</var> messages as long as they are replies.
+ * Ordering within the connection is preserved, so this stops at the first
+ * message that is not a reply.
  */
-- (void)handleTimeout: (NSTimer*)timer
+- (NSUInteger)dispatchRepliesWithBudget: (NSUInteger)budget
 {
-  DBusTimeout *timeout = (DBusTimeout*)[(NSValue*)[timer userInfo] pointerValue];
-  NSAssert(timeout, @"Missing timeout data during D-Bus event handling.");
-  NSDebugMLog(@"Handling timeout");
-  dbus_timeout_handle(timeout);
-  /*
-   * Note: dbus_timeout_handle() returns FALSE on OOM, but the documentation
-   * specifies we just ignore that and retry the next time the timeout fires.
-   */
+  NSUInteger count = 0;
+  while ((count < budget)
+    && (DBUS_DISPATCH_DATA_REMAINS == dbus_connection_get_dispatch_status(connection))
+    && [self _nextMessageIsReply])
+  {
+    dbus_connection_dispatch(connection);
+    count++;
+  }
+  dispatchedMessages += count;
+  dispatchedReplies += count;
+  return count;
+}
+
+/**
+ * Dispatches up to <var>budget</var> messages. Returns whether the connection
+ * has more data to dispatch.
+ */
+- (BOOL)dispatchWithBudget: (NSUInteger)budget
+{
+  NSUInteger count = 0;
+  BOOL remains = NO;
+  while ((count < budget)
+    && (DBUS_DISPATCH_DATA_REMAINS == dbus_connection_get_dispatch_status(connection)))
+  {
+    dbus_connection_dispatch(connection);
+    count++;
+  }
+  dispatchedMessages += count;
+  remains = (DBUS_DISPATCH_DATA_REMAINS == dbus_connection_get_dispatch_status(connection));
+  if (remains)
+  {
+    exhaustedTurns++;
+    backlogTurns++;
+  }
+  else
+  {
+    backlogTurns = 0;
+  }
+  return remains;
+}
+
+- (NSDictionary*)dispatchStatistics
+{
+  return [NSDictionary dictionaryWithObjectsAndKeys:
+    [NSNumber numberWithUnsignedInteger: dispatchedMessages], @"dispatchedMessages",
+    [NSNumber numberWithUnsignedInteger: dispatchedReplies], @"dispatchedReplies",
+    [NSNumber numberWithUnsignedInteger: exhaustedTurns], @"exhaustedTurns",
+    [NSNumber numberWithUnsignedInteger: backlogTurns], @"backlogTurns",
+    [NSNumber numberWithBool: dispatchQueued], @"queued",
+    [NSNumber numberWithLong: dbus_connection_get_outgoing_size(connection)], @"outgoingBytes",
+    nil];
 }
 
 /**
- * Called by libdbus to drain the message queue.
+ * Drains the message queue of the connection completely.
  */
 - (BOOL)dispatchForConnection: (DBusConnection*)conn
 {
@@ -782,9 +970,31 @@ static IMP performOnWorkerThread;
 }
 
 /**
- * Remove a file descriptor from the list of those monitored.
+ * Follows changes to the enabled state of a watch.
  */
-- (void)removeWatch: (DBusWatch*)watch
+- (BOOL)toggleWatch: (DBusWatch*)watch
+{
+  DKWatcher *watcher = nil;
+  NSAssert(watch, @"Missing watch data during D-Bus event handling.");
+  watcher = NSMapGet(watchers, watch);
+  if (nil == watcher)
+  {
+    // Watches that were disabled when added have not been set up yet:
+    if (dbus_watch_get_enabled(watch))
+    {
+      return [self addWatch: watch];
+    }
+    return YES;
+  }
+  [watcher updateMonitoredEvents];
+  return YES;
+}
+
+/**
+ * Remove a file descriptor from the list of those monitored. Returns YES
+ * because it is performed synchronously on the worker thread.
+ */
+- (BOOL)removeWatch: (DBusWatch*)watch
 {
 
   DKWatcher *watcher = nil;
@@ -796,6 +1006,7 @@ static IMP performOnWorkerThread;
     [theManager unregisterWatcher: watcher];
     NSMapRemove(watchers, watch);
   }
+  return YES;
 }
 @end
 
@@ -823,21 +1034,22 @@ DKTimeoutRemove(DBusTimeout *timeout, void *data)
   CTX(data);
   NSCAssert(timeout, @"Missing timeout data during D-Bus event handling.");
   NSDebugFLog(@"Timeout removed");
-  ctxPerformOnWorkerThread(@selector(removeTimeout:),timeout);
+  /*
+   * The timer wheel reads the timeout when unlinking it, and libdbus might
+   * free the timeout as soon as we return (e.g. when the pending call that
+   * owns it is released), so this cannot be deferred.
+   */
+  syncCtxPerformOnWorkerThread(@selector(removeTimeout:),timeout);
 }
 
 static void
 DKTimeoutToggled(DBusTimeout *timeout, void *data)
 {
-  /*
-   * Note: This is the easy solution, not sure whether we can be smarter about
-   * this.
-   */
+  CTX(data);
+  NSCAssert(timeout, @"Missing timeout data during D-Bus event handling.");
   NSDebugFLog(@"Timeout toggled");
-  DKTimeoutRemove(timeout, data);
-  // DKTimeoutRemove immediately returns, but the ringbuffer perserves the
-  // ordering
-  DKTimeoutAdd(timeout, data);
+  // Rescheduling in the timer wheel is cheap, so we do it in one request.
+  syncCtxPerformOnWorkerThread(@selector(toggleTimeout:),timeout);
 }
 
 static dbus_bool_t
@@ -859,19 +1071,24 @@ DKWatchRemove(DBusWatch *watch, void *data)
   CTX(data);
   NSCAssert(watch, @"Missing watch data during D-Bus event handling.");
   NSDebugFLog(@"Removed watch");
-  ctxPerformOnWorkerThread(@selector(removeWatch:),watch);
+  /*
+   * libdbus frees the watch once we return, so the watcher must be gone by
+   * then: it would otherwise still read the flags of the watch or handle
+   * events for it.
+   */
+  syncCtxPerformOnWorkerThread(@selector(removeWatch:),watch);
 }
 
 static void
 DKWatchToggled(DBusWatch *watch, void *data)
 {
-  /*
-   * Note: This is the easy solution, not sure whether we can be smarter about
-   * this.
-   */
+  CTX(data);
+  NSCAssert(watch, @"Missing watch data during D-Bus event handling.");
   NSDebugFLog(@"Watch toggled");
-  DKWatchRemove(watch, data);
-  DKWatchAdd(watch, data);
+  // The watcher stays registered with the event backend, which only changes
+  // the events it reports. It reads the flags from the watch, so we wait
+  // until it is done.
+  syncCtxPerformOnWorkerThread(@selector(toggleWatch:),watch);
 }
 
 static void
@@ -887,7 +1104,7 @@ DKWakeUp(void *data)
   CTX(data);
   NSDebugFLog(@"Starting runLoop on D-Bus request");
   // If we are woken up, we surely need to dispatch new messages:
-  ctxPerformOnWorkerThread(@selector(dispatchForConnection:),NULL);
+  ctxPerformOnWorkerThread(@selector(scheduleDispatch:),NULL);
 }
 
 static void
@@ -909,9 +1126,10 @@ DKUpdateDispatchStatus(DBusConnection *conn,
     case DBUS_DISPATCH_DATA_REMAINS:
       NSDebugFLog(@"Will schedule handling of messages.");
   }
-  /* FIXME: libdbus has issues unless we synchronise on connection dispatch. */
-  if (syncCtxPerformOnWorkerThread(@selector(dispatchForConnection:), conn))
-  {
-    return;
-  };
+  /*
+   * libdbus does not allow dispatching from within this callback, so we only
+   * queue the connection. The worker dispatches it in its next turn, along
+   * with the other connections it serves.
+   */
+  ctxPerformOnWorkerThread(@selector(scheduleDispatch:), NULL);
 }
@@ -23,20 +23,245 @@
 
 #import <Foundation/NSObject.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <dbus/dbus.h>
 
-@class DKEndpoint, DKProxy, NSLock, NSMapTable, NSThread, NSRecursiveLock;
+@class DKEndpoint, DKEndpointManager, DKEventBackend, DKProxy, NSCondition,
+  NSHashTable, NSMutableArray,
+  NSMapTable, NSThread, NSRecursiveLock, NSTimer;
 
 
+/*
+ * Completion handle for requests whose caller waits for the return value. It
+ * lives on the stack of the waiting thread, which parks on the condition
+ * variable until the worker thread has stored the result.
+ */
+typedef struct {
+  volatile uint32_t completed;
+  NSInteger result;
+  pthread_mutex_t lock;
+  pthread_cond_t condition;
+} DKRequestCompletion;
+
 // The structure members should all be of the same size, so the compiler should
 // not do any awkward packing.
 typedef struct {
   id target;
   SEL selector;
   id object;
-  intptr_t* returnPointer;
+  DKRequestCompletion* completion;
 } DKRingBufferElement;
 
+/*
+ * A slot in the request ring. The sequence number tells producers whether the
+ * slot is free for the current pass around the ring and tells the consumer
+ * whether a reserved slot has already been filled.
+ */
+typedef struct {
+  volatile uint32_t sequence;
+  DKRingBufferElement element;
+} DKRingBufferSlot;
+
+/*
+ * The state of a bounded multi-producer/single-consumer request ring. Producers
+ * reserve slots by advancing <var>producerCounter</var> with a compare-and-swap,
+ * so they never need to take a lock unless the ring is full. In that case they
+ * park on <var>spaceCondition</var> until the consumer frees a slot.
+ * The slots are allocated for <var>maximumCapacity</var> requests, but only
+ * <var>capacity</var> of them will be used at a time. The capacity doubles
+ * whenever the ring runs full until it reaches the maximum.
+ */
+typedef struct {
+  DKRingBufferSlot *slots;
+  uint32_t mask;
+  volatile uint32_t capacity;
+  uint32_t maximumCapacity;
+  volatile uint32_t producerCounter;
+  volatile uint32_t consumerCounter;
+  volatile uint32_t waitingProducers;
+  NSCondition *spaceCondition;
+} DKRequestRing;
+
+/**
+ * Determines what happens to a request if the ring buffer of the endpoint
+ * manager is full:
+ * <deflist>
+ *   <term>DKRequestQueueBlock</term>
+ *   <desc>The calling thread blocks until there is room for the request.</desc>
+ *   <term>DKRequestQueueFail</term>
+ *   <desc>A DKRequestQueueFullException is raised.</desc>
+ *   <term>DKRequestQueueRunInline</term>
+ *   <desc>The request is performed on the calling thread if it does not need
+ *   to run on the worker thread. Otherwise the calling thread blocks.</desc>
+ * </deflist>
+ */
+typedef NS_ENUM(NSUInteger, DKRequestQueueFullPolicy)
+{
+  DKRequestQueueBlock,
+  DKRequestQueueFail,
+  DKRequestQueueRunInline
+};
+
+/**
+ * A DKWorker owns a thread running the run loop which interacts with libdbus,
+ * and the ring buffer used to pass requests to that thread. By default, the
+ * endpoint manager uses one worker for all endpoints, but it can be configured
+ * to create a separate worker for every endpoint.
+ */
+@interface DKWorker: NSObject
+{
+  @private
+  /**
+   * The manager that created the worker. Not retained.
+   */
+  DKEndpointManager *manager;
+
+  /**
+   * The thread running the runloop which interacts with libdbus.
+   */
+  NSThread *thread;
+
+  /**
+   * Tracks whether the thread has been started.
+   */
+  BOOL threadStarted;
+
+  /**
+   * Timer that keeps the run loop of the thread running.
+   */
+  NSTimer *keepAliveTimer;
+
+  /**
+   * The backend monitoring the file descriptors and timeouts of libdbus on the
+   * thread of the worker. Only exists while the thread is running.
+   */
+  DKEventBackend *eventBackend;
+
+  /**
+   * A (oneway) ring buffer for queuing tuples of the following form:
+   * <target, selector, data, pointer-to-return>. The tuples are inserted
+   * whenever a libdbus callback requires a value to be returned from the worker
+   * thread. Any number of threads may insert requests without locking, the
+   * worker thread is the only consumer.
+   */
+  DKRequestRing ring;
+
+  /**
+   * Descriptors used to wake up the worker thread when requests are pending.
+   * The worker thread watches the first one on its run loop, producers write
+   * to the second one. (They are the same descriptor if eventfd is available.)
+   */
+  int wakeupDescriptors[2];
+
+  /**
+   * Set by the producer that schedules a wakeup and cleared by the worker
+   * thread when it starts draining. Producers finding it set skip the wakeup
+   * because the pending drain will pick up their request as well.
+   */
+  volatile uint32_t drainPending;
+
+  /**
+   * Counters for requests inserted into the ring, wakeups signalled to the
+   * worker thread, wakeups that were avoided because a drain was pending, and
+   * passes through -drainBuffer:.
+   */
+  volatile NSUInteger requestCount;
+  volatile NSUInteger wakeupCount;
+  volatile NSUInteger avoidedWakeupCount;
+  volatile NSUInteger drainCount;
+
+  /**
+   * Run loop contexts of the connections that have messages waiting to be
+   * dispatched, in round-robin order. Only used on the worker thread.
+   */
+  NSMutableArray *dispatchQueue;
+}
+
+/**
+ * Initializes a worker whose thread will be called <var>name</var>. The ring
+ * buffer will initially hold <var>capacity</var> requests and can grow to hold
+ * <var>maximumCapacity</var> requests.
+ */
+- (id)initWithName: (NSString*)name
+           manager: (DKEndpointManager*)aManager
+          capacity: (uint32_t)capacity
+   maximumCapacity: (uint32_t)maximumCapacity;
+
+/**
+ * Returns the thread of the worker.
+ */
+- (NSThread*)thread;
+
+/**
+ * Returns the event backend used by the thread of the worker, or nil if the
+ * thread is not running.
+ */
+- (DKEventBackend*)eventBackend;
+
+/**
+ * Starts the thread of the worker unless it is already running.
+ */
+- (void)startThread;
+
+/**
+ * Entry point for the worker thread.
+ */
+- (void)start: (id)ignored;
+
+/**
+ * Makes the thread of the worker exit once it has no more work to do.
+ */
+- (void)stop;
+
+/**
+ * Inserts the request into the ring buffer and schedules it for draining in the
+ * worker thread, or performs it directly if called from the worker thread and
+ * <var>doWait</var> is YES. Returns the result of the request if
+ * <var>doWait</var> is YES and YES otherwise.
+ */
+- (BOOL)boolReturnForRequest: (DKRingBufferElement)request
+               waitForReturn: (BOOL)doWait;
+
+/**
+ * Called from within the worker thread to process requests from the ring
+ * buffer. All requests available will be processed in one pass.
+ */
+- (void)drainBuffer: (id)ignored;
+
+/**
+ * Called from within the worker thread to queue the run loop context of a
+ * connection with messages waiting to be dispatched. The connection will get
+ * its share of the next dispatch turn.
+ */
+- (void)scheduleDispatchForContext: (id)context;
+
+/**
+ * Called from within the worker thread to perform one dispatch turn: Every
+ * queued connection first gets to dispatch the replies at the head of its
+ * queue and then any kind of message, up to the dispatch budget each.
+ * Connections with messages left over are queued for the next turn, which
+ * will happen after the run loop has had a chance to handle other events.
+ */
+- (void)dispatchQueuedConnections;
+
+/**
+ * Returns the number of requests the ring buffer can hold at the moment.
+ */
+- (NSUInteger)requestQueueCapacity;
+
+/**
+ * Returns the number of requests the ring buffer can hold if it is allowed to
+ * grow.
+ */
+- (NSUInteger)maximumRequestQueueCapacity;
+
+/**
+ * Adds the request counters of the worker to the four element array
+ * <var>counters</var> (requests, wakeups, avoided wakeups and drain passes).
+ */
+- (void)addRequestStatisticsTo: (NSUInteger*)counters;
+@end
+
 /**
  * DKEndpointManager is a singleton class that maintains a thread to interact
  * with D-Bus. It is responsible for creating and tracking the endpoints to
@@ -47,19 +272,54 @@ typedef struct {
  * method calls that might trigger the manager (especially to DKEndpoint,
  * DKPort, DKPortNameServer, DKProxy, or DKNotificationCenter) with calls to
  * -enterInitialize and -leaveInitialize.
+ *
+ * The capacity of the ring buffer used to pass requests to the worker thread
+ * can be configured using the <code>DKRequestQueueCapacity</code> default. If
+ * <code>DKRequestQueueMaximumCapacity</code> is set to a larger value, the
+ * capacity will grow up to that value when the ring buffer runs full. The
+ * <code>DKRequestQueueFullPolicy</code> default (<code>block</code>,
+ * <code>fail</code> or <code>inline</code>) selects the initial
+ * DKRequestQueueFullPolicy.
+ *
+ * If the <code>DKWorkerThreadPerEndpoint</code> default is set (or
+ * -setUsesWorkerThreadPerEndpoint: has been called), every endpoint gets its
+ * own worker thread, run loop and request queue, so that traffic on one
+ * connection does not delay another.
+ *
+ * Workers dispatch incoming messages in turns, allowing each connection to
+ * dispatch at most <code>DKDispatchBudget</code> messages (32 by default)
+ * before the other connections and events get their share.
  */
 @interface DKEndpointManager: NSObject
 {
   /**
-   * The thread running the runloop which interacts with libdbus.
+   * The thread running the runloop which interacts with libdbus. If the
+   * manager uses one worker thread per endpoint, this is the thread used for
+   * requests that are not specific to any endpoint.
    */
   NSThread *workerThread;
   @private
 
   /**
-   * Tracks whether the thread has been started.
+   * The worker owning <ivar>workerThread</ivar>.
    */
-  BOOL threadStarted;
+  DKWorker *sharedWorker;
+
+  /**
+   * All workers presently in use, including the shared worker. Protected by the
+   * <ivar>connectionStateLock</ivar>.
+   */
+  NSHashTable *workers;
+
+  /**
+   * Number of workers besides the shared one.
+   */
+  volatile NSUInteger endpointWorkerCount;
+
+  /**
+   * Whether new endpoints get their own worker.
+   */
+  BOOL workerPerEndpoint;
 
   /**
    * Tracks whether we already enabled threading.
@@ -77,30 +337,20 @@ typedef struct {
   NSRecursiveLock *connectionStateLock;
 
   /**
-   * A (oneway) ring buffer for queuing tuples of the following form:
-   * <target, selector, data, pointer-to-return>. The tuples are inserted
-   * whenever a libdbus callback requires a value to be returned from the worker
-   * thread.
+   * Initial and maximum capacity for the ring buffers of the workers.
    */
-  DKRingBufferElement *ringBuffer;
+  uint32_t requestQueueCapacity;
+  uint32_t maximumRequestQueueCapacity;
 
   /**
-   * Free-running counter for the producer threads
+   * Number of messages a connection may dispatch per turn of its worker.
    */
-  uint32_t producerCounter;
+  NSUInteger dispatchBudget;
 
   /**
-   * Since it is possible for more than one thread to write to the ring buffer,
-   * it cannot be completely lockless: Producers need to obtain the
-   * <ivar>producerLock</ivar> in order to prevent overwriting. Since there is
-   * only one consumer thread, it needs no such provisions.
+   * What to do with requests if a ring buffer is full and cannot grow.
    */
-  NSLock *producerLock;
-
-  /**
-   * Free-running counter for the consumer thread
-   */
-  uint32_t consumerCounter;
+  DKRequestQueueFullPolicy fullPolicy;
 
   /**
    * Counter to track how many callers are calling into the endpoint-manager
@@ -140,10 +390,46 @@ typedef struct {
 + (id)sharedEndpointManager;
 
 /**
- * Returns a reference to the worker thread that interacts with D-Bus.
+ * Returns a reference to the worker thread that interacts with D-Bus. If the
+ * manager uses one worker thread per endpoint, this is the thread used for
+ * requests that are not specific to any endpoint.
  */
 - (NSThread*)workerThread;
 
+/**
+ * Returns the worker thread that interacts with D-Bus on behalf of
+ * <var>endpoint</var>.
+ */
+- (NSThread*)workerThreadForEndpoint: (DKEndpoint*)endpoint;
+
+/**
+ * Returns whether <var>thread</var> is the thread of any of the workers.
+ */
+- (BOOL)isWorkerThread: (NSThread*)thread;
+
+/**
+ * Sets whether endpoints created from now on will get their own worker thread.
+ */
+- (void)setUsesWorkerThreadPerEndpoint: (BOOL)yesno;
+
+/**
+ * Returns whether new endpoints get their own worker thread.
+ */
+- (BOOL)usesWorkerThreadPerEndpoint;
+
+/**
+ * Returns the worker a new endpoint should use. This will be a new worker if
+ * the manager uses one worker thread per endpoint, and the shared worker
+ * otherwise.
+ */
+- (DKWorker*)workerForNewEndpoint;
+
+/**
+ * Called when an endpoint worker is no longer used by any endpoint. This stops
+ * the worker unless it is the shared one.
+ */
+- (void)retireWorker: (DKWorker*)worker;
+
 /**
  * Creates or reuses an endpoint.
  */
@@ -169,12 +455,6 @@ typedef struct {
  */
 - (void)removeEndpointForDBusConnection: (DBusConnection*)connection;
 
-
-/**
- * Entry point for the worker thread.
- */
-- (void)start: (id)ignored;
-
 /**
  * Schedules periodic recovery attempts for  <var>endpoint/var>. Will be used in
  * case of bus failures. If recovery is successful, <var>aProxy</var> will be
@@ -186,8 +466,10 @@ typedef struct {
 /**
  * Inserts the request into the ring buffer and schedules it for draining in the
  * worker thread. With <var>doWait</var> set to YES this method becomes a
- * synchonisation point: It will spin until the request has completed. This
+ * synchonisation point: It will block until the request has completed. This
  * should only be used when a return value is required by the libdbus API.
+ * If the ring buffer is full, the request is handled according to the
+ * DKRequestQueueFullPolicy for the calling thread.
  */
 - (BOOL)boolReturnForPerformingSelector: (SEL)selector
                                  target: (id)target
@@ -195,11 +477,87 @@ typedef struct {
                           waitForReturn: (BOOL)doWait;
 
 /**
- * Called from within the worker thread to process requests from the ring
- * buffer.
+ * Like -boolReturnForPerformingSelector:target:data:waitForReturn:, but
+ * performs the request on the worker thread of <var>endpoint</var>.
  */
-- (void)drainBuffer: (id)ignored;
+- (BOOL)boolReturnForPerformingSelector: (SEL)selector
+                                 target: (id)target
+                                   data: (void*)data
+                          waitForReturn: (BOOL)doWait
+                            forEndpoint: (DKEndpoint*)endpoint;
+
+/**
+ * Like -boolReturnForPerformingSelector:target:data:waitForReturn:, but
+ * performs the request on the thread of <var>worker</var>.
+ */
+- (BOOL)boolReturnForPerformingSelector: (SEL)selector
+                                 target: (id)target
+                                   data: (void*)data
+                          waitForReturn: (BOOL)doWait
+                                 worker: (DKWorker*)worker;
+
+/**
+ * Schedules the request on the run loop of the current thread.  Used when
+ * requests cannot go through the ring buffer.
+ */
+- (void)invokeRequest: (const DKRingBufferElement)request;
+
+/**
+ * Returns a dictionary with the number of requests passed through the ring
+ * buffers (key: <code>requests</code>), the number of times worker threads
+ * have been woken up (<code>wakeups</code>) and the number of wakeups that were
+ * avoided because the worker thread was already going to drain the buffer
+ * (<code>avoidedWakeups</code>), as well as the number of passes through
+ * -drainBuffer: (<code>drainPasses</code>).
+ */
+- (NSDictionary*)requestStatistics;
+
+/**
+ * Returns the number of requests the ring buffer of the shared worker can
+ * hold at the moment.
+ */
+- (NSUInteger)requestQueueCapacity;
 
+/**
+ * Returns the number of requests the ring buffers can hold if they are allowed
+ * to grow.
+ */
+- (NSUInteger)maximumRequestQueueCapacity;
+
+/**
+ * Sets the number of messages a connection may dispatch per turn.
+ */
+- (void)setDispatchBudget: (NSUInteger)budget;
+
+/**
+ * Returns the number of messages a connection may dispatch per turn.
+ */
+- (NSUInteger)dispatchBudget;
+
+/**
+ * Sets the policy to apply to requests that find the ring buffer full. This can
+ * be overridden for specific threads using
+ * -setRequestQueueFullPolicyForCurrentThread:.
+ */
+- (void)setRequestQueueFullPolicy: (DKRequestQueueFullPolicy)policy;
+
+/**
+ * Returns the policy that applies to requests that find the ring buffer full,
+ * unless a thread specific policy has been set.
+ */
+- (DKRequestQueueFullPolicy)requestQueueFullPolicy;
+
+/**
+ * Sets the policy to apply when requests from the current thread find the ring
+ * buffer full. This way, latency sensitive threads can avoid stalling behind
+ * bulk traffic from other threads.
+ */
+- (void)setRequestQueueFullPolicyForCurrentThread: (DKRequestQueueFullPolicy)policy;
+
+/**
+ * Returns the policy that applies to requests from the current thread.
+ */
+- (DKRequestQueueFullPolicy)requestQueueFullPolicyForCurrentThread;
 
 /**
  * Will be called in order to enable threaded mode.
@@ -258,7 +616,13 @@ typedef struct {
 - (void)unregisterWatcher: (id)watcher;
 @end
 
+/**
+ * Macro to check whether the code is presently executing in a worker thread
+ */
+#define DKInWorkerThread (BOOL)[[DKEndpointManager sharedEndpointManager] isWorkerThread: [NSThread currentThread]]
+
 /**
  * Macro to check whether the code is presently executing in the worker thread
+ * of the endpoint.
  */
-#define DKInWorkerThread (BOOL)[[[DKEndpointManager sharedEndpointManager] workerThread] isEqual: [NSThread currentThread]];
+#define DKInWorkerThreadForEndpoint(endpoint) (BOOL)[[[DKEndpointManager sharedEndpointManager] workerThreadForEndpoint: (endpoint)] isEqual: [NSThread currentThread]]
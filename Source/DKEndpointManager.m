@@ -23,6 +23,7 @@
 #import "DKArgument.h"
 #import "DKEndpointManager.h"
 #import "DKEndpoint.h"
+#import "DKEventBackend.h"
 #import "DKIntrospectionParserDelegate.h"
 #import "DKMethodCall.h"
 #import "DKObjectPathNode.h"
@@ -31,19 +32,29 @@
 
 #import "DBusKit/DKProxy.h"
 
+#import <Foundation/NSArray.h>
 #import <Foundation/NSDate.h>
 #import <Foundation/NSDebug.h>
 #import <Foundation/NSDictionary.h>
 #import <Foundation/NSException.h>
+#import <Foundation/NSHashTable.h>
 #import <Foundation/NSInvocation.h>
 #import <Foundation/NSLock.h>
 #import <Foundation/NSMapTable.h>
 #import <Foundation/NSRunLoop.h>
 #import <Foundation/NSThread.h>
 #import <Foundation/NSTimer.h>
+#import <Foundation/NSUserDefaults.h>
 #import <Foundation/NSValue.h>
+#import <GNUstepBase/GSObjCRuntime.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <sched.h>
+#include <unistd.h>
+#if defined(__linux__)
+#  include <sys/eventfd.h>
+#endif
 
 /*
  * Phony interfaces to make the compiler aware of the fact that the private
@@ -57,14 +68,29 @@
 - (void)_mergeInfo: (NSDictionary*)info;
 @end
 
+@interface DKWorker (DKWakeup) <RunLoopEvents>
+@end
+
 @interface NSObject (DKContextPrivateMethods)
 - (void)monitorForEvents;
 - (void)unmonitorForEvents;
 - (void)handleTimeout: (NSTimer*)timer;
+- (DKWorker*)worker;
+- (BOOL)isDispatchQueued;
+- (void)setDispatchQueued: (BOOL)yesno;
+- (NSUInteger)dispatchRepliesWithBudget: (NSUInteger)budget;
+- (BOOL)dispatchWithBudget: (NSUInteger)budget;
 @end
 
 static DKEndpointManager *sharedManager;
 
+/*
+ * Returns the worker thread for objects from the run loop context of an
+ * endpoint (i.e. watchers and the contexts themselves).
+ */
+#define DKWorkerThreadFor(obj) \
+  ((nil != [obj worker]) ? [[obj worker] thread] : workerThread)
+
 #define DKTheManager getManager(managerClass, getManagerSelector)
 #define DKManagerThread managerThread
 #define DKPerformOnManagerThread(target,payloadSelector,object) performOnThread(target,\
@@ -78,89 +104,807 @@ static DKEndpointManager *sharedManager;
 
 /* Definitions for the ring buffer, designwise inspired by EtoileThread */
 
-// Needs to be 2^n
+// Default capacity, needs to be 2^n
 #define DKRingSize ((NSUInteger)32)
 
-#define DKRingMask (DKRingSize - 1)
+// Upper bound for configured capacities.
+#define DKRingSizeLimit ((NSUInteger)1 << 20)
+
+// Default number of messages a connection may dispatch per turn.
+#define DKDefaultDispatchBudget ((NSUInteger)32)
+
+/*
+ * Key for overriding the DKRequestQueueFullPolicy in the thread dictionary.
+ */
+#define DKRequestQueueFullPolicyKey @"DKRequestQueueFullPolicy"
 
-#define DKRingSpace (DKRingSize - (producerCounter - consumerCounter))
+/*
+ * Key under which worker threads store their worker in the thread dictionary.
+ */
+#define DKWorkerKey @"DKWorker"
 
-#define DKRingFull (DKRingSpace == 0)
-#define DKRingEmpty ((producerCounter - consumerCounter) == 0)
-#define DKMaskIndex(index) ((index) & DKRingMask)
+/*
+ * Results of handling requests that found the ring buffer full.
+ */
+enum
+{
+  DK_REQUEST_INSERTED = 0,
+  DK_REQUEST_PERFORMED = 1,
+  DK_REQUEST_REJECTED = -1
+};
 
-#define DKRingSchedule \
-if (NO == DKRingEmpty)\
+/*
+ * Number of attempts a producer makes to insert into a full ring before it
+ * parks on the space condition.
+ */
+#define DKRingSpinLimit 64
+
+#define DKRingEmpty (ring.producerCounter == ring.consumerCounter)
+
+/*
+ * Wakes up the worker thread unless a drain is already pending.
+ */
+#define DKRingWakeUp \
+if (__sync_bool_compare_and_swap(&drainPending, 0, 1))\
 {\
-  if (0 == initializeRefCount)\
+  NSDebugMLog(@"Stuff in buffer: Scheduling buffer draining.");\
+  __sync_fetch_and_add(&wakeupCount, 1);\
+  DKWakeupSignal(wakeupDescriptors[1]);\
+}\
+else\
+{\
+  __sync_fetch_and_add(&avoidedWakeupCount, 1);\
+}
+
+#define DKRingSchedule do {\
+  if ((NO == threadStarted) && (NO == [manager isSynchronizing]))\
   {\
-    if (__sync_bool_compare_and_swap(&threadStarted, 0, 1))\
-    {\
-      [workerThread start];\
-    }\
+    [self startThread];\
   }\
-  NSDebugMLog(@"Stuff in buffer: Scheduling buffer draining.");\
-  [self performSelector: @selector(drainBuffer:)\
-               onThread: workerThread\
-	     withObject: nil\
-          waitUntilDone: NO];\
+  __sync_fetch_and_add(&requestCount, 1);\
+  if (NO == DKRingEmpty)\
+  {\
+    DKRingWakeUp\
+  }\
+  else\
+  {\
+    __sync_fetch_and_add(&avoidedWakeupCount, 1);\
+  }\
+} while (0)
+
+/*
+ * Creates the descriptors used to wake up the worker thread. We use an eventfd
+ * where available and fall back to a non-blocking pipe otherwise.
+ */
+static BOOL
+DKWakeupDescriptorsCreate(int *fds)
+{
+#if defined(__linux__)
+  fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  fds[1] = fds[0];
+  return (-1 != fds[0]);
+#else
+  NSUInteger i = 0;
+  if (0 != pipe(fds))
+  {
+    fds[0] = fds[1] = -1;
+    return NO;
+  }
+  for (i = 0; i < 2; i++)
+  {
+    fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  return YES;
+#endif
+}
+
+static void
+DKWakeupDescriptorsClose(int *fds)
+{
+  if (-1 != fds[0])
+  {
+    close(fds[0]);
+  }
+  if ((fds[1] != fds[0]) && (-1 != fds[1]))
+  {
+    close(fds[1]);
+  }
+  fds[0] = fds[1] = -1;
+}
+
+static inline void
+DKWakeupSignal(int fd)
+{
+  uint64_t value = 1;
+  ssize_t written = 0;
+#if defined(__linux__)
+  written = write(fd, &value, sizeof(value));
+#else
+  written = write(fd, &value, 1);
+#endif
+  // EAGAIN means that the descriptor is still readable, which is fine.
+  if ((-1 == written) && (EAGAIN != errno))
+  {
+    NSWarnFLog(@"Could not wake up worker thread (%d).", errno);
+  }
+}
+
+static inline void
+DKWakeupClear(int fd)
+{
+  uint64_t buffer[8];
+  while (0 < read(fd, buffer, sizeof(buffer)))
+  {
+    // Nothing to do, we just want the descriptor to become unreadable.
+  }
+}
+
+/*
+ * Number of times a waiting thread checks for completion of its request before
+ * parking on the condition variable.
+ */
+#define DKCompletionSpinLimit 128
+
+static inline void
+DKCompletionInit(DKRequestCompletion *c)
+{
+  c->completed = 0;
+  c->result = 0;
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->condition, NULL);
+}
+
+static inline void
+DKCompletionDestroy(DKRequestCompletion *c)
+{
+  pthread_cond_destroy(&c->condition);
+  pthread_mutex_destroy(&c->lock);
+}
+
+/*
+ * Stores the result and wakes up the waiting thread. The completion flag is
+ * set under the mutex so that the waiter cannot miss the wakeup.
+ */
+static inline void
+DKCompletionSignal(DKRequestCompletion *c, NSInteger result)
+{
+  pthread_mutex_lock(&c->lock);
+  c->result = result;
+  __atomic_store_n(&c->completed, 1, __ATOMIC_RELEASE);
+  pthread_cond_signal(&c->condition);
+  pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Waits for the request to complete. Requests served quickly by the worker
+ * thread are caught by the short spin, otherwise the thread parks without
+ * consuming CPU. The mutex is always taken once before returning so that the
+ * signalling thread is done with the completion when the caller destroys it.
+ */
+static inline NSInteger
+DKCompletionWait(DKRequestCompletion *c)
+{
+  NSUInteger count = 0;
+  NSInteger result = 0;
+  while ((0 == __atomic_load_n(&c->completed, __ATOMIC_ACQUIRE))
+    && (count++ < DKCompletionSpinLimit))
+  {
+    // Spin
+  }
+  pthread_mutex_lock(&c->lock);
+  while (0 == c->completed)
+  {
+    pthread_cond_wait(&c->condition, &c->lock);
+  }
+  result = c->result;
+  pthread_mutex_unlock(&c->lock);
+  return result;
+}
+
+static uint32_t
+DKRingRoundCapacity(NSInteger capacity)
+{
+  uint32_t rounded = 1;
+  if (capacity <= 0)
+  {
+    return DKRingSize;
+  }
+  while ((rounded < capacity) && (rounded < DKRingSizeLimit))
+  {
+    rounded <<= 1;
+  }
+  return rounded;
+}
+
+/*
+ * Checks whether the slot the next producer would reserve is free and whether
+ * the ring has not yet reached its present capacity.
+ */
+static inline BOOL
+DKRingHasSpace(DKRequestRing *r)
+{
+  uint32_t pos = r->producerCounter;
+  uint32_t seq = __atomic_load_n(&r->slots[pos & r->mask].sequence,
+    __ATOMIC_ACQUIRE);
+  return (((int32_t)(seq - pos) >= 0)
+    && ((pos - r->consumerCounter) < r->capacity));
 }
 
 /*
  * This works the following way:
- * 1.  Start the worker thread if it is not yet running.
- * 2.  Check whether the buffer is full
- * 3.  If so, spin for a short while to allow it to drain or yield to other
- *     threads if it's taking to long.
- * 4.  Lock the producer lock since multiple threads might want to write to the
- *     buffer.
- * 5.  Check again if the buffer hasn't filled in the meantime.
- * 6.  Retain the target for its trip to the other thread.
- * 7.  Insert the new request into the buffer.
- * 8.  Increment the producer counter.
- * 9.  Unlock the producer lock.
+ * 1.  Load the producer counter and look at the slot it points to.
+ * 2.  If the sequence number of the slot equals the counter, the slot is free
+ *     for this pass around the ring: Try to reserve it by advancing the
+ *     producer counter with a compare-and-swap.
+ * 3.  If that succeeded, store the request and publish it to the consumer by
+ *     advancing the sequence number of the slot.
+ * 4.  If the sequence number lags behind the counter, the consumer has not yet
+ *     freed the slot and the ring is full.
+ * 5.  Otherwise, another producer got there first: Reload and try again.
+ * Additionally, a free slot is not used if that would exceed the present
+ * capacity of the ring.
  */
-#define DKRingInsert(x) do {\
-  NSUInteger count = 0; \
-  while (DKRingFull)\
-  {\
-    if ((++count % 16) == 0)\
-    {\
-      sched_yield();\
-    }\
-  }\
-  [producerLock lock];\
-    while (DKRingFull)\
-    {\
-      if ((++count % 16) == 0)\
-      {\
-	sched_yield();\
-      }\
-    }\
-  [x.target retain];\
-  ringBuffer[DKMaskIndex(producerCounter)] = x;\
-  __sync_fetch_and_add(&producerCounter, 1);\
-  [producerLock unlock];\
-  NSDebugMLog(@"Inserting into ringbuffer (remaining capacity: %"PRIuPTR").",\
-    DKRingSpace);\
-} while (0)
+static inline BOOL
+DKRingTryInsert(DKRequestRing *r, DKRingBufferElement *x)
+{
+  uint32_t pos = r->producerCounter;
+  while (1)
+  {
+    DKRingBufferSlot *slot = &r->slots[pos & r->mask];
+    uint32_t seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    int32_t diff = (int32_t)(seq - pos);
+    if (0 == diff)
+    {
+      if ((pos - r->consumerCounter) >= r->capacity)
+      {
+	return NO;
+      }
+      if (__sync_bool_compare_and_swap(&r->producerCounter, pos, pos + 1))
+      {
+	slot->element = *x;
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+	return YES;
+      }
+    }
+    else if (diff < 0)
+    {
+      return NO;
+    }
+    pos = r->producerCounter;
+  }
+}
 
+/*
+ * Doubles the capacity of the ring unless it already has reached the maximum.
+ * Returns NO if the ring could not grow.
+ */
+static BOOL
+DKRingGrow(DKRequestRing *r)
+{
+  uint32_t capacity = r->capacity;
+  while (capacity < r->maximumCapacity)
+  {
+    uint32_t newCapacity = MIN((capacity << 1), r->maximumCapacity);
+    if (__sync_bool_compare_and_swap(&r->capacity, capacity, newCapacity))
+    {
+      NSDebugFLog(@"Ring buffer capacity increased to %"PRIu32".",
+	newCapacity);
+      return YES;
+    }
+    capacity = r->capacity;
+  }
+  return NO;
+}
 
 /*
- * If the buffer is not empty, remove an element and process it.
+ * Inserts x into the ring. The target is retained for its trip to the other
+ * thread. If the ring is full, we try to grow it and otherwise spin for a short
+ * while to allow it to drain. If that is taking too long, we either park on
+ * the space condition (if mayBlock is YES) or give up. The worker thread must
+ * never block, since it would wait for itself.
  */
-#define DKRingRemove(x) do {\
-  if (NO == DKRingEmpty)\
-  {\
-    NSDebugMLog(@"Removing element at %"PRIuPTR" from ring buffer", (unsigned long)DKMaskIndex(consumerCounter));\
-    x = ringBuffer[DKMaskIndex(consumerCounter)];\
-    ringBuffer[DKMaskIndex(consumerCounter)] = (DKRingBufferElement){nil, NULL, nil, NULL};\
-    [x.target autorelease];\
-    __sync_fetch_and_add(&consumerCounter, 1);\
-  }\
-  NSDebugMLog(@"(new capacity: %"PRIuPTR").",\
-    (unsigned long)DKRingSpace);\
-} while (0)
+static BOOL
+DKRingInsert(DKRequestRing *r, DKRingBufferElement x, BOOL mayBlock)
+{
+  NSUInteger count = 0;
+  [x.target retain];
+  while (NO == DKRingTryInsert(r, &x))
+  {
+    if (DKRingGrow(r))
+    {
+      continue;
+    }
+    if (++count < DKRingSpinLimit)
+    {
+      if (0 == (count % 16))
+      {
+	sched_yield();
+      }
+      continue;
+    }
+    if (NO == mayBlock)
+    {
+      [x.target release];
+      return NO;
+    }
+    NSDebugFLog(@"Ring buffer full, waiting for the worker thread.");
+    [r->spaceCondition lock];
+    __sync_fetch_and_add(&r->waitingProducers, 1);
+    while (NO == DKRingHasSpace(r))
+    {
+      [r->spaceCondition wait];
+    }
+    __sync_fetch_and_sub(&r->waitingProducers, 1);
+    [r->spaceCondition unlock];
+    count = 0;
+  }
+  return YES;
+}
+
+/*
+ * Requests to method calls only interact with libdbus, which is thread-safe,
+ * so they may be performed on any thread. Everything else (especially the
+ * run loop contexts of the endpoints) needs to run on the worker thread.
+ */
+static inline BOOL
+DKRequestMayRunInline(id target)
+{
+  static Class methodCallClass = Nil;
+  if (Nil == methodCallClass)
+  {
+    methodCallClass = [DKMethodCall class];
+  }
+  return GSObjCIsKindOf(object_getClass(target), methodCallClass);
+}
+
+/*
+ * If the buffer contains a published element, remove it. The slot is handed
+ * back to the producers by advancing its sequence number by one pass around
+ * the ring. Afterwards, wake up any producers that are waiting for space. (The
+ * full barrier ensures that they either see the free slot or we see them
+ * waiting.)
+ */
+static inline BOOL
+DKRingRemove(DKRequestRing *r, DKRingBufferElement *x)
+{
+  uint32_t pos = r->consumerCounter;
+  DKRingBufferSlot *slot = &r->slots[pos & r->mask];
+  if ((pos + 1) != __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE))
+  {
+    return NO;
+  }
+  NSDebugFLog(@"Removing element at %"PRIu32" from ring buffer",
+    (pos & r->mask));
+  *x = slot->element;
+  slot->element = (DKRingBufferElement){nil, NULL, nil, NULL};
+  [x->target autorelease];
+  __atomic_store_n(&slot->sequence, pos + r->mask + 1, __ATOMIC_RELEASE);
+  r->consumerCounter = pos + 1;
+  __sync_synchronize();
+  if (0 != r->waitingProducers)
+  {
+    [r->spaceCondition lock];
+    [r->spaceCondition broadcast];
+    [r->spaceCondition unlock];
+  }
+  return YES;
+}
+
+@implementation DKWorker
+- (id)initWithName: (NSString*)name
+           manager: (DKEndpointManager*)aManager
+          capacity: (uint32_t)capacity
+   maximumCapacity: (uint32_t)maximumCapacity
+{
+  NSUInteger i = 0;
+  if (nil == (self = [super init]))
+  {
+    return nil;
+  }
+  manager = aManager;
+  thread = [[NSThread alloc] initWithTarget: self
+                                   selector: @selector(start:)
+                                     object: nil];
+  [thread setName: name];
+  ring.capacity = capacity;
+  ring.maximumCapacity = MAX(capacity, maximumCapacity);
+  ring.slots = calloc(sizeof(DKRingBufferSlot), ring.maximumCapacity);
+  ring.mask = ring.maximumCapacity - 1;
+  ring.spaceCondition = [NSCondition new];
+  dispatchQueue = [NSMutableArray new];
+  DKWakeupDescriptorsCreate(wakeupDescriptors);
+  if (NO == (thread && ring.slots && ring.spaceCondition && dispatchQueue
+    && (-1 != wakeupDescriptors[0])))
+  {
+    [self release];
+    return nil;
+  }
+  for (i = 0; i < ring.maximumCapacity; i++)
+  {
+    ring.slots[i].sequence = i;
+  }
+  return self;
+}
+
+- (NSThread*)thread
+{
+  return thread;
+}
+
+- (DKEventBackend*)eventBackend
+{
+  return eventBackend;
+}
+
+- (void)startThread
+{
+  if (__sync_bool_compare_and_swap(&threadStarted, 0, 1))
+  {
+    [thread start];
+    NSDebugMLog(@"Worker thread started.");
+  }
+}
+
+- (void)distantFutureReached: (id)ignored
+{
+  //Won't happen.
+}
+
+- (void)start: (id)ignored
+{
+  NSAutoreleasePool *arp = [NSAutoreleasePool new];
+  NSRunLoop *runLoop = [NSRunLoop currentRunLoop];
+  [[thread threadDictionary] setObject: self
+                                forKey: DKWorkerKey];
+  // We schedule a timer to make sure that the run loop actually runs:
+  keepAliveTimer = [NSTimer scheduledTimerWithTimeInterval: [[NSDate distantFuture] timeIntervalSinceNow]
+                                                    target: self
+                                                  selector: @selector(distantFutureReached:)
+                                                  userInfo: nil
+                                                   repeats: NO];
+  // Watch for requests being inserted into the ring buffer:
+  [runLoop addEvent: (void*)(intptr_t)wakeupDescriptors[0]
+               type: ET_RDESC
+            watcher: self
+            forMode: NSDefaultRunLoopMode];
+  // Set up the backend that will monitor the descriptors of libdbus:
+  eventBackend = [[[DKEventBackend defaultBackendClass] alloc] init];
+  if (nil == eventBackend)
+  {
+    eventBackend = [[DKRunLoopEventBackend alloc] init];
+  }
+  [eventBackend attachToRunLoop: runLoop
+                           mode: NSDefaultRunLoopMode];
+  [runLoop run];
+  [[thread threadDictionary] removeObjectForKey: DKWorkerKey];
+  [arp release];
+}
+
+- (void)_stop: (id)ignored
+{
+  NSEnumerator *theEnum = nil;
+  id context = nil;
+  // Drain what is left before removing the input sources from the run loop.
+  [self drainBuffer: nil];
+  theEnum = [dispatchQueue objectEnumerator];
+  while (nil != (context = [theEnum nextObject]))
+  {
+    [context setDispatchQueued: NO];
+  }
+  [dispatchQueue removeAllObjects];
+  [keepAliveTimer invalidate];
+  keepAliveTimer = nil;
+  [[NSRunLoop currentRunLoop] removeEvent: (void*)(intptr_t)wakeupDescriptors[0]
+                                     type: ET_RDESC
+                                  forMode: NSDefaultRunLoopMode
+                                      all: YES];
+  // Watchers still holding on to the backend will no longer get events:
+  [eventBackend detach];
+  DESTROY(eventBackend);
+}
+
+- (void)stop
+{
+  if (threadStarted)
+  {
+    [self performSelector: @selector(_stop:)
+                 onThread: thread
+               withObject: nil
+            waitUntilDone: NO];
+  }
+}
+
+- (BOOL)boolReturnForRequest: (DKRingBufferElement)request
+               waitForReturn: (BOOL)doWait
+{
+  NSInteger retVal = 1;
+  DKRequestCompletion completion;
+
+  if ([thread isEqual: [NSThread currentThread]])
+  {
+    if (YES == doWait)
+    {
+      IMP performRequest = [request.target methodForSelector: request.selector];
+      NSDebugMLog(@"Performing on current thread");
+      NSAssert2(performRequest, @"Could not perform selector %@ on %@",
+        NSStringFromSelector(request.selector),
+        request.target);
+      return (BOOL)(intptr_t)performRequest(request.target,
+        request.selector,
+        request.object);
+    }
+
+    /*
+     * The worker thread must never wait for space in the ring since it is
+     * the one supposed to make room.
+     */
+    if (NO == DKRingInsert(&ring, request, NO))
+    {
+      NSWarnMLog(@"Warning, ring buffer full when called from within worker thread. Will handle call through NSInvocation.");
+      [manager invokeRequest: request];
+      return YES;
+    }
+    DKRingSchedule;
+    return YES;
+  }
+
+  /*
+   * Otherwise, we insert the request and, if requested, block until the worker
+   * thread completes the request.
+   */
+  if (NO == doWait)
+  {
+    if (NO == DKRingInsert(&ring, request, NO))
+    {
+      switch ([self _handleFullRingForRequest: request result: &retVal])
+      {
+        case DK_REQUEST_PERFORMED:
+          return YES;
+        case DK_REQUEST_REJECTED:
+          [NSException raise: @"DKRequestQueueFullException"
+                      format: @"Request queue of the endpoint manager is full (capacity: %"PRIu32").",
+            ring.capacity];
+        default:
+          break;
+      }
+    }
+    DKRingSchedule;
+    return YES;
+  }
+
+  DKCompletionInit(&completion);
+  request.completion = &completion;
+  if (NO == DKRingInsert(&ring, request, NO))
+  {
+    NSInteger state = DK_REQUEST_REJECTED;
+    NS_DURING
+    {
+      state = [self _handleFullRingForRequest: request result: &retVal];
+    }
+    NS_HANDLER
+    {
+      DKCompletionDestroy(&completion);
+      [localException raise];
+    }
+    NS_ENDHANDLER
+    if (DK_REQUEST_INSERTED != state)
+    {
+      DKCompletionDestroy(&completion);
+    }
+    if (DK_REQUEST_PERFORMED == state)
+    {
+      return (BOOL)retVal;
+    }
+    else if (DK_REQUEST_REJECTED == state)
+    {
+      [NSException raise: @"DKRequestQueueFullException"
+                  format: @"Request queue of the endpoint manager is full (capacity: %"PRIu32").",
+        ring.capacity];
+    }
+  }
+  DKRingSchedule;
+  retVal = DKCompletionWait(&completion);
+  DKCompletionDestroy(&completion);
+  return (BOOL)retVal;
+}
+
+/*
+ * Applies the DKRequestQueueFullPolicy of the calling thread to a request that
+ * could not be inserted because the ring buffer was full.
+ */
+- (NSInteger)_handleFullRingForRequest: (DKRingBufferElement)request
+                                result: (NSInteger*)result
+{
+  DKRequestQueueFullPolicy policy =
+    [manager requestQueueFullPolicyForCurrentThread];
+
+  if (DKRequestQueueFail == policy)
+  {
+    return DK_REQUEST_REJECTED;
+  }
+  else if ((DKRequestQueueRunInline == policy)
+    && DKRequestMayRunInline(request.target))
+  {
+    IMP performRequest = [request.target methodForSelector: request.selector];
+    NSDebugMLog(@"Ring buffer full, performing on current thread");
+    *result = (BOOL)(intptr_t)performRequest(request.target,
+      request.selector,
+      request.object);
+    return DK_REQUEST_PERFORMED;
+  }
+  DKRingInsert(&ring, request, YES);
+  return DK_REQUEST_INSERTED;
+}
+
+- (void)receivedEvent: (void*)data
+                 type: (RunLoopEventType)type
+                extra: (void*)extra
+              forMode: (NSString*)mode
+{
+  DKWakeupClear(wakeupDescriptors[0]);
+  [self drainBuffer: nil];
+  if (0 != [dispatchQueue count])
+  {
+    [self dispatchQueuedConnections];
+  }
+}
+
+- (void)scheduleDispatchForContext: (id)context
+{
+  if ([context isDispatchQueued])
+  {
+    return;
+  }
+  [context setDispatchQueued: YES];
+  [dispatchQueue addObject: context];
+  // Make sure the turn happens, even if we are not called from -drainBuffer:
+  DKRingWakeUp
+}
+
+- (void)dispatchQueuedConnections
+{
+  NSUInteger budget = [manager dispatchBudget];
+  NSUInteger count = [dispatchQueue count];
+  NSUInteger i = 0;
+
+  // Priority lane: Replies complete pending calls that threads are waiting on.
+  for (i = 0; i < count; i++)
+  {
+    [[dispatchQueue objectAtIndex: i] dispatchRepliesWithBudget: budget];
+  }
+
+  // Bulk lane: Each connection gets its budget, in round-robin order.
+  for (i = 0; i < count; i++)
+  {
+    id context = [[dispatchQueue objectAtIndex: 0] retain];
+    [dispatchQueue removeObjectAtIndex: 0];
+    NS_DURING
+    {
+      if ([context dispatchWithBudget: budget])
+      {
+        // Back to the end of the queue for the next turn.
+        [dispatchQueue addObject: context];
+      }
+      else
+      {
+        [context setDispatchQueued: NO];
+      }
+    }
+    NS_HANDLER
+    {
+      [context setDispatchQueued: NO];
+      [context release];
+      if (0 != [dispatchQueue count])
+      {
+        DKRingWakeUp
+      }
+      [localException raise];
+    }
+    NS_ENDHANDLER
+    [context release];
+  }
+
+  if (0 != [dispatchQueue count])
+  {
+    // Let the run loop handle other events before the next turn.
+    DKRingWakeUp
+  }
+}
+
+- (void)drainBuffer: (id)ignored
+{
+  DKRingBufferElement element = {nil, NULL, nil, NULL};
+  NSDebugMLog(@"Started draining buffer");
+  /*
+   * Clear the pending flag before looking at the ring: A producer inserting
+   * after this point will either have its request picked up by the loop below
+   * or schedule another wakeup.
+   */
+  __atomic_store_n(&drainPending, 0, __ATOMIC_SEQ_CST);
+  __sync_fetch_and_add(&drainCount, 1);
+
+  while (DKRingRemove(&ring, &element))
+  {
+    IMP performRequest = [element.target methodForSelector: element.selector];
+    DKRequestCompletion *completion = element.completion;
+    NSAssert2(performRequest, @"Could not perform selector %@ on %@",
+      NSStringFromSelector(element.selector),
+      element.target);
+    if (NULL != completion)
+    {
+      NSInteger result = 0;
+      NS_DURING
+      {
+        result = (NSInteger)performRequest(element.target,
+          element.selector,
+          element.object);
+      }
+      NS_HANDLER
+      {
+        // Signal failure so that the requesting thread does not continue to
+        // wait for the result.
+        DKCompletionSignal(completion, 0);
+        // Make sure the remaining requests will be handled.
+        if (NO == DKRingEmpty)
+        {
+          DKRingWakeUp
+        }
+        [localException raise];
+      }
+      NS_ENDHANDLER
+      DKCompletionSignal(completion, result);
+    }
+    else
+    {
+      // If no completion handle is set, the other thread is not waiting for
+      // completion.
+      NS_DURING
+      {
+        performRequest(element.target, element.selector, element.object);
+      }
+      NS_HANDLER
+      {
+        if (NO == DKRingEmpty)
+        {
+          DKRingWakeUp
+        }
+        [localException raise];
+      }
+      NS_ENDHANDLER
+    }
+  }
+}
+
+- (NSUInteger)requestQueueCapacity
+{
+  return ring.capacity;
+}
+
+- (NSUInteger)maximumRequestQueueCapacity
+{
+  return ring.maximumCapacity;
+}
+
+- (void)addRequestStatisticsTo: (NSUInteger*)counters
+{
+  counters[0] += requestCount;
+  counters[1] += wakeupCount;
+  counters[2] += avoidedWakeupCount;
+  counters[3] += drainCount;
+}
+
+- (void)dealloc
+{
+  [thread release];
+  [eventBackend release];
+  free(ring.slots);
+  DKWakeupDescriptorsClose(wakeupDescriptors);
+  [ring.spaceCondition release];
+  [dispatchQueue release];
+  [super dealloc];
+}
+@end
 
 @implementation DKEndpointManager
 
@@ -227,6 +971,9 @@ if (NO == DKRingEmpty)\
 
 - (id)init
 {
+  NSUserDefaults *defaults = nil;
+  NSString *policyName = nil;
+  NSInteger budget = 0;
   if (nil != sharedManager)
   {
     [self release];
@@ -242,18 +989,44 @@ if (NO == DKRingEmpty)\
      NSNonRetainedObjectMapValueCallBacks,
      3);
    connectionStateLock = [NSRecursiveLock new];
-   workerThread = [[NSThread alloc] initWithTarget: self
-                                          selector: @selector(start:)
-                                            object: nil];
-   [workerThread setName: @"DBusKit worker thread"];
    /*
     * We set this up with a refcout of 1 because we want to start in
     * non-threaded mode. Otherwise people will get bitten by synchronisation
     * issues from +initialize.
     */
    initializeRefCount = 1;
-   ringBuffer = calloc(sizeof(DKRingBufferElement), DKRingSize);
-   producerLock = [NSLock new];
+   defaults = [NSUserDefaults standardUserDefaults];
+   requestQueueCapacity =
+     DKRingRoundCapacity([defaults integerForKey: @"DKRequestQueueCapacity"]);
+   maximumRequestQueueCapacity = MAX(requestQueueCapacity,
+     DKRingRoundCapacity([defaults integerForKey: @"DKRequestQueueMaximumCapacity"]));
+   policyName = [defaults stringForKey: @"DKRequestQueueFullPolicy"];
+   if ([policyName isEqualToString: @"fail"])
+   {
+     fullPolicy = DKRequestQueueFail;
+   }
+   else if ([policyName isEqualToString: @"inline"])
+   {
+     fullPolicy = DKRequestQueueRunInline;
+   }
+   else
+   {
+     fullPolicy = DKRequestQueueBlock;
+   }
+   workerPerEndpoint = [defaults boolForKey: @"DKWorkerThreadPerEndpoint"];
+   budget = [defaults integerForKey: @"DKDispatchBudget"];
+   dispatchBudget = (budget > 0) ? (NSUInteger)budget : DKDefaultDispatchBudget;
+
+   sharedWorker = [[DKWorker alloc] initWithName: @"DBusKit worker thread"
+                                         manager: self
+                                        capacity: requestQueueCapacity
+                                 maximumCapacity: maximumRequestQueueCapacity];
+   workerThread = [[sharedWorker thread] retain];
+   workers = NSCreateHashTable(NSObjectHashCallBacks, 3);
+   if (nil != sharedWorker)
+   {
+     NSHashInsert(workers, sharedWorker);
+   }
 
    synchronizationStateLock = [NSRecursiveLock new];
    syncedWatchers = [[NSMapTable alloc] initWithKeyOptions: NSMapTableStrongMemory
@@ -263,7 +1036,7 @@ if (NO == DKRingEmpty)\
                                             valueOptions: NSMapTableStrongMemory
                                                 capacity: 5];
    if (NO == (activeConnections && connectionStateLock
-     && workerThread && ringBuffer && producerLock && synchronizationStateLock
+     && sharedWorker && workerThread && workers && synchronizationStateLock
      && syncedWatchers && syncedTimers))
    {
      [self release];
@@ -286,6 +1059,80 @@ if (NO == DKRingEmpty)\
   return workerThread;
 }
 
+- (NSThread*)workerThreadForEndpoint: (DKEndpoint*)endpoint
+{
+  DKWorker *worker = [endpoint worker];
+  if (nil == worker)
+  {
+    return workerThread;
+  }
+  return [worker thread];
+}
+
+- (BOOL)isWorkerThread: (NSThread*)thread
+{
+  if ([workerThread isEqual: thread])
+  {
+    return YES;
+  }
+  else if (0 == endpointWorkerCount)
+  {
+    return NO;
+  }
+  return (nil != [[thread threadDictionary] objectForKey: DKWorkerKey]);
+}
+
+- (void)setUsesWorkerThreadPerEndpoint: (BOOL)yesno
+{
+  workerPerEndpoint = yesno;
+}
+
+- (BOOL)usesWorkerThreadPerEndpoint
+{
+  return workerPerEndpoint;
+}
+
+- (DKWorker*)workerForNewEndpoint
+{
+  DKWorker *worker = nil;
+  if (NO == workerPerEndpoint)
+  {
+    return sharedWorker;
+  }
+  worker = [[DKWorker alloc] initWithName: @"DBusKit endpoint worker thread"
+                                  manager: self
+                                 capacity: requestQueueCapacity
+                          maximumCapacity: maximumRequestQueueCapacity];
+  if (nil == worker)
+  {
+    NSWarnMLog(@"Could not create worker for endpoint, using the shared one.");
+    return sharedWorker;
+  }
+  [connectionStateLock lock];
+  NSHashInsert(workers, worker);
+  __sync_fetch_and_add(&endpointWorkerCount, 1);
+  [connectionStateLock unlock];
+  return [worker autorelease];
+}
+
+- (void)retireWorker: (DKWorker*)worker
+{
+  if ((nil == worker) || (sharedWorker == worker))
+  {
+    return;
+  }
+  [worker retain];
+  [connectionStateLock lock];
+  if (NULL != NSHashGet(workers, worker))
+  {
+    NSHashRemove(workers, worker);
+    __sync_fetch_and_sub(&endpointWorkerCount, 1);
+  }
+  [connectionStateLock unlock];
+  [worker stop];
+  [worker release];
+}
+
 - (id)endpointForDBusConnection: (DBusConnection*)connection
                     mergingInfo: (NSDictionary*)info
 {
@@ -455,23 +1302,6 @@ if (NO == DKRingEmpty)\
   [connectionStateLock unlock];
 }
 
-- (void)distantFutureReached: (id)ignored
-{
-  //Won't happen.
-}
-
-- (void)start: (id)ignored
-{
-  NSAutoreleasePool *arp = [NSAutoreleasePool new];
-  // We schedule a timer to make sure that the run loop actually runs:
-  [NSTimer scheduledTimerWithTimeInterval: [[NSDate distantFuture] timeIntervalSinceNow]
-                                   target: self
-                                 selector: @selector(distantFutureReached:)
-                                 userInfo: nil
-                                  repeats: NO];
-  [[NSRunLoop currentRunLoop] run];
-  [arp release];
-}
 - (void)_performRecovery: (NSTimer*)timer
 {
   NSDictionary *userInfo = [timer userInfo];
@@ -554,34 +1384,52 @@ if (NO == DKRingEmpty)\
 		 		   data: (void*)data
                           waitForReturn: (BOOL)doWait
 {
-  /*
-   * Setup the returnValue with -1 to signify that the call has not been
-   * completed.
-   */
-  volatile NSInteger retVal = -1;
-  NSInteger *retValPointer = NULL;
-  NSUInteger count = 0;
-  static DKRingBufferElement request;
+  return [self boolReturnForPerformingSelector: selector
+                                        target: target
+                                          data: data
+                                 waitForReturn: doWait
+                                        worker: sharedWorker];
+}
+
+- (BOOL)boolReturnForPerformingSelector: (SEL)selector
+                                 target: (id)target
+		 		   data: (void*)data
+                          waitForReturn: (BOOL)doWait
+                            forEndpoint: (DKEndpoint*)endpoint
+{
+  return [self boolReturnForPerformingSelector: selector
+                                        target: target
+                                          data: data
+                                 waitForReturn: doWait
+                                        worker: [endpoint worker]];
+}
+
+- (BOOL)boolReturnForPerformingSelector: (SEL)selector
+                                 target: (id)target
+		 		   data: (void*)data
+                          waitForReturn: (BOOL)doWait
+                                 worker: (DKWorker*)worker
+{
+  NSInteger retVal = 1;
+  DKRingBufferElement request;
   BOOL performSynchronized = NO;
-  BOOL workerThreadIsCurrent = [workerThread isEqual: [NSThread currentThread]];
-  if (doWait)
-  {
-    // If we are waiting for the return value, we pass the return value pointer.
-    retValPointer = (NSInteger*)&retVal;
-  }
-  else
+
+  if (nil == worker)
   {
-    //Otherwise we pass NULL and set the return value to 1.
-    retVal = 1;
+    worker = sharedWorker;
   }
 
-  request = (DKRingBufferElement){target, selector, (id)data, retValPointer};
+  /*
+   * The completion handle is only attached when the worker inserts a request
+   * that we will wait for.
+   */
+  request = (DKRingBufferElement){target, selector, (id)data, NULL};
 
   /*
    * Under two conditions we want to execute the request directly: a) we are
    * being called from within the worker thread and are supposed to wait for the
-   * result. b) We are being called from within an +initialize method and thus
-   * cannot use the worker thread.
+   * result. (The worker takes care of that.) b) We are being called from within
+   * an +initialize method and thus cannot use the worker thread.
    */
 
   performSynchronized = (0 != initializeRefCount);
@@ -600,103 +1448,96 @@ if (NO == DKRingEmpty)\
   }
   // Note the following if statement will be executed under lock if
   // preformSynchronized == YES
-  if (workerThreadIsCurrent || (YES == performSynchronized))
+  if (YES == performSynchronized)
   {
     IMP performRequest = [target methodForSelector: selector];
     NSDebugMLog(@"Performing on current thread");
     NSAssert2(performRequest, @"Could not perform selector %@ on %@",
-      selector,
+      NSStringFromSelector(selector),
       target);
     if (YES == doWait)
     {
       retVal = (BOOL)(intptr_t)performRequest(target, selector, data);
-      if (performSynchronized)
-      {
-        [synchronizationStateLock unlock];
-      }
     }
-    else if (performSynchronized)
+    else
     {
       [self invokeRequest: request];
       retVal = YES;
-      [synchronizationStateLock unlock];
-    }
-    else if (YES == DKRingFull)
-    {
-      NSWarnMLog(@"Warning, ring buffer full when called from within worker thread. Will handle call through NSInvocation.");
-      [self invokeRequest: request];
-      return YES;
-    }
-
-    if (doWait || performSynchronized)
-    {
-      return retVal;
     }
+    [synchronizationStateLock unlock];
+    return retVal;
   }
 
-  /*
-   * Otherwise, we insert the request and spin until the worker thread completes
-   * the request.
-   */
+  return [worker boolReturnForRequest: request
+                        waitForReturn: doWait];
+}
 
-  DKRingInsert(request);
-  DKRingSchedule;
-  while ((-1 == retVal) && (YES == doWait))
-  {
-    if (0 == (++count % 16))
-    {
-      sched_yield();
-    }
-  }
-  return (BOOL)retVal;
+- (NSUInteger)requestQueueCapacity
+{
+  return [sharedWorker requestQueueCapacity];
 }
 
-- (void)drainBuffer: (id)ignored
+- (NSUInteger)maximumRequestQueueCapacity
 {
-  DKRingBufferElement element = {nil, NULL, nil, NULL};
-  NSInteger *returnPointer = NULL;
-  NSDebugMLog(@"Started draining buffer");
-  DKRingRemove(element);
+  return maximumRequestQueueCapacity;
+}
+
+- (void)setRequestQueueFullPolicy: (DKRequestQueueFullPolicy)policy
+{
+  fullPolicy = policy;
+}
+
+- (DKRequestQueueFullPolicy)requestQueueFullPolicy
+{
+  return fullPolicy;
+}
+
+- (void)setDispatchBudget: (NSUInteger)budget
+{
+  dispatchBudget = MAX(budget, 1);
+}
+
+- (NSUInteger)dispatchBudget
+{
+  return dispatchBudget;
+}
+
+- (void)setRequestQueueFullPolicyForCurrentThread: (DKRequestQueueFullPolicy)policy
+{
+  [[[NSThread currentThread] threadDictionary] setObject: [NSNumber numberWithUnsignedInteger: policy]
+                                                  forKey: DKRequestQueueFullPolicyKey];
+}
 
-  if (nil != element.target)
+- (DKRequestQueueFullPolicy)requestQueueFullPolicyForCurrentThread
+{
+  NSNumber *threadPolicy = [[[NSThread currentThread] threadDictionary]
+    objectForKey: DKRequestQueueFullPolicyKey];
+  if (nil != threadPolicy)
   {
-    IMP performRequest = [element.target methodForSelector: element.selector];
-    returnPointer = element.returnPointer;
-    NSAssert2(performRequest, @"Could not perform selector %@ on %@",
-      NSStringFromSelector(element.selector),
-      element.target);
-    if (NULL != returnPointer)
-    {
-      NS_DURING
-      {
-        *returnPointer = (NSInteger)performRequest(element.target,
-          element.selector,
-          element.object);
-      }
-      NS_HANDLER
-      {
-        // Set the pointer to 0 so that the requesting thread does not
-        // continue to wait for the result.
-        *returnPointer = 0;
-        [localException raise];
-      }
-      NS_ENDHANDLER
-    }
-    else
-    {
-      // If no return pointer is set, the other thread is not waiting for
-      // completion.
-      performRequest(element.target, element.selector, element.object);
-    }
+    return [threadPolicy unsignedIntegerValue];
   }
-  else
+  return fullPolicy;
+}
+
+- (NSDictionary*)requestStatistics
+{
+  NSUInteger counters[4] = {0, 0, 0, 0};
+  NSHashEnumerator theEnum;
+  DKWorker *worker = nil;
+  [connectionStateLock lock];
+  theEnum = NSEnumerateHashTable(workers);
+  while (nil != (worker = NSNextHashEnumeratorItem(&theEnum)))
   {
-    // If there was no object:
-    if (NULL != returnPointer)
-    {
-      *returnPointer = 0;
-    }
+    [worker addRequestStatisticsTo: counters];
   }
+  NSEndHashTableEnumeration(&theEnum);
+  [connectionStateLock unlock];
+  return [NSDictionary dictionaryWithObjectsAndKeys:
+    [NSNumber numberWithUnsignedInteger: counters[0]], @"requests",
+    [NSNumber numberWithUnsignedInteger: counters[1]], @"wakeups",
+    [NSNumber numberWithUnsignedInteger: counters[2]], @"avoidedWakeups",
+    [NSNumber numberWithUnsignedInteger: counters[3]], @"drainPasses",
+    nil];
 }
 
 - (void)enterInitialize
@@ -737,10 +1578,11 @@ if (NO == DKRingEmpty)\
 	               waitUntilDone: YES];
       }
       /*
-       * Schedule it for monitoring the fd on the worker thread.
+       * Schedule it for monitoring the fd on the worker thread of its
+       * endpoint.
        */
       [thisWatcher performSelector: @selector(monitorForEvents)
-	                  onThread: workerThread
+	                  onThread: DKWorkerThreadFor(thisWatcher)
 	                withObject: nil
 	             waitUntilDone: NO];
     }
@@ -764,9 +1606,9 @@ if (NO == DKRingEmpty)\
     return;
   }
 
-  if (NO == [workerThread isEqual: [NSThread currentThread]])
+  if (NO == [self isWorkerThread: [NSThread currentThread]])
   {
-    // We only inject timers into the worker thread;
+    // We only inject timers into worker threads;
     return;
   }
 
@@ -827,10 +1669,10 @@ if (NO == DKRingEmpty)\
 	             waitUntilDone: YES];
       }
       /*
-       * Inject the timer to the worker thread:
+       * Inject the timer to the worker thread of its endpoint:
        */
       [self performSelector: @selector(_injectTimer:)
-                   onThread: workerThread
+                   onThread: DKWorkerThreadFor(target)
 		 withObject: newTimer
 	      waitUntilDone: NO];
     }
@@ -855,12 +1697,17 @@ if (NO == DKRingEmpty)\
     {
       if (1 == initializeRefCount)
       {
-        // Start the worker thread if necessary:
-        if (__sync_bool_compare_and_swap(&threadStarted, 0, 1))
+        NSHashEnumerator theEnum;
+        DKWorker *worker = nil;
+        // Start the worker threads if necessary:
+        [connectionStateLock lock];
+        theEnum = NSEnumerateHashTable(workers);
+        while (nil != (worker = NSNextHashEnumeratorItem(&theEnum)))
         {
-          [workerThread start];
-	  NSDebugMLog(@"Worker thread started.");
+          [worker startThread];
         }
+        NSEndHashTableEnumeration(&theEnum);
+        [connectionStateLock unlock];
 
         // Move the watchers to the worker thread
         [self _transferWatchersToWorkerThread];
@@ -996,16 +1843,14 @@ if (NO == DKRingEmpty)\
 {
   [connectionStateLock lock];
   [synchronizationStateLock lock];
-  [producerLock lock];
   [workerThread release];
+  [sharedWorker release];
+  NSFreeHashTable(workers);
   NSFreeMapTable(activeConnections);
   NSFreeMapTable(syncedWatchers);
   NSFreeMapTable(syncedTimers);
-  free(ringBuffer);
-  [producerLock unlock];
   [synchronizationStateLock unlock];
   [connectionStateLock unlock];
-  [producerLock release];
   [synchronizationStateLock release];
   [connectionStateLock release];
   [super dealloc];
@@ -0,0 +1,130 @@
+/** Declaration of event backends used by the DBusKit worker threads.
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+   */
+
+#import <Foundation/NSObject.h>
+#import <Foundation/NSRunLoop.h>
+#include <dbus/dbus.h>
+
+@class NSLock, NSString;
+
+/**
+ * Objects handling events on file descriptors monitored by an event backend.
+ * The run loop backend delivers events through the RunLoopEvents protocol,
+ * other backends call -handleWatchEvents: directly.
+ */
+@protocol DKEventHandler <RunLoopEvents>
+/**
+ * Handles the events (DBUS_WATCH_READABLE, DBUS_WATCH_WRITABLE,
+ * DBUS_WATCH_ERROR and DBUS_WATCH_HANGUP flags) that occurred on the file
+ * descriptor.
+ */
+- (void)handleWatchEvents: (NSUInteger)flags;
+@end
+
+/**
+ * DKEventBackend is the abstract superclass of the mechanisms used to monitor
+ * the file descriptors of libdbus. (Timeouts are scheduled by the timer wheel
+ * of each connection, which uses the backend for its timer source.) A backend
+ * is attached to the run loop of the thread that uses it and must only be used
+ * from that thread. Events are given as D-Bus watch flags.
+ */
+@interface DKEventBackend: NSObject
+{
+  NSRunLoop *runLoop;
+  NSString *runLoopMode;
+}
+
+/**
+ * Returns the backend class used for worker threads. This will be the epoll
+ * backend where it is available, unless the DKEventBackend user default is set
+ * to "runloop".
+ */
++ (Class)defaultBackendClass;
+
+/**
+ * Makes the backend deliver events while <var>aRunLoop</var> is running in
+ * <var>mode</var>.
+ */
+- (void)attachToRunLoop: (NSRunLoop*)aRunLoop
+                   mode: (NSString*)mode;
+
+/**
+ * Stops event delivery through the run loop the backend was attached to.
+ */
+- (void)detach;
+
+/**
+ * Starts monitoring <var>fd</var> for <var>events</var> on behalf of
+ * <var>handler</var>. The handler is not retained.
+ */
+- (BOOL)monitorFileDescriptor: (int)fd
+                    forEvents: (NSUInteger)events
+                      handler: (id<DKEventHandler>)handler;
+
+/**
+ * Temporarily enables or disables delivery of <var>events</var> to a
+ * registered handler without removing it from the backend.
+ */
+- (void)setEnabled: (BOOL)enabled
+         forEvents: (NSUInteger)events
+    fileDescriptor: (int)fd
+           handler: (id<DKEventHandler>)handler;
+
+/**
+ * Stops monitoring <var>fd</var> for <var>events</var> on behalf of
+ * <var>handler</var>.
+ */
+- (void)unmonitorFileDescriptor: (int)fd
+                      forEvents: (NSUInteger)events
+                        handler: (id<DKEventHandler>)handler;
+@end
+
+/**
+ * Backend that registers every file descriptor with the NSRunLoop it is
+ * attached to.
+ */
+@interface DKRunLoopEventBackend: DKEventBackend
+@end
+
+#if defined(__linux__)
+/*
+ * Per-descriptor state of the epoll backend.
+ */
+typedef struct
+{
+  id<DKEventHandler> readHandler;
+  id<DKEventHandler> writeHandler;
+  BOOL readEnabled;
+  BOOL writeEnabled;
+} DKEpollRegistration;
+
+/**
+ * Backend that monitors all file descriptors of a worker through a single
+ * epoll descriptor. The run loop only watches the epoll descriptor.
+ * Descriptors are registered edge-triggered and toggled in place.
+ */
+@interface DKEpollEventBackend: DKEventBackend <RunLoopEvents>
+{
+  int epollDescriptor;
+  DKEpollRegistration **registrations;
+  int registrationCount;
+  NSLock *lock;
+}
+@end
+#endif
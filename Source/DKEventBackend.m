@@ -0,0 +1,521 @@
+/** Implementation of event backends used by the DBusKit worker threads.
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+   */
+
+#import "DKEventBackend.h"
+
+#import <Foundation/NSDebug.h>
+#import <Foundation/NSException.h>
+#import <Foundation/NSLock.h>
+#import <Foundation/NSString.h>
+#import <Foundation/NSUserDefaults.h>
+#import <GNUstepBase/NSDebug+GNUstepBase.h>
+
+#if defined(__linux__)
+#  include <errno.h>
+#  include <stdlib.h>
+#  include <string.h>
+#  include <unistd.h>
+#  include <sys/epoll.h>
+#  include <sys/ioctl.h>
+#endif
+
+@implementation DKEventBackend
++ (Class)defaultBackendClass
+{
+  NSString *name = [[NSUserDefaults standardUserDefaults] stringForKey: @"DKEventBackend"];
+  if ([name isEqualToString: @"runloop"])
+  {
+    return [DKRunLoopEventBackend class];
+  }
+# if defined(__linux__)
+  return [DKEpollEventBackend class];
+# else
+  return [DKRunLoopEventBackend class];
+# endif
+}
+
+- (void)attachToRunLoop: (NSRunLoop*)aRunLoop
+                   mode: (NSString*)mode
+{
+  ASSIGN(runLoop, aRunLoop);
+  ASSIGN(runLoopMode, mode);
+}
+
+- (void)detach
+{
+  DESTROY(runLoop);
+  DESTROY(runLoopMode);
+}
+
+- (BOOL)monitorFileDescriptor: (int)fd
+                    forEvents: (NSUInteger)events
+                      handler: (id<DKEventHandler>)handler
+{
+  [self subclassResponsibility: _cmd];
+  return NO;
+}
+
+- (void)setEnabled: (BOOL)enabled
+         forEvents: (NSUInteger)events
+    fileDescriptor: (int)fd
+           handler: (id<DKEventHandler>)handler
+{
+  [self subclassResponsibility: _cmd];
+}
+
+- (void)unmonitorFileDescriptor: (int)fd
+                      forEvents: (NSUInteger)events
+                        handler: (id<DKEventHandler>)handler
+{
+  [self subclassResponsibility: _cmd];
+}
+
+- (void)dealloc
+{
+  [runLoop release];
+  [runLoopMode release];
+  [super dealloc];
+}
+@end
+
+@implementation DKRunLoopEventBackend
+- (BOOL)monitorFileDescriptor: (int)fd
+                    forEvents: (NSUInteger)events
+                      handler: (id<DKEventHandler>)handler
+{
+  [self setEnabled: YES
+         forEvents: events
+    fileDescriptor: fd
+           handler: handler];
+  return YES;
+}
+
+- (void)setEnabled: (BOOL)enabled
+         forEvents: (NSUInteger)events
+    fileDescriptor: (int)fd
+           handler: (id<DKEventHandler>)handler
+{
+  NSRunLoop *rl = (nil == runLoop) ? [NSRunLoop currentRunLoop] : runLoop;
+  NSString *mode = (nil == runLoopMode) ? NSDefaultRunLoopMode : runLoopMode;
+  if (events & DBUS_WATCH_READABLE)
+  {
+    if (enabled)
+    {
+      [rl addEvent: (void*)(intptr_t)fd
+              type: ET_RDESC
+           watcher: handler
+           forMode: mode];
+    }
+    else
+    {
+      [rl removeEvent: (void*)(intptr_t)fd
+                 type: ET_RDESC
+              forMode: mode
+                  all: NO];
+    }
+  }
+  if (events & DBUS_WATCH_WRITABLE)
+  {
+    if (enabled)
+    {
+      [rl addEvent: (void*)(intptr_t)fd
+              type: ET_WDESC
+           watcher: handler
+           forMode: mode];
+    }
+    else
+    {
+      [rl removeEvent: (void*)(intptr_t)fd
+                 type: ET_WDESC
+              forMode: mode
+                  all: NO];
+    }
+  }
+}
+
+- (void)unmonitorFileDescriptor: (int)fd
+                      forEvents: (NSUInteger)events
+                        handler: (id<DKEventHandler>)handler
+{
+  [self setEnabled: NO
+         forEvents: events
+    fileDescriptor: fd
+           handler: handler];
+}
+@end
+
+#if defined(__linux__)
+
+/*
+ * Number of events fetched from the epoll descriptor in one go.
+ */
+#define DKEpollBatchSize 32
+
+static inline uint32_t
+DKEpollMaskForRegistration(DKEpollRegistration *reg)
+{
+  uint32_t mask = EPOLLET;
+  if ((nil != reg->readHandler) && reg->readEnabled)
+  {
+    mask |= EPOLLIN;
+  }
+  if ((nil != reg->writeHandler) && reg->writeEnabled)
+  {
+    mask |= EPOLLOUT;
+  }
+  return mask;
+}
+
+static inline NSUInteger
+DKWatchFlagsForEpollEvents(uint32_t events)
+{
+  NSUInteger flags = 0;
+  if (events & EPOLLIN)
+  {
+    flags |= DBUS_WATCH_READABLE;
+  }
+  if (events & EPOLLOUT)
+  {
+    flags |= DBUS_WATCH_WRITABLE;
+  }
+  if (events & EPOLLERR)
+  {
+    flags |= DBUS_WATCH_ERROR;
+  }
+  if (events & EPOLLHUP)
+  {
+    flags |= DBUS_WATCH_HANGUP;
+  }
+  return flags;
+}
+
+@implementation DKEpollEventBackend
+- (id)init
+{
+  if (nil == (self = [super init]))
+  {
+    return nil;
+  }
+  epollDescriptor = epoll_create1(EPOLL_CLOEXEC);
+  lock = [NSLock new];
+  if ((-1 == epollDescriptor) || (nil == lock))
+  {
+    NSWarnMLog(@"Could not create epoll backend: %s", strerror(errno));
+    [self release];
+    return nil;
+  }
+  return self;
+}
+
+- (void)attachToRunLoop: (NSRunLoop*)aRunLoop
+                   mode: (NSString*)mode
+{
+  [super attachToRunLoop: aRunLoop
+                    mode: mode];
+  [runLoop addEvent: (void*)(intptr_t)epollDescriptor
+               type: ET_RDESC
+            watcher: self
+            forMode: runLoopMode];
+}
+
+- (void)detach
+{
+  [runLoop removeEvent: (void*)(intptr_t)epollDescriptor
+                  type: ET_RDESC
+               forMode: runLoopMode
+                   all: YES];
+  [super detach];
+}
+
+/*
+ * Returns the registration for fd, creating it if requested. Needs to be
+ * called with the lock held.
+ */
+- (DKEpollRegistration*)_registrationForFileDescriptor: (int)fd
+                                                create: (BOOL)doCreate
+{
+  if ((fd < 0) || ((fd >= registrationCount) && (NO == doCreate)))
+  {
+    return NULL;
+  }
+  if (fd >= registrationCount)
+  {
+    int newCount = MAX(fd + 1, 2 * registrationCount);
+    DKEpollRegistration **newRegs = realloc(registrations,
+      newCount * sizeof(DKEpollRegistration*));
+    if (NULL == newRegs)
+    {
+      return NULL;
+    }
+    memset(newRegs + registrationCount, 0,
+      (newCount - registrationCount) * sizeof(DKEpollRegistration*));
+    registrations = newRegs;
+    registrationCount = newCount;
+  }
+  if ((NULL == registrations[fd]) && doCreate)
+  {
+    registrations[fd] = calloc(1, sizeof(DKEpollRegistration));
+  }
+  return registrations[fd];
+}
+
+/*
+ * Installs the event mask for the registration with the kernel, or removes the
+ * descriptor from the epoll set if no handlers are left. Needs to be called
+ * with the lock held.
+ */
+- (BOOL)_updateFileDescriptor: (int)fd
+                 registration: (DKEpollRegistration*)reg
+                        isNew: (BOOL)isNew
+{
+  struct epoll_event ev;
+  if ((nil == reg->readHandler) && (nil == reg->writeHandler))
+  {
+    epoll_ctl(epollDescriptor, EPOLL_CTL_DEL, fd, NULL);
+    free(reg);
+    registrations[fd] = NULL;
+    return YES;
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = DKEpollMaskForRegistration(reg);
+  ev.data.fd = fd;
+  if (0 == epoll_ctl(epollDescriptor,
+    (isNew ? EPOLL_CTL_ADD : EPOLL_CTL_MOD), fd, &ev))
+  {
+    return YES;
+  }
+  NSWarnMLog(@"Could not update epoll registration for fd %d: %s",
+    fd, strerror(errno));
+  return NO;
+}
+
+- (BOOL)monitorFileDescriptor: (int)fd
+                    forEvents: (NSUInteger)events
+                      handler: (id<DKEventHandler>)handler
+{
+  DKEpollRegistration *reg = NULL;
+  BOOL isNew = NO;
+  BOOL success = NO;
+  [lock lock];
+  isNew = (NULL == [self _registrationForFileDescriptor: fd
+                                                 create: NO]);
+  reg = [self _registrationForFileDescriptor: fd
+                                      create: YES];
+  if (NULL != reg)
+  {
+    if (events & DBUS_WATCH_READABLE)
+    {
+      reg->readHandler = handler;
+      reg->readEnabled = YES;
+    }
+    if (events & DBUS_WATCH_WRITABLE)
+    {
+      reg->writeHandler = handler;
+      reg->writeEnabled = YES;
+    }
+    success = [self _updateFileDescriptor: fd
+                             registration: reg
+                                    isNew: isNew];
+  }
+  [lock unlock];
+  return success;
+}
+
+- (void)setEnabled: (BOOL)enabled
+         forEvents: (NSUInteger)events
+    fileDescriptor: (int)fd
+           handler: (id<DKEventHandler>)handler
+{
+  DKEpollRegistration *reg = NULL;
+  [lock lock];
+  reg = [self _registrationForFileDescriptor: fd
+                                      create: NO];
+  if (NULL != reg)
+  {
+    if ((events & DBUS_WATCH_READABLE) && (handler == reg->readHandler))
+    {
+      reg->readEnabled = enabled;
+    }
+    if ((events & DBUS_WATCH_WRITABLE) && (handler == reg->writeHandler))
+    {
+      reg->writeEnabled = enabled;
+    }
+    // EPOLL_CTL_MOD also re-arms the edge trigger for ready descriptors.
+    [self _updateFileDescriptor: fd
+                   registration: reg
+                          isNew: NO];
+  }
+  [lock unlock];
+}
+
+- (void)unmonitorFileDescriptor: (int)fd
+                      forEvents: (NSUInteger)events
+                        handler: (id<DKEventHandler>)handler
+{
+  DKEpollRegistration *reg = NULL;
+  [lock lock];
+  reg = [self _registrationForFileDescriptor: fd
+                                      create: NO];
+  if (NULL != reg)
+  {
+    if ((events & DBUS_WATCH_READABLE) && (handler == reg->readHandler))
+    {
+      reg->readHandler = nil;
+      reg->readEnabled = NO;
+    }
+    if ((events & DBUS_WATCH_WRITABLE) && (handler == reg->writeHandler))
+    {
+      reg->writeHandler = nil;
+      reg->writeEnabled = NO;
+    }
+    [self _updateFileDescriptor: fd
+                   registration: reg
+                          isNew: NO];
+  }
+  [lock unlock];
+}
+
+/*
+ * Delivers the events for one descriptor. Since the descriptors are
+ * edge-triggered, we re-arm them if the handler left data behind or still wants
+ * to write, so that the next pass picks them up again.
+ */
+- (void)_handleEvents: (uint32_t)epollEvents
+     onFileDescriptor: (int)fd
+{
+  NSUInteger flags = DKWatchFlagsForEpollEvents(epollEvents);
+  NSUInteger errorFlags = (flags & (DBUS_WATCH_ERROR | DBUS_WATCH_HANGUP));
+  id<DKEventHandler> readHandler = nil;
+  id<DKEventHandler> writeHandler = nil;
+  DKEpollRegistration *reg = NULL;
+
+  [lock lock];
+  reg = [self _registrationForFileDescriptor: fd
+                                      create: NO];
+  if (NULL != reg)
+  {
+    if (reg->readEnabled)
+    {
+      readHandler = [reg->readHandler retain];
+    }
+    if (reg->writeEnabled)
+    {
+      writeHandler = [reg->writeHandler retain];
+    }
+  }
+  [lock unlock];
+
+  if (readHandler == writeHandler)
+  {
+    if (nil != readHandler)
+    {
+      [readHandler handleWatchEvents: flags];
+    }
+  }
+  else
+  {
+    if ((nil != readHandler)
+      && (flags & (DBUS_WATCH_READABLE | errorFlags)))
+    {
+      [readHandler handleWatchEvents: (flags & ~DBUS_WATCH_WRITABLE)];
+    }
+    if ((nil != writeHandler)
+      && (flags & (DBUS_WATCH_WRITABLE | errorFlags)))
+    {
+      [writeHandler handleWatchEvents: (flags & ~DBUS_WATCH_READABLE)];
+    }
+  }
+  [readHandler release];
+  [writeHandler release];
+
+  if (0 != errorFlags)
+  {
+    // libdbus will remove the watches for a broken connection.
+    return;
+  }
+
+  [lock lock];
+  reg = [self _registrationForFileDescriptor: fd
+                                      create: NO];
+  if (NULL != reg)
+  {
+    int pending = 0;
+    BOOL rearm = NO;
+    if ((nil != reg->readHandler) && reg->readEnabled
+      && (0 == ioctl(fd, FIONREAD, &pending)) && (pending > 0))
+    {
+      rearm = YES;
+    }
+    if ((nil != reg->writeHandler) && reg->writeEnabled
+      && (epollEvents & EPOLLOUT))
+    {
+      rearm = YES;
+    }
+    if (rearm)
+    {
+      [self _updateFileDescriptor: fd
+                     registration: reg
+                            isNew: NO];
+    }
+  }
+  [lock unlock];
+}
+
+- (void)receivedEvent: (void*)data
+                 type: (RunLoopEventType)type
+                extra: (void*)extra
+              forMode: (NSString*)mode
+{
+  struct epoll_event events[DKEpollBatchSize];
+  int count = 0;
+  int i = 0;
+
+  do
+  {
+    count = epoll_wait(epollDescriptor, events, DKEpollBatchSize, 0);
+  } while ((-1 == count) && (EINTR == errno));
+
+  for (i = 0; i < count; i++)
+  {
+    [self _handleEvents: events[i].events
+       onFileDescriptor: events[i].data.fd];
+  }
+}
+
+- (void)dealloc
+{
+  int i = 0;
+  if (nil != runLoop)
+  {
+    [self detach];
+  }
+  for (i = 0; i < registrationCount; i++)
+  {
+    free(registrations[i]);
+  }
+  free(registrations);
+  if (-1 != epollDescriptor)
+  {
+    close(epollDescriptor);
+  }
+  [lock release];
+  [super dealloc];
+}
+@end
+#endif
@@ -0,0 +1,118 @@
+/** Interface for the DKFuture class standing in for results of D-Bus calls.
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+   */
+
+#import <Foundation/NSProxy.h>
+
+@class DKCallCompletion, NSArray, NSCondition, NSError, NSException, NSThread;
+
+/**
+ * DKFuture is returned in place of the object returned by a D-Bus method that
+ * is called asynchronously. It is resolved by the worker thread once the reply
+ * arrives. The first message sent to the future blocks until then and is
+ * forwarded to the real return value. If the call failed, every message sent
+ * to the future raises the exception describing the failure.
+ */
+@interface DKFuture: NSProxy
+{
+  NSCondition *condition;
+  id object;
+  NSException *exception;
+  DKCallCompletion *completion;
+  BOOL resolved;
+}
+
+/**
+ * Returns a new, unresolved future.
+ */
+- (id)init;
+
+/**
+ * Resolves the future with <var>anObject</var> and wakes up all threads
+ * waiting for it. Only the first resolution of a future takes effect.
+ */
+- (void)resolveWithObject: (id)anObject;
+
+/**
+ * Resolves the future with <var>anException</var>, which will be raised when
+ * the future is used.
+ */
+- (void)resolveWithException: (NSException*)anException;
+
+/**
+ * Sets the completion that will be notified of the resolution of the future.
+ * Must be called before the future can be resolved.
+ */
+- (void)setCompletion: (DKCallCompletion*)aCompletion;
+
+/**
+ * Returns whether the future has been resolved. Does not block.
+ */
+- (BOOL)isResolved;
+
+/**
+ * Blocks until the future is resolved and returns the real object or raises
+ * the exception it was resolved with.
+ */
+- (id)resolvedObject;
+@end
+
+/**
+ * Returns an NSError in the DKDBusErrorDomain describing
+ * <var>anException</var>.
+ */
+NSError *DKErrorForException(NSException *anException);
+
+/**
+ * DKCallCompletion delivers the result of an asynchronous call to a handler
+ * object. The handler is sent a message with two arguments, the result of the
+ * call and an NSError (one of which is nil), as in:
+ * <example>
+ * - (void)callReturned: (id)result error: (NSError*)error;
+ * </example>
+ * The message is delivered on the chosen thread, or on the worker thread that
+ * received the reply if no thread was chosen.
+ */
+@interface DKCallCompletion: NSObject
+{
+  id handler;
+  SEL selector;
+  NSThread *thread;
+  NSArray *modes;
+  id result;
+  NSError *error;
+}
+
+/**
+ * Initializes the completion to send <var>aSelector</var> to
+ * <var>aHandler</var> on <var>aThread</var>, whose run loop needs to be running
+ * in one of <var>runLoopModes</var> (the default mode if nil). The handler is
+ * retained until the completion has been delivered.
+ */
+- (id)initWithHandler: (id)aHandler
+             selector: (SEL)aSelector
+               thread: (NSThread*)aThread
+                modes: (NSArray*)runLoopModes;
+
+/**
+ * Schedules delivery of the result or of an NSError describing
+ * <var>anException</var>.
+ */
+- (void)completeWithObject: (id)anObject
+                 exception: (NSException*)anException;
+@end
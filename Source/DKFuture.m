@@ -0,0 +1,310 @@
+/** Implementation of the DKFuture class standing in for results of D-Bus calls.
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+   */
+
+#import "DKFuture.h"
+#import "DKEndpointManager.h"
+
+#import <Foundation/NSArray.h>
+#import <Foundation/NSCondition.h>
+#import <Foundation/NSDate.h>
+#import <Foundation/NSDictionary.h>
+#import <Foundation/NSError.h>
+#import <Foundation/NSException.h>
+#import <Foundation/NSInvocation.h>
+#import <Foundation/NSMethodSignature.h>
+#import <Foundation/NSRunLoop.h>
+#import <Foundation/NSString.h>
+#import <Foundation/NSThread.h>
+#import <GNUstepBase/NSDebug+GNUstepBase.h>
+
+#import "DBusKit/DKProxy.h"
+
+static DKEndpointManager *manager;
+
+NSError*
+DKErrorForException(NSException *anException)
+{
+  NSMutableDictionary *info = [NSMutableDictionary dictionary];
+  NSString *reason = [anException reason];
+  if (nil != [anException userInfo])
+  {
+    [info addEntriesFromDictionary: [anException userInfo]];
+  }
+  if (nil != reason)
+  {
+    [info setObject: reason
+             forKey: NSLocalizedDescriptionKey];
+  }
+  [info setObject: anException
+           forKey: DKExceptionErrorKey];
+  return [NSError errorWithDomain: DKDBusErrorDomain
+                             code: 0
+                         userInfo: info];
+}
+
+@implementation DKFuture
++ (void)initialize
+{
+  if ([DKFuture class] == self)
+  {
+    manager = [DKEndpointManager sharedEndpointManager];
+  }
+}
+
+- (id)init
+{
+  // This class derives from NSProxy, hence no call to -[super init].
+  condition = [[NSCondition alloc] init];
+  return self;
+}
+
+- (void)setCompletion: (DKCallCompletion*)aCompletion
+{
+  [condition lock];
+  ASSIGN(completion, aCompletion);
+  [condition unlock];
+}
+
+- (void)_resolveWithObject: (id)anObject
+                 exception: (NSException*)anException
+{
+  DKCallCompletion *theCompletion = nil;
+  [condition lock];
+  if (NO == resolved)
+  {
+    ASSIGN(object, anObject);
+    ASSIGN(exception, anException);
+    resolved = YES;
+    theCompletion = completion;
+    completion = nil;
+    [condition broadcast];
+  }
+  else
+  {
+    NSDebugMLog(@"Ignoring repeated resolution of future.");
+  }
+  [condition unlock];
+
+  // Deliver outside the lock, the handler might be called right away.
+  if (nil != theCompletion)
+  {
+    [theCompletion completeWithObject: anObject
+                            exception: anException];
+    [theCompletion release];
+  }
+}
+
+- (void)resolveWithObject: (id)anObject
+{
+  [self _resolveWithObject: anObject
+                 exception: nil];
+}
+
+- (void)resolveWithException: (NSException*)anException
+{
+  [self _resolveWithObject: nil
+                 exception: anException];
+}
+
+- (BOOL)isResolved
+{
+  BOOL isResolved = NO;
+  [condition lock];
+  isResolved = resolved;
+  [condition unlock];
+  return isResolved;
+}
+
+- (id)resolvedObject
+{
+  [condition lock];
+  while (NO == resolved)
+  {
+    /*
+     * If the reply will be dispatched by the run loop of this thread, we need
+     * to keep it running instead of sleeping.
+     */
+    if ([manager isSynchronizing]
+      || [manager isWorkerThread: [NSThread currentThread]])
+    {
+      [condition unlock];
+      [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                               beforeDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+      [condition lock];
+    }
+    else
+    {
+      [condition wait];
+    }
+  }
+  [condition unlock];
+
+  if (nil != exception)
+  {
+    [exception raise];
+  }
+  return object;
+}
+
+- (NSMethodSignature*)methodSignatureForSelector: (SEL)aSelector
+{
+  id target = [self resolvedObject];
+  NSMethodSignature *sig = nil;
+  if (nil != target)
+  {
+    sig = [target methodSignatureForSelector: aSelector];
+  }
+  if (nil == sig)
+  {
+    // Messages to nil return zero, so any signature will do.
+    sig = [NSMethodSignature signatureWithObjCTypes: "@@:"];
+  }
+  return sig;
+}
+
+- (void)forwardInvocation: (NSInvocation*)inv
+{
+  [inv invokeWithTarget: [self resolvedObject]];
+}
+
+/*
+ * NSProxy implements these itself, so we need to forward them explicitly.
+ */
+- (Class)class
+{
+  return [[self resolvedObject] class];
+}
+
+- (BOOL)isKindOfClass: (Class)aClass
+{
+  return [[self resolvedObject] isKindOfClass: aClass];
+}
+
+- (BOOL)isMemberOfClass: (Class)aClass
+{
+  return [[self resolvedObject] isMemberOfClass: aClass];
+}
+
+- (BOOL)respondsToSelector: (SEL)aSelector
+{
+  return [[self resolvedObject] respondsToSelector: aSelector];
+}
+
+- (BOOL)conformsToProtocol: (Protocol*)aProtocol
+{
+  return [[self resolvedObject] conformsToProtocol: aProtocol];
+}
+
+- (BOOL)isEqual: (id)other
+{
+  return [[self resolvedObject] isEqual: other];
+}
+
+- (NSUInteger)hash
+{
+  return [[self resolvedObject] hash];
+}
+
+- (NSString*)description
+{
+  return [[self resolvedObject] description];
+}
+
+- (void)dealloc
+{
+  [object release];
+  [exception release];
+  [completion release];
+  [condition release];
+  [super dealloc];
+}
+@end
+
+@implementation DKCallCompletion
+- (id)initWithHandler: (id)aHandler
+             selector: (SEL)aSelector
+               thread: (NSThread*)aThread
+                modes: (NSArray*)runLoopModes
+{
+  if (nil == (self = [super init]))
+  {
+    return nil;
+  }
+  if ((nil == aHandler) || (0 == aSelector))
+  {
+    [self release];
+    return nil;
+  }
+  ASSIGN(handler, aHandler);
+  selector = aSelector;
+  ASSIGN(thread, aThread);
+  if (nil == runLoopModes)
+  {
+    runLoopModes = [NSArray arrayWithObject: NSDefaultRunLoopMode];
+  }
+  ASSIGNCOPY(modes, runLoopModes);
+  return self;
+}
+
+- (void)_deliver: (id)ignored
+{
+  void (*deliver)(id,SEL,id,NSError*) = (void(*)(id,SEL,id,NSError*))
+    [handler methodForSelector: selector];
+  NSAssert2(deliver, @"%@ does not implement %@",
+    handler, NSStringFromSelector(selector));
+  deliver(handler, selector, result, error);
+  // Break the cycle and free the handler as soon as possible.
+  DESTROY(handler);
+  DESTROY(result);
+  DESTROY(error);
+}
+
+- (void)completeWithObject: (id)anObject
+                 exception: (NSException*)anException
+{
+  ASSIGN(result, anObject);
+  if (nil != anException)
+  {
+    ASSIGN(error, DKErrorForException(anException));
+  }
+
+  if (nil == thread)
+  {
+    [self _deliver: nil];
+  }
+  else
+  {
+    [self performSelector: @selector(_deliver:)
+                 onThread: thread
+               withObject: nil
+            waitUntilDone: NO
+                    modes: modes];
+  }
+}
+
+- (void)dealloc
+{
+  [handler release];
+  [thread release];
+  [modes release];
+  [result release];
+  [error release];
+  [super dealloc];
+}
+@end
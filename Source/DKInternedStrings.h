@@ -0,0 +1,45 @@
+/** Declarations of functions for interning strings from D-Bus messages.
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+
+   */
+
+#import <Foundation/NSObject.h>
+
+@class NSString;
+
+/**
+ * Returns a shared, immutable string for the NUL-terminated UTF-8 string
+ * <var>utf8</var>, or nil if <var>utf8</var> is NULL. Interface names, member
+ * names and well-known bus names in the headers of D-Bus messages come from a
+ * small set, so interning them avoids creating new strings for every message
+ * and allows comparing them by pointer first. Unique bus names and object
+ * paths should not be interned, they keep changing. This function is
+ * thread-safe. Interned strings are never released, so the table is limited
+ * in size. Once it is full, new strings are returned without being interned.
+ * Interning can be disabled by setting the DKInternedStrings user default to
+ * NO.
+ */
+NSString*
+DKInternedString(const char *utf8);
+
+/**
+ * Returns the shared instance of <var>string</var>, or <var>string</var>
+ * itself if it could not be interned.
+ */
+NSString*
+DKInternedStringForString(NSString *string);
@@ -0,0 +1,177 @@
+/** Functions for interning strings from D-Bus messages.
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+
+   */
+
+#import "DKInternedStrings.h"
+
+#import <Foundation/NSAutoreleasePool.h>
+#import <Foundation/NSLock.h>
+#import <Foundation/NSMapTable.h>
+#import <Foundation/NSString.h>
+#import <Foundation/NSUserDefaults.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Upper bound for the number of interned strings, in case a peer keeps
+ * sending new interface or member names. We stop interning new strings once
+ * we have seen this many.
+ */
+#define DK_INTERNED_STRINGS_MAX 4096
+
+static pthread_once_t internedStringsOnce = PTHREAD_ONCE_INIT;
+static BOOL usesInternedStrings;
+static NSLock *internedStringsLock;
+static NSMapTable *internedStrings;
+
+/*
+ * Key callbacks for the table, which is keyed on copies of the UTF-8 bytes so
+ * that lookups don't need to create a string.
+ */
+static NSUInteger
+DKCStringHash(NSMapTable *table, const void *key)
+{
+  const unsigned char *bytes = key;
+  NSUInteger hash = 5381;
+  while ('\0' != *bytes)
+  {
+    hash = ((hash << 5) + hash) + *bytes++;
+  }
+  return hash;
+}
+
+static BOOL
+DKCStringIsEqual(NSMapTable *table, const void *key1, const void *key2)
+{
+  return (0 == strcmp(key1, key2));
+}
+
+static void
+DKCStringRetain(NSMapTable *table, const void *key)
+{
+  // The keys are copied before they are inserted.
+}
+
+static void
+DKCStringRelease(NSMapTable *table, void *key)
+{
+  free(key);
+}
+
+static NSString*
+DKCStringDescribe(NSMapTable *table, const void *key)
+{
+  return [NSString stringWithUTF8String: key];
+}
+
+static const NSMapTableKeyCallBacks DKCStringMapKeyCallBacks = {
+  DKCStringHash,
+  DKCStringIsEqual,
+  DKCStringRetain,
+  DKCStringRelease,
+  DKCStringDescribe,
+  NULL
+};
+
+static void
+DKInternedStringsInitialize(void)
+{
+  NSAutoreleasePool *arp = [NSAutoreleasePool new];
+  NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+  usesInternedStrings = ((nil == [defaults objectForKey: @"DKInternedStrings"])
+    || [defaults boolForKey: @"DKInternedStrings"]);
+  internedStringsLock = [NSLock new];
+  internedStrings = NSCreateMapTable(DKCStringMapKeyCallBacks,
+    NSObjectMapValueCallBacks,
+    64);
+  [arp release];
+}
+
+NSString*
+DKInternedString(const char *utf8)
+{
+  NSString *string = nil;
+  NSString *existing = nil;
+  char *key = NULL;
+  if (NULL == utf8)
+  {
+    return nil;
+  }
+  pthread_once(&internedStringsOnce, DKInternedStringsInitialize);
+  if (NO == usesInternedStrings)
+  {
+    return [NSString stringWithUTF8String: utf8];
+  }
+
+  [internedStringsLock lock];
+  string = NSMapGet(internedStrings, utf8);
+  [internedStringsLock unlock];
+  if (nil != string)
+  {
+    return string;
+  }
+
+  string = [[NSString alloc] initWithUTF8String: utf8];
+  if (nil == string)
+  {
+    return nil;
+  }
+  key = strdup(utf8);
+  if (NULL == key)
+  {
+    return [string autorelease];
+  }
+
+  [internedStringsLock lock];
+  existing = NSMapGet(internedStrings, key);
+  if (nil != existing)
+  {
+    // Another thread was faster, so we use its string.
+    free(key);
+    [string release];
+    string = existing;
+  }
+  else if (NSCountMapTable(internedStrings) < DK_INTERNED_STRINGS_MAX)
+  {
+    // The table retains the string.
+    NSMapInsert(internedStrings, key, string);
+    [string release];
+  }
+  else
+  {
+    free(key);
+    [string autorelease];
+  }
+  [internedStringsLock unlock];
+  return string;
+}
+
+NSString*
+DKInternedStringForString(NSString *string)
+{
+  NSString *interned = nil;
+  if (nil == string)
+  {
+    return nil;
+  }
+  interned = DKInternedString([string UTF8String]);
+  return (nil != interned) ? interned : string;
+}
@@ -0,0 +1,81 @@
+/** Interface for containers decoding D-Bus message contents on demand.
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+   */
+
+#import <Foundation/NSArray.h>
+#import <Foundation/NSDictionary.h>
+#import <Foundation/NSMapTable.h>
+#include <dbus/dbus.h>
+
+@class DKArgument;
+
+/**
+ * DKLazyArray is an immutable array whose elements are unmarshalled from a
+ * D-Bus message when they are first accessed. It keeps the message referenced
+ * and remembers the position of every element in it. Errors in the message are
+ * only detected when the offending element is accessed.
+ */
+@interface DKLazyArray: NSArray
+{
+  DBusMessage *message;
+  DKArgument *elementArgument;
+  NSArray *ancestors;
+  NSUInteger count;
+  DBusMessageIter *iterators;
+  id *objects;
+}
+
+/**
+ * Initializes the array with the elements starting at <var>iter</var>, which
+ * must have been obtained by recursing into an array in <var>msg</var>. The
+ * elements are described by <var>arg</var>. The iterator is advanced past the
+ * last element.
+ */
+- (id)initWithIterator: (DBusMessageIter*)iter
+               message: (DBusMessage*)msg
+       elementArgument: (DKArgument*)arg;
+@end
+
+/**
+ * DKLazyDictionary is an immutable dictionary whose values are unmarshalled
+ * from a D-Bus message when they are first accessed. The keys (which are basic
+ * types) are unmarshalled right away because they are needed for lookups.
+ */
+@interface DKLazyDictionary: NSDictionary
+{
+  DBusMessage *message;
+  DKArgument *valueArgument;
+  NSArray *ancestors;
+  NSMapTable *indices;
+  NSUInteger count;
+  DBusMessageIter *iterators;
+  id *values;
+}
+
+/**
+ * Initializes the dictionary with the dict entries starting at
+ * <var>iter</var>, which must have been obtained by recursing into an array in
+ * <var>msg</var>. The keys and values of the entries are described by
+ * <var>keyArg</var> and <var>valueArg</var>. The iterator is advanced past the
+ * last entry.
+ */
+- (id)initWithIterator: (DBusMessageIter*)iter
+               message: (DBusMessage*)msg
+           keyArgument: (DKArgument*)keyArg
+         valueArgument: (DKArgument*)valueArg;
+@end
@@ -0,0 +1,351 @@
+/** Implementation of containers decoding D-Bus message contents on demand.
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+   */
+
+#import "DKLazyContainers.h"
+#import "DKArgument.h"
+
+#import <Foundation/NSDebug.h>
+#import <Foundation/NSEnumerator.h>
+#import <Foundation/NSException.h>
+#import <Foundation/NSNull.h>
+#import <Foundation/NSValue.h>
+#import <GNUstepBase/NSDebug+GNUstepBase.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Returns the argument and all of its ancestors. Arguments do not retain their
+ * parents, but they need them (e.g. to create proxies for object paths) when
+ * the elements are unmarshalled later on.
+ */
+static NSArray*
+DKLazyAncestors(DKArgument *arg)
+{
+  NSMutableArray *ancestors = [NSMutableArray array];
+  id node = arg;
+  while (nil != node)
+  {
+    [ancestors addObject: node];
+    if (NO == [node isKindOfClass: [DKIntrospectionNode class]])
+    {
+      break;
+    }
+    node = [node parent];
+  }
+  return ancestors;
+}
+
+/*
+ * Records the positions of the values in an array, growing the buffer as
+ * needed. Returns NO if we ran out of memory.
+ */
+static BOOL
+DKLazyAddPosition(DBusMessageIter **positions,
+  NSUInteger *capacity,
+  NSUInteger index,
+  DBusMessageIter *iter)
+{
+  if (index >= *capacity)
+  {
+    NSUInteger newCapacity = (0 == *capacity) ? 16 : (*capacity * 2);
+    DBusMessageIter *newPositions = realloc(*positions,
+      newCapacity * sizeof(DBusMessageIter));
+    if (NULL == newPositions)
+    {
+      return NO;
+    }
+    *positions = newPositions;
+    *capacity = newCapacity;
+  }
+  // Iterators can be copied to save their position in the message.
+  (*positions)[index] = *iter;
+  return YES;
+}
+
+/*
+ * Unmarshalls the value at <var>position</var> and stores it in
+ * <var>slot</var> unless another thread was faster.
+ */
+static id
+DKLazyUnmarshall(DBusMessage *msg,
+  DKArgument *arg,
+  const DBusMessageIter *position,
+  id *slot)
+{
+  DBusMessageIter iter = *position;
+  DBusMessage *previousMessage = [DKArgument messageBeingUnmarshalled];
+  id object = nil;
+
+  // Nested containers can refer to the same message.
+  [DKArgument setMessageBeingUnmarshalled: msg];
+  NS_DURING
+  {
+    object = [arg unmarshalledObjectFromIterator: &iter];
+  }
+  NS_HANDLER
+  {
+    [DKArgument setMessageBeingUnmarshalled: previousMessage];
+    [localException raise];
+  }
+  NS_ENDHANDLER
+  [DKArgument setMessageBeingUnmarshalled: previousMessage];
+
+  if (nil == object)
+  {
+    object = [NSNull null];
+  }
+  [object retain];
+  if (NO == __sync_bool_compare_and_swap(slot, nil, object))
+  {
+    [object release];
+    object = *slot;
+  }
+  return object;
+}
+
+@implementation DKLazyArray
+- (id)initWithIterator: (DBusMessageIter*)iter
+               message: (DBusMessage*)msg
+       elementArgument: (DKArgument*)arg
+{
+  NSUInteger capacity = 0;
+  // NSArray leaves initialization to its concrete subclasses, hence no call to
+  // -[super init].
+  message = dbus_message_ref(msg);
+  ASSIGN(elementArgument, arg);
+  ASSIGN(ancestors, DKLazyAncestors(arg));
+
+  // Index the elements without unmarshalling them:
+  while (DBUS_TYPE_INVALID != dbus_message_iter_get_arg_type(iter))
+  {
+    if (NO == DKLazyAddPosition(&iterators, &capacity, count, iter))
+    {
+      [self release];
+      return nil;
+    }
+    count++;
+    if (NO == (BOOL)dbus_message_iter_next(iter))
+    {
+      break;
+    }
+  }
+
+  objects = calloc(MAX(count, 1), sizeof(id));
+  if (NULL == objects)
+  {
+    [self release];
+    return nil;
+  }
+  return self;
+}
+
+- (NSUInteger)count
+{
+  return count;
+}
+
+- (id)objectAtIndex: (NSUInteger)index
+{
+  id object = nil;
+  if (index >= count)
+  {
+    [NSException raise: NSRangeException
+                format: @"Index %lu out of range for array of %lu elements.",
+      (unsigned long)index, (unsigned long)count];
+  }
+  object = __atomic_load_n(&objects[index], __ATOMIC_ACQUIRE);
+  if (nil == object)
+  {
+    object = DKLazyUnmarshall(message,
+      elementArgument,
+      &iterators[index],
+      &objects[index]);
+  }
+  return object;
+}
+
+- (id)copyWithZone: (NSZone*)zone
+{
+  // We are immutable.
+  return [self retain];
+}
+
+- (void)dealloc
+{
+  NSUInteger index = 0;
+  if (NULL != objects)
+  {
+    for (index = 0; index < count; index++)
+    {
+      [objects[index] release];
+    }
+    free(objects);
+  }
+  free(iterators);
+  if (NULL != message)
+  {
+    dbus_message_unref(message);
+  }
+  [elementArgument release];
+  [ancestors release];
+  [super dealloc];
+}
+@end
+
+@implementation DKLazyDictionary
+- (id)initWithIterator: (DBusMessageIter*)iter
+               message: (DBusMessage*)msg
+           keyArgument: (DKArgument*)keyArg
+         valueArgument: (DKArgument*)valueArg
+{
+  NSUInteger capacity = 0;
+  NSMutableArray *missingValues = [NSMutableArray array];
+  NSEnumerator *theEnum = nil;
+  NSNumber *missing = nil;
+  // NSDictionary leaves initialization to its concrete subclasses, hence no
+  // call to -[super init].
+  message = dbus_message_ref(msg);
+  ASSIGN(valueArgument, valueArg);
+  ASSIGN(ancestors, DKLazyAncestors(valueArg));
+  indices = NSCreateMapTable(NSObjectMapKeyCallBacks,
+    NSIntegerMapValueCallBacks,
+    16);
+
+  // Unmarshall the keys and index the values:
+  while (DBUS_TYPE_INVALID != dbus_message_iter_get_arg_type(iter))
+  {
+    DBusMessageIter entryIter;
+    id key = nil;
+    NSAssert((DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(iter)),
+      @"Type mismatch between introspection data and D-Bus message.");
+    dbus_message_iter_recurse(iter, &entryIter);
+    key = [keyArg unmarshalledObjectFromIterator: &entryIter];
+    if (nil == key)
+    {
+      key = [NSNull null];
+    }
+
+    if (NULL != NSMapGet(indices, key))
+    {
+      // We ignore duplicate keys like the eager implementation.
+      NSWarnMLog(@"Ignoring duplicate key (%@) in D-Bus dictionary.", key);
+    }
+    else
+    {
+      if (NO == (BOOL)dbus_message_iter_next(&entryIter))
+      {
+        [missingValues addObject: [NSNumber numberWithUnsignedInteger: count]];
+      }
+      if (NO == DKLazyAddPosition(&iterators, &capacity, count, &entryIter))
+      {
+        [self release];
+        return nil;
+      }
+      // Store the index offset by one, because NULL denotes missing keys.
+      NSMapInsert(indices, key, (void*)(uintptr_t)(count + 1));
+      count++;
+    }
+
+    if (NO == (BOOL)dbus_message_iter_next(iter))
+    {
+      break;
+    }
+  }
+
+  values = calloc(MAX(count, 1), sizeof(id));
+  if (NULL == values)
+  {
+    [self release];
+    return nil;
+  }
+  theEnum = [missingValues objectEnumerator];
+  while (nil != (missing = [theEnum nextObject]))
+  {
+    values[[missing unsignedIntegerValue]] = [[NSNull null] retain];
+  }
+  return self;
+}
+
+- (NSUInteger)count
+{
+  return count;
+}
+
+- (id)objectForKey: (id)aKey
+{
+  NSUInteger index = 0;
+  id object = nil;
+  if (nil == aKey)
+  {
+    return nil;
+  }
+  index = (NSUInteger)(uintptr_t)NSMapGet(indices, aKey);
+  if (0 == index)
+  {
+    return nil;
+  }
+  index--;
+  object = __atomic_load_n(&values[index], __ATOMIC_ACQUIRE);
+  if (nil == object)
+  {
+    object = DKLazyUnmarshall(message,
+      valueArgument,
+      &iterators[index],
+      &values[index]);
+  }
+  return object;
+}
+
+- (NSEnumerator*)keyEnumerator
+{
+  return [NSAllMapTableKeys(indices) objectEnumerator];
+}
+
+- (id)copyWithZone: (NSZone*)zone
+{
+  // We are immutable.
+  return [self retain];
+}
+
+- (void)dealloc
+{
+  NSUInteger index = 0;
+  if (NULL != values)
+  {
+    for (index = 0; index < count; index++)
+    {
+      [values[index] release];
+    }
+    free(values);
+  }
+  free(iterators);
+  if (NULL != indices)
+  {
+    NSFreeMapTable(indices);
+  }
+  if (NULL != message)
+  {
+    dbus_message_unref(message);
+  }
+  [valueArgument release];
+  [ancestors release];
+  [super dealloc];
+}
+@end
@@ -0,0 +1,124 @@
+/** Declaration of marshalling plans for DKMethod.
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+   */
+
+#import <Foundation/NSObject.h>
+#include <dbus/dbus.h>
+
+@class DKArgument, DKMethod, NSArray, NSInvocation, NSMethodSignature;
+
+/*
+ * The ways a value can be moved between an invocation and a D-Bus message.
+ */
+typedef enum
+{
+  /* Nothing to do (void return value). */
+  DK_MARSHALLING_OP_NONE,
+  /* Basic value whose representation is the same on both sides. */
+  DK_MARSHALLING_OP_COPY,
+  /* Basic value that needs to be converted to a different C type. */
+  DK_MARSHALLING_OP_CONVERT,
+  /* Basic value that is boxed in an object in the invocation. */
+  DK_MARSHALLING_OP_BOX,
+  /* Anything else, the DKArgument handles it itself. */
+  DK_MARSHALLING_OP_ARGUMENT
+} DKMarshallingOpKind;
+
+/*
+ * A single step of a marshalling plan. All information that the generic
+ * DKArgument code computes for every value is precomputed here.
+ */
+typedef struct
+{
+  DKMarshallingOpKind kind;
+  int DBusType;
+  NSInteger index;
+  BOOL boxed;
+  const char *invocationType;
+  const char *DBusObjCType;
+  DKArgument *argument;
+  IMP unbox;
+  IMP box;
+  IMP fixup;
+} DKMarshallingOp;
+
+/*
+ * A DKMarshallingPlan describes how the arguments and return value of an
+ * invocation with a specific method signature are transferred to and from
+ * D-Bus messages for a DKMethod. The plan does not retain the arguments or the
+ * signature, so it must not outlive either.
+ */
+typedef struct DKMarshallingPlan
+{
+  NSUInteger count;
+  /* NO if the return value cannot be handled by a single op. */
+  BOOL coversReturnValue;
+  DKMarshallingOp returnValue;
+  DKMarshallingOp arguments[];
+} DKMarshallingPlan;
+
+/**
+ * Compiles the plan for <var>inArgs</var> and <var>outArgs</var> of
+ * <var>method</var> being used with invocations of <var>sig</var>. Returns NULL
+ * if the signature cannot be used with the method.
+ */
+DKMarshallingPlan*
+DKMarshallingPlanCreate(DKMethod *method,
+  NSArray *inArgs,
+  NSArray *outArgs,
+  NSMethodSignature *sig);
+
+/**
+ * Frees a plan created by DKMarshallingPlanCreate().
+ */
+void
+DKMarshallingPlanFree(DKMarshallingPlan *plan);
+
+/**
+ * Appends the arguments of <var>inv</var> to the message.
+ */
+void
+DKMarshallingPlanMarshallArguments(DKMarshallingPlan *plan,
+  NSInvocation *inv,
+  DBusMessageIter *iter);
+
+/**
+ * Sets the arguments of <var>inv</var> from the message.
+ */
+void
+DKMarshallingPlanUnmarshallArguments(DKMarshallingPlan *plan,
+  DBusMessageIter *iter,
+  NSInvocation *inv);
+
+/**
+ * Appends the return value of <var>inv</var> to the message. Returns NO if the
+ * plan does not cover the return value.
+ */
+BOOL
+DKMarshallingPlanMarshallReturnValue(DKMarshallingPlan *plan,
+  NSInvocation *inv,
+  DBusMessageIter *iter);
+
+/**
+ * Sets the return value of <var>inv</var> from the message. Returns NO if the
+ * plan does not cover the return value.
+ */
+BOOL
+DKMarshallingPlanUnmarshallReturnValue(DKMarshallingPlan *plan,
+  DBusMessageIter *iter,
+  NSInvocation *inv);
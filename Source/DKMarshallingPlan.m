@@ -0,0 +1,364 @@
+/** Implementation of marshalling plans for DKMethod.
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+   */
+
+#import "DKMarshallingPlan.h"
+#import "DKArgument.h"
+#import "DKBoxingUtils.h"
+#import "DKMethod.h"
+
+#import <Foundation/NSArray.h>
+#import <Foundation/NSException.h>
+#import <Foundation/NSInvocation.h>
+#import <Foundation/NSMethodSignature.h>
+#import <Foundation/NSString.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+@interface DKArgument (DKMarshallingPlan)
+- (void)fixupBuffer: (uint64_t*)buffer
+           fromType: (const char*)sourceType
+             toType: (const char*)targetType;
+@end
+
+typedef BOOL (*DKUnboxIMP)(id, SEL, id, long long*);
+typedef id (*DKBoxIMP)(id, SEL, void*);
+typedef void (*DKFixupIMP)(id, SEL, uint64_t*, const char*, const char*);
+
+static SEL unboxSelector;
+static SEL boxSelector;
+static SEL fixupSelector;
+static SEL marshallSelector;
+static SEL unmarshallSelector;
+static IMP genericMarshall;
+static IMP genericUnmarshall;
+
+static void
+DKMarshallingPlanSetup()
+{
+  if (0 != genericUnmarshall)
+  {
+    return;
+  }
+  unboxSelector = @selector(unboxValue:intoBuffer:);
+  boxSelector = @selector(boxedValueForValueAt:);
+  fixupSelector = @selector(fixupBuffer:fromType:toType:);
+  marshallSelector = @selector(marshallArgumentAtIndex:fromInvocation:intoIterator:boxing:);
+  unmarshallSelector = @selector(unmarshallFromIterator:intoInvocation:atIndex:boxing:);
+  genericMarshall = [DKArgument instanceMethodForSelector: marshallSelector];
+  genericUnmarshall = [DKArgument instanceMethodForSelector: unmarshallSelector];
+}
+
+/*
+ * Decides how the value for <var>arg</var> at <var>index</var> will be
+ * transferred. Only basic types handled by the generic DKArgument code are
+ * compiled into specialised ops. Conversions are only precomputed if they are
+ * valid in both directions, so that the type assertions of DKArgument still
+ * apply to everything else.
+ */
+static void
+DKMarshallingOpInit(DKMarshallingOp *op,
+  DKArgument *arg,
+  NSInteger index,
+  const char *invocationType,
+  BOOL doBox)
+{
+  const char *DBusObjCType = doBox ? @encode(id) : [arg unboxedObjCTypeChar];
+  BOOL isGeneric = ((genericMarshall == [arg methodForSelector: marshallSelector])
+    && (genericUnmarshall == [arg methodForSelector: unmarshallSelector]));
+
+  op->argument = arg;
+  op->index = index;
+  op->boxed = doBox;
+  op->DBusType = [arg DBusType];
+  op->invocationType = invocationType;
+  op->DBusObjCType = DBusObjCType;
+  op->unbox = [arg methodForSelector: unboxSelector];
+  op->box = [arg methodForSelector: boxSelector];
+  op->fixup = [arg methodForSelector: fixupSelector];
+
+  if ((NO == isGeneric) || [arg isContainerType]
+    || (NULL == invocationType) || (NULL == DBusObjCType)
+    || (NO == DKObjCTypeFitsIntoObjCType(invocationType, DBusObjCType))
+    || (NO == DKObjCTypeFitsIntoObjCType(DBusObjCType, invocationType)))
+  {
+    op->kind = DK_MARSHALLING_OP_ARGUMENT;
+  }
+  else if (doBox)
+  {
+    op->kind = DK_MARSHALLING_OP_BOX;
+  }
+  else if (0 == strcmp(invocationType, DBusObjCType))
+  {
+    op->kind = DK_MARSHALLING_OP_COPY;
+  }
+  else
+  {
+    op->kind = DK_MARSHALLING_OP_CONVERT;
+  }
+}
+
+DKMarshallingPlan*
+DKMarshallingPlanCreate(DKMethod *method,
+  NSArray *inArgs,
+  NSArray *outArgs,
+  NSMethodSignature *sig)
+{
+  NSUInteger count = [inArgs count];
+  NSUInteger outCount = [outArgs count];
+  NSUInteger index = 0;
+  NSInteger boxingState = 0;
+  DKMarshallingPlan *plan = NULL;
+
+  DKMarshallingPlanSetup();
+  if ((nil == sig) || (count != ([sig numberOfArguments] - 2)))
+  {
+    return NULL;
+  }
+  boxingState = [method boxingStateForReturnValueFromMethodSignature: sig];
+  if (DK_ARGUMENT_INVALID == boxingState)
+  {
+    return NULL;
+  }
+
+  plan = calloc(1, sizeof(DKMarshallingPlan) + (count * sizeof(DKMarshallingOp)));
+  if (NULL == plan)
+  {
+    return NULL;
+  }
+  plan->count = count;
+
+  if (0 == outCount)
+  {
+    plan->coversReturnValue = YES;
+    plan->returnValue.kind = DK_MARSHALLING_OP_NONE;
+  }
+  else if (1 == outCount)
+  {
+    plan->coversReturnValue = YES;
+    DKMarshallingOpInit(&plan->returnValue,
+      [outArgs objectAtIndex: 0],
+      -1,
+      [sig methodReturnType],
+      (BOOL)boxingState);
+  }
+
+  for (index = 0; index < count; index++)
+  {
+    boxingState = [method boxingStateForArgumentAtIndex: index
+                                    fromMethodSignature: sig];
+    if (DK_ARGUMENT_INVALID == boxingState)
+    {
+      free(plan);
+      return NULL;
+    }
+    // Add an offset to accommodate self and _cmd:
+    DKMarshallingOpInit(&plan->arguments[index],
+      [inArgs objectAtIndex: index],
+      (index + 2),
+      [sig getArgumentTypeAtIndex: (index + 2)],
+      (BOOL)boxingState);
+  }
+  return plan;
+}
+
+void
+DKMarshallingPlanFree(DKMarshallingPlan *plan)
+{
+  free(plan);
+}
+
+static inline void
+DKMarshallingOpGetValue(const DKMarshallingOp *op, NSInvocation *inv, void *buffer)
+{
+  if (-1 == op->index)
+  {
+    [inv getReturnValue: buffer];
+  }
+  else
+  {
+    [inv getArgument: buffer
+             atIndex: op->index];
+  }
+}
+
+static inline void
+DKMarshallingOpSetValue(const DKMarshallingOp *op, NSInvocation *inv, void *buffer)
+{
+  if (-1 == op->index)
+  {
+    [inv setReturnValue: buffer];
+  }
+  else
+  {
+    [inv setArgument: buffer
+             atIndex: op->index];
+  }
+}
+
+static void
+DKMarshallingOpMarshall(const DKMarshallingOp *op,
+  NSInvocation *inv,
+  DBusMessageIter *iter)
+{
+  // All basic types are guaranteed to fit into 64bit.
+  uint64_t buffer = 0;
+  switch (op->kind)
+  {
+    case DK_MARSHALLING_OP_NONE:
+      return;
+    case DK_MARSHALLING_OP_ARGUMENT:
+      [op->argument marshallArgumentAtIndex: op->index
+                             fromInvocation: inv
+                               intoIterator: iter
+                                     boxing: op->boxed];
+      return;
+    case DK_MARSHALLING_OP_BOX:
+    {
+      id value = nil;
+      DKMarshallingOpGetValue(op, inv, &value);
+      if (NO == ((DKUnboxIMP)op->unbox)(op->argument, unboxSelector, value,
+        (long long*)(void*)&buffer))
+      {
+        [NSException raise: @"DKArgumentUnboxingException"
+                    format: @"Could not unbox object '%@' into D-Bus format",
+          value];
+      }
+      break;
+    }
+    case DK_MARSHALLING_OP_CONVERT:
+      DKMarshallingOpGetValue(op, inv, &buffer);
+      ((DKFixupIMP)op->fixup)(op->argument, fixupSelector, &buffer,
+        op->invocationType, op->DBusObjCType);
+      break;
+    case DK_MARSHALLING_OP_COPY:
+      DKMarshallingOpGetValue(op, inv, &buffer);
+      break;
+  }
+  if (NO == (BOOL)dbus_message_iter_append_basic(iter, op->DBusType, (void*)&buffer))
+  {
+    [NSException raise: @"DKArgumentMarshallingException"
+                format: @"Out of memory when marshalling argument."];
+  }
+}
+
+static void
+DKMarshallingOpUnmarshall(const DKMarshallingOp *op,
+  DBusMessageIter *iter,
+  NSInvocation *inv)
+{
+  uint64_t buffer = 0;
+  int iterType = 0;
+  switch (op->kind)
+  {
+    case DK_MARSHALLING_OP_NONE:
+      return;
+    case DK_MARSHALLING_OP_ARGUMENT:
+      [op->argument unmarshallFromIterator: iter
+                            intoInvocation: inv
+                                   atIndex: op->index
+                                    boxing: op->boxed];
+      return;
+    default:
+      break;
+  }
+
+  iterType = dbus_message_iter_get_arg_type(iter);
+  NSCAssert3((iterType == op->DBusType),
+    @"Type mismatch between D-Bus message and introspection data. Got '%ld', expected '%ld' in method %@." ,
+      (long)iterType, (long)op->DBusType, [[op->argument parent] name]);
+  dbus_message_iter_get_basic(iter, (void*)&buffer);
+
+  if (DK_MARSHALLING_OP_BOX == op->kind)
+  {
+    id value = ((DKBoxIMP)op->box)(op->argument, boxSelector, (void*)&buffer);
+    DKMarshallingOpSetValue(op, inv, &value);
+    return;
+  }
+  if (DK_MARSHALLING_OP_CONVERT == op->kind)
+  {
+    ((DKFixupIMP)op->fixup)(op->argument, fixupSelector, &buffer,
+      op->DBusObjCType, op->invocationType);
+  }
+  DKMarshallingOpSetValue(op, inv, &buffer);
+}
+
+void
+DKMarshallingPlanMarshallArguments(DKMarshallingPlan *plan,
+  NSInvocation *inv,
+  DBusMessageIter *iter)
+{
+  const DKMarshallingOp *op = plan->arguments;
+  const DKMarshallingOp *end = op + plan->count;
+  while (op < end)
+  {
+    DKMarshallingOpMarshall(op++, inv, iter);
+  }
+}
+
+void
+DKMarshallingPlanUnmarshallArguments(DKMarshallingPlan *plan,
+  DBusMessageIter *iter,
+  NSInvocation *inv)
+{
+  const DKMarshallingOp *op = plan->arguments;
+  const DKMarshallingOp *end = op + plan->count;
+  while (op < end)
+  {
+    DKMarshallingOpUnmarshall(op++, iter, inv);
+    /*
+     * Proceed to the next value in the message, but raise an exception if
+     * we are missing some arguments.
+     */
+    if ((op < end) && (NO == (BOOL)dbus_message_iter_next(iter)))
+    {
+      [NSException raise: @"DKMethodUnmarshallingException"
+                  format: @"D-Bus message too short when unmarshalling arguments for invocation of '%@' on '%@'.",
+        NSStringFromSelector([inv selector]),
+        [inv target]];
+    }
+  }
+}
+
+BOOL
+DKMarshallingPlanMarshallReturnValue(DKMarshallingPlan *plan,
+  NSInvocation *inv,
+  DBusMessageIter *iter)
+{
+  if (NO == plan->coversReturnValue)
+  {
+    return NO;
+  }
+  DKMarshallingOpMarshall(&plan->returnValue, inv, iter);
+  return YES;
+}
+
+BOOL
+DKMarshallingPlanUnmarshallReturnValue(DKMarshallingPlan *plan,
+  DBusMessageIter *iter,
+  NSInvocation *inv)
+{
+  if (NO == plan->coversReturnValue)
+  {
+    return NO;
+  }
+  DKMarshallingOpUnmarshall(&plan->returnValue, iter, inv);
+  return YES;
+}
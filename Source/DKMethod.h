@@ -35,6 +35,7 @@
 #endif
 
 @class NSString, NSMutableArray,  NSMethodSignature, DKArgument;
+struct DKMarshallingPlan;
 
 enum
 {
@@ -52,6 +53,10 @@ enum
 {
   NSMutableArray *inArgs;
   NSMutableArray *outArgs;
+  NSMethodSignature *boxedSignature;
+  NSMethodSignature *unboxedSignature;
+  struct DKMarshallingPlan *boxedPlan;
+  struct DKMarshallingPlan *unboxedPlan;
 }
 
 /**
@@ -128,7 +133,8 @@ enum
  * boxed variant where every D-Bus type will be boxed by an equivalent class on
  * the Objective-C side. The other with minimal boxing (only variable/containar
  * types will be boxed) will return the plain C types corresponding to the D-Bus
- * types. If you want that variant. Pass NO for the doBox argument.
+ * types. If you want that variant. Pass NO for the doBox argument. Both
+ * signatures are only computed once.
  */
 - (NSMethodSignature*) methodSignatureBoxed: (BOOL)doBox;
 
@@ -154,6 +160,13 @@ enum
  */
 - (BOOL) isDeprecated;
 
+/**
+ * Returns the timeout (in seconds) that the
+ * <code>org.gnustep.dbuskit.method.timeout</code> annotation specifies for
+ * calls of the method, or 0 if there is none.
+ */
+- (NSTimeInterval) timeout;
+
 /**
  * Returns an Objective-C method declaration for the D-Bus method.
  */
@@ -179,6 +192,21 @@ enum
 - (void) unmarshallFromIterator: (DBusMessageIter*)iter
                  intoInvocation: (NSInvocation*)inv
    	            messageType: (int)type;
+
+/**
+ * Appends the objects in <var>args</var>, one for every in-direction argument
+ * of the method, to a method call message using the iterator. This is used
+ * when the arguments are not available as an invocation.
+ */
+- (void)marshallObjects: (const id*)args
+           intoIterator: (DBusMessageIter*)iter;
+
+/**
+ * Returns the boxed return value of a method return message at the iterator:
+ * nil if the method has no out-direction arguments, the object for a single
+ * one, and an array of the objects otherwise.
+ */
+- (id)unmarshalledReturnValueFromIterator: (DBusMessageIter*)iter;
 /**
  * Serializes the appropriate values from the invocation and appends them using
  * the message iterator. Use type to indicate whether this is done for an method
@@ -29,11 +29,13 @@
 #import <Foundation/NSMethodSignature.h>
 #import <Foundation/NSNull.h>
 #import <Foundation/NSString.h>
+#import <Foundation/NSUserDefaults.h>
 #import <Foundation/NSXMLNode.h>
 
 #import "DKArgument.h"
 #import "DKMethod.h"
 #import "DKBoxingUtils.h"
+#import "DKMarshallingPlan.h"
 
 #import "DKProxy+Private.h"
 
@@ -50,9 +52,22 @@
 #include <stdint.h>
 #include <string.h>
 
-
+/*
+ * Whether invocations are marshalled using precompiled plans. Enabled unless
+ * the DKMarshallingPlans user default is set to NO.
+ */
+static BOOL usesMarshallingPlans;
 
 @implementation DKMethod
++ (void)initialize
+{
+  if ([DKMethod class] == self)
+  {
+    NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+    usesMarshallingPlans = ((nil == [defaults objectForKey: @"DKMarshallingPlans"])
+      || [defaults boolForKey: @"DKMarshallingPlans"]);
+  }
+}
 
 
 + (id)methodWithObjCSelector: (SEL)theSel
@@ -336,7 +351,8 @@
 
 - (NSInteger)boxingStateForReturnValueFromMethodSignature: (NSMethodSignature*)aSignature
 {
-  const char* sigReturn = [aSignature methodReturnType];
+  // Ignore qualifiers such as oneway:
+  const char* sigReturn = objc_skip_type_qualifiers([aSignature methodReturnType]);
   BOOL boxedReturnMatch = (0 == strcmp(sigReturn, [self returnTypeBoxed: YES]));
   BOOL unboxedReturnMatch = NO;
   if (boxedReturnMatch)
@@ -438,7 +454,75 @@
 
 - (NSMethodSignature*) methodSignatureBoxed: (BOOL)doBox
 {
-  return [NSMethodSignature signatureWithObjCTypes: [self objCTypesBoxed: doBox]];
+  NSMethodSignature **slot = doBox ? &boxedSignature : &unboxedSignature;
+  NSMethodSignature *sig = *slot;
+  if (nil == sig)
+  {
+    sig = [[NSMethodSignature signatureWithObjCTypes: [self objCTypesBoxed: doBox]] retain];
+    // Another thread might have been faster, use its signature then.
+    if (NO == __sync_bool_compare_and_swap(slot, nil, sig))
+    {
+      [sig release];
+      sig = *slot;
+    }
+  }
+  return sig;
+}
+
+- (void)_invalidateMethodSignatures
+{
+  // The plans refer to the type strings of the signatures, free them first.
+  DKMarshallingPlanFree(boxedPlan);
+  boxedPlan = NULL;
+  DKMarshallingPlanFree(unboxedPlan);
+  unboxedPlan = NULL;
+  DESTROY(boxedSignature);
+  DESTROY(unboxedSignature);
+}
+
+/**
+ * Returns the marshalling plan for invocations with <var>sig</var>. Plans are
+ * only compiled for the memoized signatures of the receiver, which are the
+ * ones used by proxies. NULL is returned for any other signature and the
+ * arguments will marshall themselves.
+ */
+- (struct DKMarshallingPlan*)_marshallingPlanForSignature: (NSMethodSignature*)sig
+{
+  struct DKMarshallingPlan **slot = NULL;
+  DKMarshallingPlan *plan = NULL;
+  if ((NO == usesMarshallingPlans) || (nil == sig))
+  {
+    return NULL;
+  }
+  if (sig == boxedSignature)
+  {
+    slot = &boxedPlan;
+  }
+  else if (sig == unboxedSignature)
+  {
+    slot = &unboxedPlan;
+  }
+  else
+  {
+    return NULL;
+  }
+
+  plan = *slot;
+  if (NULL == plan)
+  {
+    plan = DKMarshallingPlanCreate(self, inArgs, outArgs, sig);
+    if (NULL == plan)
+    {
+      return NULL;
+    }
+    // Another thread might have been faster, use its plan then.
+    if (NO == __sync_bool_compare_and_swap(slot, NULL, plan))
+    {
+      DKMarshallingPlanFree(plan);
+      plan = *slot;
+    }
+  }
+  return plan;
 }
 
 - (NSMethodSignature*) methodSignature
@@ -481,10 +565,12 @@
   if ((direction == nil) || [direction isEqualToString: kDKArgumentDirectionIn])
   {
     [inArgs addObject: argument];
+    [self _invalidateMethodSignatures];
   }
   else if ([direction isEqualToString: kDKArgumentDirectionOut])
   {
     [outArgs addObject: argument];
+    [self _invalidateMethodSignatures];
   }
   else
   {
@@ -506,6 +592,11 @@
   return [[annotations valueForKey: @"org.freedesktop.DBus.Deprecated"] isEqualToString: @"true"];
 }
 
+- (NSTimeInterval) timeout
+{
+  return [[annotations valueForKey: @"org.gnustep.dbuskit.method.timeout"] doubleValue];
+}
+
 - (BOOL) isOneway
 {
   return [[annotations valueForKey: @"org.freedesktop.DBus.Method.NoReply"] isEqualToString: @"true"];
@@ -518,7 +609,16 @@
   NSUInteger numArgs = [outArgs count];
   NSMethodSignature *sig = [inv methodSignature];
   BOOL doBox = YES;
-  NSInteger boxingState = [self boxingStateForReturnValueFromMethodSignature: sig];
+  NSInteger boxingState = DK_ARGUMENT_INVALID;
+  DKMarshallingPlan *plan = [self _marshallingPlanForSignature: sig];
+
+  if ((NULL != plan)
+    && DKMarshallingPlanUnmarshallReturnValue(plan, iter, inv))
+  {
+    return;
+  }
+
+  boxingState = [self boxingStateForReturnValueFromMethodSignature: sig];
 
   // Make sure the return value is boxable
   NSAssert1((DK_ARGUMENT_INVALID != boxingState),
@@ -544,38 +644,56 @@
   }
   else
   {
-    NSMutableArray *returnValues = [NSMutableArray array];
-    NSUInteger index = 0;
-    NSNull *theNull = [NSNull null];
-    while (index < numArgs)
+    // We can only support objects here, so we always get the boxed values.
+    NSArray *returnValues = [self unmarshalledReturnValueFromIterator: iter];
+    [inv setReturnValue: &returnValues];
+  }
+
+}
+
+- (id)unmarshalledReturnValueFromIterator: (DBusMessageIter*)iter
+{
+  NSUInteger numArgs = [outArgs count];
+  NSMutableArray *returnValues = nil;
+  NSUInteger index = 0;
+  NSNull *theNull = [NSNull null];
+
+  if (0 == numArgs)
+  {
+    return nil;
+  }
+  else if (1 == numArgs)
+  {
+    return [[outArgs objectAtIndex: 0] unmarshalledObjectFromIterator: iter];
+  }
+
+  returnValues = [NSMutableArray array];
+  while (index < numArgs)
+  {
+    id object = [[outArgs objectAtIndex: index] unmarshalledObjectFromIterator: iter];
+
+    // Do not try to add nil objects
+    if (nil == object)
     {
-      // We can only support objects here, so we always get the boxed value
-      id object = [[outArgs objectAtIndex: index] unmarshalledObjectFromIterator: iter];
+      object = theNull;
+    }
+    [returnValues addObject: object];
 
-      // Do not try to add nil objects
-      if (nil == object)
-      {
-	object = theNull;
-      }
-      [returnValues addObject: object];
-
-      /*
-       * Proceed to the next value in the message, but raise an exception if
-       * we are missing some.
-       */
-      if ((NO == (BOOL)dbus_message_iter_next(iter))
-        && (numArgs > (index + 1)))
-      {
-        DKArgument *nextArg = [outArgs objectAtIndex: index + 1];
-        [NSException raise: @"DKMethodUnmarshallingException"
-                    format: @"D-Bus message too short when unmarshalling return value for '%@'. Expected value for argument %@ of type %c.",
-	  name, [nextArg name], [nextArg DBusType]];
-      }
-      index++;
+    /*
+     * Proceed to the next value in the message, but raise an exception if
+     * we are missing some.
+     */
+    if ((NO == (BOOL)dbus_message_iter_next(iter))
+      && (numArgs > (index + 1)))
+    {
+      DKArgument *nextArg = [outArgs objectAtIndex: index + 1];
+      [NSException raise: @"DKMethodUnmarshallingException"
+                  format: @"D-Bus message too short when unmarshalling return value for '%@'. Expected value for argument %@ of type %c.",
+        name, [nextArg name], [nextArg DBusType]];
     }
-    [inv setReturnValue: &returnValues];
+    index++;
   }
-
+  return returnValues;
 }
 
 - (void) marshallReturnValueFromInvocation: (NSInvocation*)inv
@@ -584,7 +702,16 @@
   NSUInteger numArgs = [outArgs count];
   NSMethodSignature *sig = [inv methodSignature];
   BOOL doBox = YES;
-  NSInteger boxingState = [self boxingStateForReturnValueFromMethodSignature: sig];
+  NSInteger boxingState = DK_ARGUMENT_INVALID;
+  DKMarshallingPlan *plan = [self _marshallingPlanForSignature: sig];
+
+  if ((NULL != plan)
+    && DKMarshallingPlanMarshallReturnValue(plan, inv, iter))
+  {
+    return;
+  }
+
+  boxingState = [self boxingStateForReturnValueFromMethodSignature: sig];
 
   // Make sure the return value is boxable
   NSAssert1(DK_ARGUMENT_INVALID != boxingState,
@@ -656,6 +783,14 @@
   // Arguments start at index 2 (i.e. after self and _cmd)
   NSUInteger index = 2;
   NSMethodSignature *sig = [inv methodSignature];
+  DKMarshallingPlan *plan = [self _marshallingPlanForSignature: sig];
+
+  if (NULL != plan)
+  {
+    DKMarshallingPlanUnmarshallArguments(plan, iter, inv);
+    return;
+  }
+
   while (index < (numArgs +2))
   {
     NSUInteger argIndex = index - 2;
@@ -694,6 +829,13 @@
   DKArgument *argument = nil;
   NSEnumerator *argEnum = [inArgs objectEnumerator];
   NSMethodSignature *sig = [inv methodSignature];
+  DKMarshallingPlan *plan = [self _marshallingPlanForSignature: sig];
+
+  if (NULL != plan)
+  {
+    DKMarshallingPlanMarshallArguments(plan, inv, iter);
+    return;
+  }
 
   NSAssert1(([inArgs count] == ([[inv methodSignature] numberOfArguments] -2)),
     @"Argument number mismatch when constructing D-Bus call for '%@'", name);
@@ -717,6 +859,18 @@
   }
 }
 
+- (void)marshallObjects: (const id*)args
+           intoIterator: (DBusMessageIter*)iter
+{
+  NSUInteger count = [inArgs count];
+  NSUInteger index = 0;
+  for (index = 0; index < count; index++)
+  {
+    [[inArgs objectAtIndex: index] marshallObject: args[index]
+                                     intoIterator: iter];
+  }
+}
+
 - (void) unmarshallFromIterator: (DBusMessageIter*)iter
                  intoInvocation: (NSInvocation*)inv
    	            messageType: (int)type
@@ -912,12 +1066,14 @@
 {
   ASSIGN(outArgs, newOut);
   [outArgs makeObjectsPerformSelector: @selector(setParent:) withObject: self];
+  [self _invalidateMethodSignatures];
 }
 
 - (void)setInArgs: (NSMutableArray*)newIn
 {
   ASSIGN(inArgs, newIn);
   [inArgs makeObjectsPerformSelector: @selector(setParent:) withObject: self];
+  [self _invalidateMethodSignatures];
 }
 
 - (id)copyWithZone: (NSZone*)zone
@@ -986,6 +1142,10 @@
 {
   [inArgs release];
   [outArgs release];
+  DKMarshallingPlanFree(boxedPlan);
+  DKMarshallingPlanFree(unboxedPlan);
+  [boxedSignature release];
+  [unboxedSignature release];
   [super dealloc];
 }
 @end
@@ -23,7 +23,8 @@
 
 #import "DKMessage.h"
 #import <Foundation/NSDate.h>
-@class DKMethod, DKProxy, NSInvocation;
+@class DKCallCompletion, DKCancellationToken, DKFuture, DKMethod,
+  DKMethodCallBatch, DKProxy, NSInvocation;
 
 /**
  * The DKMethodCall can be used to call methods on a remote object.
@@ -41,16 +42,64 @@
    */
    NSInvocation *invocation;
 
+  /**
+   * The return value (or the future standing in for it) of a call that was
+   * created without an invocation.
+   */
+   id returnObject;
+
   /**
    * The timeout for the call;
    */
    NSInteger timeout;
+
+  /**
+   * The future standing in for the return value of an asynchronous call.
+   */
+   DKFuture *future;
+
+  /**
+   * The pending call of a call that is sent as part of a batch.
+   */
+   DBusPendingCall *pendingCall;
+
+  /**
+   * The token that can be used to cancel the call.
+   */
+   DKCancellationToken *token;
+
+  /**
+   * The batch waiting for a call that is sent as part of a batch.
+   */
+   DKMethodCallBatch *batch;
+
+  /**
+   * Set if sending the call failed for lack of memory.
+   */
+   BOOL outOfMemory;
+
+  /**
+   * Set once the call has been cancelled.
+   */
+   BOOL cancelled;
 }
 
+/**
+ * Sends all method calls in <var>calls</var> and waits until all of them have
+ * completed. The calls are queued to their connections in one hop to the
+ * worker thread for each connection, so that they are in flight at the same
+ * time. Return values are stored in the invocations of the calls. Returns an
+ * array containing NSNull for every call that succeeded and the exception
+ * describing the failure for every call that failed.
+ */
++ (NSArray*)sendBatch: (NSArray*)calls;
+
 /**
  * Initializes the method call to be sent to the object represented by the
  * proxy. This involves serializing the arguments from the invocation into D-Bus
- * format, but does include sending the message.
+ * format, but does include sending the message. The call fails if no reply
+ * arrives within <var>interval</var> seconds. If <var>interval</var> is 0, the
+ * default timeout of libdbus is used.
  */
 - (id) initWithProxy: (DKProxy*)aProxy
               method: (DKMethod*)aMethod
@@ -68,13 +117,69 @@
           invocation: (NSInvocation*)anInvocation;
 
 /**
- * Sends the method call asynchronously via D-Bus. User code should retrieve
- * the DKPendingCall object corresponding to this method call in order to get
- * the return value.
- * FIXME: Not yet implemented
+ * Initializes the method call with the objects in <var>args</var> instead of
+ * an invocation, one for every in-direction argument of the method. This is
+ * only possible for methods whose arguments and return value are all objects.
+ * The return value is available from -returnValue once the call has been
+ * sent.
+ */
+- (id) initWithProxy: (DKProxy*)aProxy
+              method: (DKMethod*)aMethod
+           arguments: (const id*)args
+             timeout: (NSTimeInterval)interval;
+
+/**
+ * Returns the object returned by the call, or the future standing in for it
+ * if the call was sent asynchronously. Returns nil for methods that do not
+ * return objects.
+ */
+- (id)returnValue;
+
+/**
+ * Sends the method call asynchronously via D-Bus without waiting for the
+ * reply. The return value of the invocation is set to a DKFuture that will be
+ * resolved by the worker thread once the reply arrives. Calls that do not
+ * return objects, or that are made from within the worker thread or in
+ * synchronized mode, are sent synchronously.
  */
 - (void)sendAsynchronously;
 
+/**
+ * Sends the method call asynchronously via D-Bus and notifies
+ * <var>completion</var> when the reply arrives. This never waits for the reply,
+ * not even when called from the worker thread, except in synchronized mode.
+ * The method must return an object or void.
+ */
+- (void)sendAsynchronouslyWithCompletion: (DKCallCompletion*)completion;
+
+/**
+ * Returns whether the method returns an object and can thus be called
+ * asynchronously.
+ */
+- (BOOL)hasObjectReturn;
+
+/**
+ * Returns whether the method returns nothing.
+ */
+- (BOOL)hasVoidReturn;
+
+/**
+ * Sends the method call via D-Bus without expecting a reply. The message is
+ * flagged so that the remote side does not send one, and it is queued to the
+ * worker thread without waiting for it to be sent. Errors can therefore not be
+ * reported. The method must not return anything.
+ */
+- (void)sendWithoutReply;
+
+/**
+ * Abandons the call if it is still in flight. libdbus stops waiting for the
+ * reply, the message and the invocation are released, and whoever is waiting
+ * for the call is woken up with a <code>DKDBusCallCancelledException</code>.
+ * Does nothing if the call has already completed. Cancellation happens
+ * asynchronously on the worker thread.
+ */
+- (void)cancel;
+
 /**
  * Sends the method call via D-Bus and waits until it completes (i.e. the result
  * of the call is deserialized as the return value of the invocation.)
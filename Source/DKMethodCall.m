@@ -22,29 +22,291 @@
    */
 
 #import "DKMethodCall.h"
+#import "DKArgument.h"
 #import "DKProxy+Private.h"
 #import "DKEndpoint.h"
 #import "DKEndpointManager.h"
+#import "DKFuture.h"
 #import "DKMethod.h"
+#import "DBusKit/DKCancellationToken.h"
 
+#import <Foundation/NSArray.h>
+#import <Foundation/NSAutoreleasePool.h>
+#import <Foundation/NSCondition.h>
 #import <Foundation/NSDate.h>
 #import <Foundation/NSDictionary.h>
 #import <Foundation/NSException.h>
 #import <Foundation/NSInvocation.h>
+#import <Foundation/NSNull.h>
 #import <Foundation/NSRunLoop.h>
 #import <Foundation/NSString.h>
 #import <Foundation/NSThread.h>
 
 #import <GNUstepBase/NSDebug+GNUstepBase.h>
 
-#include <sched.h>
+#define INCLUDE_RUNTIME_H
+#include "config.h"
+#undef INCLUDE_RUNTIME_H
+
+/* GCC libobjc has the encodings stuff in runtime.h */
+#if HAVE_OBJC_ENCODING_H
+#include <objc/encoding.h>
+#endif
+
+#include <limits.h>
+#include <math.h>
 #include <string.h>
 
+@interface DKCancellationToken (DKMethodCall)
+- (BOOL)_addCall: (DKMethodCall*)call;
+- (void)_removeCall: (DKMethodCall*)call;
+@end
+
 @interface DKMethodCall (Private)
+- (id) _initWithProxy: (DKProxy*)aProxy
+               method: (DKMethod*)aMethod
+              timeout: (NSTimeInterval)aTimeout;
 - (BOOL) serialize;
+- (BOOL) _serializeObjects: (const id*)args;
+- (const char*) _returnType;
+- (void) _handleAsynchronousReplyFromPendingCall: (DBusPendingCall*)pending;
+- (void) _scheduleAsynchronousSend;
+- (BOOL) _sendInBatch: (DKMethodCallBatch*)aBatch;
+- (BOOL) _isCompletedInBatch;
+- (void) _finishBatchedCall;
+- (NSException*) _cancellationException;
+@end
+
+/*
+ * Helper class that sends a batch of calls and waits for their replies. The
+ * waiting thread sleeps on the condition, or, if it needs to keep its run loop
+ * running to receive the replies, in the run loop, which is woken up for each
+ * reply.
+ */
+@interface DKMethodCallBatch: NSObject
+{
+  NSArray *calls;
+  NSCondition *condition;
+  NSThread *runLoopThread;
+}
+- (id)initWithCalls: (NSArray*)someCalls;
+- (void)lock;
+- (void)unlock;
+- (BOOL)sendCalls: (NSArray*)someCalls;
+- (void)callCompleted;
+- (void)waitUntilCompleted;
+@end
+
+/*
+ * Called by libdbus on the worker thread once the reply to an asynchronous call
+ * has arrived (or the call timed out).
+ */
+static void
+DKMethodCallReplyNotify(DBusPendingCall *pending, void *data)
+{
+  NSAutoreleasePool *arp = [[NSAutoreleasePool alloc] init];
+  [(DKMethodCall*)data _handleAsynchronousReplyFromPendingCall: pending];
+  [arp release];
+}
+
+/*
+ * Called by libdbus on the worker thread once the reply to a call in a batch
+ * has arrived.
+ */
+static void
+DKMethodCallBatchNotify(DBusPendingCall *pending, void *data)
+{
+  [(DKMethodCallBatch*)data callCompleted];
+}
+
+static void
+DKMethodCallRelease(void *data)
+{
+  [(id)data release];
+}
+
+@implementation DKMethodCallBatch
+- (id)initWithCalls: (NSArray*)someCalls
+{
+  if (nil == (self = [super init]))
+  {
+    return nil;
+  }
+  ASSIGN(calls, someCalls);
+  condition = [[NSCondition alloc] init];
+  return self;
+}
+
+/**
+ * Protects the state of the calls in the batch, which is changed by the worker
+ * thread when a call is cancelled and by the waiting thread when it finishes
+ * the calls.
+ */
+- (void)lock
+{
+  [condition lock];
+}
+
+- (void)unlock
+{
+  [condition unlock];
+}
+
+/**
+ * Called on the worker thread to queue the calls to their connection.
+ */
+- (BOOL)sendCalls: (NSArray*)someCalls
+{
+  NSEnumerator *theEnum = [someCalls objectEnumerator];
+  DKMethodCall *call = nil;
+  while (nil != (call = [theEnum nextObject]))
+  {
+    [call _sendInBatch: self];
+  }
+  return YES;
+}
+
+- (void)_wakeUp: (id)ignored
+{
+  // Nothing to do, we only need the run loop to return.
+}
+
+- (void)callCompleted
+{
+  [condition lock];
+  [condition broadcast];
+  if ((nil != runLoopThread)
+    && (NO == [runLoopThread isEqual: [NSThread currentThread]]))
+  {
+    [self performSelector: @selector(_wakeUp:)
+                 onThread: runLoopThread
+               withObject: nil
+            waitUntilDone: NO
+                    modes: [NSArray arrayWithObject: NSDefaultRunLoopMode]];
+  }
+  [condition unlock];
+}
+
+- (BOOL)_isCompleted
+{
+  NSEnumerator *theEnum = [calls objectEnumerator];
+  DKMethodCall *call = nil;
+  while (nil != (call = [theEnum nextObject]))
+  {
+    if (NO == [call _isCompletedInBatch])
+    {
+      return NO;
+    }
+  }
+  return YES;
+}
+
+- (void)waitUntilCompleted
+{
+  DKEndpointManager *manager = [DKEndpointManager sharedEndpointManager];
+  NSThread *current = [NSThread currentThread];
+  // The worker thread and synchronized mode need the run loop to receive the
+  // replies.
+  BOOL useRunLoop = ([manager isSynchronizing]
+    || [manager isWorkerThread: current]);
+  [condition lock];
+  if (useRunLoop)
+  {
+    ASSIGN(runLoopThread, current);
+  }
+  while (NO == [self _isCompleted])
+  {
+    if (useRunLoop)
+    {
+      [condition unlock];
+      [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                               beforeDate: [NSDate distantFuture]];
+      [condition lock];
+    }
+    else
+    {
+      [condition wait];
+    }
+  }
+  DESTROY(runLoopThread);
+  /*
+   * The calls keep a reference to us until they are deallocated, so we drop
+   * ours to avoid a retain cycle.
+   */
+  DESTROY(calls);
+  [condition unlock];
+}
+
+- (void)dealloc
+{
+  [calls release];
+  [runLoopThread release];
+  [condition release];
+  [super dealloc];
+}
 @end
 
 @implementation DKMethodCall
++ (NSArray*)sendBatch: (NSArray*)calls
+{
+  DKEndpointManager *manager = [DKEndpointManager sharedEndpointManager];
+  DKMethodCallBatch *batch = [[DKMethodCallBatch alloc] initWithCalls: calls];
+  NSMutableArray *endpoints = [NSMutableArray array];
+  NSMutableArray *groups = [NSMutableArray array];
+  NSMutableArray *results = [NSMutableArray arrayWithCapacity: [calls count]];
+  NSNull *theNull = [NSNull null];
+  NSEnumerator *theEnum = [calls objectEnumerator];
+  DKMethodCall *call = nil;
+  NSUInteger count = 0;
+  NSUInteger i = 0;
+
+  // Group the calls by connection, so that each worker is only asked once.
+  while (nil != (call = [theEnum nextObject]))
+  {
+    DKEndpoint *ep = call->endpoint;
+    NSUInteger index = [endpoints indexOfObjectIdenticalTo: ep];
+    if (NSNotFound == index)
+    {
+      [endpoints addObject: ep];
+      [groups addObject: [NSMutableArray arrayWithObject: call]];
+    }
+    else
+    {
+      [[groups objectAtIndex: index] addObject: call];
+    }
+  }
+
+  count = [endpoints count];
+  for (i = 0; i < count; i++)
+  {
+    [manager boolReturnForPerformingSelector: @selector(sendCalls:)
+                                      target: batch
+                                        data: (void*)[groups objectAtIndex: i]
+                               waitForReturn: YES
+                                 forEndpoint: [endpoints objectAtIndex: i]];
+  }
+
+  [batch waitUntilCompleted];
+  [batch release];
+
+  // Unmarshall the replies on the calling thread.
+  theEnum = [calls objectEnumerator];
+  while (nil != (call = [theEnum nextObject]))
+  {
+    NS_DURING
+    {
+      [call _finishBatchedCall];
+      [results addObject: theNull];
+    }
+    NS_HANDLER
+    {
+      [results addObject: localException];
+    }
+    NS_ENDHANDLER
+  }
+  return results;
+}
+
 - (id) initWithProxy: (DKProxy*)aProxy
               method: (DKMethod*)aMethod
           invocation: (NSInvocation*)anInvocation
@@ -58,6 +320,52 @@
               method: (DKMethod*)aMethod
           invocation: (NSInvocation*)anInvocation
              timeout: (NSTimeInterval)aTimeout
+{
+  if (nil == anInvocation)
+  {
+    [self release];
+    return nil;
+  }
+  if (nil == (self = [self _initWithProxy: aProxy
+                                   method: aMethod
+                                  timeout: aTimeout]))
+  {
+    return nil;
+  }
+  ASSIGN(invocation,anInvocation);
+  if (NO == [self serialize])
+  {
+    [self release];
+    return nil;
+  }
+  return self;
+}
+
+- (id) initWithProxy: (DKProxy*)aProxy
+              method: (DKMethod*)aMethod
+           arguments: (const id*)args
+             timeout: (NSTimeInterval)aTimeout
+{
+  if (nil == (self = [self _initWithProxy: aProxy
+                                   method: aMethod
+                                  timeout: aTimeout]))
+  {
+    return nil;
+  }
+  if (NO == [self _serializeObjects: args])
+  {
+    [self release];
+    return nil;
+  }
+  return self;
+}
+
+/**
+ * Sets up the message for the call, without any arguments.
+ */
+- (id) _initWithProxy: (DKProxy*)aProxy
+               method: (DKMethod*)aMethod
+              timeout: (NSTimeInterval)aTimeout
 {
   DBusMessage *theMessage = NULL;
   DKEndpoint *theEndpoint = [aProxy _endpoint];
@@ -66,7 +374,7 @@
   const char* interface = [[aMethod interface] UTF8String];
   const char* methodName = [[aMethod name] UTF8String];
 
-  if (((nil == aProxy) || (nil == aMethod)) || (nil == anInvocation))
+  if ((nil == aProxy) || (nil == aMethod))
   {
     [self release];
     return nil;
@@ -96,24 +404,21 @@
 
   dbus_message_unref(theMessage);
 
-  ASSIGN(invocation,anInvocation);
   ASSIGN(method,aMethod);
-  if (0 == aTimeout)
+  ASSIGN(token, [DKProxy DBusCancellationToken]);
+  if (aTimeout <= 0)
   {
-    // Default timeout
+    // -1 means default timeout
     timeout = -1;
   }
-
-  /*
-   * Convert NSTimeInterval (seconds, floating point) into D-Bus representation
-   * (milliseconds, integer).
-   */
-  timeout = (NSInteger)(aTimeout * 1000.0);
-
-  if (NO == [self serialize])
+  else
   {
-    [self release];
-    return nil;
+    /*
+     * Convert NSTimeInterval (seconds, floating point) into D-Bus
+     * representation (milliseconds, integer). Round up so that short timeouts
+     * don't become zero.
+     */
+    timeout = (NSInteger)MIN(ceil(aTimeout * 1000.0), (double)INT_MAX);
   }
   return self;
 }
@@ -139,9 +444,65 @@
   NS_ENDHANDLER
   return didSucceed;
 }
+
+- (BOOL)_serializeObjects: (const id*)args
+{
+  BOOL didSucceed = YES;
+  DBusMessageIter iter;
+
+  dbus_message_iter_init_append(msg, &iter);
+  NS_DURING
+  {
+    [method marshallObjects: args
+               intoIterator: &iter];
+  }
+  NS_HANDLER
+  {
+    NSWarnMLog(@"Could not marshall arguments into D-Bus message. Exception raised: %@",
+      localException);
+    didSucceed = NO;
+  }
+  NS_ENDHANDLER
+  return didSucceed;
+}
+
+/**
+ * Returns the return type the caller expects, which is the boxed one if the
+ * call was created without an invocation.
+ */
+- (const char*)_returnType
+{
+  if (nil == invocation)
+  {
+    return [method returnTypeBoxed: YES];
+  }
+  return [[invocation methodSignature] methodReturnType];
+}
+
 - (BOOL)hasObjectReturn
 {
-  return  (0 == strcmp(@encode(id), [[invocation methodSignature] methodReturnType]));
+  return  (0 == strcmp(@encode(id),
+    objc_skip_type_qualifiers([self _returnType])));
+}
+
+- (BOOL)hasVoidReturn
+{
+  return  (0 == strcmp(@encode(void),
+    objc_skip_type_qualifiers([self _returnType])));
+}
+
+- (id)returnValue
+{
+  id result = nil;
+  if (nil == invocation)
+  {
+    return returnObject;
+  }
+  if ([self hasObjectReturn])
+  {
+    [invocation getReturnValue: &result];
+  }
+  return result;
 }
 
 - (void)handleReplyFromPendingCall: (DBusPendingCall*)pending
@@ -152,11 +513,12 @@
   DBusError error;
   NSException *errorException = nil;
   DBusMessageIter iter;
-  // This is the future we are going to use for asynchronous resolution.
-  id future = nil;
+  DBusMessage *previousMessage = NULL;
+  id object = nil;
 
   // Bad things would happen if we tried this
-  NSAssert(!(didAsyncOperation && (NO == [self hasObjectReturn])),
+  NSAssert(!(didAsyncOperation && (NO == [self hasObjectReturn])
+    && (NO == [self hasVoidReturn])),
     @"Filling asynchronous return values for non-objects is impossible.");
 
   if (NULL == reply)
@@ -171,6 +533,7 @@
   if (NO == ((msgType == DBUS_MESSAGE_TYPE_METHOD_RETURN)
     || (msgType == DBUS_MESSAGE_TYPE_ERROR)))
   {
+    dbus_message_unref(reply);
     [NSException raise: @"DKDBusMethodReplyException"
                 format: @"Invalid message type (%ld) in D-Bus reply", (long)msgType];
   }
@@ -214,10 +577,13 @@
                                                reason: @"Undefined error in D-Bus method reply"
                                              userInfo: nil];
     }
+    dbus_error_free(&error);
+    dbus_message_unref(reply);
       if (didAsyncOperation)
       {
-	// TODO: Pass the exception to the future. It will raise once user code
-	// tries to reference the object.
+	// The future will raise the exception once user code tries to reference
+	// the object.
+	[future resolveWithException: errorException];
 	return;
       }
       else
@@ -229,20 +595,24 @@
 
   // Implicit else if (type == DBUS_MESSAGE_TYPE_METHOD_RETURN)
 
-  if (YES == didAsyncOperation)
-  {
-    // Extract the future from the invocation, we need it for later use:
-    [invocation getReturnValue: &future];
-  }
-
 
   // We need to catch possible exceptions in order to pass them to the future if
   // we are operating asynchronously.
+  previousMessage = [DKArgument messageBeingUnmarshalled];
+  [DKArgument setMessageBeingUnmarshalled: reply];
   NS_DURING
   {
     // dbus_message_iter_init() will return NO if there are no arguments to
     // unmarshall.
-    if (YES == (BOOL)dbus_message_iter_init(reply, &iter))
+    if (NO == (BOOL)dbus_message_iter_init(reply, &iter))
+    {
+      // Nothing to unmarshall.
+    }
+    else if (nil == invocation)
+    {
+      object = [method unmarshalledReturnValueFromIterator: &iter];
+    }
+    else
     {
       [method unmarshallFromIterator: &iter
                       intoInvocation: invocation
@@ -254,20 +624,26 @@
     errorException = localException;
   }
   NS_ENDHANDLER
+  [DKArgument setMessageBeingUnmarshalled: previousMessage];
+  dbus_message_unref(reply);
 
   if (YES == didAsyncOperation)
   {
-    id realObject = nil;
+    id realObject = object;
     if (nil != errorException)
     {
-      //TODO: Pass the exception to the future.
+      [future resolveWithException: errorException];
+      return;
     }
 
     // Extract the real returned object from the invocation:
-    [invocation getReturnValue: &realObject];
+    if ((nil != invocation) && [self hasObjectReturn])
+    {
+      [invocation getReturnValue: &realObject];
+    }
 
-    // TODO: Pass the object to the future. Message sends to the future will no
-    // longer block.
+    // Message sends to the future will no longer block.
+    [future resolveWithObject: realObject];
   }
   else
   {
@@ -275,7 +651,10 @@
     {
       [errorException raise];
     }
-
+    if (nil == invocation)
+    {
+      ASSIGN(returnObject, object);
+    }
   }
 }
 
@@ -290,92 +669,411 @@
     timeout);
 
 }
-- (void)sendAsynchronously
+/**
+ * Helper method to send the message on the worker thread and have libdbus
+ * notify us about the reply. Balances the retain from -sendAsynchronously.
+ */
+- (BOOL)sendWithReplyNotification: (id)ignored
 {
-  // If the endpoint manager is in synchronizing mode, we don't bother doing an
-  // asynchronous call.
-  if (([[DKEndpointManager sharedEndpointManager] isSynchronizing])
-    || ([[NSThread currentThread] isEqual: [[DKEndpointManager sharedEndpointManager] workerThread]]))
+  NSException *failure = nil;
+  if (NO == [token _addCall: self])
   {
-    [self sendSynchronously];
+    cancelled = YES;
+    failure = [self _cancellationException];
   }
-  //TODO: Implement asynchronous behaviour.
+  else if (NO == [self sendWithPendingCallAt: &pendingCall])
+  {
+    failure = [NSException exceptionWithName: @"DKDBusOutOfMemoryException"
+                                      reason: @"Out of memory when sending D-Bus message."
+                                    userInfo: nil];
+  }
+  else if (NULL == pendingCall)
+  {
+    failure = [NSException exceptionWithName: @"DKDBusDisconnectedException"
+                                      reason: @"Disconnected from D-Bus when sending message."
+                                    userInfo: nil];
+  }
+  else if (NO == (BOOL)dbus_pending_call_set_notify(pendingCall,
+    DKMethodCallReplyNotify,
+    (void*)[self retain],
+    DKMethodCallRelease))
+  {
+    [self release];
+    dbus_pending_call_cancel(pendingCall);
+    dbus_pending_call_unref(pendingCall);
+    pendingCall = NULL;
+    failure = [NSException exceptionWithName: @"DKDBusOutOfMemoryException"
+                                      reason: @"Out of memory when sending D-Bus message."
+                                    userInfo: nil];
+  }
+  else if ((BOOL)dbus_pending_call_get_completed(pendingCall))
+  {
+    // The reply might have been processed before we installed the callback.
+    [self _handleAsynchronousReplyFromPendingCall: pendingCall];
+  }
+  /*
+   * Otherwise, we keep the pending call so that it can be cancelled. The
+   * notification keeps us alive until the reply has been handled.
+   */
+
+  if (nil != failure)
+  {
+    [token _removeCall: self];
+    [future resolveWithException: failure];
+  }
+  [self release];
+  return (nil == failure);
 }
 
-- (void)sendSynchronously
+- (BOOL)_sendInBatch: (DKMethodCallBatch*)aBatch
+{
+  if (NO == [token _addCall: self])
+  {
+    cancelled = YES;
+    return NO;
+  }
+  if (NO == [self sendWithPendingCallAt: &pendingCall])
+  {
+    outOfMemory = YES;
+    return NO;
+  }
+  if (NULL == pendingCall)
+  {
+    return NO;
+  }
+  if (NO == (BOOL)dbus_pending_call_set_notify(pendingCall,
+    DKMethodCallBatchNotify,
+    (void*)[aBatch retain],
+    DKMethodCallRelease))
+  {
+    [aBatch release];
+    dbus_pending_call_cancel(pendingCall);
+    dbus_pending_call_unref(pendingCall);
+    pendingCall = NULL;
+    outOfMemory = YES;
+    return NO;
+  }
+  // Needed to wake up the waiting thread if the call is cancelled.
+  ASSIGN(batch, aBatch);
+  return YES;
+}
+
+/**
+ * Called by the waiting thread with the lock of the batch held.
+ */
+- (BOOL)_isCompletedInBatch
+{
+  // Calls that could not be sent or were cancelled don't need to be waited
+  // for.
+  return (cancelled || (NULL == pendingCall)
+    || (BOOL)dbus_pending_call_get_completed(pendingCall));
+}
+
+- (void)_finishBatchedCall
 {
   DBusPendingCall *pending = NULL;
-  // -1 means default timeout
-  BOOL couldSend = NO;
-  NSInteger count = 0;
-  DKEndpointManager *manager = [DKEndpointManager sharedEndpointManager];
-  IMP isSynchronizing = [manager methodForSelector: @selector(isSynchronizing)];
-  couldSend = [manager boolReturnForPerformingSelector: @selector(sendWithPendingCallAt:)
-                                                target: self
-                                                  data: (void*)&pending
-                                         waitForReturn: YES];
-  if (NO == couldSend)
+  DBusMessage *theMessage = NULL;
+  BOOL wasCancelled = NO;
+
+  // The call might be cancelled on the worker thread at the same time.
+  [batch lock];
+  pending = pendingCall;
+  pendingCall = NULL;
+  theMessage = msg;
+  msg = NULL;
+  wasCancelled = cancelled;
+  [batch unlock];
+
+  [token _removeCall: self];
+  if (NULL != theMessage)
+  {
+    dbus_message_unref(theMessage);
+  }
+  if (wasCancelled)
+  {
+    if (NULL != pending)
+    {
+      dbus_pending_call_unref(pending);
+    }
+    [[self _cancellationException] raise];
+  }
+  if (outOfMemory)
   {
     [NSException raise: @"DKDBusOutOfMemoryException"
                 format: @"Out of memory when sending D-Bus message."];
-
   }
-
   if (NULL == pending)
   {
     [NSException raise: @"DKDBusDisconnectedException"
                 format: @"Disconnected from D-Bus when sending message."];
-
   }
+  NS_DURING
+  {
+    [self handleReplyFromPendingCall: pending
+                               async: NO];
+  }
+  NS_HANDLER
+  {
+    dbus_pending_call_unref(pending);
+    [localException raise];
+  }
+  NS_ENDHANDLER
+  dbus_pending_call_unref(pending);
+}
 
-  do
+- (void)_handleAsynchronousReplyFromPendingCall: (DBusPendingCall*)pending
+{
+  if (cancelled || [future isResolved])
+  {
+    return;
+  }
+  [token _removeCall: self];
+  // Now we are sure that we don't need the message any more.
+  if (NULL != msg)
+  {
+    dbus_message_unref(msg);
+    msg = NULL;
+  }
+  NS_DURING
+  {
+    [self handleReplyFromPendingCall: pending
+                               async: YES];
+  }
+  NS_HANDLER
+  {
+    [future resolveWithException: localException];
+  }
+  NS_ENDHANDLER
+  /*
+   * Dropping our reference releases the notification data, but libdbus keeps
+   * the pending call alive while it is notifying us.
+   */
+  if (NULL != pendingCall)
   {
-    // Determine wether the manager is in synchronized mode and we need to use
-    // the runloop.
-    BOOL useCurrentRunLoop = ((BOOL)(uintptr_t)isSynchronizing(manager, @selector(isSynchronizing))
-    || ([[NSThread currentThread] isEqual: [manager workerThread]]));
+    dbus_pending_call_unref(pendingCall);
+    pendingCall = NULL;
+  }
+}
+
+- (NSException*)_cancellationException
+{
+  return [NSException exceptionWithName: @"DKDBusCallCancelledException"
+                                 reason: @"The D-Bus method call was cancelled."
+                               userInfo: nil];
+}
 
-    // If we are using the worker thread, we can yield aggressively until the
-    // call completes.
-    if (((++count % 16) == 0)
-      && (NO == useCurrentRunLoop))
+/**
+ * Helper method to cancel the call on the worker thread, which is the only
+ * thread touching the pending call of an asynchronous call while it is in
+ * flight. Calls in a batch are finished by the waiting thread, so they are
+ * cancelled with the lock of the batch held. Balances the retain from -cancel.
+ */
+- (BOOL)_cancelOnWorkerThread: (id)ignored
+{
+  BOOL didCancel = NO;
+  if (nil != future)
+  {
+    if ((NO == cancelled) && (NULL != pendingCall)
+      && (NO == (BOOL)dbus_pending_call_get_completed(pendingCall))
+      && (NO == [future isResolved]))
     {
-      sched_yield();
+      // After this, libdbus will neither wait for the reply nor notify us.
+      dbus_pending_call_cancel(pendingCall);
+      if (NULL != msg)
+      {
+        dbus_message_unref(msg);
+        msg = NULL;
+      }
+      DESTROY(invocation);
+      [token _removeCall: self];
+      // This releases the notification data, but we are still retained.
+      dbus_pending_call_unref(pendingCall);
+      pendingCall = NULL;
+      cancelled = YES;
+      [future resolveWithException: [self _cancellationException]];
+      didCancel = YES;
     }
-    else if (useCurrentRunLoop)
+  }
+  else if (nil != batch)
+  {
+    [batch lock];
+    if ((NO == cancelled) && (NULL != pendingCall)
+      && (NO == (BOOL)dbus_pending_call_get_completed(pendingCall)))
     {
-      // Otherwise, we need to the runloop to complete our request.
-      [[NSRunLoop currentRunLoop] runUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+      // The waiting thread will release the pending call.
+      dbus_pending_call_cancel(pendingCall);
+      if (NULL != msg)
+      {
+        dbus_message_unref(msg);
+        msg = NULL;
+      }
+      cancelled = YES;
+      didCancel = YES;
     }
-  } while (NO == (BOOL)dbus_pending_call_get_completed(pending));
+    [batch unlock];
+    if (didCancel)
+    {
+      [token _removeCall: self];
+      [batch callCompleted];
+    }
+  }
+  [self release];
+  return didCancel;
+}
 
-  //Now we are sure that we don't need the message any more.
-  if (NULL != msg)
+- (void)cancel
+{
+  // Retained until the worker has cancelled the call.
+  [self retain];
+  if (NO == [[DKEndpointManager sharedEndpointManager] boolReturnForPerformingSelector: @selector(_cancelOnWorkerThread:)
+                                                                                 target: self
+                                                                                   data: NULL
+                                                                          waitForReturn: NO
+                                                                            forEndpoint: endpoint])
   {
-    dbus_message_unref(msg);
-    msg = NULL;
+    NSWarnMLog(@"Could not schedule cancellation of D-Bus method call.");
+    [self release];
   }
+}
 
-  NS_DURING
+- (void)sendAsynchronously
+{
+  id returnValue = nil;
+  // If the endpoint manager is in synchronizing mode, we don't bother doing an
+  // asynchronous call. Neither can we wait for a future in the worker thread,
+  // or pass any other return value than an object.
+  if ([[DKEndpointManager sharedEndpointManager] isSynchronizing]
+    || DKInWorkerThreadForEndpoint(endpoint)
+    || (NO == [self hasObjectReturn]))
   {
-    [self handleReplyFromPendingCall: pending
-                               async: NO];
+    [self sendSynchronously];
+    return;
   }
-  NS_HANDLER
+
+  future = [[DKFuture alloc] init];
+  // The caller receives the future autoreleased, we keep our own reference.
+  returnValue = [[future retain] autorelease];
+  if (nil == invocation)
   {
-    // Throw away the pending call
-    if (NULL != pending)
+    // The worker thread never touches this, so the caller can read it.
+    ASSIGN(returnObject, future);
+  }
+  else
+  {
+    [invocation setReturnValue: &returnValue];
+  }
+  [self _scheduleAsynchronousSend];
+}
+
+- (void)sendAsynchronouslyWithCompletion: (DKCallCompletion*)completion
+{
+  NSAssert(([self hasObjectReturn] || [self hasVoidReturn]),
+    @"Completions can only be used for methods returning objects or void.");
+  // In synchronized mode, we complete the call right away.
+  if ([[DKEndpointManager sharedEndpointManager] isSynchronizing])
+  {
+    id result = nil;
+    NSException *failure = nil;
+    NS_DURING
     {
-      dbus_pending_call_unref(pending);
-      pending = NULL;
+      [self sendSynchronously];
+      result = [self returnValue];
     }
-    [localException raise];
+    NS_HANDLER
+    {
+      failure = localException;
+    }
+    NS_ENDHANDLER
+    [completion completeWithObject: result
+                         exception: failure];
+    return;
   }
-  NS_ENDHANDLER
-  if (NULL != pending)
+
+  // The future is only used internally to pass on the reply.
+  future = [[DKFuture alloc] init];
+  [future setCompletion: completion];
+  [self _scheduleAsynchronousSend];
+}
+
+- (void)_scheduleAsynchronousSend
+{
+  DKEndpointManager *manager = [DKEndpointManager sharedEndpointManager];
+  // Retained until the worker has sent the message.
+  [self retain];
+  if (NO == [manager boolReturnForPerformingSelector: @selector(sendWithReplyNotification:)
+                                              target: self
+                                                data: NULL
+                                       waitForReturn: NO
+                                         forEndpoint: endpoint])
   {
-    dbus_pending_call_unref(pending);
-    pending = NULL;
+    [future resolveWithException: [NSException exceptionWithName: @"DKDBusOutOfMemoryException"
+                                                          reason: @"Could not schedule sending of D-Bus message."
+                                                        userInfo: nil]];
+    [self release];
+  }
+}
+
+/**
+ * Helper method to send a message without reply on the worker thread.
+ * Balances the retain from -sendWithoutReply.
+ */
+- (BOOL)sendWithoutReplyOnWorkerThread: (id)ignored
+{
+  BOOL couldSend = (BOOL)dbus_connection_send([endpoint DBusConnection],
+    msg,
+    NULL);
+  if (NO == couldSend)
+  {
+    NSWarnMLog(@"Out of memory when sending D-Bus message for %@.",
+      [method name]);
+  }
+  [self release];
+  return couldSend;
+}
+
+- (void)sendWithoutReply
+{
+  NSAssert([self hasVoidReturn],
+    @"Only methods without return values can be called without reply.");
+  dbus_message_set_no_reply(msg, TRUE);
+
+  // Retained until the worker has sent the message.
+  [self retain];
+  if (NO == [[DKEndpointManager sharedEndpointManager] boolReturnForPerformingSelector: @selector(sendWithoutReplyOnWorkerThread:)
+                                                                                 target: self
+                                                                                   data: NULL
+                                                                          waitForReturn: NO
+                                                                            forEndpoint: endpoint])
+  {
+    NSWarnMLog(@"Could not schedule sending of D-Bus message for %@.",
+      [method name]);
+    [self release];
+  }
+}
+
+- (void)sendSynchronously
+{
+  // A single call is a batch, too. The reply wakes us up, so we don't need to
+  // poll for it.
+  id result = [[DKMethodCall sendBatch: [NSArray arrayWithObject: self]] objectAtIndex: 0];
+  if ([NSNull null] != result)
+  {
+    [(NSException*)result raise];
+  }
+}
+
+- (void)dealloc
+{
+  if (NULL != pendingCall)
+  {
+    dbus_pending_call_unref(pendingCall);
   }
+  [invocation release];
+  [returnObject release];
+  [method release];
+  [future release];
+  [token release];
+  [batch release];
+  [super dealloc];
 }
 @end
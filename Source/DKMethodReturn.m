@@ -22,6 +22,7 @@
    Boston, MA 02111 USA.
    */
 
+#import "DKArgument.h"
 #import "DKMethod.h"
 #import "DKMethodReturn.h"
 #import "DKObjectPathNode.h"
@@ -39,8 +40,10 @@
 {
 
   DBusMessageIter iter;
+  DBusMessage *previousMessage = [DKArgument messageBeingUnmarshalled];
   dbus_message_iter_init(original, &iter);
   NSDebugMLog(@"Deserializing arguments from method call");
+  [DKArgument setMessageBeingUnmarshalled: original];
   NS_DURING
   {
     [method unmarshallFromIterator: &iter
@@ -49,10 +52,12 @@
   }
   NS_HANDLER
   {
+    [DKArgument setMessageBeingUnmarshalled: previousMessage];
     NSWarnMLog(@"Could not unmarshall arguments from D-Bus message. Exception raised: %@", localException);
     [localException raise];
   }
   NS_ENDHANDLER
+  [DKArgument setMessageBeingUnmarshalled: previousMessage];
 }
 
 - (id) initAsReplyToDBusMessage: (DBusMessage*)aMsg
@@ -161,13 +166,15 @@
     msg = error;
   }
   NS_ENDHANDLER
-  // DBusKit rule #1 is that all interaction with libdbus happens from one
-  // thread, so we go via the endpoint manager to schedule sending the reply or
-  // error out. The superclass logic is sufficient for us in this case.
+  // DBusKit rule #1 is that all interaction with a libdbus connection happens
+  // from one thread, so we go via the endpoint manager to schedule sending the
+  // reply or error out on the worker of the endpoint. The superclass logic is
+  // sufficient for us in this case.
   [[DKEndpointManager sharedEndpointManager] boolReturnForPerformingSelector: @selector(send:)
     target: self
     data: NULL
-    waitForReturn: NO];
+    waitForReturn: NO
+    forEndpoint: endpoint];
 }
 
 
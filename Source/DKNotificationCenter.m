@@ -24,6 +24,7 @@
 #import "DBusKit/DKPort.h"
 #import "DKArgument.h"
 #import "DKInterface.h"
+#import "DKInternedStrings.h"
 #import "DKSignal.h"
 #import "DKSignalEmission.h"
 #import "DKProxy+Private.h"
@@ -255,6 +256,19 @@
   }
   if (nil != value)
   {
+    /*
+     * Interning the value allows matching header values by pointer. We only do
+     * that for the keys whose values come from a small set. Unique names and
+     * object paths would just fill the table of interned strings.
+     */
+    if (([value isKindOfClass: [NSString class]])
+      && (([key isEqualToString: @"interface"])
+      || ([key isEqualToString: @"member"])
+      || (([key isEqualToString: @"destination"])
+      && (NO == [value hasPrefix: @":"]))))
+    {
+      value = DKInternedStringForString(value);
+    }
     [rules setObject: value
               forKey: key];
   }
@@ -489,7 +503,8 @@
       }
 
       // Complete matches only
-      if (NO == [thisRule isEqualToString: (NSString*)thisValue])
+      if ((thisRule != thisValue)
+        && (NO == [thisRule isEqualToString: (NSString*)thisValue]))
       {
 	return NO;
       }
@@ -1831,13 +1846,27 @@ static DKEndpointManager *manager;
   NSString *destination = nil;
   const char *signature = dbus_message_get_signature(msg);
   id theNull = [NSNull null];
+  DBusMessage *previousMessage = [DKArgument messageBeingUnmarshalled];
 
   // We cannot add nil to the userInfo, so we replace empty things with NSNull
-  signal = (NULL != cSignal) ? [NSString stringWithUTF8String: cSignal] : theNull;
-  interface = (NULL != cInterface) ? [NSString stringWithUTF8String: cInterface] : theNull;
+  // Interfaces, members and well-known names are interned because the same
+  // ones arrive over and over. Unique names and paths are not.
+  signal = (NULL != cSignal) ? DKInternedString(cSignal) : theNull;
+  interface = (NULL != cInterface) ? DKInternedString(cInterface) : theNull;
   sender = (NULL != cSender) ? [NSString stringWithUTF8String: cSender] : theNull;
   path = (NULL != cPath) ? [NSString stringWithUTF8String: cPath]: theNull;
-  destination = (NULL != cDestination) ? [NSString stringWithUTF8String: cDestination] : theNull;
+  if (NULL == cDestination)
+  {
+    destination = theNull;
+  }
+  else if (':' == cDestination[0])
+  {
+    destination = [NSString stringWithUTF8String: cDestination];
+  }
+  else
+  {
+    destination = DKInternedString(cDestination);
+  }
 
 
   [lock lock];
@@ -1896,7 +1925,9 @@ static DKEndpointManager *manager;
     }
 
     dbus_message_iter_init(msg, &iter);
+    [DKArgument setMessageBeingUnmarshalled: msg];
     [userInfo addEntriesFromDictionary: [theSignal userInfoFromIterator: &iter]];
+    [DKArgument setMessageBeingUnmarshalled: previousMessage];
 
     matchingObservables = [self _observablesMatchingUserInfo: userInfo];
     if (nil == matchingObservables)
@@ -1918,6 +1949,7 @@ static DKEndpointManager *manager;
   }
   NS_HANDLER
   {
+    [DKArgument setMessageBeingUnmarshalled: previousMessage];
     [lock unlock];
     [localException raise];
   }
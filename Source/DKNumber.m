@@ -25,13 +25,13 @@
 #import "DKNumberTemplate.h"
 #import <inttypes.h>
 
-DK_NUMBER_IMPLEMENTATION(int8_t, Int8, signed char, charValue, @"%i")
-DK_NUMBER_IMPLEMENTATION(uint8_t, UInt8, unsigned char, unsignedChar, @"%u")
-DK_NUMBER_IMPLEMENTATION(int16_t, Int16, short, shortValue, @"%i")
-DK_NUMBER_IMPLEMENTATION(uint16_t, UInt16, unsigned short, unsignedShortValue, @"%u")
-DK_NUMBER_IMPLEMENTATION(int32_t, Int32, int, intValue, @"%d")
-DK_NUMBER_IMPLEMENTATION(uint32_t, UInt32, unsigned int, unsignedIntValue, @"%u")
-DK_NUMBER_IMPLEMENTATION(int64_t, Int64, long long, longLongValue, @"%"PRIi64)
-DK_NUMBER_IMPLEMENTATION(uint64_t, UInt64, unsigned long long, unsignedLongLongValue, @"%"PRIu64)
+DK_CACHED_NUMBER_IMPLEMENTATION(int8_t, Int8, signed char, charValue, @"%i")
+DK_CACHED_NUMBER_IMPLEMENTATION(uint8_t, UInt8, unsigned char, unsignedChar, @"%u")
+DK_CACHED_NUMBER_IMPLEMENTATION(int16_t, Int16, short, shortValue, @"%i")
+DK_CACHED_NUMBER_IMPLEMENTATION(uint16_t, UInt16, unsigned short, unsignedShortValue, @"%u")
+DK_CACHED_NUMBER_IMPLEMENTATION(int32_t, Int32, int, intValue, @"%d")
+DK_CACHED_NUMBER_IMPLEMENTATION(uint32_t, UInt32, unsigned int, unsignedIntValue, @"%u")
+DK_CACHED_NUMBER_IMPLEMENTATION(int64_t, Int64, long long, longLongValue, @"%"PRIi64)
+DK_CACHED_NUMBER_IMPLEMENTATION(uint64_t, UInt64, unsigned long long, unsignedLongLongValue, @"%"PRIu64)
 DK_NUMBER_IMPLEMENTATION(float, Float, float, floatValue, @"%0.7g")
 DK_NUMBER_IMPLEMENTATION(double, Double, double, doubleValue, @"%0.16g")
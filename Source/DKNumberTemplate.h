@@ -21,13 +21,52 @@
    Boston, MA 02111 USA.
    */
 
+/*
+ * Booleans and small integers are boxed very frequently (e.g. in property
+ * dictionaries), so we keep shared instances for the values in the following
+ * range around. This covers all values of D-Bus bytes and booleans.
+ */
+#define DK_NUMBER_CACHE_MIN (-128)
+#define DK_NUMBER_CACHE_MAX 255
+#define DK_NUMBER_CACHE_SIZE (DK_NUMBER_CACHE_MAX - DK_NUMBER_CACHE_MIN + 1)
 
-#define DK_NUMBER_IMPLEMENTATION(type, capitalized, numberType, numberMethod, format) \
-@implementation DK ## capitalized ## Number \
-+ (id)numberWith ## capitalized: (type)num \
-{\
-  return [[[DK ## capitalized ## Number alloc] initWith ## capitalized: num] autorelease]; \
-}\
+/*
+ * Checks whether an integer falls into the cached range. Comparing against
+ * zero first keeps the comparisons correct for unsigned types.
+ */
+#define DK_NUMBER_IS_CACHEABLE(num) \
+  (((num) >= 0) ? ((num) <= DK_NUMBER_CACHE_MAX) : ((num) >= DK_NUMBER_CACHE_MIN))
+
+/*
+ * Returns the number cached for <var>num</var> in <var>cache</var>, or nil if
+ * it has not been created yet.
+ */
+static inline id
+DKNumberCacheGet(id *cache, long long num)
+{
+  return __atomic_load_n(&cache[num - DK_NUMBER_CACHE_MIN], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Stores <var>number</var> in the slot for <var>num</var> unless another
+ * thread was faster and returns the cached object. Cached numbers are never
+ * released. On runtimes supporting small objects, many of them will be tagged
+ * pointers for which retaining and caching is free.
+ */
+static inline id
+DKNumberCacheInsert(id *cache, long long num, id number)
+{
+  id *slot = &cache[num - DK_NUMBER_CACHE_MIN];
+  [number retain];
+  if (NO == __sync_bool_compare_and_swap(slot, nil, number))
+  {
+    [number release];
+    number = *slot;
+  }
+  return number;
+}
+
+#define DK_NUMBER_METHODS(type, capitalized, numberType, numberMethod, format) \
 - (id)initWith ## capitalized: (type)num\
 {\
   value = num;\
@@ -57,5 +96,38 @@
 {\
   type *ptr = buffer;\
   *ptr = value;\
+}
+
+#define DK_NUMBER_IMPLEMENTATION(type, capitalized, numberType, numberMethod, format) \
+@implementation DK ## capitalized ## Number \
++ (id)numberWith ## capitalized: (type)num \
+{\
+  return [[[DK ## capitalized ## Number alloc] initWith ## capitalized: num] autorelease]; \
+}\
+DK_NUMBER_METHODS(type, capitalized, numberType, numberMethod, format)\
+@end
+
+/*
+ * Like DK_NUMBER_IMPLEMENTATION, but for integer types, where values in the
+ * cached range are boxed into shared instances.
+ */
+#define DK_CACHED_NUMBER_IMPLEMENTATION(type, capitalized, numberType, numberMethod, format) \
+static id DK ## capitalized ## NumberCache[DK_NUMBER_CACHE_SIZE];\
+@implementation DK ## capitalized ## Number \
++ (id)numberWith ## capitalized: (type)num \
+{\
+  id number = nil;\
+  if (DK_NUMBER_IS_CACHEABLE(num))\
+  {\
+    number = DKNumberCacheGet(DK ## capitalized ## NumberCache, (long long)num);\
+    if (nil == number)\
+    {\
+      number = DKNumberCacheInsert(DK ## capitalized ## NumberCache, (long long)num,\
+        [[[DK ## capitalized ## Number alloc] initWith ## capitalized: num] autorelease]);\
+    }\
+    return number;\
+  }\
+  return [[[DK ## capitalized ## Number alloc] initWith ## capitalized: num] autorelease]; \
 }\
+DK_NUMBER_METHODS(type, capitalized, numberType, numberMethod, format)\
 @end
@@ -27,6 +27,7 @@
 #import "DKMethod.h"
 #import "DKMethodReturn.h"
 #import "DKIntrospectionParserDelegate.h"
+#import "DKInternedStrings.h"
 
 #import <Foundation/NSData.h>
 #import <Foundation/NSLock.h>
@@ -312,14 +313,14 @@
   }
   const char *iface = dbus_message_get_interface(message);
   const char *mthod = dbus_message_get_member(message);
-  DKInterface *interface = [[self _interfaces] objectForKey: [NSString stringWithUTF8String: iface]];
+  DKInterface *interface = [[self _interfaces] objectForKey: DKInternedString(iface)];
   if (interface == nil)
   {
     NSDebugMLog(@"%@ doesn't know how to handle interface '%s' (method: %s)", object, iface, mthod);
     return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
   }
 
-  DKMethod *method = [[interface methods] objectForKey: [NSString stringWithUTF8String: mthod]];
+  DKMethod *method = [[interface methods] objectForKey: DKInternedString(mthod)];
 
   if (method == nil)
   {
@@ -0,0 +1,164 @@
+/** Implementation of the DKPackedArray class holding packed numeric D-Bus arrays.
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+   */
+
+#import "DBusKit/DKPackedArray.h"
+
+#import <Foundation/NSData.h>
+#import <Foundation/NSException.h>
+#import <Foundation/NSValue.h>
+
+#include <string.h>
+
+/*
+ * Returns a type string that stays valid for the lifetime of the array, or NULL
+ * if the type is not supported.
+ */
+static const char*
+DKPackedArrayCanonicalType(const char *type)
+{
+  if (NULL == type)
+  {
+    return NULL;
+  }
+  switch (*type)
+  {
+#   define DK_PACKED_TYPE(typeName, cType) \
+    case _C_ ## typeName: \
+      return @encode(cType);
+    DK_PACKED_TYPE(CHR, char)
+    DK_PACKED_TYPE(UCHR, unsigned char)
+    DK_PACKED_TYPE(SHT, short)
+    DK_PACKED_TYPE(USHT, unsigned short)
+    DK_PACKED_TYPE(INT, int)
+    DK_PACKED_TYPE(UINT, unsigned int)
+    DK_PACKED_TYPE(LNG, long)
+    DK_PACKED_TYPE(ULNG, unsigned long)
+    DK_PACKED_TYPE(LNG_LNG, long long)
+    DK_PACKED_TYPE(ULNG_LNG, unsigned long long)
+    DK_PACKED_TYPE(FLT, float)
+    DK_PACKED_TYPE(DBL, double)
+#   undef DK_PACKED_TYPE
+    default:
+      return NULL;
+  }
+}
+
+@implementation DKPackedArray
++ (id)arrayWithData: (NSData*)someData
+           objCType: (const char*)type
+{
+  return [[[self alloc] initWithData: someData
+                            objCType: type] autorelease];
+}
+
+- (id)initWithData: (NSData*)someData
+          objCType: (const char*)type
+{
+  NSUInteger size = 0;
+  // NSArray leaves initialization to its concrete subclasses, hence no call to
+  // -[super init].
+  objCType = DKPackedArrayCanonicalType(type);
+  if (NULL == objCType)
+  {
+    [self release];
+    return nil;
+  }
+  NSGetSizeAndAlignment(objCType, &size, NULL);
+  // Copying makes sure that the bytes do not change under our feet.
+  data = [someData copy];
+  bytes = [data bytes];
+  elementSize = size;
+  count = [data length] / size;
+  return self;
+}
+
+- (NSData*)data
+{
+  return data;
+}
+
+- (const void*)bytes
+{
+  return bytes;
+}
+
+- (const char*)objCType
+{
+  return objCType;
+}
+
+- (NSUInteger)count
+{
+  return count;
+}
+
+- (id)objectAtIndex: (NSUInteger)index
+{
+  const void *element = NULL;
+  if (index >= count)
+  {
+    [NSException raise: NSRangeException
+                format: @"Index %lu out of range for packed array of %lu numbers.",
+      (unsigned long)index, (unsigned long)count];
+  }
+  element = (const char*)bytes + (index * elementSize);
+
+  /*
+   * The data might not be suitably aligned for the type, so we copy the number
+   * before boxing it.
+   */
+  switch (*objCType)
+  {
+#   define DK_PACKED_BOX(typeName, type, capitalizedName) \
+    case _C_ ## typeName: \
+    { \
+      type value; \
+      memcpy(&value, element, sizeof(type)); \
+      return [NSNumber numberWith ## capitalizedName: value]; \
+    }
+    DK_PACKED_BOX(CHR, char, Char)
+    DK_PACKED_BOX(UCHR, unsigned char, UnsignedChar)
+    DK_PACKED_BOX(SHT, short, Short)
+    DK_PACKED_BOX(USHT, unsigned short, UnsignedShort)
+    DK_PACKED_BOX(INT, int, Int)
+    DK_PACKED_BOX(UINT, unsigned int, UnsignedInt)
+    DK_PACKED_BOX(LNG, long, Long)
+    DK_PACKED_BOX(ULNG, unsigned long, UnsignedLong)
+    DK_PACKED_BOX(LNG_LNG, long long, LongLong)
+    DK_PACKED_BOX(ULNG_LNG, unsigned long long, UnsignedLongLong)
+    DK_PACKED_BOX(FLT, float, Float)
+    DK_PACKED_BOX(DBL, double, Double)
+#   undef DK_PACKED_BOX
+    default:
+      return nil;
+  }
+}
+
+- (id)copyWithZone: (NSZone*)zone
+{
+  // We are immutable.
+  return [self retain];
+}
+
+- (void)dealloc
+{
+  [data release];
+  [super dealloc];
+}
+@end
@@ -28,6 +28,7 @@
 #import "DKIntrospectionParserDelegate.h"
 #import "DKMethod.h"
 #import "DKMethodCall.h"
+#import "DKFuture.h"
 #import "DKProperty.h"
 #import "DKProxy+Private.h"
 
@@ -46,15 +47,19 @@
 #import <Foundation/NSMapTable.h>
 #import <Foundation/NSMethodSignature.h>
 #import <Foundation/NSNotification.h>
+#import <Foundation/NSNull.h>
 #import <Foundation/NSRunLoop.h>
 #import <Foundation/NSString.h>
 #import <Foundation/NSThread.h>
+#import <Foundation/NSUserDefaults.h>
 #import <Foundation/NSValue.h>
 #import <Foundation/NSXMLNode.h>
 #import <Foundation/NSXMLParser.h>
 #import <GNUstepBase/GSObjCRuntime.h>
 #import <GNUstepBase/NSDebug+GNUstepBase.h>
 
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 /*
@@ -68,10 +73,156 @@ static SEL getEndpointSelector;
 static SEL getServiceNameSelector;
 static IMP getEndpoint;
 static IMP getServiceName;
+static BOOL usesFuturesByDefault;
+static NSTimeInterval callTimeoutByDefault;
+static BOOL usesDirectDispatch;
+static NSLock *directDispatchLock;
+static NSMutableDictionary *directDispatchClasses;
+
+#define DK_CALL_DEADLINE_KEY @"DKDBusCallDeadline"
+#define DK_CANCELLATION_TOKEN_KEY @"DKDBusCancellationToken"
 
 #define DK_PORT_ENDPOINT getEndpoint(port, getEndpointSelector)
 #define DK_PORT_SERVICE getServiceName(port, getServiceNameSelector)
 
+#define DK_SELECTOR_CACHE_INITIAL_CAPACITY 32
+
+/*
+ * The number of selectors the proxy does not handle that the selector cache
+ * will remember. Further misses are resolved the slow way, so that probing the
+ * proxy with arbitrary selectors does not make the cache grow without bound.
+ */
+#define DK_SELECTOR_CACHE_MAXIMUM_MISSES 64
+
+/*
+ * Entry in the selector cache. The method is nil for selectors that the proxy
+ * does not handle. The call selector is the unmangled version of the selector.
+ * The signature is the one to use for invocations of the selector, or nil if it
+ * does not fit the method.
+ */
+typedef struct
+{
+  SEL selector;
+  SEL callSelector;
+  DKMethod *method;
+  NSMethodSignature *signature;
+} DKSelectorCacheEntry;
+
+/*
+ * The selector cache is an open addressing hash table that is only ever added
+ * to. Entries are published by storing their selector last, so readers don't
+ * need to lock. When the table needs to grow or becomes stale, a new one
+ * replaces it. Old tables might still be read and are kept until no thread is
+ * looking up selectors (cf. -_reclaimRetiredSelectorCaches).
+ */
+typedef struct DKSelectorCache
+{
+  struct DKSelectorCache *previous;
+  NSUInteger capacity;
+  NSUInteger count;
+  NSUInteger misses;
+  DKSelectorCacheEntry *entries;
+} DKSelectorCache;
+
+static inline NSUInteger
+DKSelectorCacheHash(SEL selector)
+{
+  return (NSUInteger)((uintptr_t)selector >> 3);
+}
+
+static DKSelectorCache*
+DKSelectorCacheCreate(NSUInteger capacity, DKSelectorCache *previous)
+{
+  DKSelectorCache *cache = calloc(1, sizeof(DKSelectorCache));
+  if (NULL == cache)
+  {
+    return NULL;
+  }
+  cache->entries = calloc(capacity, sizeof(DKSelectorCacheEntry));
+  if (NULL == cache->entries)
+  {
+    free(cache);
+    return NULL;
+  }
+  cache->capacity = capacity;
+  cache->previous = previous;
+  return cache;
+}
+
+static void
+DKSelectorCacheDestroy(DKSelectorCache *cache)
+{
+  while (NULL != cache)
+  {
+    DKSelectorCache *previous = cache->previous;
+    NSUInteger i = 0;
+    for (i = 0; i < cache->capacity; i++)
+    {
+      [cache->entries[i].method release];
+      [cache->entries[i].signature release];
+    }
+    free(cache->entries);
+    free(cache);
+    cache = previous;
+  }
+}
+
+/*
+ * Looks up the selector without locking. Returns NO if there is no entry.
+ */
+static inline BOOL
+DKSelectorCacheLookup(DKSelectorCache *cache,
+  SEL selector,
+  DKSelectorCacheEntry *result)
+{
+  NSUInteger mask = cache->capacity - 1;
+  NSUInteger i = DKSelectorCacheHash(selector) & mask;
+  SEL key = 0;
+  while (0 != (key = __atomic_load_n(&cache->entries[i].selector, __ATOMIC_ACQUIRE)))
+  {
+    if (key == selector)
+    {
+      *result = cache->entries[i];
+      return YES;
+    }
+    i = (i + 1) & mask;
+  }
+  return NO;
+}
+
+/*
+ * Adds an entry. The table needs to have a free slot and the caller needs to
+ * hold the table lock of the proxy.
+ */
+static void
+DKSelectorCacheInsert(DKSelectorCache *cache,
+  SEL selector,
+  SEL callSelector,
+  DKMethod *method,
+  NSMethodSignature *signature)
+{
+  NSUInteger mask = cache->capacity - 1;
+  NSUInteger i = DKSelectorCacheHash(selector) & mask;
+  while (0 != cache->entries[i].selector)
+  {
+    if (selector == cache->entries[i].selector)
+    {
+      return;
+    }
+    i = (i + 1) & mask;
+  }
+  cache->entries[i].callSelector = callSelector;
+  cache->entries[i].method = [method retain];
+  cache->entries[i].signature = [signature retain];
+  // Publish the entry only after it is complete.
+  __atomic_store_n(&cache->entries[i].selector, selector, __ATOMIC_RELEASE);
+  cache->count++;
+  if (nil == method)
+  {
+    cache->misses++;
+  }
+}
+
 
 @interface DKProxy (DKProxyInternal)
 
@@ -80,6 +231,20 @@ static IMP getServiceName;
                    waitForCache: (BOOL)doWait;
 - (BOOL)_buildMethodCache: (id)ignored;
 - (void)_installIntrospectionMethod;
+- (DKMethod*)_DBusMethodForCallingSelector: (SEL*)selector
+                                 signature: (NSMethodSignature**)signature;
+- (DKMethod*)_cachedDBusMethodForSelector: (SEL*)selector
+                                signature: (NSMethodSignature**)signature;
+- (void)_resetSelectorCache;
+- (void)_invalidateSelectorCache;
+- (void)_reclaimRetiredSelectorCaches;
+- (void)_callDBusMethod: (DKMethod*)method
+             invocation: (NSInvocation*)inv;
+- (void)_sendDBusMethodCall: (DKMethodCall*)call
+                     oneway: (BOOL)isOneway;
+- (void)_installDirectDispatch;
+- (void)_removeDirectDispatch;
+- (NSTimeInterval)_timeoutForMethod: (DKMethod*)method;
 
 /* Define introspect on ourselves. */
 - (NSString*)Introspect;
@@ -131,6 +296,14 @@ NSString *kDKDBusDocType = @"<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS O
     getServiceNameSelector = @selector(serviceName);
     getServiceName = class_getMethodImplementation([DKPort class],
       getServiceNameSelector);
+    usesFuturesByDefault = [[NSUserDefaults standardUserDefaults] boolForKey: @"DKUseFutures"];
+    callTimeoutByDefault = MAX(0,
+      [[NSUserDefaults standardUserDefaults] doubleForKey: @"DKCallTimeout"]);
+    // Direct dispatch is on unless explicitly disabled.
+    usesDirectDispatch = ((nil == [[NSUserDefaults standardUserDefaults] objectForKey: @"DKDirectDispatch"])
+      || [[NSUserDefaults standardUserDefaults] boolForKey: @"DKDirectDispatch"]);
+    directDispatchLock = [[NSLock alloc] init];
+    directDispatchClasses = [[NSMutableDictionary alloc] init];
   }
 }
 
@@ -150,6 +323,69 @@ NSString *kDKDBusDocType = @"<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS O
                                 path: aPath] autorelease];
 }
 
++ (NSArray*)invokeBatch: (NSArray*)invocations
+{
+  NSMutableArray *calls = [NSMutableArray arrayWithCapacity: [invocations count]];
+  NSMutableArray *results = nil;
+  NSEnumerator *theEnum = [invocations objectEnumerator];
+  NSInvocation *inv = nil;
+  NSUInteger count = 0;
+  NSUInteger index = 0;
+  NSNull *theNull = [NSNull null];
+
+  // Marshall all calls up front.
+  while (nil != (inv = [theEnum nextObject]))
+  {
+    DKProxy *target = [inv target];
+    SEL selector = [inv selector];
+    DKMethod *method = nil;
+    DKMethodCall *call = nil;
+    if (NO == GSObjCIsKindOf(GSObjCClass(target), [DKProxy class]))
+    {
+      [NSException raise: @"DKInvalidArgumentException"
+                  format: @"Cannot invoke %@ on %@ as part of a D-Bus batch.",
+	NSStringFromSelector(selector),
+	target];
+    }
+    method = [target _DBusMethodForCallingSelector: &selector
+                                         signature: NULL];
+    [inv setSelector: selector];
+    if (NO == [method isValidForMethodSignature: [inv methodSignature]])
+    {
+      [NSException raise: @"DKInvalidArgumentException"
+                  format: @"D-Bus object %@: Mismatched method signature for %@.",
+	target->path,
+	NSStringFromSelector(selector)];
+    }
+    call = [[DKMethodCall alloc] initWithProxy: target
+                                        method: method
+                                    invocation: inv
+                                       timeout: [target _timeoutForMethod: method]];
+    if (nil == call)
+    {
+      [NSException raise: @"DKInvalidArgumentException"
+                  format: @"D-Bus object %@: Could not marshall arguments for %@.",
+	target->path,
+	NSStringFromSelector(selector)];
+    }
+    [calls addObject: call];
+    [call release];
+  }
+
+  results = [[[DKMethodCall sendBatch: calls] mutableCopy] autorelease];
+  count = [results count];
+  for (index = 0; index < count; index++)
+  {
+    id result = [results objectAtIndex: index];
+    if (theNull != result)
+    {
+      [results replaceObjectAtIndex: index
+                         withObject: DKErrorForException(result)];
+    }
+  }
+  return results;
+}
+
 - (id)initWithService: (NSString*)aService
                  path: (NSString*)aPath
                   bus: (DKDBusBusType)type
@@ -192,6 +428,8 @@ NSString *kDKDBusDocType = @"<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS O
   tableLock = [[NSLock alloc] init];
   condition = [[NSCondition alloc] init];
   state = DK_NO_TABLES;
+  usesFutures = usesFuturesByDefault;
+  callTimeout = callTimeoutByDefault;
   [self _setupTables];
   [self _installIntrospectionMethod];
   return self;
@@ -223,6 +461,8 @@ NSString *kDKDBusDocType = @"<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS O
   tableLock = [[NSLock alloc] init];
   condition = [[NSCondition alloc] init];
   state = DK_NO_TABLES;
+  usesFutures = usesFuturesByDefault;
+  callTimeout = callTimeoutByDefault;
   [self _setupTables];
   [self _installIntrospectionMethod];
   return self;
@@ -300,7 +540,8 @@ NSString *kDKDBusDocType = @"<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS O
     [[DKEndpointManager sharedEndpointManager] boolReturnForPerformingSelector: @selector(_buildMethodCache:)
                                                                         target: self
                                                                           data: NULL
-                                                                 waitForReturn: YES];
+                                                                 waitForReturn: YES
+                                                                   forEndpoint: [self _endpoint]];
   }
   else
   {
@@ -377,6 +618,99 @@ NSString *kDKDBusDocType = @"<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS O
     DKInterface *theIf = [interfaces objectForKey: anInterface];
     ASSIGN(activeInterface, theIf);
   }
+  // The active interface takes precedence, so resolved methods might change.
+  [tableLock lock];
+  [self _invalidateSelectorCache];
+  [tableLock unlock];
+}
+
+- (void)setUsesFutures: (BOOL)yesno
+{
+  usesFutures = yesno;
+}
+
+- (BOOL)usesFutures
+{
+  return usesFutures;
+}
+
++ (void)setDBusCallDeadline: (NSDate*)deadline
+{
+  NSMutableDictionary *dict = [[NSThread currentThread] threadDictionary];
+  if (nil == deadline)
+  {
+    [dict removeObjectForKey: DK_CALL_DEADLINE_KEY];
+  }
+  else
+  {
+    [dict setObject: deadline
+             forKey: DK_CALL_DEADLINE_KEY];
+  }
+}
+
++ (NSDate*)DBusCallDeadline
+{
+  return [[[NSThread currentThread] threadDictionary] objectForKey: DK_CALL_DEADLINE_KEY];
+}
+
++ (void)setDBusCancellationToken: (DKCancellationToken*)token
+{
+  NSMutableDictionary *dict = [[NSThread currentThread] threadDictionary];
+  if (nil == token)
+  {
+    [dict removeObjectForKey: DK_CANCELLATION_TOKEN_KEY];
+  }
+  else
+  {
+    [dict setObject: token
+             forKey: DK_CANCELLATION_TOKEN_KEY];
+  }
+}
+
++ (DKCancellationToken*)DBusCancellationToken
+{
+  return [[[NSThread currentThread] threadDictionary] objectForKey: DK_CANCELLATION_TOKEN_KEY];
+}
+
+- (void)setDBusCallTimeout: (NSTimeInterval)interval
+{
+  callTimeout = MAX(0, interval);
+}
+
+- (NSTimeInterval)DBusCallTimeout
+{
+  return callTimeout;
+}
+
+/**
+ * Determines the timeout for a call of <var>method</var>: The annotation of
+ * the method takes precedence over the timeout of the proxy, and both are
+ * limited by the deadline of the current thread.
+ */
+- (NSTimeInterval)_timeoutForMethod: (DKMethod*)method
+{
+  NSTimeInterval interval = [method timeout];
+  NSDate *deadline = [DKProxy DBusCallDeadline];
+  if (interval <= 0)
+  {
+    interval = [self DBusCallTimeout];
+  }
+  if (nil != deadline)
+  {
+    NSTimeInterval remaining = [deadline timeIntervalSinceNow];
+    if (remaining <= 0)
+    {
+      [NSException raise: @"DKDBusTimeoutException"
+                  format: @"Deadline passed before calling '%@' on D-Bus object %@.",
+	[method name],
+	path];
+    }
+    if ((interval <= 0) || (remaining < interval))
+    {
+      interval = remaining;
+    }
+  }
+  return interval;
 }
 
 /**
@@ -476,43 +810,10 @@ NSString *kDKDBusDocType = @"<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS O
    * For simple cases we can simply look up the selector in the table and return
    * the signature from the associated method.
    */
-  DKMethod *method = [self DBusMethodForSelector: aSelector];
-  const char *types = NULL;
+  SEL callSelector = aSelector;
   NSMethodSignature *theSig = nil;
-  types = GSTypesFromSelector(aSelector);
-
-  // Build a signature with the types:
-  theSig = [NSMethodSignature signatureWithObjCTypes: types];
-
-  /*
-   * Second chance to find the method: Remove mangling constructs from the
-   * selector string.
-   */
-  if (nil == method)
-  {
-    NSString *interface = nil;
-    SEL unmangledSel = [self _unmangledSelector: aSelector
-                                      interface: &interface];
-    if (0 == unmangledSel)
-    {
-      // We can't do anything then.
-      return nil;
-    }
-
-    if (nil != interface)
-    {
-      // The interface was specified. Retrieve the corresponding method;
-      [tableLock lock];
-      method = [(DKInterface*)[interfaces objectForKey: interface] DBusMethodForSelector: unmangledSel];
-      [tableLock unlock];
-    }
-    else
-    {
-      // No interface, so we try the standard dispatch table:
-      method = [self DBusMethodForSelector: unmangledSel];
-    }
-  }
-
+  DKMethod *method = [self _cachedDBusMethodForSelector: &callSelector
+                                              signature: &theSig];
 
   // Finally check whether we have a sensible method and signature:
   if (nil == method)
@@ -520,7 +821,7 @@ NSString *kDKDBusDocType = @"<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS O
     // Bad luck, the method is not there:
     return nil;
   }
-  else if ([method isValidForMethodSignature: theSig])
+  else if (nil != theSig)
   {
     // Good, the method can handle the signature for which we are being called:
     return theSig;
@@ -600,62 +901,659 @@ NSString *kDKDBusDocType = @"<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS O
   return m;
 }
 
-- (void)forwardInvocation: (NSInvocation*)inv
+/**
+ * Returns the method to call for <var>selector</var>, which might be mangled
+ * to include the interface name. In that case, <var>selector</var> is replaced
+ * with the unmangled version. Raises an exception if there is no such method.
+ */
+- (DKMethod*)_DBusMethodForCallingSelector: (SEL*)selector
+                                 signature: (NSMethodSignature**)signature
 {
-  SEL selector = [inv selector];
-  NSMethodSignature *signature = [inv methodSignature];
+  DKMethod *method = [self _cachedDBusMethodForSelector: selector
+                                              signature: signature];
+  if (nil == method)
+  {
+    // If so, we cannot do anything more:
+    [NSException raise: @"DKInvalidArgumentException"
+                format: @"D-Bus object %@ for service %@ does not recognize %@",
+      path,
+      DK_PORT_SERVICE,
+     NSStringFromSelector(*selector)];
+  }
+  return method;
+}
+
+/*
+ * Returns the signature for invocations of the selector that are handled by the
+ * method, or nil if the method cannot handle them. The signatures memoized by
+ * the method are used where possible.
+ */
+static NSMethodSignature*
+DKSignatureForSelector(SEL selector, DKMethod *method)
+{
+  const char *types = GSTypesFromSelector(selector);
+  NSMethodSignature *sig = nil;
+  NSMethodSignature *boxedSig = [method methodSignatureBoxed: YES];
+  if (NULL == types)
+  {
+    // Untyped selectors are called with the boxed signature.
+    return boxedSig;
+  }
+  sig = [NSMethodSignature signatureWithObjCTypes: types];
+  if ([sig isEqual: boxedSig])
+  {
+    return boxedSig;
+  }
+  else if ([sig isEqual: [method methodSignatureBoxed: NO]])
+  {
+    return [method methodSignatureBoxed: NO];
+  }
+  else if ([method isValidForMethodSignature: sig])
+  {
+    return sig;
+  }
+  return nil;
+}
+
+/**
+ * Resolves <var>selector</var> like -_DBusMethodForCallingSelector:, but
+ * returns nil if there is no method. If <var>signature</var> is not NULL, it
+ * is set to the signature to use for the selector, or to nil if it does not
+ * fit the method. Once the method cache has been built, results (including
+ * misses) are remembered, so that resolving the selector again takes no locks.
+ */
+- (DKMethod*)_cachedDBusMethodForSelector: (SEL*)selector
+                                signature: (NSMethodSignature**)signature
+{
+  DKSelectorCache *cache = NULL;
+  DKSelectorCacheEntry entry;
   NSString *interface = nil;
-  DKMethod *method = [self DBusMethodForSelector: selector];
-  DKMethodCall *call = nil;
+  SEL callSelector = *selector;
+  DKMethod *method = nil;
+  NSMethodSignature *sig = nil;
+  BOOL found = NO;
+
+  /*
+   * Register as a reader before loading the table, so that it will not be freed
+   * while we are looking at it. The table pointer is only compared to the
+   * current one afterwards.
+   */
+  __atomic_add_fetch(&selectorCacheReaders, 1, __ATOMIC_SEQ_CST);
+  cache = __atomic_load_n((DKSelectorCache**)&selectorCache, __ATOMIC_SEQ_CST);
+  found = ((NULL != cache) && DKSelectorCacheLookup(cache, *selector, &entry));
+  __atomic_sub_fetch(&selectorCacheReaders, 1, __ATOMIC_RELEASE);
+  if (found)
+  {
+    if (nil != entry.method)
+    {
+      *selector = entry.callSelector;
+    }
+    if (NULL != signature)
+    {
+      /*
+       * The table might be freed once we are done with it. Methods are owned
+       * by their interfaces, but signatures that the method has not memoized
+       * are only kept alive by the table.
+       */
+      *signature = [[entry.signature retain] autorelease];
+    }
+    return entry.method;
+  }
 
+  method = [self DBusMethodForSelector: callSelector];
   if (nil == method)
   {
-    SEL newSel = 0;
-    newSel = [self _unmangledSelector: selector
-                            interface: &interface];
+    // Second chance: Remove mangling constructs from the selector string.
+    SEL newSel = [self _unmangledSelector: callSelector
+                                interface: &interface];
     if (0 != newSel)
     {
-      [inv setSelector: newSel];
       if (nil != interface)
       {
+	// The interface was specified. Retrieve the corresponding method.
 	[tableLock lock];
 	method = [(DKInterface*)[interfaces objectForKey: interface] DBusMethodForSelector: newSel];
         [tableLock unlock];
       }
       else
       {
+	// No interface, so we try the standard dispatch table.
 	method = [self DBusMethodForSelector: newSel];
       }
+      if (nil != method)
+      {
+        callSelector = newSel;
+      }
     }
   }
-  if (nil == method)
+  if (nil != method)
   {
-    // If so, we cannot do anything more:
-    [NSException raise: @"DKInvalidArgumentException"
-                format: @"D-Bus object %@ for service %@ does not recognize %@",
-      path,
-      DK_PORT_SERVICE,
-     NSStringFromSelector(selector)];
+    // The types come from the selector the caller used.
+    sig = DKSignatureForSelector(*selector, method);
+  }
+
+  /*
+   * Only remember the result if the cache has neither been invalidated nor
+   * grown in the meantime. If there was no cache when we started, the method
+   * cache was not ready and we must not remember misses.
+   */
+  if (NULL != cache)
+  {
+    [tableLock lock];
+    [self _reclaimRetiredSelectorCaches];
+    if ((cache == selectorCache) && ((nil != method)
+      || (cache->misses < DK_SELECTOR_CACHE_MAXIMUM_MISSES)))
+    {
+      if ((2 * (cache->count + 1)) > cache->capacity)
+      {
+        DKSelectorCache *newCache = DKSelectorCacheCreate(2 * cache->capacity,
+	  cache);
+	NSUInteger i = 0;
+	if (NULL != newCache)
+	{
+	  for (i = 0; i < cache->capacity; i++)
+	  {
+	    DKSelectorCacheEntry *old = &cache->entries[i];
+	    if (0 != old->selector)
+	    {
+	      DKSelectorCacheInsert(newCache,
+	        old->selector,
+		old->callSelector,
+		old->method,
+		old->signature);
+	    }
+	  }
+	  cache = newCache;
+	}
+	else
+	{
+	  cache = NULL;
+	}
+      }
+      if (NULL != cache)
+      {
+        DKSelectorCacheInsert(cache, *selector, callSelector, method, sig);
+	__atomic_store_n((DKSelectorCache**)&selectorCache, cache,
+	  __ATOMIC_SEQ_CST);
+	[self _reclaimRetiredSelectorCaches];
+      }
+    }
+    [tableLock unlock];
   }
 
-  if (NO == [method isValidForMethodSignature: signature])
+  if (nil != method)
+  {
+    *selector = callSelector;
+  }
+  if (NULL != signature)
+  {
+    *signature = sig;
+  }
+  return method;
+}
+
+/**
+ * Publishes a new, empty selector cache. Must be called with the table lock
+ * held.
+ */
+- (void)_resetSelectorCache
+{
+  DKSelectorCache *newCache = DKSelectorCacheCreate(DK_SELECTOR_CACHE_INITIAL_CAPACITY,
+    (DKSelectorCache*)selectorCache);
+  if (NULL != newCache)
+  {
+    __atomic_store_n((DKSelectorCache**)&selectorCache, newCache,
+      __ATOMIC_SEQ_CST);
+    [self _reclaimRetiredSelectorCaches];
+  }
+}
+
+/**
+ * Frees the tables replaced by the current selector cache unless a thread is
+ * looking up selectors at the moment. Otherwise they are kept for the next
+ * attempt. Must be called with the table lock held.
+ */
+- (void)_reclaimRetiredSelectorCaches
+{
+  DKSelectorCache *cache = (DKSelectorCache*)selectorCache;
+  if ((NULL == cache) || (NULL == cache->previous))
+  {
+    return;
+  }
+  /*
+   * The current table was published before we check for readers. Readers
+   * register before loading the table, so if there are none now, every later
+   * reader will find the current table.
+   */
+  if (0 == __atomic_load_n(&selectorCacheReaders, __ATOMIC_SEQ_CST))
+  {
+    DKSelectorCacheDestroy(cache->previous);
+    cache->previous = NULL;
+  }
+}
+
+/**
+ * Discards the entries in the selector cache because the set of methods
+ * changed. Must be called with the table lock held.
+ */
+- (void)_invalidateSelectorCache
+{
+  // Nothing to do if the cache has not been published yet.
+  if (NULL != selectorCache)
+  {
+    [self _resetSelectorCache];
+  }
+}
+
+- (void)forwardInvocation: (NSInvocation*)inv
+{
+  SEL selector = [inv selector];
+  NSMethodSignature *signature = [inv methodSignature];
+  NSMethodSignature *cachedSig = nil;
+  DKMethod *method = [self _DBusMethodForCallingSelector: &selector
+                                               signature: &cachedSig];
+
+  [inv setSelector: selector];
+
+  // Invocations created from our own signature need not be checked again.
+  if ((signature != cachedSig)
+    && (NO == [method isValidForMethodSignature: signature]))
   {
     [NSException raise: @"DKInvalidArgumentException"
                 format: @"D-Bus object %@ for service %@: Mismatched method signature.",
       path,
       DK_PORT_SERVICE];
   }
+  [self _callDBusMethod: method
+             invocation: inv];
+}
+
+/**
+ * Calls <var>method</var> with the arguments from <var>inv</var> and stores the
+ * return value in it.
+ */
+- (void)_callDBusMethod: (DKMethod*)method
+             invocation: (NSInvocation*)inv
+{
+  DKMethodCall *call = [[DKMethodCall alloc] initWithProxy: self
+                                                    method: method
+                                                invocation: inv
+                                                   timeout: [self _timeoutForMethod: method]];
+  [self _sendDBusMethodCall: call
+                     oneway: ([method isOneway] || [[inv methodSignature] isOneway])];
+  [call release];
+}
+
+/**
+ * Sends <var>call</var> the way the receiver is configured to.
+ */
+- (void)_sendDBusMethodCall: (DKMethodCall*)call
+                     oneway: (BOOL)isOneway
+{
+  if (isOneway && [call hasVoidReturn])
+  {
+    // Nobody is waiting for a reply, so there is no need to ask for one.
+    [call sendWithoutReply];
+  }
+  else if ([self usesFutures])
+  {
+    // Falls back to a synchronous call unless the method returns an object.
+    [call sendAsynchronously];
+  }
+  else
+  {
+    [call sendSynchronously];
+  }
+}
+
+/*
+ * Direct dispatch: Once the interfaces of a proxy are known, the proxy is moved
+ * to a generated subclass of DKProxy that implements the D-Bus methods, so that
+ * calling them does not involve -methodSignatureForSelector:, the forwarding
+ * machinery or an NSInvocation: the arguments are marshalled straight from the
+ * call frame. This is only done for methods whose boxed and unboxed signatures
+ * are the same (i.e. all arguments and the return value are objects), because
+ * the implementation cannot tell which of them the caller used. All of these
+ * share the following implementations, one for each number of arguments.
+ */
+#define DK_DIRECT_DISPATCH_MAX_ARGS 6
+
+static id
+DKDirectDispatch(DKProxy *self, SEL _cmd, id *args)
+{
+  SEL selector = _cmd;
+  NSMethodSignature *sig = nil;
+  DKMethod *method = [self _DBusMethodForCallingSelector: &selector
+                                               signature: &sig];
+  DKMethodCall *call = nil;
+
+  if (nil == sig)
+  {
+    // The caller used a signature that does not fit the method.
+    [NSException raise: @"DKInvalidArgumentException"
+                format: @"D-Bus object %@: Mismatched method signature for %@.",
+      self->path,
+      NSStringFromSelector(_cmd)];
+  }
+  /*
+   * The call is autoreleased, so that it does not leak if sending it raises,
+   * and so that it keeps the return value alive for the caller.
+   */
+  call = [[[DKMethodCall alloc] initWithProxy: self
+                                       method: method
+                                    arguments: args
+                                      timeout: [self _timeoutForMethod: method]] autorelease];
+  [self _sendDBusMethodCall: call
+                     oneway: [method isOneway]];
+  return [call returnValue];
+}
+
+static id
+DKDirectDispatch0(DKProxy *self, SEL _cmd)
+{
+  return DKDirectDispatch(self, _cmd, NULL);
+}
+
+static id
+DKDirectDispatch1(DKProxy *self, SEL _cmd, id a1)
+{
+  id args[1] = {a1};
+  return DKDirectDispatch(self, _cmd, args);
+}
+
+static id
+DKDirectDispatch2(DKProxy *self, SEL _cmd, id a1, id a2)
+{
+  id args[2] = {a1, a2};
+  return DKDirectDispatch(self, _cmd, args);
+}
+
+static id
+DKDirectDispatch3(DKProxy *self, SEL _cmd, id a1, id a2, id a3)
+{
+  id args[3] = {a1, a2, a3};
+  return DKDirectDispatch(self, _cmd, args);
+}
+
+static id
+DKDirectDispatch4(DKProxy *self, SEL _cmd, id a1, id a2, id a3, id a4)
+{
+  id args[4] = {a1, a2, a3, a4};
+  return DKDirectDispatch(self, _cmd, args);
+}
+
+static id
+DKDirectDispatch5(DKProxy *self, SEL _cmd, id a1, id a2, id a3, id a4, id a5)
+{
+  id args[5] = {a1, a2, a3, a4, a5};
+  return DKDirectDispatch(self, _cmd, args);
+}
+
+static id
+DKDirectDispatch6(DKProxy *self, SEL _cmd, id a1, id a2, id a3, id a4, id a5,
+  id a6)
+{
+  id args[6] = {a1, a2, a3, a4, a5, a6};
+  return DKDirectDispatch(self, _cmd, args);
+}
+
+/*
+ * The generated classes are an implementation detail, so they pretend to be
+ * DKProxy.
+ */
+static Class
+DKDirectDispatchPublicClass(DKProxy *self, SEL _cmd)
+{
+  return [DKProxy class];
+}
+
+static IMP directDispatchIMPs[DK_DIRECT_DISPATCH_MAX_ARGS + 1] = {
+  (IMP)DKDirectDispatch0,
+  (IMP)DKDirectDispatch1,
+  (IMP)DKDirectDispatch2,
+  (IMP)DKDirectDispatch3,
+  (IMP)DKDirectDispatch4,
+  (IMP)DKDirectDispatch5,
+  (IMP)DKDirectDispatch6
+};
+
+/*
+ * Returns whether calls to the method can be dispatched directly.
+ */
+static BOOL
+DKMethodAllowsDirectDispatch(DKMethod *method)
+{
+  const char *returnType = [method returnTypeBoxed: YES];
+  if ([[method userVisibleArguments] count] > DK_DIRECT_DISPATCH_MAX_ARGS)
+  {
+    return NO;
+  }
+  if ((0 != strcmp(returnType, @encode(id)))
+    && (0 != strcmp(returnType, @encode(void))))
+  {
+    return NO;
+  }
+  return [[method methodSignatureBoxed: YES] isEqual: [method methodSignatureBoxed: NO]];
+}
+
+/*
+ * Returns the generated class implementing the methods in the array of
+ * selector names. Classes are shared between all proxies implementing the same
+ * selectors, since the implementations look up the D-Bus method anyways.
+ */
+static Class
+DKDirectDispatchClass(NSArray *selectorNames, NSDictionary *types)
+{
+  NSString *key = [selectorNames componentsJoinedByString: @","];
+  Class theClass = Nil;
+  [directDispatchLock lock];
+  theClass = [directDispatchClasses objectForKey: key];
+  if (Nil == theClass)
+  {
+    NSString *className = [NSString stringWithFormat: @"DKProxy_Direct%lu",
+      (unsigned long)[directDispatchClasses count]];
+    NSEnumerator *theEnum = [selectorNames objectEnumerator];
+    NSString *selName = nil;
+    theClass = objc_allocateClassPair([DKProxy class], [className UTF8String], 0);
+    if (Nil == theClass)
+    {
+      [directDispatchLock unlock];
+      NSWarnMLog(@"Could not generate class %@ for direct dispatch.", className);
+      return Nil;
+    }
+    while (nil != (selName = [theEnum nextObject]))
+    {
+      SEL sel = sel_registerName([selName UTF8String]);
+      NSUInteger argCount = [[selName componentsSeparatedByString: @":"] count] - 1;
+      // The class lives forever, so does its type information.
+      class_addMethod(theClass,
+        sel,
+        directDispatchIMPs[argCount],
+        strdup([[types objectForKey: selName] UTF8String]));
+    }
+    class_addMethod(theClass,
+      @selector(class),
+      (IMP)DKDirectDispatchPublicClass,
+      "#@:");
+    objc_registerClassPair(theClass);
+    [directDispatchClasses setObject: theClass
+                              forKey: key];
+    NSDebugMLog(@"Generated %@ for %@", className, key);
+  }
+  [directDispatchLock unlock];
+  return theClass;
+}
+
+/**
+ * Moves the receiver to a generated class implementing the D-Bus methods that
+ * can be dispatched directly. Only plain proxies (not subclasses such as
+ * DKDBus) are moved. The table lock is held throughout, because
+ * -_addInterface: changes the interfaces and moves the receiver back to
+ * DKProxy with the lock held. Otherwise, we might install a class for an
+ * outdated set of interfaces after it has already been removed.
+ */
+- (void)_installDirectDispatch
+{
+  NSMutableDictionary *types = [NSMutableDictionary dictionary];
+  NSMutableArray *selectorNames = nil;
+  NSArray *allInterfaces = nil;
+  NSEnumerator *ifEnum = nil;
+  DKInterface *theIf = nil;
+  Class generatedClass = Nil;
+  if (NO == usesDirectDispatch)
+  {
+    return;
+  }
+  [tableLock lock];
+  // Proxies that have been moved already stay where they are.
+  if (usesDirectDispatchClass || ([DKProxy class] != GSObjCClass(self)))
+  {
+    [tableLock unlock];
+    return;
+  }
+  allInterfaces = [interfaces allValues];
+
+  ifEnum = [allInterfaces objectEnumerator];
+  while (nil != (theIf = [ifEnum nextObject]))
+  {
+    NSEnumerator *methodEnum = [[theIf methods] objectEnumerator];
+    DKMethod *method = nil;
+    while (nil != (method = [methodEnum nextObject]))
+    {
+      NSString *selName = [method selectorString];
+      SEL sel = NSSelectorFromString(selName);
+      NSEnumerator *otherEnum = nil;
+      DKInterface *otherIf = nil;
+      BOOL allowed = YES;
+      if ((nil == selName) || (nil != [types objectForKey: selName])
+	|| class_respondsToSelector([DKProxy class], sel))
+      {
+        continue;
+      }
+      // Every method the selector might resolve to needs to qualify.
+      otherEnum = [allInterfaces objectEnumerator];
+      while (allowed && (nil != (otherIf = [otherEnum nextObject])))
+      {
+        DKMethod *other = [otherIf DBusMethodForSelector: sel];
+	allowed = ((nil == other) || DKMethodAllowsDirectDispatch(other));
+      }
+      if (allowed)
+      {
+        [types setObject: [NSString stringWithUTF8String: [method objCTypesBoxed: YES]]
+	          forKey: selName];
+      }
+    }
+  }
+  if (0 == [types count])
+  {
+    [tableLock unlock];
+    return;
+  }
+  selectorNames = [[[types allKeys] mutableCopy] autorelease];
+  [selectorNames sortUsingSelector: @selector(compare:)];
+  generatedClass = DKDirectDispatchClass(selectorNames, types);
+  if (Nil != generatedClass)
+  {
+    object_setClass(self, generatedClass);
+    usesDirectDispatchClass = YES;
+  }
+  [tableLock unlock];
+}
+
+/**
+ * Moves the receiver back to DKProxy because the methods it implements might
+ * no longer be correct. Must be called with the table lock held.
+ */
+- (void)_removeDirectDispatch
+{
+  if (usesDirectDispatchClass)
+  {
+    object_setClass(self, [DKProxy class]);
+    usesDirectDispatchClass = NO;
+  }
+}
+
+- (void)callDBusMethod: (SEL)selector
+         withArguments: (NSArray*)arguments
+     completionHandler: (id)handler
+              selector: (SEL)completionSelector
+              onThread: (NSThread*)thread
+                 modes: (NSArray*)modes
+{
+  DKMethod *method = [self _DBusMethodForCallingSelector: &selector
+                                               signature: NULL];
+  NSMethodSignature *signature = [method methodSignatureBoxed: YES];
+  NSInvocation *inv = [NSInvocation invocationWithMethodSignature: signature];
+  NSUInteger count = [arguments count];
+  NSUInteger index = 0;
+  NSNull *theNull = [NSNull null];
+  DKMethodCall *call = nil;
+  DKCallCompletion *completion = nil;
+
+  if (count != ([signature numberOfArguments] - 2))
+  {
+    [NSException raise: @"DKInvalidArgumentException"
+                format: @"D-Bus object %@ for service %@: Wrong number of arguments for %@.",
+      path,
+      DK_PORT_SERVICE,
+      NSStringFromSelector(selector)];
+  }
+
+  [inv setTarget: self];
+  [inv setSelector: selector];
+  while (index < count)
+  {
+    id arg = [arguments objectAtIndex: index];
+    if (theNull == arg)
+    {
+      arg = nil;
+    }
+    [inv setArgument: &arg
+             atIndex: (index + 2)];
+    index++;
+  }
 
   call = [[DKMethodCall alloc] initWithProxy: self
                                       method: method
                                   invocation: inv
-				     timeout: 5000];
-
-  //TODO: Implement asynchronous method calls using futures
-  [call sendSynchronously];
+				     timeout: [self _timeoutForMethod: method]];
+  if (nil == call)
+  {
+    [NSException raise: @"DKInvalidArgumentException"
+                format: @"D-Bus object %@ for service %@: Could not marshall arguments for %@.",
+      path,
+      DK_PORT_SERVICE,
+      NSStringFromSelector(selector)];
+  }
+  completion = [[DKCallCompletion alloc] initWithHandler: handler
+                                                selector: completionSelector
+                                                  thread: thread
+                                                   modes: modes];
+  if (nil == completion)
+  {
+    [call release];
+    [NSException raise: @"DKInvalidArgumentException"
+                format: @"No completion handler for asynchronous call of %@.",
+      NSStringFromSelector(selector)];
+  }
+  [call sendAsynchronouslyWithCompletion: completion];
+  [completion release];
   [call release];
 }
 
+- (void)callDBusMethod: (SEL)selector
+         withArguments: (NSArray*)arguments
+     completionHandler: (id)handler
+              selector: (SEL)completionSelector
+{
+  [self callDBusMethod: selector
+         withArguments: arguments
+     completionHandler: handler
+              selector: completionSelector
+              onThread: [NSThread currentThread]
+                 modes: nil];
+}
+
 - (BOOL)isKindOfClass: (Class)aClass
 {
   return GSObjCIsKindOf([self class], aClass);
@@ -798,12 +1696,14 @@ NSString *kDKDBusDocType = @"<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS O
     [theIf installProperties];
     [self _registerSignalsFromInterface: theIf];
   }
+  // From now on, resolved selectors can be remembered.
+  [self _resetSelectorCache];
   [tableLock unlock];
 
   state = DK_CACHE_READY;
   [condition broadcast];
   [condition unlock];
-
+  [self _installDirectDispatch];
 }
 
 - (void)_setupTables
@@ -847,6 +1747,8 @@ NSString *kDKDBusDocType = @"<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS O
     [tableLock lock];
     [interfaces setObject: interface
                    forKey: ifName];
+    [self _invalidateSelectorCache];
+    [self _removeDirectDispatch];
     // Check whether this is the interface we need to activate:
     if ([activeInterface isKindOfClass: [NSString class]])
     {
@@ -1062,6 +1964,7 @@ NSString *kDKDBusDocType = @"<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS O
   [interfaces release];
   [children release];
   [activeInterface release];
+  DKSelectorCacheDestroy((DKSelectorCache*)selectorCache);
   [tableLock release];
   [condition release];
   [super dealloc];
@@ -1074,6 +1977,8 @@ static DKProxy *systemBus;
 static DKProxy *sessionBus;
 
 NSString* DKBusDisconnectedNotification = @"DKDBusDisconnectedNotification";
+NSString* DKDBusErrorDomain = @"DKDBusErrorDomain";
+NSString* DKExceptionErrorKey = @"DKException";
 NSString* DKBusReconnectedNotification = @"DKBusReconnectedNotification";
 @implementation DKDBus
 + (void)initialize
@@ -1255,6 +2160,23 @@ NSString* DKBusReconnectedNotification = @"DKBusReconnectedNotification";
    NSWarnMLog(@"'%@' called for a shared DKDBus object.", NSStringFromSelector(_cmd));
 }
 
+- (void)setUsesFutures: (BOOL)yesno
+{
+  // No-Op for the same reason as above.
+  NSWarnMLog(@"'%@' called for a shared DKDBus object.", NSStringFromSelector(_cmd));
+}
+
+- (BOOL)usesFutures
+{
+  return NO;
+}
+
+- (void)setDBusCallTimeout: (NSTimeInterval)interval
+{
+  // No-Op for the same reason as above.
+  NSWarnMLog(@"'%@' called for a shared DKDBus object.", NSStringFromSelector(_cmd));
+}
+
 - (NSString*)_uniqueName
 {
   /*
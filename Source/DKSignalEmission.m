@@ -143,13 +143,15 @@
 
 - (void)sendAsynchronously
 {
-  // DBusKit rule #1 is that all interaction with libdbus happens from one
-  // thread, so we go via the endpoint manager to schedule sending the reply or
-  // error out. The superclass logic is sufficient for us in this case.
+  // DBusKit rule #1 is that all interaction with a libdbus connection happens
+  // from one thread, so we go via the endpoint manager to schedule sending the
+  // reply or error out on the worker of the endpoint. The superclass logic is
+  // sufficient for us in this case.
   [[DKEndpointManager sharedEndpointManager] boolReturnForPerformingSelector: @selector(send:)
     target: self
     data: NULL
-    waitForReturn: NO];
+    waitForReturn: NO
+    forEndpoint: endpoint];
 }
 
 @end
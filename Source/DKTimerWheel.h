@@ -0,0 +1,126 @@
+/** Declaration of the DKTimerWheel class scheduling libdbus timeouts.
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+   */
+
+#import <Foundation/NSObject.h>
+#import "DKEventBackend.h"
+#include <stdint.h>
+#include <dbus/dbus.h>
+
+@class DKWorker, NSTimer;
+
+/*
+ * Number of levels in the wheel and number of slots per level (2^6). With a
+ * tick of 10ms, the levels cover 0.64s, 41s, 44min and 46h respectively.
+ * Timeouts further in the future are parked on the outermost level until they
+ * come into range.
+ */
+#define DKTimerWheelLevels 4
+#define DKTimerWheelSlotBits 6
+#define DKTimerWheelSlots (1 << DKTimerWheelSlotBits)
+
+/*
+ * Node for a scheduled timeout. Nodes are linked into the slot they expire in
+ * and attached to their DBusTimeout with dbus_timeout_set_data(), so they can
+ * be found and unlinked in constant time. Unused nodes are kept on a free list.
+ */
+typedef struct DKTimerNode
+{
+  struct DKTimerNode *next;
+  struct DKTimerNode *prev;
+  DBusTimeout *timeout;
+  uint64_t expiry;
+  uint32_t interval;
+  uint8_t level;
+  uint8_t slot;
+} DKTimerNode;
+
+/**
+ * DKTimerWheel is a hierarchical timer wheel that schedules all timeouts of a
+ * libdbus connection. Adding and removing a timeout takes constant time, and
+ * the wheel uses a single timer source (a timerfd watched through the event
+ * backend where available, an NSTimer otherwise) that is armed for the next
+ * tick at which a timeout expires or needs to be moved to a lower level.
+ */
+@interface DKTimerWheel: NSObject <DKEventHandler>
+{
+  id context;
+  DKEventBackend *backend;
+  DKTimerNode *slots[DKTimerWheelLevels][DKTimerWheelSlots];
+  uint64_t occupied[DKTimerWheelLevels];
+  DKTimerNode *freeNodes;
+  NSUInteger count;
+  NSTimeInterval origin;
+  uint64_t now;
+  uint64_t armedTick;
+  BOOL armed;
+# if defined(__linux__)
+  int timerDescriptor;
+# else
+  NSTimer *timer;
+# endif
+}
+
+/**
+ * Initializes a timer wheel for the run loop context of a connection. The
+ * context is not retained and provides the event backend and the worker.
+ */
+- (id)initWithContext: (id)aContext;
+
+/**
+ * Schedules <var>timeout</var> to fire after its interval, replacing any
+ * previous schedule for it.
+ */
+- (BOOL)addTimeout: (DBusTimeout*)timeout;
+
+/**
+ * Cancels <var>timeout</var>.
+ */
+- (void)removeTimeout: (DBusTimeout*)timeout;
+
+/**
+ * Returns the number of scheduled timeouts.
+ */
+- (NSUInteger)count;
+
+/**
+ * Returns whether the wheel is attached to an event backend.
+ */
+- (BOOL)isMonitoring;
+
+/**
+ * Attaches the timer source of the wheel to the event backend of the current
+ * thread.
+ */
+- (void)monitorForEvents;
+
+/**
+ * Detaches the timer source from the event backend.
+ */
+- (void)unmonitorForEvents;
+
+/**
+ * Returns the worker of the context.
+ */
+- (DKWorker*)worker;
+
+/**
+ * Fires all timeouts that have expired by now.
+ */
+- (void)fireExpiredTimeouts;
+@end
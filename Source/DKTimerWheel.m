@@ -0,0 +1,524 @@
+/** Implementation of the DKTimerWheel class scheduling libdbus timeouts.
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+   */
+
+#import "DKTimerWheel.h"
+
+#import <Foundation/NSDate.h>
+#import <Foundation/NSDebug.h>
+#import <Foundation/NSRunLoop.h>
+#import <Foundation/NSTimer.h>
+#import <GNUstepBase/NSDebug+GNUstepBase.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__linux__)
+#  include <errno.h>
+#  include <unistd.h>
+#  include <sys/timerfd.h>
+#endif
+
+/*
+ * Length of a tick in seconds.
+ */
+#define DKTimerWheelTick 0.01
+
+#define DKTimerWheelSlotMask ((uint64_t)(DKTimerWheelSlots - 1))
+
+/*
+ * Number of ticks covered by the whole wheel.
+ */
+#define DKTimerWheelRange \
+  ((uint64_t)1 << (DKTimerWheelSlotBits * DKTimerWheelLevels))
+
+@interface NSObject (DKTimerWheelContext)
+- (DKEventBackend*)eventBackend;
+- (DKWorker*)worker;
+- (NSRunLoop*)runLoop;
+- (NSString*)runLoopMode;
+@end
+
+static inline NSTimeInterval
+DKMonotonicTime()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (NSTimeInterval)ts.tv_sec + ((NSTimeInterval)ts.tv_nsec / 1e9);
+}
+
+@implementation DKTimerWheel
+- (id)initWithContext: (id)aContext
+{
+  if (nil == (self = [super init]))
+  {
+    return nil;
+  }
+  context = aContext;
+  origin = DKMonotonicTime();
+# if defined(__linux__)
+  timerDescriptor = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (-1 == timerDescriptor)
+  {
+    NSWarnMLog(@"Could not create timer descriptor: %s", strerror(errno));
+    [self release];
+    return nil;
+  }
+# endif
+  return self;
+}
+
+- (uint64_t)_currentTick
+{
+  return (uint64_t)((DKMonotonicTime() - origin) / DKTimerWheelTick);
+}
+
+/*
+ * Links the node into the slot for its expiry. The level is chosen by the
+ * distance to the current tick of the wheel. Nodes expiring beyond the range
+ * of the wheel go into the outermost level and will be re-linked when their
+ * slot is cascaded.
+ */
+- (void)_linkNode: (DKTimerNode*)node
+{
+  uint64_t expiry = MAX(node->expiry, now);
+  uint64_t delta = expiry - now;
+  unsigned level = 0;
+  unsigned slot = 0;
+
+  while (((level + 1) < DKTimerWheelLevels)
+    && (delta >= ((uint64_t)1 << (DKTimerWheelSlotBits * (level + 1)))))
+  {
+    level++;
+  }
+  if (delta >= DKTimerWheelRange)
+  {
+    expiry = now + DKTimerWheelRange - 1;
+  }
+  slot = (unsigned)((expiry >> (DKTimerWheelSlotBits * level)) & DKTimerWheelSlotMask);
+
+  node->level = level;
+  node->slot = slot;
+  node->prev = NULL;
+  node->next = slots[level][slot];
+  if (NULL != node->next)
+  {
+    node->next->prev = node;
+  }
+  slots[level][slot] = node;
+  occupied[level] |= ((uint64_t)1 << slot);
+}
+
+- (void)_unlinkNode: (DKTimerNode*)node
+{
+  if (NULL != node->prev)
+  {
+    node->prev->next = node->next;
+  }
+  else
+  {
+    slots[node->level][node->slot] = node->next;
+    if (NULL == node->next)
+    {
+      occupied[node->level] &= ~((uint64_t)1 << node->slot);
+    }
+  }
+  if (NULL != node->next)
+  {
+    node->next->prev = node->prev;
+  }
+  node->next = NULL;
+  node->prev = NULL;
+}
+
+/*
+ * Moves the nodes from the current slot of <var>level</var> to the lower
+ * levels. The slot is detached first because nodes that are still out of
+ * range end up in the same slot again.
+ */
+- (void)_cascadeLevel: (unsigned)level
+{
+  unsigned slot = (unsigned)((now >> (DKTimerWheelSlotBits * level)) & DKTimerWheelSlotMask);
+  DKTimerNode *node = NULL;
+
+  if ((0 == slot) && ((level + 1) < DKTimerWheelLevels))
+  {
+    [self _cascadeLevel: (level + 1)];
+  }
+  node = slots[level][slot];
+  slots[level][slot] = NULL;
+  occupied[level] &= ~((uint64_t)1 << slot);
+  while (NULL != node)
+  {
+    DKTimerNode *next = node->next;
+    [self _linkNode: node];
+    node = next;
+  }
+}
+
+/*
+ * Fires the timeouts in the level 0 slot for the current tick. Each node is
+ * rescheduled before libdbus handles it (libdbus timeouts repeat until they
+ * are removed), so libdbus is free to remove or re-add it while handling.
+ * Rescheduled nodes never end up in the current slot again, so the loop
+ * terminates.
+ */
+- (void)_fireCurrentSlot
+{
+  unsigned slot = (unsigned)(now & DKTimerWheelSlotMask);
+  DKTimerNode *node = NULL;
+  while (NULL != (node = slots[0][slot]))
+  {
+    DBusTimeout *timeout = node->timeout;
+    [self _unlinkNode: node];
+    node->expiry = now + node->interval;
+    [self _linkNode: node];
+    NSDebugMLog(@"Handling timeout");
+    /*
+     * Note: dbus_timeout_handle() returns FALSE on OOM, but the documentation
+     * specifies we just ignore that and retry the next time the timeout fires.
+     */
+    dbus_timeout_handle(timeout);
+  }
+}
+
+/*
+ * Advances the wheel to <var>target</var>, jumping straight to the ticks at
+ * which level 0 slots are occupied or the higher levels need to be cascaded.
+ */
+- (void)_advanceTo: (uint64_t)target
+{
+  while (now < target)
+  {
+    unsigned current = (unsigned)(now & DKTimerWheelSlotMask);
+    uint64_t pending = occupied[0] & ~((2ULL << current) - 1);
+    uint64_t next = 0;
+    if (0 == count)
+    {
+      now = target;
+      break;
+    }
+    if (0 != pending)
+    {
+      next = (now & ~DKTimerWheelSlotMask) + __builtin_ctzll(pending);
+    }
+    else
+    {
+      next = (now | DKTimerWheelSlotMask) + 1;
+    }
+    if (next > target)
+    {
+      now = target;
+      break;
+    }
+    now = next;
+    if (0 == (now & DKTimerWheelSlotMask))
+    {
+      [self _cascadeLevel: 1];
+    }
+    [self _fireCurrentSlot];
+  }
+}
+
+/*
+ * Computes the next tick at which a timeout expires or a slot of a higher
+ * level needs to be cascaded. Slots at or below the current index of a level
+ * belong to the next revolution of that level.
+ */
+- (BOOL)_nextEventTick: (uint64_t*)tick
+{
+  BOOL found = NO;
+  uint64_t best = 0;
+  unsigned level = 0;
+  for (level = 0; level < DKTimerWheelLevels; level++)
+  {
+    unsigned shift = DKTimerWheelSlotBits * level;
+    uint64_t bits = occupied[level];
+    uint64_t base = now >> shift;
+    unsigned current = (unsigned)(base & DKTimerWheelSlotMask);
+    uint64_t above = 0;
+    uint64_t index = 0;
+    uint64_t candidate = 0;
+    if (0 == bits)
+    {
+      continue;
+    }
+    above = bits & ~((2ULL << current) - 1);
+    if (0 != above)
+    {
+      index = __builtin_ctzll(above);
+    }
+    else
+    {
+      index = __builtin_ctzll(bits) + DKTimerWheelSlots;
+    }
+    candidate = ((base & ~DKTimerWheelSlotMask) + index) << shift;
+    if ((NO == found) || (candidate < best))
+    {
+      best = candidate;
+      found = YES;
+    }
+  }
+  *tick = best;
+  return found;
+}
+
+# if !defined(__linux__)
+- (void)_timerFired: (NSTimer*)aTimer
+{
+  armed = NO;
+  [self fireExpiredTimeouts];
+}
+# endif
+
+/*
+ * Arms the timer source for the next event. Unless <var>force</var> is set,
+ * this is skipped if the source is already armed for an earlier tick, which
+ * makes adding timeouts cheap. A source that fires early merely advances the
+ * wheel.
+ */
+- (void)_armForcing: (BOOL)force
+{
+  uint64_t tick = 0;
+  NSTimeInterval fireTime = 0;
+  BOOL hasEvent = [self _nextEventTick: &tick];
+
+  if ((NO == force) && armed && hasEvent && (armedTick <= tick))
+  {
+    return;
+  }
+  if ((NO == force) && (NO == armed) && (NO == hasEvent))
+  {
+    return;
+  }
+  armed = hasEvent;
+  armedTick = tick;
+  fireTime = origin + (tick * DKTimerWheelTick);
+
+# if defined(__linux__)
+  {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (hasEvent)
+    {
+      spec.it_value.tv_sec = (time_t)fireTime;
+      spec.it_value.tv_nsec = (long)((fireTime - spec.it_value.tv_sec) * 1e9);
+      if ((0 == spec.it_value.tv_sec) && (0 == spec.it_value.tv_nsec))
+      {
+        // A zero value would disarm the timer.
+        spec.it_value.tv_nsec = 1;
+      }
+    }
+    timerfd_settime(timerDescriptor, TFD_TIMER_ABSTIME, &spec, NULL);
+  }
+# else
+  [timer invalidate];
+  DESTROY(timer);
+  if (hasEvent && (nil != backend))
+  {
+    timer = [[NSTimer alloc] initWithFireDate: [NSDate dateWithTimeIntervalSinceNow: (fireTime - DKMonotonicTime())]
+                                     interval: 0
+                                       target: self
+                                     selector: @selector(_timerFired:)
+                                     userInfo: nil
+                                      repeats: NO];
+    [[context runLoop] addTimer: timer
+                        forMode: [context runLoopMode]];
+  }
+  else
+  {
+    armed = NO;
+  }
+# endif
+}
+
+- (BOOL)addTimeout: (DBusTimeout*)timeout
+{
+  DKTimerNode *node = (DKTimerNode*)dbus_timeout_get_data(timeout);
+  int milliSeconds = dbus_timeout_get_interval(timeout);
+  uint64_t tick = (uint64_t)(DKTimerWheelTick * 1000);
+  /*
+   * Round up in 64 bits: D-Bus uses INT_MAX for timeouts that should never
+   * expire, and adding the tick to that would overflow an int.
+   */
+  uint32_t interval = (uint32_t)MAX(1,
+    ((uint64_t)MAX(0, milliSeconds) + tick - 1) / tick);
+
+  if (NULL != node)
+  {
+    [self _unlinkNode: node];
+  }
+  else
+  {
+    if (NULL != freeNodes)
+    {
+      node = freeNodes;
+      freeNodes = node->next;
+    }
+    else
+    {
+      node = malloc(sizeof(DKTimerNode));
+      if (NULL == node)
+      {
+        return NO;
+      }
+    }
+    memset(node, 0, sizeof(DKTimerNode));
+    node->timeout = timeout;
+    dbus_timeout_set_data(timeout, node, NULL);
+    if (0 == count)
+    {
+      // Nothing to fire, so the idle wheel can catch up with the clock.
+      now = [self _currentTick];
+    }
+    count++;
+  }
+  /*
+   * The wheel might lag behind the clock, but we must not fire timeouts from
+   * within a libdbus callback, so we compute the expiry from the clock and let
+   * the node be cascaded in time.
+   */
+  node->interval = interval;
+  node->expiry = [self _currentTick] + interval;
+  [self _linkNode: node];
+  [self _armForcing: NO];
+  return YES;
+}
+
+- (void)removeTimeout: (DBusTimeout*)timeout
+{
+  DKTimerNode *node = (DKTimerNode*)dbus_timeout_get_data(timeout);
+  if (NULL == node)
+  {
+    return;
+  }
+  [self _unlinkNode: node];
+  dbus_timeout_set_data(timeout, NULL, NULL);
+  node->timeout = NULL;
+  node->next = freeNodes;
+  freeNodes = node;
+  count--;
+  // We don't disarm the timer source, a spurious wakeup is cheaper.
+}
+
+- (NSUInteger)count
+{
+  return count;
+}
+
+- (void)fireExpiredTimeouts
+{
+  [self _advanceTo: [self _currentTick]];
+  [self _armForcing: YES];
+}
+
+- (BOOL)isMonitoring
+{
+  return (nil != backend);
+}
+
+- (void)monitorForEvents
+{
+  if (nil != backend)
+  {
+    return;
+  }
+  backend = [[context eventBackend] retain];
+# if defined(__linux__)
+  [backend monitorFileDescriptor: timerDescriptor
+                       forEvents: DBUS_WATCH_READABLE
+                         handler: self];
+# endif
+  [self _armForcing: YES];
+}
+
+- (void)unmonitorForEvents
+{
+# if defined(__linux__)
+  [backend unmonitorFileDescriptor: timerDescriptor
+                         forEvents: DBUS_WATCH_READABLE
+                           handler: self];
+# else
+  [timer invalidate];
+  DESTROY(timer);
+  armed = NO;
+# endif
+  DESTROY(backend);
+}
+
+- (DKWorker*)worker
+{
+  return [context worker];
+}
+
+- (void)handleWatchEvents: (NSUInteger)flags
+{
+# if defined(__linux__)
+  uint64_t expirations = 0;
+  while (-1 != read(timerDescriptor, &expirations, sizeof(expirations)))
+  {
+    // Clear the timer descriptor.
+  }
+# endif
+  armed = NO;
+  [self fireExpiredTimeouts];
+}
+
+- (void)receivedEvent: (void*)data
+                 type: (RunLoopEventType)type
+                extra: (void*)extra
+              forMode: (NSString*)mode
+{
+  [self handleWatchEvents: DBUS_WATCH_READABLE];
+}
+
+- (void)dealloc
+{
+  unsigned level = 0;
+  unsigned slot = 0;
+  DKTimerNode *node = NULL;
+  [self unmonitorForEvents];
+  for (level = 0; level < DKTimerWheelLevels; level++)
+  {
+    for (slot = 0; slot < DKTimerWheelSlots; slot++)
+    {
+      node = slots[level][slot];
+      while (NULL != node)
+      {
+        DKTimerNode *next = node->next;
+        // The timeout might outlive us, so it must not point to the node.
+        dbus_timeout_set_data(node->timeout, NULL, NULL);
+        free(node);
+        node = next;
+      }
+    }
+  }
+  while (NULL != (node = freeNodes))
+  {
+    freeNodes = node->next;
+    free(node);
+  }
+# if defined(__linux__)
+  if (-1 != timerDescriptor)
+  {
+    close(timerDescriptor);
+  }
+# endif
+  [super dealloc];
+}
+@end
@@ -30,12 +30,16 @@
 #import <UnitKit/UnitKit.h>
 
 #import "DBusKit/DKProxy.h"
+#import "DBusKit/DKNumber.h"
+#import "DBusKit/DKPackedArray.h"
 #import "DBusKit/DKPort.h"
 #import "../Source/DKArgument.h"
 #import "../Source/DKBoxingUtils.h"
+#import "../Source/DKLazyContainers.h"
 
 #include <stdint.h>
 #include <math.h>
+#include <string.h>
 #include <dbus/dbus.h>
 
 @interface DKArgument (ExposeForTest)
@@ -44,6 +48,13 @@
  *
  */
 - (DKArgument*) DKArgumentWithObject: (id)object;
+
+/*
+ * Implemented by DKArrayTypeArgument and DKDictEntryTypeArgument respectively.
+ */
+- (DKArgument*) elementTypeArgument;
+- (DKArgument*) keyArgument;
+- (DKArgument*) valueArgument;
 @end
 
 @interface CustomUnboxableObject: NSObject
@@ -70,6 +81,17 @@
 }
 @end
 
+@interface CustomUnboxableInt16Object: NSObject
+- (int16_t)myInt16Value;
+@end
+
+@implementation CustomUnboxableInt16Object
+- (int16_t)myInt16Value
+{
+  return -23;
+}
+@end
+
 @interface TestDKArgument: NSObject <UKTest>
 @end
 
@@ -507,6 +529,41 @@ static NSDictionary *basicSigsAndClasses;
   [arg release];
 }
 
+- (void)testBoxingCache
+{
+  int32_t small = 42;
+  int32_t large = 1000000;
+  BOOL flag = YES;
+  DKArgument *intArg = [[DKArgument alloc] initWithDBusSignature: "i"
+                                                            name: nil
+                                                          parent: nil];
+  DKArgument *boolArg = [[DKArgument alloc] initWithDBusSignature: "b"
+                                                             name: nil
+                                                           parent: nil];
+  // Small values are shared, large ones are not cached:
+  UKObjectsSame([intArg boxedValueForValueAt: (void*)&small],
+    [intArg boxedValueForValueAt: (void*)&small]);
+  UKObjectsSame([boolArg boxedValueForValueAt: (void*)&flag],
+    [boolArg boxedValueForValueAt: (void*)&flag]);
+  UKObjectsEqual([NSNumber numberWithInt: 42],
+    [intArg boxedValueForValueAt: (void*)&small]);
+  UKObjectsEqual([NSNumber numberWithInt: 1000000],
+    [intArg boxedValueForValueAt: (void*)&large]);
+
+  // The type-safe numbers are cached per type:
+  UKObjectsSame([DKInt8Number numberWithInt8: -1],
+    [DKInt8Number numberWithInt8: -1]);
+  UKObjectsSame([DKUInt64Number numberWithUInt64: 255],
+    [DKUInt64Number numberWithUInt64: 255]);
+  UKFalse([DKUInt64Number numberWithUInt64: UINT64_MAX]
+    == [DKUInt64Number numberWithUInt64: UINT64_MAX]);
+  UKTrue((0 == strcmp(@encode(uint16_t),
+    [[DKUInt16Number numberWithUInt16: 7] objCType])));
+  UKIntsEqual(7, [[DKUInt16Number numberWithUInt16: 7] unsignedShortValue]);
+  [intArg release];
+  [boolArg release];
+}
+
 - (void)testSimpleBoxingDBusSignature
 {
   char *foo = "(ss)";
@@ -576,6 +633,30 @@ static NSDictionary *basicSigsAndClasses;
   [arg release];
 }
 
+- (void)testRegisteringUnboxingSelectorAfterLookup
+{
+  DKArgument *arg = [[DKArgument alloc] initWithDBusSignature: "n"
+                                                         name: nil
+                                                       parent: nil];
+  DKArgument *variantArg = [[DKArgument alloc] initWithDBusSignature: "v"
+                                                                name: nil
+                                                              parent: nil];
+  id boxedFoo = [[CustomUnboxableInt16Object alloc] init];
+  int16_t foo = [boxedFoo myInt16Value];
+  long long buffer = 0;
+
+  // The results for the class are cached until a new selector is registered.
+  UKFalse([arg unboxValue: boxedFoo intoBuffer: &buffer]);
+  UKNil([variantArg DKArgumentWithObject: boxedFoo]);
+  [DKArgument registerUnboxingSelector: @selector(myInt16Value)
+                           forDBusType: DBUS_TYPE_INT16];
+  TEST_UNBOX_INTTYPE(int16_t);
+  UKObjectsEqual(@"n", [[variantArg DKArgumentWithObject: boxedFoo] DBusTypeSignature]);
+  [boxedFoo release];
+  [variantArg release];
+  [arg release];
+}
+
 - (void)testGenerateArrayDBusSignatureForVariantType
 {
   NSArray *object = [[NSArray alloc] initWithObjects: @"foo", @"bar", nil];
@@ -677,4 +758,146 @@ static NSDictionary *basicSigsAndClasses;
   [data release];
   [dataArg release];
 }
+
+- (void)testNSDataArgumentReferencesMessage
+{
+  uint8_t bytes[1024];
+  NSData *data = nil;
+  NSData *result = nil;
+  NSUInteger i = 0;
+  DKArgument *dataArg  = [[DKArgument alloc] initWithDBusSignature: "ay"
+                                                              name: nil
+                                                            parent: nil];
+  DBusMessage *theMessage = NULL;
+  DBusMessageIter appendIter;
+  DBusMessageIter readIter;
+  for (i = 0; i < 1024; i++)
+  {
+    bytes[i] = (uint8_t)i;
+  }
+  data = [[NSData alloc] initWithBytes: bytes length: 1024];
+  [dataArg setAnnotationValue: @"NSData"
+                       forKey: @"org.gnustep.objc.class"];
+  theMessage = dbus_message_new_method_call("org.gnustep.dummy",
+    "/",
+    "org.gnustep.dummy",
+    "Dummy");
+  dbus_message_iter_init_append(theMessage, &appendIter);
+  [dataArg marshallObject: data intoIterator: &appendIter];
+  dbus_message_iter_init(theMessage, &readIter);
+  [DKArgument setMessageBeingUnmarshalled: theMessage];
+  result = [[dataArg unmarshalledObjectFromIterator: &readIter] retain];
+  [DKArgument setMessageBeingUnmarshalled: NULL];
+  UKTrue(NULL == [DKArgument messageBeingUnmarshalled]);
+  // The data keeps the message alive:
+  dbus_message_unref(theMessage);
+  UKObjectsEqual(data, result);
+  [result release];
+  [data release];
+  [dataArg release];
+}
+
+- (void)testPackedArrayArgument
+{
+  double doubles[3] = {0.5, -1.25, 1e10};
+  NSData *data = [NSData dataWithBytes: doubles length: sizeof(doubles)];
+  DKPackedArray *packed = [DKPackedArray arrayWithData: data
+                                              objCType: @encode(double)];
+  DKArgument *arrayArg = [[DKArgument alloc] initWithDBusSignature: "ad"
+                                                              name: nil
+                                                            parent: nil];
+  DKArgument *plainArg = [[DKArgument alloc] initWithDBusSignature: "ad"
+                                                              name: nil
+                                                            parent: nil];
+  DBusMessage *theMessage = NULL;
+  DBusMessageIter appendIter;
+  DBusMessageIter readIter;
+  id result = nil;
+  [arrayArg setAnnotationValue: @"DKPackedArray"
+                        forKey: @"org.gnustep.objc.class"];
+  UKIntsEqual(3, [packed count]);
+  UKObjectsEqual([NSNumber numberWithDouble: -1.25], [packed objectAtIndex: 1]);
+
+  theMessage = dbus_message_new_method_call("org.gnustep.dummy",
+    "/",
+    "org.gnustep.dummy",
+    "Dummy");
+  dbus_message_iter_init_append(theMessage, &appendIter);
+  [arrayArg marshallObject: packed intoIterator: &appendIter];
+  [arrayArg marshallObject: [NSArray arrayWithObjects: [NSNumber numberWithDouble: 0.5],
+    [NSNumber numberWithDouble: -1.25], [NSNumber numberWithDouble: 1e10], nil]
+              intoIterator: &appendIter];
+  UKTrue((0 == strcmp("adad", dbus_message_get_signature(theMessage))));
+
+  dbus_message_iter_init(theMessage, &readIter);
+  // Only annotated arguments return packed arrays:
+  result = [plainArg unmarshalledObjectFromIterator: &readIter];
+  UKFalse([result isKindOfClass: [DKPackedArray class]]);
+  UKObjectsEqual(packed, result);
+  dbus_message_iter_next(&readIter);
+  result = [arrayArg unmarshalledObjectFromIterator: &readIter];
+  UKTrue([result isKindOfClass: [DKPackedArray class]]);
+  UKTrue((0 == strcmp(@encode(double), [result objCType])));
+  UKTrue((0 == memcmp(doubles, [result bytes], sizeof(doubles))));
+  UKObjectsEqual(packed, result);
+  dbus_message_unref(theMessage);
+  [arrayArg release];
+  [plainArg release];
+}
+
+- (void)testLazyContainers
+{
+  DKArgument *dictArg = [[DKArgument alloc] initWithDBusSignature: "a{sv}"
+                                                             name: nil
+                                                           parent: nil];
+  DKArgument *arrayArg = [[DKArgument alloc] initWithDBusSignature: "as"
+                                                              name: nil
+                                                            parent: nil];
+  NSNumber *one = [NSNumber numberWithInt: 1];
+  NSDictionary *dict = [NSDictionary dictionaryWithObjectsAndKeys: one, @"one",
+    @"bar", @"foo", nil];
+  NSArray *array = [NSArray arrayWithObjects: @"foo", @"bar", @"baz", nil];
+  DBusMessage *theMessage = NULL;
+  DBusMessageIter appendIter;
+  DBusMessageIter readIter;
+  DBusMessageIter subIter;
+  DKLazyDictionary *lazyDict = nil;
+  DKLazyArray *lazyArray = nil;
+
+  theMessage = dbus_message_new_method_call("org.gnustep.dummy",
+    "/",
+    "org.gnustep.dummy",
+    "Dummy");
+  dbus_message_iter_init_append(theMessage, &appendIter);
+  [dictArg marshallObject: dict intoIterator: &appendIter];
+  [arrayArg marshallObject: array intoIterator: &appendIter];
+
+  dbus_message_iter_init(theMessage, &readIter);
+  dbus_message_iter_recurse(&readIter, &subIter);
+  lazyDict = [[DKLazyDictionary alloc] initWithIterator: &subIter
+                                                message: theMessage
+                                            keyArgument: [[dictArg elementTypeArgument] keyArgument]
+                                          valueArgument: [[dictArg elementTypeArgument] valueArgument]];
+  dbus_message_iter_next(&readIter);
+  dbus_message_iter_recurse(&readIter, &subIter);
+  lazyArray = [[DKLazyArray alloc] initWithIterator: &subIter
+                                            message: theMessage
+                                    elementArgument: [arrayArg elementTypeArgument]];
+  // The containers keep the message alive:
+  dbus_message_unref(theMessage);
+
+  UKIntsEqual(2, [lazyDict count]);
+  UKIntsEqual(1, [[lazyDict objectForKey: @"one"] intValue]);
+  UKObjectsEqual(@"bar", [lazyDict objectForKey: @"foo"]);
+  UKNil([lazyDict objectForKey: @"bar"]);
+  UKObjectsEqual(dict, lazyDict);
+  UKIntsEqual(3, [lazyArray count]);
+  UKObjectsEqual(@"baz", [lazyArray objectAtIndex: 2]);
+  UKObjectsSame([lazyArray objectAtIndex: 2], [lazyArray objectAtIndex: 2]);
+  UKObjectsEqual(array, lazyArray);
+  [lazyDict release];
+  [lazyArray release];
+  [dictArg release];
+  [arrayArg release];
+}
 @end
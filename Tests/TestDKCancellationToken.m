@@ -0,0 +1,54 @@
+/* Unit tests for DKCancellationToken
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+
+   */
+#import <Foundation/NSObject.h>
+#import <UnitKit/UnitKit.h>
+
+#import "DBusKit/DKCancellationToken.h"
+
+@interface DKCancellationToken (Private)
+- (BOOL)_addCall: (id)call;
+- (void)_removeCall: (id)call;
+@end
+
+@interface TestDKCancellationToken: NSObject <UKTest>
+@end
+
+@implementation TestDKCancellationToken
+- (void)testCancel
+{
+  DKCancellationToken *token = [DKCancellationToken token];
+  UKFalse([token isCancelled]);
+  [token cancel];
+  UKTrue([token isCancelled]);
+  // Cancelling twice is harmless:
+  [token cancel];
+  UKTrue([token isCancelled]);
+}
+
+- (void)testAddCallAfterCancel
+{
+  DKCancellationToken *token = [DKCancellationToken token];
+  NSObject *call = [[NSObject new] autorelease];
+  UKTrue([token _addCall: call]);
+  [token _removeCall: call];
+  [token cancel];
+  UKFalse([token _addCall: call]);
+}
+@end
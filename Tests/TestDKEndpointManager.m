@@ -24,8 +24,10 @@
 #import <UnitKit/UnitKit.h>
 
 #import "../Source/DKEndpointManager.h"
+#import "../Source/DKMethodCall.h"
 #import "../Headers/DKPort.h"
 
+#include <time.h>
 #include <unistd.h>
 
 @interface DKTestDummy: NSObject
@@ -37,12 +39,53 @@
 @interface DKTestMultiCaller: NSObject
 @end
 
+@interface DKTestContentionProducer: NSObject
+@end
+
+/*
+ * Keeps a worker thread busy until it is told to go on, so that the ring buffer
+ * of the worker can be filled.
+ */
+@interface DKTestBlocker: NSObject
+{
+  NSCondition *condition;
+  BOOL started;
+  BOOL released;
+}
+- (BOOL)waitUntilStarted;
+- (void)unblock;
+@end
+
+/*
+ * Requests targeting method calls may run inline if the ring buffer is full.
+ * This one records the thread it was performed on.
+ */
+@interface DKTestInlineCall: DKMethodCall
+{
+  NSThread *performingThread;
+}
+- (NSThread*)performingThread;
+@end
+
+/*
+ * Number of requests each producer thread inserts in
+ * -testRingBufferConcurrentProducers. The throughput under contention is
+ * measured by the contention mode of dk_benchmark instead.
+ */
+#define DKTestContentionRequests 100
+
 @implementation DKTestDummy
 - (BOOL)boolFunction: (id)ignored
 {
   return YES;
 }
 
+- (BOOL)boolSlow: (id)ignored
+{
+  sleep(1);
+  return YES;
+}
+
 - (BOOL)boolMulti: (id)ignored
 {
   callCount++;
@@ -55,6 +98,11 @@
   callCount++;
 }
 
+- (void)atomicMulti: (id)ignored
+{
+  __sync_fetch_and_add(&callCount, 1);
+}
+
 - (int)callCount
 {
   return callCount;
@@ -74,6 +122,103 @@
 }
 @end
 
+@implementation DKTestContentionProducer
+- (void)run: (DKTestDummy*)dummy
+{
+  NSAutoreleasePool *arp = [NSAutoreleasePool new];
+  DKEndpointManager *manager = [DKEndpointManager sharedEndpointManager];
+  NSUInteger count = 0;
+  for (count = 0; count < DKTestContentionRequests; count++)
+  {
+    [manager boolReturnForPerformingSelector: @selector(atomicMulti:)
+                                      target: dummy
+                                        data: nil
+                               waitForReturn: NO];
+  }
+  [arp release];
+}
+@end
+
+@implementation DKTestBlocker
+- (id)init
+{
+  if (nil == (self = [super init]))
+  {
+    return nil;
+  }
+  condition = [NSCondition new];
+  return self;
+}
+
+- (BOOL)block: (id)ignored
+{
+  [condition lock];
+  started = YES;
+  [condition broadcast];
+  while (NO == released)
+  {
+    [condition wait];
+  }
+  [condition unlock];
+  return YES;
+}
+
+- (BOOL)waitUntilStarted
+{
+  NSDate *limit = [NSDate dateWithTimeIntervalSinceNow: 10];
+  BOOL didStart = NO;
+  [condition lock];
+  while ((NO == started) && [condition waitUntilDate: limit])
+  {
+    // Loop until the worker has picked up the request or we time out.
+  }
+  didStart = started;
+  [condition unlock];
+  return didStart;
+}
+
+- (void)unblock
+{
+  [condition lock];
+  released = YES;
+  [condition broadcast];
+  [condition unlock];
+}
+
+- (void)unblockAfterDelay: (id)ignored
+{
+  NSAutoreleasePool *arp = [NSAutoreleasePool new];
+  sleep(1);
+  [self unblock];
+  [arp release];
+}
+
+- (void)dealloc
+{
+  [condition release];
+  [super dealloc];
+}
+@end
+
+@implementation DKTestInlineCall
+- (BOOL)recordThread: (id)ignored
+{
+  ASSIGN(performingThread, [NSThread currentThread]);
+  return YES;
+}
+
+- (NSThread*)performingThread
+{
+  return performingThread;
+}
+
+- (void)dealloc
+{
+  [performingThread release];
+  [super dealloc];
+}
+@end
+
 @interface TestDKEndpointManager: NSObject <UKTest>
 @end
 
@@ -92,6 +237,190 @@
   UKNotNil([[DKEndpointManager sharedEndpointManager] workerThread]);
 }
 
+- (void)testWorkerThreadPerEndpoint
+{
+  DKEndpointManager *manager = [DKEndpointManager sharedEndpointManager];
+  BOOL oldSetting = [manager usesWorkerThreadPerEndpoint];
+  DKWorker *worker = nil;
+  [manager setUsesWorkerThreadPerEndpoint: NO];
+  UKObjectsEqual([manager workerThread], [[manager workerForNewEndpoint] thread]);
+  [manager setUsesWorkerThreadPerEndpoint: YES];
+  worker = [[manager workerForNewEndpoint] retain];
+  UKNotNil([worker thread]);
+  UKObjectsNotEqual([manager workerThread], [worker thread]);
+  UKTrue([manager isWorkerThread: [worker thread]]);
+  UKFalse([manager isWorkerThread: [NSThread currentThread]]);
+  [manager retireWorker: worker];
+  [worker release];
+  [manager setUsesWorkerThreadPerEndpoint: oldSetting];
+}
+
+- (void)testRequestQueueConfiguration
+{
+  DKEndpointManager *manager = [DKEndpointManager sharedEndpointManager];
+  DKRequestQueueFullPolicy oldPolicy = [manager requestQueueFullPolicy];
+  UKTrue([manager requestQueueCapacity] > 0);
+  UKTrue([manager requestQueueCapacity] <= [manager maximumRequestQueueCapacity]);
+  [manager setRequestQueueFullPolicy: DKRequestQueueRunInline];
+  UKIntsEqual(DKRequestQueueRunInline, [manager requestQueueFullPolicy]);
+  [manager setRequestQueueFullPolicy: oldPolicy];
+}
+
+/*
+ * Returns a worker with a small ring buffer whose thread is kept busy by
+ * <var>blocker</var>, with the ring filled up to its maximum capacity by
+ * requests to <var>dummy</var>.
+ */
+- (DKWorker*)_filledWorkerBlockedBy: (DKTestBlocker*)blocker
+                         withDummy: (DKTestDummy*)dummy
+{
+  DKEndpointManager *manager = [DKEndpointManager sharedEndpointManager];
+  DKWorker *worker = [[DKWorker alloc] initWithName: @"DBusKit test worker thread"
+                                            manager: manager
+                                           capacity: 4
+                                    maximumCapacity: 8];
+  NSUInteger count = 0;
+  UKNotNil(worker);
+  UKTrue([manager boolReturnForPerformingSelector: @selector(block:)
+                                           target: blocker
+                                             data: nil
+                                    waitForReturn: NO
+                                           worker: worker]);
+  // The blocker is taken out of the ring once the worker is stuck in it.
+  UKTrue([blocker waitUntilStarted]);
+  for (count = 0; count < 8; count++)
+  {
+    UKTrue([manager boolReturnForPerformingSelector: @selector(atomicMulti:)
+                                             target: dummy
+                                               data: nil
+                                      waitForReturn: NO
+                                             worker: worker]);
+  }
+  // The ring had to grow to hold all requests.
+  UKIntsEqual(8, [worker requestQueueCapacity]);
+  UKIntsEqual([worker maximumRequestQueueCapacity], [worker requestQueueCapacity]);
+  return [worker autorelease];
+}
+
+- (void)_waitForCalls: (int)expected
+              toDummy: (DKTestDummy*)dummy
+{
+  NSUInteger count = 0;
+  for (count = 0; (count < 100) && ([dummy callCount] < expected); count++)
+  {
+    usleep(100000);
+  }
+  UKIntsEqual(expected, [dummy callCount]);
+}
+
+- (void)testRequestQueueFullFail
+{
+  DKEndpointManager *manager = [DKEndpointManager sharedEndpointManager];
+  DKRequestQueueFullPolicy oldPolicy = [manager requestQueueFullPolicyForCurrentThread];
+  DKTestBlocker *blocker = [DKTestBlocker new];
+  DKTestDummy *dummy = [DKTestDummy new];
+  DKWorker *worker = nil;
+  [manager setRequestQueueFullPolicyForCurrentThread: DKRequestQueueFail];
+  worker = [self _filledWorkerBlockedBy: blocker
+                              withDummy: dummy];
+  UKRaisesExceptionNamed([manager boolReturnForPerformingSelector: @selector(atomicMulti:)
+                                                           target: dummy
+                                                             data: nil
+                                                    waitForReturn: NO
+                                                           worker: worker],
+    @"DKRequestQueueFullException");
+  UKRaisesExceptionNamed([manager boolReturnForPerformingSelector: @selector(boolMulti:)
+                                                           target: dummy
+                                                             data: nil
+                                                    waitForReturn: YES
+                                                           worker: worker],
+    @"DKRequestQueueFullException");
+  [blocker unblock];
+  // The rejected requests must not have been performed.
+  [self _waitForCalls: 8
+              toDummy: dummy];
+  [manager setRequestQueueFullPolicyForCurrentThread: oldPolicy];
+  [manager retireWorker: worker];
+  [dummy release];
+  [blocker release];
+}
+
+- (void)testRequestQueueFullRunInline
+{
+  DKEndpointManager *manager = [DKEndpointManager sharedEndpointManager];
+  DKRequestQueueFullPolicy oldPolicy = [manager requestQueueFullPolicyForCurrentThread];
+  DKTestBlocker *blocker = [DKTestBlocker new];
+  DKTestDummy *dummy = [DKTestDummy new];
+  DKTestInlineCall *call = [DKTestInlineCall new];
+  DKWorker *worker = nil;
+  [manager setRequestQueueFullPolicyForCurrentThread: DKRequestQueueRunInline];
+  worker = [self _filledWorkerBlockedBy: blocker
+                              withDummy: dummy];
+  // Method calls are performed on the calling thread.
+  UKTrue([manager boolReturnForPerformingSelector: @selector(recordThread:)
+                                           target: call
+                                             data: nil
+                                    waitForReturn: YES
+                                           worker: worker]);
+  UKObjectsEqual([NSThread currentThread], [call performingThread]);
+  /*
+   * Everything else needs to run on the worker thread, so the calling thread
+   * waits for space as with the block policy.
+   */
+  [NSThread detachNewThreadSelector: @selector(unblockAfterDelay:)
+                           toTarget: blocker
+                         withObject: nil];
+  UKTrue([manager boolReturnForPerformingSelector: @selector(atomicMulti:)
+                                           target: dummy
+                                             data: nil
+                                    waitForReturn: NO
+                                           worker: worker]);
+  [self _waitForCalls: 9
+              toDummy: dummy];
+  [manager setRequestQueueFullPolicyForCurrentThread: oldPolicy];
+  [manager retireWorker: worker];
+  [call release];
+  [dummy release];
+  [blocker release];
+}
+
+- (void)testRequestQueueFullBlock
+{
+  DKEndpointManager *manager = [DKEndpointManager sharedEndpointManager];
+  DKRequestQueueFullPolicy oldPolicy = [manager requestQueueFullPolicyForCurrentThread];
+  DKTestBlocker *blocker = [DKTestBlocker new];
+  DKTestDummy *dummy = [DKTestDummy new];
+  DKWorker *worker = nil;
+  [manager setRequestQueueFullPolicyForCurrentThread: DKRequestQueueBlock];
+  worker = [self _filledWorkerBlockedBy: blocker
+                              withDummy: dummy];
+  [NSThread detachNewThreadSelector: @selector(unblockAfterDelay:)
+                           toTarget: blocker
+                         withObject: nil];
+  // Returns once the worker has made room for the request.
+  UKTrue([manager boolReturnForPerformingSelector: @selector(boolMulti:)
+                                           target: dummy
+                                             data: nil
+                                    waitForReturn: YES
+                                           worker: worker]);
+  UKIntsEqual(9, [dummy callCount]);
+  [manager setRequestQueueFullPolicyForCurrentThread: oldPolicy];
+  [manager retireWorker: worker];
+  [dummy release];
+  [blocker release];
+}
+
+- (void)testDispatchBudget
+{
+  DKEndpointManager *manager = [DKEndpointManager sharedEndpointManager];
+  NSUInteger oldBudget = [manager dispatchBudget];
+  UKTrue(oldBudget > 0);
+  [manager setDispatchBudget: 0];
+  UKIntsEqual(1, [manager dispatchBudget]);
+  [manager setDispatchBudget: oldBudget];
+  UKIntsEqual(oldBudget, [manager dispatchBudget]);
+}
+
 - (void)testRingBufferReturn
 {
   DKTestDummy *dummy = [DKTestDummy new];
@@ -102,6 +431,32 @@
   [dummy release];
 }
 
+- (void)testRingBufferBlockingReturn
+{
+  DKTestDummy *dummy = [DKTestDummy new];
+# ifdef CLOCK_THREAD_CPUTIME_ID
+  struct timespec before;
+  struct timespec after;
+  double cpuSeconds = 0;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &before);
+# endif
+  UKTrue([[DKEndpointManager sharedEndpointManager] boolReturnForPerformingSelector: @selector(boolSlow:)
+                                                                             target: dummy
+                                                                               data: nil
+                                                                      waitForReturn: YES]);
+# ifdef CLOCK_THREAD_CPUTIME_ID
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &after);
+  cpuSeconds = (after.tv_sec - before.tv_sec)
+    + ((after.tv_nsec - before.tv_nsec) / 1e9);
+  /*
+   * The worker sleeps for a second. A waiter that parks instead of spinning
+   * uses only a small fraction of that in CPU time.
+   */
+  UKTrue(cpuSeconds < 0.25);
+# endif
+  [dummy release];
+}
+
 - (void)testRingBufferAsync
 {
   DKTestDummy *dummy = [DKTestDummy new];
@@ -120,6 +475,39 @@
   [dummy release];
 }
 
+- (void)testRingBufferWakeupCoalescing
+{
+  DKEndpointManager *manager = [DKEndpointManager sharedEndpointManager];
+  DKTestDummy *dummy = [DKTestDummy new];
+  NSUInteger avoidedBefore = [[[manager requestStatistics] objectForKey: @"avoidedWakeups"] unsignedIntegerValue];
+  NSUInteger avoidedAfter = 0;
+  NSUInteger count = 0;
+  /*
+   * The first request keeps the worker thread busy for a second while we insert
+   * the others. The worker clears the pending flag only once on its way into
+   * -drainBuffer:, so at most one of them can schedule a wakeup.
+   */
+  UKTrue([manager boolReturnForPerformingSelector: @selector(boolSlow:)
+                                           target: dummy
+                                             data: nil
+                                    waitForReturn: NO]);
+  for (count = 0; count < 5; count++)
+  {
+    UKTrue([manager boolReturnForPerformingSelector: @selector(atomicMulti:)
+                                             target: dummy
+                                               data: nil
+                                      waitForReturn: NO]);
+  }
+  for (count = 0; (count < 100) && ([dummy callCount] < 5); count++)
+  {
+    usleep(100000);
+  }
+  UKIntsEqual(5, [dummy callCount]);
+  avoidedAfter = [[[manager requestStatistics] objectForKey: @"avoidedWakeups"] unsignedIntegerValue];
+  UKTrue((avoidedAfter - avoidedBefore) >= 4);
+  [dummy release];
+}
+
 - (void)testRingBufferMultiProducer
 {
   NSUInteger count = 0;
@@ -146,4 +534,26 @@
   free(threads);
   free(callers);
 }
+
+- (void)testRingBufferConcurrentProducers
+{
+  DKTestDummy *dummy = [DKTestDummy new];
+  DKTestContentionProducer *producer = [DKTestContentionProducer new];
+  int expected = 4 * DKTestContentionRequests;
+  NSUInteger count = 0;
+  for (count = 0; count < 4; count++)
+  {
+    [NSThread detachNewThreadSelector: @selector(run:)
+                             toTarget: producer
+                           withObject: dummy];
+  }
+  // No request may be lost or run twice.
+  for (count = 0; (count < 100) && ([dummy callCount] < expected); count++)
+  {
+    usleep(100000);
+  }
+  UKIntsEqual(expected, [dummy callCount]);
+  [producer release];
+  [dummy release];
+}
 @end
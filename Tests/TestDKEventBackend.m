@@ -0,0 +1,130 @@
+/* Unit tests for DKEventBackend
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+
+   */
+#import <Foundation/NSDate.h>
+#import <Foundation/NSRunLoop.h>
+#import <UnitKit/UnitKit.h>
+
+#import "../Source/DKEventBackend.h"
+
+#include <unistd.h>
+
+@interface DKTestEventHandler: NSObject <DKEventHandler>
+{
+  @public
+  int fd;
+  NSUInteger readableCount;
+}
+@end
+
+@implementation DKTestEventHandler
+- (void)handleWatchEvents: (NSUInteger)flags
+{
+  char buf[16];
+  if (flags & DBUS_WATCH_READABLE)
+  {
+    readableCount++;
+    read(fd, buf, sizeof(buf));
+  }
+}
+
+- (void)receivedEvent: (void*)data
+                 type: (RunLoopEventType)type
+                extra: (void*)extra
+              forMode: (NSString*)mode
+{
+  if (ET_RDESC == type)
+  {
+    [self handleWatchEvents: DBUS_WATCH_READABLE];
+  }
+}
+@end
+
+@interface TestDKEventBackend: NSObject <UKTest>
+@end
+
+@implementation TestDKEventBackend
+/*
+ * Monitors a pipe with the backend and checks that toggling the descriptor
+ * suspends and resumes event delivery.
+ */
+- (void)runBackend: (DKEventBackend*)backend
+       withHandler: (DKTestEventHandler*)handler
+{
+  NSRunLoop *rl = [NSRunLoop currentRunLoop];
+  int fds[2];
+  UKIntsEqual(0, pipe(fds));
+  handler->fd = fds[0];
+  [backend attachToRunLoop: rl
+                      mode: NSDefaultRunLoopMode];
+  UKTrue([backend monitorFileDescriptor: fds[0]
+                              forEvents: DBUS_WATCH_READABLE
+                                handler: handler]);
+  write(fds[1], "x", 1);
+  [rl runUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+  UKIntsEqual(1, handler->readableCount);
+
+  // Disabled descriptors stay registered but do not report events:
+  [backend setEnabled: NO
+            forEvents: DBUS_WATCH_READABLE
+       fileDescriptor: fds[0]
+              handler: handler];
+  write(fds[1], "x", 1);
+  [rl runUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+  UKIntsEqual(1, handler->readableCount);
+
+  // Re-enabling picks up the data that arrived in the meantime:
+  [backend setEnabled: YES
+            forEvents: DBUS_WATCH_READABLE
+       fileDescriptor: fds[0]
+              handler: handler];
+  [rl runUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+  UKIntsEqual(2, handler->readableCount);
+
+  [backend unmonitorFileDescriptor: fds[0]
+                         forEvents: DBUS_WATCH_READABLE
+                           handler: handler];
+  [backend detach];
+  close(fds[0]);
+  close(fds[1]);
+}
+
+- (void)testRunLoopBackendToggle
+{
+  DKEventBackend *backend = [[DKRunLoopEventBackend alloc] init];
+  DKTestEventHandler *handler = [[DKTestEventHandler alloc] init];
+  [self runBackend: backend
+       withHandler: handler];
+  [handler release];
+  [backend release];
+}
+
+#if defined(__linux__)
+- (void)testEpollBackendToggle
+{
+  DKEventBackend *backend = [[DKEpollEventBackend alloc] init];
+  DKTestEventHandler *handler = [[DKTestEventHandler alloc] init];
+  UKNotNil(backend);
+  [self runBackend: backend
+       withHandler: handler];
+  [handler release];
+  [backend release];
+}
+#endif
+@end
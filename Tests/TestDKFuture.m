@@ -0,0 +1,140 @@
+/* Unit tests for DKFuture
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02111 USA.
+
+   */
+#import <Foundation/NSAutoreleasePool.h>
+#import <Foundation/NSDate.h>
+#import <Foundation/NSError.h>
+#import <Foundation/NSException.h>
+#import <Foundation/NSRunLoop.h>
+#import <Foundation/NSString.h>
+#import <Foundation/NSThread.h>
+#import <UnitKit/UnitKit.h>
+
+#import "DBusKit/DKProxy.h"
+#import "../Source/DKFuture.h"
+
+@interface TestDKFuture: NSObject <UKTest>
+{
+  id completedResult;
+  NSError *completedError;
+  NSUInteger completionCount;
+}
+@end
+
+@implementation TestDKFuture
+- (void)callReturned: (id)result
+               error: (NSError*)error
+{
+  ASSIGN(completedResult, result);
+  ASSIGN(completedError, error);
+  completionCount++;
+}
+
+- (void)resolveLater: (DKFuture*)future
+{
+  NSAutoreleasePool *arp = [[NSAutoreleasePool alloc] init];
+  [NSThread sleepForTimeInterval: 0.1];
+  [future resolveWithObject: @"foo"];
+  [arp release];
+}
+
+- (void)testResolveWithObject
+{
+  id future = [[DKFuture alloc] init];
+  UKFalse([future isResolved]);
+  [future resolveWithObject: @"foo"];
+  UKTrue([future isResolved]);
+  UKTrue([future isKindOfClass: [NSString class]]);
+  UKObjectsEqual(@"foo", [future resolvedObject]);
+  UKIntsEqual(3, [future length]);
+  // Later resolutions are ignored:
+  [future resolveWithObject: @"bar"];
+  UKObjectsEqual(@"foo", [future resolvedObject]);
+  [future release];
+}
+
+- (void)testResolveWithException
+{
+  id future = [[DKFuture alloc] init];
+  [future resolveWithException: [NSException exceptionWithName: @"DKTestException"
+                                                        reason: @"Test"
+                                                      userInfo: nil]];
+  UKTrue([future isResolved]);
+  UKRaisesException([future length]);
+  UKRaisesException([future resolvedObject]);
+  [future release];
+}
+
+- (void)testBlockUntilResolved
+{
+  id future = [[DKFuture alloc] init];
+  [NSThread detachNewThreadSelector: @selector(resolveLater:)
+                           toTarget: self
+                         withObject: future];
+  // Blocks until the other thread has resolved the future:
+  UKIntsEqual(3, [future length]);
+  UKTrue([future isResolved]);
+  [future release];
+}
+
+- (void)testCompletionOnResolution
+{
+  id future = [[DKFuture alloc] init];
+  DKCallCompletion *completion = [[DKCallCompletion alloc] initWithHandler: self
+                                                                  selector: @selector(callReturned:error:)
+                                                                    thread: nil
+                                                                     modes: nil];
+  completionCount = 0;
+  [future setCompletion: completion];
+  [completion release];
+  [future resolveWithObject: @"foo"];
+  UKIntsEqual(1, completionCount);
+  UKObjectsEqual(@"foo", completedResult);
+  UKNil(completedError);
+  // The completion is only delivered once:
+  [future resolveWithObject: @"bar"];
+  UKIntsEqual(1, completionCount);
+  [future release];
+  DESTROY(completedResult);
+}
+
+- (void)testCompletionWithErrorOnThread
+{
+  DKCallCompletion *completion = [[DKCallCompletion alloc] initWithHandler: self
+                                                                  selector: @selector(callReturned:error:)
+                                                                    thread: [NSThread currentThread]
+                                                                     modes: nil];
+  completionCount = 0;
+  [completion completeWithObject: nil
+                       exception: [NSException exceptionWithName: @"DKTestException"
+                                                          reason: @"Test"
+                                                        userInfo: nil]];
+  // Delivery happens through the run loop of the thread:
+  UKIntsEqual(0, completionCount);
+  [[NSRunLoop currentRunLoop] runUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+  UKIntsEqual(1, completionCount);
+  UKNil(completedResult);
+  UKObjectsEqual(DKDBusErrorDomain, [completedError domain]);
+  UKObjectsEqual(@"Test", [completedError localizedDescription]);
+  UKObjectsEqual(@"DKTestException",
+    [[[completedError userInfo] objectForKey: DKExceptionErrorKey] name]);
+  [completion release];
+  DESTROY(completedError);
+}
+@end
@@ -20,8 +20,10 @@
    Boston, MA 02111 USA.
 
    */
+#import <Foundation/NSInvocation.h>
 #import <Foundation/NSMethodSignature.h>
 #import <Foundation/NSNull.h>
+#import <Foundation/NSValue.h>
 #import <UnitKit/UnitKit.h>
 
 #import "../Source/DKArgument.h"
@@ -71,6 +73,17 @@
   [method release];
 }
 
+- (void)testTimeoutAnnotation
+{
+  DKMethod *method = [[DKMethod alloc] initWithName: @"Fooify"
+                                             parent: nil];
+  UKTrue(0 == [method timeout]);
+  [method setAnnotationValue: @"0.5"
+                      forKey: @"org.gnustep.dbuskit.method.timeout"];
+  UKTrue(0.5 == [method timeout]);
+  [method release];
+}
+
 - (void)testBuiltInIntrospectSignatureBoxed
 {
   DKMethod *method = [_DKInterfaceIntrospectable DBusMethodForSelector: @selector(Introspect)];
@@ -106,6 +119,131 @@
   }
 }
 
+- (void)testMemoizedSignatures
+{
+  DKMethod *method = [[DKMethod alloc] initWithName: @"Fooify"
+                                             parent: nil];
+  DKArgument *arg = [[DKArgument alloc] initWithDBusSignature: "i"
+                                                         name: @"bar"
+                                                       parent: method];
+  NSMethodSignature *boxed = [method methodSignatureBoxed: YES];
+  UKObjectsSame(boxed, [method methodSignatureBoxed: YES]);
+  UKObjectsSame([method methodSignatureBoxed: NO], [method methodSignatureBoxed: NO]);
+  UKIntsEqual(2, [boxed numberOfArguments]);
+  // Adding arguments changes the signature:
+  [method addArgument: arg
+            direction: kDKArgumentDirectionIn];
+  UKIntsEqual(3, [[method methodSignatureBoxed: YES] numberOfArguments]);
+  UKTrue((0 == strcmp([[method methodSignatureBoxed: NO] getArgumentTypeAtIndex: 2], @encode(int32_t))));
+  [arg release];
+  [method release];
+}
+
+- (void)testMarshallingPlans
+{
+  DKMethod *method = [[DKMethod alloc] initWithName: @"Fooify"
+                                             parent: nil];
+  DKArgument *stringArg = [[DKArgument alloc] initWithDBusSignature: "s"
+                                                               name: @"string"
+                                                             parent: method];
+  DKArgument *intArg = [[DKArgument alloc] initWithDBusSignature: "i"
+                                                            name: @"number"
+                                                          parent: method];
+  DKArgument *boolArg = [[DKArgument alloc] initWithDBusSignature: "b"
+                                                             name: @"flag"
+                                                           parent: method];
+  DKArgument *returnArg = [[DKArgument alloc] initWithDBusSignature: "u"
+                                                               name: @"result"
+                                                             parent: method];
+  NSMethodSignature *generic = nil;
+  NSInvocation *plannedInv = nil;
+  NSInvocation *genericInv = nil;
+  NSInvocation *unboxedInv = nil;
+  NSString *string = @"foo";
+  NSNumber *number = [NSNumber numberWithInt: -42];
+  NSNumber *flag = [NSNumber numberWithBool: YES];
+  id value = nil;
+  int32_t intValue = 0;
+  BOOL flagValue = NO;
+  uint32_t result = 23;
+  DBusMessage *theMessage = NULL;
+  DBusMessage *theReply = NULL;
+  DBusMessageIter iter;
+
+  [method addArgument: stringArg
+            direction: kDKArgumentDirectionIn];
+  [method addArgument: intArg
+            direction: kDKArgumentDirectionIn];
+  [method addArgument: boolArg
+            direction: kDKArgumentDirectionIn];
+  [method addArgument: returnArg
+            direction: kDKArgumentDirectionOut];
+
+  // Plans are used for the memoized signatures, but not for equal ones.
+  generic = [NSMethodSignature signatureWithObjCTypes: [method objCTypesBoxed: YES]];
+  plannedInv = [NSInvocation invocationWithMethodSignature: [method methodSignatureBoxed: YES]];
+  genericInv = [NSInvocation invocationWithMethodSignature: generic];
+  unboxedInv = [NSInvocation invocationWithMethodSignature: [method methodSignatureBoxed: NO]];
+  [plannedInv setArgument: &string
+                  atIndex: 2];
+  [plannedInv setArgument: &number
+                  atIndex: 3];
+  [plannedInv setArgument: &flag
+                  atIndex: 4];
+
+  theMessage = dbus_message_new_method_call("org.gnustep.dummy",
+    "/",
+    "org.gnustep.dummy",
+    "Fooify");
+  dbus_message_iter_init_append(theMessage, &iter);
+  [method marshallFromInvocation: plannedInv
+                    intoIterator: &iter
+                     messageType: DBUS_MESSAGE_TYPE_METHOD_CALL];
+  UKTrue((0 == strcmp("sib", dbus_message_get_signature(theMessage))));
+
+  dbus_message_iter_init(theMessage, &iter);
+  [method unmarshallFromIterator: &iter
+                  intoInvocation: genericInv
+                     messageType: DBUS_MESSAGE_TYPE_METHOD_CALL];
+  [genericInv getArgument: &value
+                  atIndex: 2];
+  UKObjectsEqual(string, value);
+  [genericInv getArgument: &value
+                  atIndex: 3];
+  UKObjectsEqual(number, value);
+  [genericInv getArgument: &value
+                  atIndex: 4];
+  UKObjectsEqual(flag, value);
+
+  dbus_message_iter_init(theMessage, &iter);
+  [method unmarshallFromIterator: &iter
+                  intoInvocation: unboxedInv
+                     messageType: DBUS_MESSAGE_TYPE_METHOD_CALL];
+  [unboxedInv getArgument: &intValue
+                  atIndex: 3];
+  UKIntsEqual(-42, intValue);
+  [unboxedInv getArgument: &flagValue
+                  atIndex: 4];
+  UKTrue(flagValue);
+
+  theReply = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  dbus_message_append_args(theReply, DBUS_TYPE_UINT32, &result, DBUS_TYPE_INVALID);
+  dbus_message_iter_init(theReply, &iter);
+  [method unmarshallFromIterator: &iter
+                  intoInvocation: plannedInv
+                     messageType: DBUS_MESSAGE_TYPE_METHOD_RETURN];
+  [plannedInv getReturnValue: &value];
+  UKIntsEqual(23, [value unsignedIntValue]);
+
+  dbus_message_unref(theMessage);
+  dbus_message_unref(theReply);
+  [stringArg release];
+  [intArg release];
+  [boolArg release];
+  [returnArg release];
+  [method release];
+}
+
 - (void)testEmitMethodDeclaration
 {
 
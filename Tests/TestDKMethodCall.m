@@ -20,14 +20,19 @@
    Boston, MA 02111 USA.
 
    */
+#import <Foundation/NSAutoreleasePool.h>
 #import <Foundation/NSConnection.h>
+#import <Foundation/NSException.h>
 #import <Foundation/NSInvocation.h>
 #import <Foundation/NSMethodSignature.h>
 #import <Foundation/NSString.h>
+#import <Foundation/NSThread.h>
 #import <UnitKit/UnitKit.h>
 
+#import "DBusKit/DKCancellationToken.h"
 #import "DBusKit/DKPort.h"
 #import "DBusKit/DKProxy.h"
+#import "../Source/DKFuture.h"
 #import "../Source/DKProxy+Private.h"
 #import "../Source/DKInterface.h"
 #import "../Source/DKMethodCall.h"
@@ -40,7 +45,59 @@
 - (NSString*)Introspect;
 @end
 
+/*
+ * Name of a service that never answers, so that calls to it stay in flight
+ * until they are cancelled.
+ */
+#define DK_SILENT_SERVICE "org.gnustep.DBusKit.Test.Silent"
+
 @implementation TestDKMethodCall
+- (void)cancelLater: (DKCancellationToken*)token
+{
+  NSAutoreleasePool *arp = [[NSAutoreleasePool alloc] init];
+  [NSThread sleepForTimeInterval: 0.2];
+  [token cancel];
+  [arp release];
+}
+
+/*
+ * Takes a name on the session bus without ever reading from the connection.
+ */
+- (DBusConnection*)silentConnection
+{
+  DBusConnection *silent = dbus_bus_get_private(DBUS_BUS_SESSION, NULL);
+  if (NULL == silent)
+  {
+    return NULL;
+  }
+  if (DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER != dbus_bus_request_name(silent,
+    DK_SILENT_SERVICE, DBUS_NAME_FLAG_DO_NOT_QUEUE, NULL))
+  {
+    dbus_connection_close(silent);
+    dbus_connection_unref(silent);
+    return NULL;
+  }
+  return silent;
+}
+
+- (DKMethodCall*)newSilentCallWithToken: (DKCancellationToken*)token
+                             invocation: (NSInvocation*)inv
+{
+  DKProxy *aProxy = [DKProxy proxyWithService: @DK_SILENT_SERVICE
+                                         path: @"/"
+                                          bus: DKDBusSessionBus];
+  DKMethodCall *call = nil;
+  [inv setTarget: aProxy];
+  [inv setSelector: @selector(Introspect)];
+  // The call picks up the token of the thread when it is created.
+  [DKProxy setDBusCancellationToken: token];
+  call = [[DKMethodCall alloc] initWithProxy: aProxy
+                                      method: [_DKInterfaceIntrospectable DBusMethodForSelector: @selector(Introspect)]
+                                  invocation: inv];
+  [DKProxy setDBusCancellationToken: nil];
+  return call;
+}
+
 - (void)testMethodCall
 {
   NSConnection *conn = nil;
@@ -67,4 +124,71 @@
   UKTrue([returnValue length] > 0);
   [call release];
 }
+
+- (void)testCancelSynchronousCall
+{
+  DKCancellationToken *token = [DKCancellationToken token];
+  DBusConnection *silent = NULL;
+  NSMethodSignature *sig = [NSMethodSignature signatureWithObjCTypes: "@8@0:4"];
+  NSInvocation *inv = [NSInvocation invocationWithMethodSignature: sig];
+  DKMethodCall *call = nil;
+  NSString *name = nil;
+  NSWarnMLog(@"This test is an expected failure if the session message bus is not available!");
+  silent = [self silentConnection];
+  UKTrue(NULL != silent);
+  call = [self newSilentCallWithToken: token
+                           invocation: inv];
+  UKNotNil(call);
+  [NSThread detachNewThreadSelector: @selector(cancelLater:)
+                           toTarget: self
+                         withObject: token];
+  // Blocks until the token is cancelled, because the service never replies.
+  NS_DURING
+  {
+    [call sendSynchronously];
+  }
+  NS_HANDLER
+  {
+    name = [localException name];
+  }
+  NS_ENDHANDLER
+  UKObjectsEqual(@"DKDBusCallCancelledException", name);
+  [call release];
+  if (NULL != silent)
+  {
+    dbus_connection_close(silent);
+    dbus_connection_unref(silent);
+  }
+}
+
+- (void)testCancelFuture
+{
+  DKCancellationToken *token = [DKCancellationToken token];
+  DBusConnection *silent = NULL;
+  NSMethodSignature *sig = [NSMethodSignature signatureWithObjCTypes: "@8@0:4"];
+  NSInvocation *inv = [NSInvocation invocationWithMethodSignature: sig];
+  DKMethodCall *call = nil;
+  id future = nil;
+  NSWarnMLog(@"This test is an expected failure if the session message bus is not available!");
+  silent = [self silentConnection];
+  UKTrue(NULL != silent);
+  call = [self newSilentCallWithToken: token
+                           invocation: inv];
+  UKNotNil(call);
+  [call sendAsynchronously];
+  [inv getReturnValue: &future];
+  UKNotNil(future);
+  // Don't send anything else to the future, it would block until resolved.
+  UKFalse([future isResolved]);
+  [token cancel];
+  // Blocks until the worker thread has cancelled the call.
+  UKRaisesExceptionNamed([future resolvedObject], @"DKDBusCallCancelledException");
+  UKTrue([future isResolved]);
+  [call release];
+  if (NULL != silent)
+  {
+    dbus_connection_close(silent);
+    dbus_connection_unref(silent);
+  }
+}
 @end
@@ -27,12 +27,18 @@
 #undef INCLUDE_RUNTIME_H
 
 #import "DBusKit/DKProxy.h"
+#import "DBusKit/DKCancellationToken.h"
 #import "../Source/DKEndpoint.h"
+#import "../Source/DKMethod.h"
 #import "DBusKit/DKPort.h"
 #import "DBusKit/NSConnection+DBus.h"
 
 #import <Foundation/NSArray.h>
+#import <Foundation/NSDate.h>
+#import <Foundation/NSError.h>
 #import <Foundation/NSException.h>
+#import <Foundation/NSInvocation.h>
+#import <Foundation/NSNull.h>
 #import <Foundation/NSThread.h>
 #import <Foundation/NSXMLNode.h>
 
@@ -43,6 +49,8 @@
                 interface: (NSString**)interface;
 - (void)DBusBuildMethodCache;
 - (NSDictionary*)_interfaces;
+- (DKMethod*)_cachedDBusMethodForSelector: (SEL*)selector
+                                signature: (NSMethodSignature**)signature;
 - (NSXMLNode*)XMLNode;
 @end
 
@@ -107,6 +115,63 @@
   UKObjectsEqual(@"org.freedesktop.DBus", interface);
 }
 
+- (void)testSelectorCache
+{
+  NSString *mangledString = @"_DKIf_org_freedesktop_DBus_DKIfEnd_GetId";
+  SEL mangledSelector = 0;
+  SEL selector = 0;
+  DKMethod *first = nil;
+  NSConnection *conn = nil;
+  id proxy = nil;
+  NSWarnMLog(@"This test is an expected failure if the session message bus is not available!");
+  conn = [NSConnection connectionWithReceivePort: [DKPort port]
+                                        sendPort: [[[DKPort alloc] initWithRemote: @"org.freedesktop.DBus"] autorelease]];
+  proxy = [conn rootProxy];
+  // Call a method to trigger cache generation:
+  [proxy GetId];
+
+  sel_registerName([mangledString UTF8String]);
+  mangledSelector = NSSelectorFromString(mangledString);
+
+  // Resolve twice, the second time from the cache:
+  selector = mangledSelector;
+  first = [proxy _cachedDBusMethodForSelector: &selector
+                                    signature: NULL];
+  UKNotNil(first);
+  UKObjectsEqual(@"GetId", NSStringFromSelector(selector));
+  selector = mangledSelector;
+  UKObjectsSame(first, [proxy _cachedDBusMethodForSelector: &selector
+                                                 signature: NULL]);
+  UKObjectsEqual(@"GetId", NSStringFromSelector(selector));
+
+  // Misses are remembered as well:
+  selector = @selector(testSelectorCache);
+  UKNil([proxy _cachedDBusMethodForSelector: &selector
+                                  signature: NULL]);
+  UKNil([proxy _cachedDBusMethodForSelector: &selector
+                                  signature: NULL]);
+  UKTrue(sel_isEqual(@selector(testSelectorCache), selector));
+}
+
+- (void)testDirectDispatch
+{
+  NSConnection *conn = nil;
+  id aProxy = nil;
+  NSWarnMLog(@"This test is an expected failure if the session message bus is not available!");
+  conn = [NSConnection connectionWithReceivePort: [DKPort port]
+                                        sendPort: [[[DKPort alloc] initWithRemote: @"org.freedesktop.DBus"] autorelease]];
+  aProxy = [conn rootProxy];
+  // Returns a string, so it is forwarded, but builds the cache:
+  UKNotNil([aProxy GetId]);
+  // ListNames only deals in objects and is implemented by a generated class:
+  UKTrue([DKProxy class] == class_getSuperclass(object_getClass(aProxy)));
+  // The generated class is not visible to users of the proxy:
+  UKTrue([DKProxy class] == [aProxy class]);
+  UKTrue([aProxy isKindOfClass: [DKProxy class]]);
+  UKTrue([[aProxy ListNames] isKindOfClass: [NSArray class]]);
+  UKTrue([aProxy respondsToSelector: @selector(ListNames)]);
+}
+
 - (void)testSendIntrospectMessage
 {
   NSConnection *conn = nil;
@@ -194,6 +259,71 @@
   UKRaisesExceptionNamed([aProxy Hello], @"DKDBusRemoteErrorException");
 }
 
+- (void)testBatchCalls
+{
+  NSConnection *conn = nil;
+  id aProxy = nil;
+  NSInvocation *getId = nil;
+  NSInvocation *hello = nil;
+  NSArray *results = nil;
+  id returnValue = nil;
+  NSWarnMLog(@"This test is an expected failure if the session message bus is not available!");
+  conn = [NSConnection connectionWithReceivePort: [DKPort port]
+                                        sendPort: [[[DKPort alloc] initWithRemote: @"org.freedesktop.DBus"] autorelease]];
+  aProxy = [conn rootProxy];
+  getId = [NSInvocation invocationWithMethodSignature: [aProxy methodSignatureForSelector: @selector(GetId)]];
+  [getId setTarget: aProxy];
+  [getId setSelector: @selector(GetId)];
+  hello = [NSInvocation invocationWithMethodSignature: [aProxy methodSignatureForSelector: @selector(Hello)]];
+  [hello setTarget: aProxy];
+  [hello setSelector: @selector(Hello)];
+
+  results = [DKProxy invokeBatch: [NSArray arrayWithObjects: getId, hello, nil]];
+  UKIntsEqual(2, [results count]);
+  UKObjectsEqual([NSNull null], [results objectAtIndex: 0]);
+  [getId getReturnValue: &returnValue];
+  UKTrue([returnValue isKindOfClass: [NSString class]]);
+  UKTrue([returnValue length] > 0);
+  // The second Hello is rejected by the bus:
+  UKTrue([[results objectAtIndex: 1] isKindOfClass: [NSError class]]);
+  UKObjectsEqual(DKDBusErrorDomain, [[results objectAtIndex: 1] domain]);
+}
+
+- (void)testPassedDeadline
+{
+  NSConnection *conn = nil;
+  id aProxy = nil;
+  NSWarnMLog(@"This test is an expected failure if the session message bus is not available!");
+  conn = [NSConnection connectionWithReceivePort: [DKPort port]
+                                        sendPort: [[[DKPort alloc] initWithRemote: @"org.freedesktop.DBus"] autorelease]];
+  aProxy = [conn rootProxy];
+  [DKProxy setDBusCallDeadline: [NSDate dateWithTimeIntervalSinceNow: -1]];
+  UKNotNil([DKProxy DBusCallDeadline]);
+  UKRaisesExceptionNamed([aProxy GetId], @"DKDBusTimeoutException");
+  [DKProxy setDBusCallDeadline: nil];
+  UKNil([DKProxy DBusCallDeadline]);
+  UKNotNil([aProxy GetId]);
+}
+
+- (void)testCancelledToken
+{
+  NSConnection *conn = nil;
+  id aProxy = nil;
+  DKCancellationToken *token = [DKCancellationToken token];
+  NSWarnMLog(@"This test is an expected failure if the session message bus is not available!");
+  conn = [NSConnection connectionWithReceivePort: [DKPort port]
+                                        sendPort: [[[DKPort alloc] initWithRemote: @"org.freedesktop.DBus"] autorelease]];
+  aProxy = [conn rootProxy];
+  [DKProxy setDBusCancellationToken: token];
+  UKObjectsSame(token, [DKProxy DBusCancellationToken]);
+  UKNotNil([aProxy GetId]);
+  [token cancel];
+  UKRaisesExceptionNamed([aProxy GetId], @"DKDBusCallCancelledException");
+  [DKProxy setDBusCancellationToken: nil];
+  UKNil([DKProxy DBusCancellationToken]);
+  UKNotNil([aProxy GetId]);
+}
+
 - (void)testUnboxedMethodCall
 {
   NSConnection *conn = nil;
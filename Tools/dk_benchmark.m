@@ -0,0 +1,634 @@
+/** Small tool to measure the performance of DBusKit.
+
+   Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   You should have received a copy of the GNU General Public
+   License along with this program; see the file COPYING.
+   If not, write to the Free Software Foundation,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+
+   */
+#import <Foundation/Foundation.h>
+#import <GNUstepBase/NSDebug+GNUstepBase.h>
+#import "DBusKit/DKNotificationCenter.h"
+#import "DBusKit/DKPort.h"
+#import "DBusKit/NSConnection+DBus.h"
+#import "../Source/DKArgument.h"
+#import "../Source/DKEndpointManager.h"
+#import "../Source/DKMethod.h"
+
+#include <unistd.h>
+
+/*
+ * Usage: dk_benchmark <benchmark> [-count <n>] [defaults...]
+ *
+ * Available benchmarks:
+ *   events  Messages per second sent through the message bus, once for each
+ *           event backend (the backends are compared by running the benchmark
+ *           in a child process with -DKEventBackend set accordingly).
+ *   signatures  Method signature lookups per second on a proxy and the number
+ *           of NSMethodSignature objects allocated for each lookup.
+ *   marshalling  Calls per second marshalled and unmarshalled for a method
+ *           taking (sib) and returning (u), with and without precompiled
+ *           marshalling plans (compared like the event backends, using the
+ *           DKMarshallingPlans default). Does not need a message bus.
+ *   containers  Time and objects allocated for unmarshalling a large a{sv}
+ *           dictionary and reading a few of its values, with eager and lazy
+ *           containers (using the DKLazyContainers default). Does not need a
+ *           message bus.
+ *   boxing  Time and objects allocated for unmarshalling an a{sv} dictionary
+ *           of small integers and booleans, with and without the cache for
+ *           boxed numbers (using the DKBoxingCache default). Does not need a
+ *           message bus.
+ *   signals  Signals per second dispatched by the notification center and the
+ *           number of objects allocated for each of them, with and without
+ *           interned header strings (using the DKInternedStrings default).
+ *   contention  Requests per second passed to the worker thread by 1, 2, 4, ...
+ *           32 producer threads at the same time. Each producer inserts
+ *           -count requests (2000 by default). Does not need a message bus.
+ */
+
+@interface NSObject (DKBenchmarkBusMethods)
+- (NSString*)GetId;
+@end
+
+@interface DKNotificationCenter (DKBenchmarkPrivate)
+- (BOOL)_handleMessage: (DBusMessage*)msg;
+@end
+
+@interface DKBenchmarkObserver: NSObject
+{
+  @public
+  NSUInteger received;
+}
+@end
+
+@implementation DKBenchmarkObserver
+- (void)receiveNotification: (NSNotification*)notification
+{
+  received++;
+}
+@end
+
+@interface DKBenchmarkProducer: NSObject
+{
+  @public
+  NSUInteger requests;
+  int performed;
+}
+@end
+
+@implementation DKBenchmarkProducer
+- (void)perform: (id)ignored
+{
+  __sync_fetch_and_add(&performed, 1);
+}
+
+- (void)run: (id)ignored
+{
+  NSAutoreleasePool *arp = [NSAutoreleasePool new];
+  DKEndpointManager *manager = [DKEndpointManager sharedEndpointManager];
+  NSUInteger i = 0;
+  for (i = 0; i < requests; i++)
+  {
+    [manager boolReturnForPerformingSelector: @selector(perform:)
+                                      target: self
+                                        data: NULL
+                               waitForReturn: NO];
+  }
+  [arp release];
+}
+@end
+
+static NSUInteger
+DKBenchmarkCount(NSUInteger fallback)
+{
+  NSInteger count = [[NSUserDefaults standardUserDefaults] integerForKey: @"count"];
+  return (count > 0) ? (NSUInteger)count : fallback;
+}
+
+/*
+ * Runs the benchmark in a child process for every value of the user default.
+ * The children run <var>fallback</var> iterations unless a count was given.
+ */
+static void
+DKBenchmarkCompare(NSString *benchmark, NSString *defaultName, NSArray *values,
+  NSUInteger fallback)
+{
+  NSString *path = [[[NSProcessInfo processInfo] arguments] objectAtIndex: 0];
+  NSEnumerator *theEnum = [values objectEnumerator];
+  NSString *value = nil;
+  while (nil != (value = [theEnum nextObject]))
+  {
+    NSTask *task = [[NSTask alloc] init];
+    NSMutableArray *args = [NSMutableArray arrayWithObjects: benchmark,
+      [@"-" stringByAppendingString: defaultName], value, nil];
+    [args addObject: @"-count"];
+    [args addObject: [NSString stringWithFormat: @"%lu",
+      (unsigned long)DKBenchmarkCount(fallback)]];
+    [task setLaunchPath: path];
+    [task setArguments: args];
+    [task launch];
+    [task waitUntilExit];
+    [task release];
+  }
+}
+
+static int
+DKBenchmarkEvents()
+{
+  NSString *backend = [[NSUserDefaults standardUserDefaults] stringForKey: @"DKEventBackend"];
+  NSUInteger count = DKBenchmarkCount(10000);
+  NSUInteger i = 0;
+  NSConnection *conn = nil;
+  id proxy = nil;
+  NSDate *start = nil;
+  NSTimeInterval elapsed = 0;
+
+  if (nil == backend)
+  {
+    DKBenchmarkCompare(@"events", @"DKEventBackend",
+      [NSArray arrayWithObjects: @"runloop", @"epoll", nil], 10000);
+    return 0;
+  }
+
+  conn = [NSConnection connectionWithReceivePort: [DKPort port]
+                                        sendPort: [[[DKPort alloc] initWithRemote: @"org.freedesktop.DBus"] autorelease]];
+  proxy = [conn rootProxy];
+  if (nil == proxy)
+  {
+    fprintf(stderr, "Could not connect to the session bus.\n");
+    return 1;
+  }
+  // Warm up: builds the method cache and sets up the connection.
+  [proxy GetId];
+
+  start = [NSDate date];
+  for (i = 0; i < count; i++)
+  {
+    NSAutoreleasePool *arp = [NSAutoreleasePool new];
+    [proxy GetId];
+    [arp release];
+  }
+  elapsed = -[start timeIntervalSinceNow];
+  printf("events: backend=%s messages=%lu seconds=%.3f messages/s=%.0f\n",
+    [backend UTF8String], (unsigned long)count, elapsed, count / elapsed);
+  return 0;
+}
+
+static int
+DKBenchmarkSignatures()
+{
+  NSUInteger count = DKBenchmarkCount(100000);
+  NSUInteger i = 0;
+  NSConnection *conn = nil;
+  id proxy = nil;
+  Class sigClass = [NSMethodSignature class];
+  int allocated = 0;
+  NSDate *start = nil;
+  NSTimeInterval elapsed = 0;
+
+  conn = [NSConnection connectionWithReceivePort: [DKPort port]
+                                        sendPort: [[[DKPort alloc] initWithRemote: @"org.freedesktop.DBus"] autorelease]];
+  proxy = [conn rootProxy];
+  if (nil == proxy)
+  {
+    fprintf(stderr, "Could not connect to the session bus.\n");
+    return 1;
+  }
+  // Warm up: builds the method cache and resolves the selector once.
+  [proxy GetId];
+  [proxy methodSignatureForSelector: @selector(GetId)];
+
+  GSDebugAllocationActive(YES);
+  allocated = GSDebugAllocationTotal(sigClass);
+  start = [NSDate date];
+  for (i = 0; i < count; i++)
+  {
+    NSAutoreleasePool *arp = [NSAutoreleasePool new];
+    [proxy methodSignatureForSelector: @selector(GetId)];
+    [arp release];
+  }
+  elapsed = -[start timeIntervalSinceNow];
+  allocated = GSDebugAllocationTotal(sigClass) - allocated;
+  GSDebugAllocationActive(NO);
+  printf("signatures: lookups=%lu seconds=%.3f lookups/s=%.0f signatures/lookup=%.3f\n",
+    (unsigned long)count, elapsed, count / elapsed,
+    (double)allocated / (double)count);
+  return 0;
+}
+
+static DKMethod*
+DKBenchmarkMethod()
+{
+  DKMethod *method = [[[DKMethod alloc] initWithName: @"Benchmark"
+                                              parent: nil] autorelease];
+  const char *inSignatures[] = {"s", "i", "b"};
+  DKArgument *arg = nil;
+  NSUInteger i = 0;
+  for (i = 0; i < 3; i++)
+  {
+    arg = [[DKArgument alloc] initWithDBusSignature: inSignatures[i]
+                                               name: nil
+                                             parent: method];
+    [method addArgument: arg
+              direction: kDKArgumentDirectionIn];
+    [arg release];
+  }
+  arg = [[DKArgument alloc] initWithDBusSignature: "u"
+                                             name: nil
+                                           parent: method];
+  [method addArgument: arg
+            direction: kDKArgumentDirectionOut];
+  [arg release];
+  return method;
+}
+
+static int
+DKBenchmarkMarshalling()
+{
+  NSString *plans = [[NSUserDefaults standardUserDefaults] stringForKey: @"DKMarshallingPlans"];
+  NSUInteger count = DKBenchmarkCount(100000);
+  NSUInteger i = 0;
+  DKMethod *method = nil;
+  NSInvocation *inv = nil;
+  NSString *string = @"benchmark";
+  NSNumber *number = [NSNumber numberWithInt: 42];
+  NSNumber *flag = [NSNumber numberWithBool: YES];
+  uint32_t result = 23;
+  DBusMessage *reply = NULL;
+  NSDate *start = nil;
+  NSTimeInterval elapsed = 0;
+
+  if (nil == plans)
+  {
+    DKBenchmarkCompare(@"marshalling", @"DKMarshallingPlans",
+      [NSArray arrayWithObjects: @"NO", @"YES", nil], 100000);
+    return 0;
+  }
+
+  method = DKBenchmarkMethod();
+  // Proxies use the boxed signature of the method:
+  inv = [NSInvocation invocationWithMethodSignature: [method methodSignature]];
+  [inv setArgument: &string
+           atIndex: 2];
+  [inv setArgument: &number
+           atIndex: 3];
+  [inv setArgument: &flag
+           atIndex: 4];
+  reply = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  dbus_message_append_args(reply, DBUS_TYPE_UINT32, &result, DBUS_TYPE_INVALID);
+
+  start = [NSDate date];
+  for (i = 0; i < count; i++)
+  {
+    NSAutoreleasePool *arp = [NSAutoreleasePool new];
+    DBusMessage *msg = dbus_message_new_method_call("org.gnustep.dummy",
+      "/",
+      "org.gnustep.dummy",
+      "Benchmark");
+    DBusMessageIter iter;
+    dbus_message_iter_init_append(msg, &iter);
+    [method marshallFromInvocation: inv
+                      intoIterator: &iter
+                       messageType: DBUS_MESSAGE_TYPE_METHOD_CALL];
+    dbus_message_iter_init(reply, &iter);
+    [method unmarshallFromIterator: &iter
+                    intoInvocation: inv
+                       messageType: DBUS_MESSAGE_TYPE_METHOD_RETURN];
+    dbus_message_unref(msg);
+    [arp release];
+  }
+  elapsed = -[start timeIntervalSinceNow];
+  dbus_message_unref(reply);
+  printf("marshalling: plans=%s calls=%lu seconds=%.3f calls/s=%.0f\n",
+    [plans UTF8String], (unsigned long)count, elapsed, count / elapsed);
+  return 0;
+}
+
+/*
+ * Returns the number of objects allocated so far (if allocation statistics are
+ * being collected).
+ */
+static int
+DKBenchmarkAllocatedObjects()
+{
+  Class *classes = GSDebugAllocationClassList();
+  int total = 0;
+  while ((NULL != classes) && (Nil != *classes))
+  {
+    total += GSDebugAllocationTotal(*classes++);
+  }
+  return total;
+}
+
+static int
+DKBenchmarkContainers()
+{
+  NSString *lazy = [[NSUserDefaults standardUserDefaults] stringForKey: @"DKLazyContainers"];
+  NSUInteger count = DKBenchmarkCount(100);
+  NSUInteger entries = 10000;
+  NSUInteger i = 0;
+  DKArgument *arg = nil;
+  DBusMessage *reply = NULL;
+  DBusMessageIter iter;
+  DBusMessageIter dictIter;
+  int allocated = 0;
+  NSDate *start = nil;
+  NSTimeInterval elapsed = 0;
+
+  if (nil == lazy)
+  {
+    DKBenchmarkCompare(@"containers", @"DKLazyContainers",
+      [NSArray arrayWithObjects: @"NO", @"YES", nil], 100);
+    return 0;
+  }
+
+  // Build a reply like the ones for org.freedesktop.DBus.Properties.GetAll:
+  reply = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  dbus_message_iter_init_append(reply, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dictIter);
+  for (i = 0; i < entries; i++)
+  {
+    DBusMessageIter entryIter;
+    DBusMessageIter variantIter;
+    const char *key = [[NSString stringWithFormat: @"Property%lu", (unsigned long)i] UTF8String];
+    int32_t value = (int32_t)i;
+    dbus_message_iter_open_container(&dictIter, DBUS_TYPE_DICT_ENTRY, NULL, &entryIter);
+    dbus_message_iter_append_basic(&entryIter, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&entryIter, DBUS_TYPE_VARIANT, "i", &variantIter);
+    dbus_message_iter_append_basic(&variantIter, DBUS_TYPE_INT32, &value);
+    dbus_message_iter_close_container(&entryIter, &variantIter);
+    dbus_message_iter_close_container(&dictIter, &entryIter);
+  }
+  dbus_message_iter_close_container(&iter, &dictIter);
+  arg = [[[DKArgument alloc] initWithDBusSignature: "a{sv}"
+                                              name: nil
+                                            parent: nil] autorelease];
+
+  GSDebugAllocationActive(YES);
+  allocated = DKBenchmarkAllocatedObjects();
+  start = [NSDate date];
+  for (i = 0; i < count; i++)
+  {
+    NSAutoreleasePool *arp = [NSAutoreleasePool new];
+    NSDictionary *dict = nil;
+    NSUInteger j = 0;
+    [DKArgument setMessageBeingUnmarshalled: reply];
+    dbus_message_iter_init(reply, &iter);
+    dict = [arg unmarshalledObjectFromIterator: &iter];
+    [DKArgument setMessageBeingUnmarshalled: NULL];
+    // Callers are usually interested in a few properties only.
+    for (j = 0; j < 10; j++)
+    {
+      [dict objectForKey: [NSString stringWithFormat: @"Property%lu", (unsigned long)(j * 997)]];
+    }
+    [arp release];
+  }
+  elapsed = -[start timeIntervalSinceNow];
+  allocated = DKBenchmarkAllocatedObjects() - allocated;
+  GSDebugAllocationActive(NO);
+  dbus_message_unref(reply);
+  printf("containers: lazy=%s replies=%lu entries=%lu seconds=%.3f replies/s=%.0f objects/reply=%.1f\n",
+    [lazy UTF8String], (unsigned long)count, (unsigned long)entries, elapsed,
+    count / elapsed, (double)allocated / (double)count);
+  return 0;
+}
+
+static int
+DKBenchmarkBoxing()
+{
+  NSString *cache = [[NSUserDefaults standardUserDefaults] stringForKey: @"DKBoxingCache"];
+  NSUInteger count = DKBenchmarkCount(1000);
+  NSUInteger entries = 100;
+  NSUInteger i = 0;
+  DKArgument *arg = nil;
+  DBusMessage *reply = NULL;
+  DBusMessageIter iter;
+  DBusMessageIter dictIter;
+  int allocated = 0;
+  NSDate *start = nil;
+  NSTimeInterval elapsed = 0;
+
+  if (nil == cache)
+  {
+    DKBenchmarkCompare(@"boxing", @"DKBoxingCache",
+      [NSArray arrayWithObjects: @"NO", @"YES", nil], 1000);
+    return 0;
+  }
+
+  // Property dictionaries mostly contain flags, counters and enumerations:
+  reply = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  dbus_message_iter_init_append(reply, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dictIter);
+  for (i = 0; i < entries; i++)
+  {
+    DBusMessageIter entryIter;
+    DBusMessageIter variantIter;
+    const char *key = [[NSString stringWithFormat: @"Property%lu", (unsigned long)i] UTF8String];
+    int32_t value = (int32_t)(i % 16);
+    dbus_bool_t flag = (0 == (i % 3));
+    dbus_message_iter_open_container(&dictIter, DBUS_TYPE_DICT_ENTRY, NULL, &entryIter);
+    dbus_message_iter_append_basic(&entryIter, DBUS_TYPE_STRING, &key);
+    if (0 == (i % 2))
+    {
+      dbus_message_iter_open_container(&entryIter, DBUS_TYPE_VARIANT, "i", &variantIter);
+      dbus_message_iter_append_basic(&variantIter, DBUS_TYPE_INT32, &value);
+    }
+    else
+    {
+      dbus_message_iter_open_container(&entryIter, DBUS_TYPE_VARIANT, "b", &variantIter);
+      dbus_message_iter_append_basic(&variantIter, DBUS_TYPE_BOOLEAN, &flag);
+    }
+    dbus_message_iter_close_container(&entryIter, &variantIter);
+    dbus_message_iter_close_container(&dictIter, &entryIter);
+  }
+  dbus_message_iter_close_container(&iter, &dictIter);
+  arg = [[[DKArgument alloc] initWithDBusSignature: "a{sv}"
+                                              name: nil
+                                            parent: nil] autorelease];
+
+  GSDebugAllocationActive(YES);
+  allocated = DKBenchmarkAllocatedObjects();
+  start = [NSDate date];
+  for (i = 0; i < count; i++)
+  {
+    NSAutoreleasePool *arp = [NSAutoreleasePool new];
+    dbus_message_iter_init(reply, &iter);
+    [arg unmarshalledObjectFromIterator: &iter];
+    [arp release];
+  }
+  elapsed = -[start timeIntervalSinceNow];
+  allocated = DKBenchmarkAllocatedObjects() - allocated;
+  GSDebugAllocationActive(NO);
+  dbus_message_unref(reply);
+  printf("boxing: cache=%s replies=%lu entries=%lu seconds=%.3f replies/s=%.0f objects/reply=%.1f\n",
+    [cache UTF8String], (unsigned long)count, (unsigned long)entries, elapsed,
+    count / elapsed, (double)allocated / (double)count);
+  return 0;
+}
+
+static int
+DKBenchmarkSignals()
+{
+  NSString *interned = [[NSUserDefaults standardUserDefaults] stringForKey: @"DKInternedStrings"];
+  NSUInteger count = DKBenchmarkCount(10000);
+  NSUInteger i = 0;
+  DKNotificationCenter *center = nil;
+  DKBenchmarkObserver *observer = nil;
+  DBusMessage *signal = NULL;
+  const char *name = "org.gnustep.DKBenchmark";
+  const char *oldOwner = "";
+  const char *newOwner = ":1.0";
+  int allocated = 0;
+  NSDate *start = nil;
+  NSTimeInterval elapsed = 0;
+
+  if (nil == interned)
+  {
+    DKBenchmarkCompare(@"signals", @"DKInternedStrings",
+      [NSArray arrayWithObjects: @"NO", @"YES", nil], 10000);
+    return 0;
+  }
+
+  center = [DKNotificationCenter sessionBusCenter];
+  observer = [[DKBenchmarkObserver new] autorelease];
+  [center addObserver: observer
+             selector: @selector(receiveNotification:)
+               signal: @"NameOwnerChanged"
+            interface: @"org.freedesktop.DBus"
+               sender: nil
+          destination: nil];
+
+  /*
+   * We feed the signal to the center directly, so that we only measure the
+   * dispatch and not the bus.
+   */
+  signal = dbus_message_new_signal("/org/freedesktop/DBus",
+    "org.freedesktop.DBus",
+    "NameOwnerChanged");
+  dbus_message_set_sender(signal, "org.freedesktop.DBus");
+  dbus_message_set_destination(signal, ":1.0");
+  dbus_message_append_args(signal,
+    DBUS_TYPE_STRING, &name,
+    DBUS_TYPE_STRING, &oldOwner,
+    DBUS_TYPE_STRING, &newOwner,
+    DBUS_TYPE_INVALID);
+  // Warm up: generates the signal stub and creates the sender proxy.
+  [center _handleMessage: signal];
+  [[NSRunLoop currentRunLoop] runUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+
+  GSDebugAllocationActive(YES);
+  allocated = DKBenchmarkAllocatedObjects();
+  start = [NSDate date];
+  for (i = 0; i < count; i++)
+  {
+    NSAutoreleasePool *arp = [NSAutoreleasePool new];
+    [center _handleMessage: signal];
+    [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                             beforeDate: [NSDate distantPast]];
+    [arp release];
+  }
+  elapsed = -[start timeIntervalSinceNow];
+  allocated = DKBenchmarkAllocatedObjects() - allocated;
+  GSDebugAllocationActive(NO);
+  [center removeObserver: observer];
+  dbus_message_unref(signal);
+  printf("signals: interned=%s signals=%lu delivered=%lu seconds=%.3f signals/s=%.0f objects/signal=%.1f\n",
+    [interned UTF8String], (unsigned long)count, (unsigned long)observer->received,
+    elapsed, count / elapsed, (double)allocated / (double)count);
+  return 0;
+}
+
+static int
+DKBenchmarkContention()
+{
+  NSUInteger requests = DKBenchmarkCount(2000);
+  NSUInteger producers = 0;
+
+  [DKPort enableWorkerThread];
+  for (producers = 1; producers <= 32; producers *= 2)
+  {
+    NSAutoreleasePool *arp = [NSAutoreleasePool new];
+    DKBenchmarkProducer *producer = [[DKBenchmarkProducer new] autorelease];
+    int expected = (int)(producers * requests);
+    NSDate *start = nil;
+    NSTimeInterval elapsed = 0;
+    NSUInteger i = 0;
+    producer->requests = requests;
+    start = [NSDate date];
+    for (i = 0; i < producers; i++)
+    {
+      [NSThread detachNewThreadSelector: @selector(run:)
+                               toTarget: producer
+                             withObject: nil];
+    }
+    while (__sync_fetch_and_add(&producer->performed, 0) < expected)
+    {
+      usleep(100);
+    }
+    elapsed = -[start timeIntervalSinceNow];
+    printf("contention: producers=%lu requests=%d seconds=%.3f requests/s=%.0f\n",
+      (unsigned long)producers, expected, elapsed, expected / elapsed);
+    [arp release];
+  }
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  NSAutoreleasePool *arp = [NSAutoreleasePool new];
+  NSString *benchmark = nil;
+  int result = 0;
+
+  if (argc < 2)
+  {
+    fprintf(stderr, "Usage: %s <benchmark> [-count <n>]\n"
+      "Available benchmarks: events signatures marshalling containers boxing signals contention\n", argv[0]);
+    [arp release];
+    return 1;
+  }
+
+  benchmark = [NSString stringWithUTF8String: argv[1]];
+  if ([benchmark isEqualToString: @"events"])
+  {
+    result = DKBenchmarkEvents();
+  }
+  else if ([benchmark isEqualToString: @"signatures"])
+  {
+    result = DKBenchmarkSignatures();
+  }
+  else if ([benchmark isEqualToString: @"marshalling"])
+  {
+    result = DKBenchmarkMarshalling();
+  }
+  else if ([benchmark isEqualToString: @"containers"])
+  {
+    result = DKBenchmarkContainers();
+  }
+  else if ([benchmark isEqualToString: @"boxing"])
+  {
+    result = DKBenchmarkBoxing();
+  }
+  else if ([benchmark isEqualToString: @"signals"])
+  {
+    result = DKBenchmarkSignals();
+  }
+  else if ([benchmark isEqualToString: @"contention"])
+  {
+    result = DKBenchmarkContention();
+  }
+  else
+  {
+    fprintf(stderr, "Unknown benchmark: %s\n", argv[1]);
+    result = 1;
+  }
+  [arp release];
+  return result;
+}